@@ -212,6 +212,36 @@ static mapcache_context_apache_server* apache_server_context_create(server_rec *
   return ctx;
 }
 
+/**
+ * \brief send the body of a response from the file region its data was read from
+ *
+ * the file bucket lets the core output filter use sendfile, instead of copying the data
+ * into the output brigade.
+ * \returns 0 if the file has been replaced or cannot be opened, in which case nothing
+ *          has been sent
+ */
+static int write_http_response_file(request_rec *r, mapcache_buffer *data)
+{
+  apr_file_t *f;
+  apr_finfo_t finfo;
+  apr_size_t sent;
+  apr_status_t rv;
+  if(apr_file_open(&f, data->file->filename, APR_FOPEN_READ|APR_FOPEN_BINARY|APR_FOPEN_SENDFILE_ENABLED,
+                   APR_OS_DEFAULT, r->pool) != APR_SUCCESS) {
+    return 0;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_IDENT, f);
+  if((rv != APR_SUCCESS && rv != APR_INCOMPLETE) ||
+      (finfo.valid & (APR_FINFO_SIZE|APR_FINFO_IDENT)) != (APR_FINFO_SIZE|APR_FINFO_IDENT) ||
+      finfo.inode != data->file->inode || finfo.device != data->file->device ||
+      finfo.size < data->file->offset + (apr_off_t)data->size) {
+    apr_file_close(f);
+    return 0;
+  }
+  ap_send_fd(f, r, data->file->offset, data->size, &sent);
+  return 1;
+}
+
 static int write_http_response(mapcache_context_apache_request *ctx, mapcache_http_response *response)
 {
   request_rec *r = ctx->request;
@@ -239,12 +269,15 @@ static int write_http_response(mapcache_context_apache_request *ctx, mapcache_ht
       }
     }
   }
+  /* set before writing the body, which may send the headers */
+  r->status = response->code;
   if(response->data) {
     ap_set_content_length(r,response->data->size);
-    ap_rwrite((void*)response->data->buf, response->data->size, r);
+    if(!response->data->file || !write_http_response_file(r, response->data)) {
+      ap_rwrite((void*)response->data->buf, response->data->size, r);
+    }
   }
 
-  r->status = response->code;
   return OK;
 
 }
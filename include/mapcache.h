@@ -36,6 +36,7 @@
 
 #include <apr_tables.h>
 #include <apr_hash.h>
+#include <apr_file_info.h>
 
 #include "util.h"
 #include "ezxml.h"
@@ -51,6 +52,7 @@
 
 #include <assert.h>
 #include <apr_time.h>
+#include <apr_shm.h>
 
 #ifdef USE_PCRE
 #include <pcre.h>
@@ -89,7 +91,9 @@ typedef struct mapcache_tileset mapcache_tileset;
 typedef struct mapcache_cache mapcache_cache;
 typedef struct mapcache_source mapcache_source;
 typedef struct mapcache_buffer mapcache_buffer;
+typedef struct mapcache_buffer_file mapcache_buffer_file;
 typedef struct mapcache_tile mapcache_tile;
+typedef struct mapcache_key_template mapcache_key_template;
 typedef struct mapcache_metatile mapcache_metatile;
 typedef struct mapcache_feature_info mapcache_feature_info;
 typedef struct mapcache_request_get_feature_info mapcache_request_get_feature_info;
@@ -100,6 +104,7 @@ typedef struct mapcache_source_wms mapcache_source_wms;
 typedef struct mapcache_source_gdal mapcache_source_gdal;
 #endif
 typedef struct mapcache_cache_disk mapcache_cache_disk;
+typedef struct mapcache_cache_bundle mapcache_cache_bundle;
 #ifdef USE_TIFF
 typedef struct mapcache_cache_tiff mapcache_cache_tiff;
 #endif
@@ -137,6 +142,7 @@ typedef struct mapcache_dimension_values mapcache_dimension_values;
 typedef struct mapcache_dimension_regex mapcache_dimension_regex;
 typedef struct mapcache_extent mapcache_extent;
 typedef struct mapcache_extent_i mapcache_extent_i;
+typedef struct mapcache_locker mapcache_locker;
 
 /** \defgroup utility Utility */
 /** @{ */
@@ -208,6 +214,11 @@ struct mapcache_context {
   char *_contenttype;
   char *_errmsg;
   int _errcode;
+  /**
+   * set along with the error when an operation failed because it would have blocked
+   * (rendering, waiting for a metatile, forwarding a getmap) in non_blocking mode
+   */
+  int _blocking;
   mapcache_cfg *config;
   mapcache_service *service;
   apr_table_t *exceptions;
@@ -231,6 +242,22 @@ struct mapcache_buffer {
   size_t size; /**< number of bytes actually used in the buffer */
   size_t avail; /**< number of bytes allocated */
   apr_pool_t* pool; /**< apache pool to allocate from */
+  mapcache_buffer_file *file; /**< the file region holding the same data, if any */
+};
+
+/**
+ * \brief a region of a file holding the data of a mapcache_buffer
+ *
+ * set by caches that read tiles from files, so that the server modules can send a
+ * response body directly from the file with sendfile, instead of copying it. the file
+ * is identified by its inode, so that it is not used if it has been replaced since
+ * the tile was read.
+ */
+struct mapcache_buffer_file {
+  const char *filename;
+  apr_off_t offset; /**< offset of the data in the file, the length is the size of the buffer */
+  apr_ino_t inode;
+  apr_dev_t device;
 };
 
 /* in buffer.c */
@@ -252,6 +279,17 @@ mapcache_buffer *mapcache_buffer_create(size_t initialStorage, apr_pool_t* pool)
  */
 int mapcache_buffer_append(mapcache_buffer *buffer, size_t len, void *data);
 
+/**
+ * \brief record the file region holding the data of a buffer
+ * \memberof mapcache_buffer
+ * \param buffer
+ * \param filename the file holding the data
+ * \param offset the offset of the data in the file
+ * \param finfo the information of the file. nothing is recorded if it does not include
+ *        APR_FINFO_IDENT
+ */
+void mapcache_buffer_set_file(mapcache_buffer *buffer, const char *filename, apr_off_t offset, apr_finfo_t *finfo);
+
 /** @} */
 
 /** \defgroup source Sources */
@@ -295,6 +333,7 @@ struct mapcache_http {
   char *url; /**< the base url to request */
   apr_table_t *headers; /**< additional headers to add to the http request, eg, Referer */
   int connection_timeout;
+  int max_connections; /**< maximum number of kept-alive connections to the host of the url */
   /* TODO: authentication */
 };
 
@@ -350,6 +389,9 @@ struct mapcache_source_gdal {
 /** @{ */
 typedef enum {
   MAPCACHE_CACHE_DISK
+  ,MAPCACHE_CACHE_SHM
+  ,MAPCACHE_CACHE_BUNDLE
+  ,MAPCACHE_CACHE_COMPOSITE
 #ifdef USE_MEMCACHE
   ,MAPCACHE_CACHE_MEMCACHE
 #endif
@@ -362,6 +404,9 @@ typedef enum {
 #ifdef USE_TC
   ,MAPCACHE_CACHE_TC
 #endif
+#ifdef USE_LMDB
+  ,MAPCACHE_CACHE_LMDB
+#endif
 #ifdef USE_TIFF
   ,MAPCACHE_CACHE_TIFF
 #endif
@@ -382,23 +427,32 @@ struct mapcache_cache {
    * \returns MAPCACHE_CACHE_MISS if the file does not exist on the disk
    * \memberof mapcache_cache
    */
-  int (*tile_get)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+
+  /**
+   * get the content of multiple tiles from the cache in a single operation
+   *
+   * optional, caches that do not implement it are queried tile by tile with tile_get
+   * \param rets filled with the value tile_get would have returned for each tile
+   * \memberof mapcache_cache
+   */
+  void (*tile_multi_get)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile **tiles, int ntiles, int *rets);
 
   /**
    * delete tile from cache
    *
    * \memberof mapcache_cache
    */
-  void (*tile_delete)(mapcache_context *ctx, mapcache_tile * tile);
+  void (*tile_delete)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
-  int (*tile_exists)(mapcache_context *ctx, mapcache_tile * tile);
+  int (*tile_exists)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
 
   /**
    * set tile content to cache
    * \memberof mapcache_cache
    */
-  void (*tile_set)(mapcache_context *ctx, mapcache_tile * tile);
-  void (*tile_multi_set)(mapcache_context *ctx, mapcache_tile *tiles, int ntiles);
+  void (*tile_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile * tile);
+  void (*tile_multi_set)(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tiles, int ntiles);
 
   void (*configuration_parse_xml)(mapcache_context *ctx, ezxml_t xml, mapcache_cache * cache, mapcache_cfg *config);
   void (*configuration_post_config)(mapcache_context *ctx, mapcache_cache * cache, mapcache_cfg *config);
@@ -408,24 +462,44 @@ struct mapcache_cache {
  * \brief a mapcache_cache on a filesytem
  * \implements mapcache_cache
  */
+typedef enum {
+  MAPCACHE_DISK_DEDUP_NONE,
+  MAPCACHE_DISK_DEDUP_SYMLINK,
+  MAPCACHE_DISK_DEDUP_HARDLINK
+} mapcache_disk_dedup;
+
 struct mapcache_cache_disk {
   mapcache_cache cache;
   char *base_directory;
   char *filename_template;
+  mapcache_key_template *template; /**< filename_template, compiled */
   int symlink_blank;
+  mapcache_disk_dedup dedup; /**< store identical tiles once, and link the tile files to them */
   int creation_retry;
+  void *dirs; /**< the directories known to exist, created with the configuration */
 
   /**
    * Set filename for a given tile
    * \memberof mapcache_cache_disk
    */
-  void (*tile_key)(mapcache_context *ctx, mapcache_tile *tile, char **path);
+  void (*tile_key)(mapcache_context *ctx, mapcache_cache_disk *cache, mapcache_tile *tile, char **path);
+};
+
+/**\class mapcache_cache_bundle
+ * \brief a mapcache_cache packing blocks of tiles into indexed bundle files
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_bundle {
+  mapcache_cache cache;
+  char *base_directory;
+  int bundle_size; /**< number of rows and columns of tiles stored in a bundle */
 };
 
 #ifdef USE_TIFF
 struct mapcache_cache_tiff {
   mapcache_cache cache;
   char *filename_template;
+  mapcache_key_template *template; /**< filename_template, compiled */
   char *x_fmt,*y_fmt,*z_fmt,*inv_x_fmt,*inv_y_fmt,*div_x_fmt,*div_y_fmt,*inv_div_x_fmt,*inv_div_y_fmt;
   int count_x;
   int count_y;
@@ -447,7 +521,7 @@ struct mapcache_cache_sqlite_stmt {
 
 struct mapcache_cache_sqlite {
   mapcache_cache cache;
-  char *dbfile;
+  char *dbfile; /**< database file, or template of the database files the tiles are spread over */
   mapcache_cache_sqlite_stmt create_stmt;
   mapcache_cache_sqlite_stmt exists_stmt;
   mapcache_cache_sqlite_stmt get_stmt;
@@ -456,6 +530,10 @@ struct mapcache_cache_sqlite {
   apr_table_t *pragmas;
   void (*bind_stmt)(mapcache_context*ctx, void *stmt, mapcache_tile *tile);
   int n_prepared_statements;
+  int ro_soft_max; /**< read-only connections kept open per database file */
+  int ro_hard_max; /**< maximum number of read-only connections per database file */
+  int max_open_dbfiles; /**< database files kept open before closing the least recently used ones */
+  int read_heavy; /**< use wal journaling and memory mapping, and serve tiles without copying them */
 };
 
 /**
@@ -467,10 +545,19 @@ mapcache_cache* mapcache_cache_mbtiles_create(mapcache_context *ctx);
 
 #ifdef USE_BDB
 typedef struct mapcache_cache_bdb mapcache_cache_bdb;
+typedef enum {
+  MAPCACHE_BDB_DURABILITY_SYNC, /**< each write is flushed to disk before returning */
+  MAPCACHE_BDB_DURABILITY_NOSYNC, /**< writes are flushed to disk by the operating system */
+  MAPCACHE_BDB_DURABILITY_PERIODIC /**< writes are flushed to disk every sync_interval seconds */
+} mapcache_bdb_durability;
+
 struct mapcache_cache_bdb {
   mapcache_cache cache;
   char *basedir;
-  char *key_template;
+  mapcache_key_template *key_template;
+  mapcache_bdb_durability durability;
+  int sync_interval; /**< seconds between log flushes with MAPCACHE_BDB_DURABILITY_PERIODIC */
+  void *shared; /**< the state shared by the connections, created with the configuration */
 };
 mapcache_cache *mapcache_cache_bdb_create(mapcache_context *ctx);
 #endif
@@ -480,21 +567,50 @@ typedef struct mapcache_cache_tc mapcache_cache_tc;
 struct mapcache_cache_tc {
   mapcache_cache cache;
   char *basedir;
-  char *key_template;
+  mapcache_key_template *key_template;
   mapcache_context *ctx;
 };
 mapcache_cache *mapcache_cache_tc_create(mapcache_context *ctx);
 #endif
 
+#ifdef USE_LMDB
+typedef struct mapcache_cache_lmdb mapcache_cache_lmdb;
+/**\class mapcache_cache_lmdb
+ * \brief a mapcache_cache stored in a memory mapped lmdb database
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_lmdb {
+  mapcache_cache cache;
+  char *basedir;
+  mapcache_key_template *key_template;
+  size_t max_size; /**< size of the memory map, i.e. the maximum size of the database */
+  int max_readers; /**< maximum number of concurrent read transactions */
+};
+mapcache_cache *mapcache_cache_lmdb_create(mapcache_context *ctx);
+#endif
+
 #ifdef USE_MEMCACHE
 typedef struct mapcache_cache_memcache mapcache_cache_memcache;
+/**
+ * \brief a point of the consistent hashing ring of a mapcache_cache_memcache
+ */
+typedef struct {
+  apr_uint32_t hash;
+  apr_memcache_server_t *server;
+} mapcache_memcache_ring_point;
+
 /**\class mapcache_cache_memcache
  * \brief a mapcache_cache on memcached servers
+ *
+ * keys are spread over the servers with consistent hashing, so that adding or removing a
+ * server only moves the keys of a share of the ring
  * \implements mapcache_cache
  */
 struct mapcache_cache_memcache {
   mapcache_cache cache;
   apr_memcache_t *memcache;
+  mapcache_memcache_ring_point *ring; /**< sorted by hash, each server has a number of points proportional to its weight */
+  int nring;
 };
 
 /**
@@ -503,6 +619,72 @@ struct mapcache_cache_memcache {
 mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx);
 #endif
 
+typedef struct mapcache_cache_composite mapcache_cache_composite;
+
+/**\class mapcache_cache_composite
+ * \brief a mapcache_cache chaining several other caches, fastest first
+ *
+ * tiles are read from the first cache that has them, and promoted to the caches before it.
+ * they are written synchronously to the first cache, and in the background to the other ones.
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_composite {
+  mapcache_cache cache;
+  apr_array_header_t *caches; /**< the mapcache_cache tiers, fastest first */
+  int write_behind; /**< maximum number of tiles queued for the lower tiers, 0 to write them synchronously */
+  int write_behind_batch; /**< number of queued tiles written to the lower tiers in a single operation */
+  void *queue; /**< tiles waiting to be written to the lower tiers, created with the configuration */
+};
+
+/**
+ * \memberof mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx);
+
+typedef struct mapcache_cache_shm mapcache_cache_shm;
+typedef struct mapcache_cache_shm_stats mapcache_cache_shm_stats;
+
+/**\class mapcache_cache_shm
+ * \brief a mapcache_cache keeping encoded tiles in a shared memory segment, in front
+ * of another mapcache_cache
+ *
+ * the segment is shared by all the processes that have been forked after it was created
+ * (apache children, nginx workers), or by all the processes attaching to the same
+ * named segment if mapcache_cache_shm::filename is set (fastcgi processes)
+ * \implements mapcache_cache
+ */
+struct mapcache_cache_shm {
+  mapcache_cache cache;
+  mapcache_cache *child; /**< the cache tiles are read from on a miss and written to on a set */
+  apr_size_t size; /**< total size in bytes of the shared memory segment */
+  int nsegments; /**< number of independently locked segments the memory is split into */
+  char *filename; /**< optional name of the segment, to share it between unrelated processes */
+  apr_shm_t *shm;
+};
+
+/**
+ * \brief usage counters of a mapcache_cache_shm, shared by all the processes using the segment
+ */
+struct mapcache_cache_shm_stats {
+  apr_uint32_t hits;
+  apr_uint32_t misses;
+  apr_uint32_t evictions;
+  apr_uint32_t insertions;
+  apr_uint32_t used_blocks;
+  apr_uint32_t total_blocks;
+};
+
+/**
+ * \memberof mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx);
+
+/**
+ * \brief fill the given stats with the current counters of a shm cache
+ * \memberof mapcache_cache_shm
+ */
+void mapcache_cache_shm_get_stats(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_cache_shm_stats *stats);
+
 /** @} */
 
 
@@ -906,6 +1088,59 @@ int mapcache_image_blank_color(mapcache_image* image);
  */
 int mapcache_image_has_alpha(mapcache_image *img);
 
+typedef enum {
+  MAPCACHE_SIMD_NONE,
+  MAPCACHE_SIMD_SSE2,
+  MAPCACHE_SIMD_AVX2
+} mapcache_simd_level;
+
+/**
+ * \brief the instruction set used by the pixel manipulation routines
+ *
+ * this is the best level supported by both the build and the running cpu
+ */
+mapcache_simd_level mapcache_image_simd_level();
+
+/**
+ * \brief restrict the instruction set used by the pixel manipulation routines
+ *
+ * used for benchmarking the different implementations against each other
+ */
+void mapcache_image_simd_limit(mapcache_simd_level level);
+
+#ifndef MAPCACHE_IMAGE_BUFFER_MAX_RETAINED
+/**
+ * maximum number of bytes of unused pixel buffers each process keeps around for reuse
+ */
+#define MAPCACHE_IMAGE_BUFFER_MAX_RETAINED (64*1024*1024)
+#endif
+
+typedef struct {
+  size_t in_use; /**< bytes currently handed out to requests */
+  size_t in_use_hwm; /**< high-water mark of in_use */
+  size_t retained; /**< bytes kept on the free lists */
+  size_t retained_hwm; /**< high-water mark of retained */
+  unsigned long hits; /**< allocations served from the free lists */
+  unsigned long misses; /**< allocations that needed a malloc */
+} mapcache_image_buffer_stats;
+
+/**
+ * \brief allocate a buffer for pixel data
+ *
+ * buffers are recycled by size class through a per-process pool, and are given back
+ * to it when ctx->pool is cleared
+ * \param size the number of bytes needed
+ * \param zero MAPCACHE_TRUE if the buffer must be zeroed, MAPCACHE_FALSE if the caller
+ * is going to overwrite all of it
+ * \returns NULL and sets the context error if the allocation failed
+ */
+unsigned char* mapcache_image_buffer_alloc(mapcache_context *ctx, size_t size, int zero);
+
+/**
+ * \brief get the usage counters and high-water marks of the pixel buffer pool
+ */
+void mapcache_image_buffer_pool_stats(mapcache_image_buffer_stats *stats);
+
 /** @} */
 
 
@@ -1004,8 +1239,19 @@ struct mapcache_cfg {
    */
   apr_interval_time_t lock_retry_interval; /* time in nanoseconds to wait before rechecking for lockfile presence */
 
+  /**
+   * backend used to synchronize the rendering of metatiles between threads and processes
+   */
+  mapcache_locker *locker;
+
   int threaded_fetching;
 
+  /**
+   * maximum number of worker threads of the process-wide pool used to fetch tiles
+   * concurrently when threaded_fetching is enabled
+   */
+  int download_threads;
+
   /**
    * the uri where the base of the service is mapped
    */
@@ -1075,6 +1321,16 @@ mapcache_source* mapcache_source_dummy_create(mapcache_context *ctx);
  * \memberof mapcache_cache_disk
  */
 mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx);
+int mapcache_cache_disk_gc(mapcache_context *ctx, mapcache_cache *cache, mapcache_tileset *tileset, mapcache_grid *grid,
+                           apr_time_t before, int *removed, apr_off_t *reclaimed);
+int mapcache_cache_disk_sweep(mapcache_context *ctx, mapcache_cache *cache, mapcache_tileset *tileset, mapcache_grid *grid,
+                              int *removed, apr_off_t *reclaimed);
+
+/**
+ * \memberof mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx);
+int mapcache_cache_bundle_compact(mapcache_context *ctx, mapcache_cache *cache, mapcache_tile *tile, apr_off_t *reclaimed);
 
 #ifdef USE_TIFF
 /**
@@ -1223,6 +1479,12 @@ struct mapcache_tileset {
    */
   int auto_expire;
 
+  /**
+   * number of seconds after #auto_expire during which a stale tile is still returned while
+   * it is re-rendered in the background. 0 to always re-render stale tiles synchronously
+   */
+  int stale_while_revalidate;
+
   /**
    * the cache in which the tiles should be stored
    */
@@ -1303,6 +1565,14 @@ void mapcache_tileset_get_level(mapcache_context *ctx, mapcache_tileset *tileset
 void mapcache_grid_get_closest_level(mapcache_context *ctx, mapcache_grid *grid, double resolution, int *level);
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile);
 
+/**
+ * \brief finish getting a tile once it has been looked up in its cache
+ *
+ * checks the expiration of a cached tile, or renders it if it was not found
+ * \param ret the value returned by the cache's tile_get or tile_multi_get for this tile
+ */
+void mapcache_tileset_tile_get_after_lookup(mapcache_context *ctx, mapcache_tile *tile, int ret);
+
 /**
  * \brief delete tile from cache
  * @param whole_metatile delete all the other tiles from the metatile to
@@ -1347,9 +1617,95 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
 void mapcache_tileset_add_watermark(mapcache_context *ctx, mapcache_tileset *tileset, const char *filename);
 
 
+typedef enum {
+  MAPCACHE_LOCKER_DISK,
+  MAPCACHE_LOCKER_SHM
+} mapcache_lock_mode;
+
+/**
+ * \brief a locking backend, used to make sure a resource is only created once
+ */
+struct mapcache_locker {
+  /**
+   * \brief aquire the lock on a resource, or wait for it to be released
+   * \returns MAPCACHE_TRUE if the lock was aquired, MAPCACHE_FALSE if another
+   * thread or process held it and has released it since
+   */
+  int (*lock_or_wait)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+  /**
+   * \brief aquire the lock on a resource if nobody holds it, without waiting
+   * \returns MAPCACHE_TRUE if the lock was aquired, MAPCACHE_FALSE otherwise
+   */
+  int (*trylock)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+  void (*unlock)(mapcache_context *ctx, mapcache_locker *self, char *resource);
+  void (*parse_xml)(mapcache_context *ctx, mapcache_locker *self, ezxml_t node);
+  void (*post_config)(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg);
+  mapcache_lock_mode type;
+
+  /**
+   * time after which a lock is considered stale, i.e. its owner is assumed to have
+   * crashed or hung and the lock can be taken over
+   */
+  apr_interval_time_t timeout;
+};
+
+/**
+ * \brief locks materialized as files in the lock directory.
+ *
+ * slower than the shm locker, as waiters poll for the lockfile removal, but
+ * can synchronize servers sharing a network mounted lock directory
+ */
+typedef struct {
+  mapcache_locker locker;
+} mapcache_locker_disk;
+
+/**
+ * \brief locks kept in a shared memory table
+ *
+ * waiters sleep on a process-shared condition and are woken up as soon as the lock
+ * is released. an anonymous table is shared with the processes forked after the
+ * configuration is loaded, i.e. the apache and nginx workers. a named table is shared
+ * by every process using the same filename.
+ */
+typedef struct {
+  mapcache_locker locker;
+  int nslots; /**< maximum number of locks held concurrently */
+  char *filename; /**< name of the shared memory segment, or NULL for an anonymous one */
+  void *table;
+} mapcache_locker_shm;
+
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx);
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx);
+
 int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource);
+int mapcache_lock_resource_try(mapcache_context *ctx, char *resource);
 void mapcache_unlock_resource(mapcache_context *ctx, char *resource);
 
+/**
+ * \brief size of a process-shared mutex to reserve in a shared memory segment
+ * \returns 0 if process-shared mutexes are not supported on this platform
+ */
+apr_size_t mapcache_shm_mutex_size(void);
+
+/**
+ * \brief initialize a process-shared mutex, robust where the platform supports it
+ * \param mutex memory of mapcache_shm_mutex_size() bytes inside a shared memory segment
+ */
+int mapcache_shm_mutex_init(mapcache_context *ctx, void *mutex);
+
+/**
+ * \brief lock a process-shared mutex
+ * \param recovered set to 1 if the previous owner died while holding the mutex,
+ * in which case the data it protects may be inconsistent
+ * \returns MAPCACHE_SUCCESS, or MAPCACHE_FAILURE with the error set on ctx
+ */
+int mapcache_shm_mutex_lock(mapcache_context *ctx, void *mutex, int *recovered);
+
+/**
+ * \brief unlock a process-shared mutex
+ */
+void mapcache_shm_mutex_unlock(void *mutex);
+
 mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache_tile *tile);
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt);
 char* mapcache_tileset_metatile_resource_key(mapcache_context *ctx, mapcache_metatile *mt);
@@ -1369,6 +1725,36 @@ mapcache_http_response* mapcache_core_get_featureinfo(mapcache_context *ctx, map
 mapcache_http_response* mapcache_core_proxy_request(mapcache_context *ctx, mapcache_request_proxy *req_proxy);
 mapcache_http_response* mapcache_core_respond_to_error(mapcache_context *ctx);
 
+typedef void (*mapcache_task_func)(mapcache_context *ctx, void *data, int i);
+
+/**
+ * \brief call task for every index of [0,ntasks[
+ *
+ * when threaded_fetching is enabled the tasks are spread over the process worker pool
+ * and the calling thread. they must therefore be independent from each other, and only
+ * allocate from the pool of the context they are given.
+ */
+void mapcache_core_run_tasks(mapcache_context *ctx, mapcache_task_func task, void *data, int ntasks);
+
+typedef void (*mapcache_detached_func)(mapcache_context *ctx, void *data);
+
+/**
+ * \brief create a context that is not tied to the current request
+ *
+ * it has its own pool, and can be handed to mapcache_core_run_detached() along with
+ * data allocated from that pool
+ */
+mapcache_context* mapcache_core_detached_context(mapcache_context *ctx);
+
+/**
+ * \brief run a function on the process worker pool, independently of the current request
+ *
+ * the pool of the detached context is destroyed once the function has returned, or
+ * straight away if the function could not be queued (i.e. threaded_fetching is disabled)
+ * \returns MAPCACHE_SUCCESS if the function was queued
+ */
+int mapcache_core_run_detached(mapcache_context *ctx, mapcache_context *dctx, mapcache_detached_func func, void *data);
+
 
 /* in grid.c */
 mapcache_grid* mapcache_grid_create(apr_pool_t *pool);
@@ -1430,7 +1816,73 @@ char* mapcache_util_str_sanitize(apr_pool_t *pool, const char *str, const char*
 
 char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile, char* sanitized_chars, char *sanitize_to);
 
-char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *stemplate,
+/**\defgroup key_template Tile key templates */
+/** @{ */
+
+typedef enum {
+  MAPCACHE_KEY_TOKEN_LITERAL,
+  MAPCACHE_KEY_TOKEN_TILESET,
+  MAPCACHE_KEY_TOKEN_GRID,
+  MAPCACHE_KEY_TOKEN_EXT,
+  MAPCACHE_KEY_TOKEN_DIM,
+  MAPCACHE_KEY_TOKEN_X,
+  MAPCACHE_KEY_TOKEN_Y,
+  MAPCACHE_KEY_TOKEN_Z,
+  MAPCACHE_KEY_TOKEN_INV_X,
+  MAPCACHE_KEY_TOKEN_INV_Y,
+  MAPCACHE_KEY_TOKEN_INV_Z,
+  MAPCACHE_KEY_TOKEN_DIV_X,
+  MAPCACHE_KEY_TOKEN_DIV_Y,
+  MAPCACHE_KEY_TOKEN_INV_DIV_X,
+  MAPCACHE_KEY_TOKEN_INV_DIV_Y
+} mapcache_key_token_type;
+
+typedef struct {
+  mapcache_key_token_type type;
+  const char *text; /**< the text of a literal, or the printf format of a number (NULL for "%d") */
+  apr_size_t len; /**< length of a literal */
+} mapcache_key_token;
+
+/**
+ * \brief a key template split into literals and {placeholders} once, at configuration time
+ */
+struct mapcache_key_template {
+  mapcache_key_token *tokens;
+  int ntokens;
+  apr_size_t literal_len; /**< total length of the literals */
+  int nnumbers; /**< number of numeric placeholders */
+  int has_dim; /**< whether the template contains a {dim} placeholder */
+  int block_x; /**< {x},{y},{div_x}... refer to blocks of block_x*block_y tiles, 1 by default */
+  int block_y;
+};
+
+/**
+ * \brief split a template such as "{tileset}/{grid}/{z}/{x}/{y}.{ext}" into tokens
+ *
+ * unknown placeholders are kept as literals
+ */
+mapcache_key_template* mapcache_key_template_compile(apr_pool_t *pool, const char *template);
+
+/**
+ * \brief set the printf format used for the placeholders of the given type
+ */
+void mapcache_key_template_set_format(mapcache_key_template *tpl, mapcache_key_token_type type, const char *fmt);
+
+/**
+ * \brief render the key of a tile with a single allocation
+ *
+ * \param dimkey the string {dim} is replaced with. If NULL, {dim} is kept as is
+ */
+char* mapcache_key_template_render(mapcache_context *ctx, mapcache_key_template *tpl, mapcache_tile *tile, const char *dimkey);
+
+/** @} */
+
+/**
+ * \brief render the key of a tile from a compiled template
+ *
+ * \param tpl the template, or NULL for the default "tileset/grid/dim/z/y/x/ext" layout
+ */
+char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, mapcache_key_template *tpl,
                                  char* sanitized_chars, char *sanitize_to);
 
 /**\defgroup imageio Image IO */
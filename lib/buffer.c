@@ -29,6 +29,7 @@
 
 #include "mapcache.h"
 #include <stdlib.h>
+#include <apr_strings.h>
 #define INITIAL_BUFFER_SIZE 100
 
 static void _mapcache_buffer_realloc(mapcache_buffer *buffer, size_t len)
@@ -76,7 +77,23 @@ int mapcache_buffer_append(mapcache_buffer *buffer, size_t len, void *data)
   memcpy(((unsigned char*)buffer->buf) + buffer->size, data, len);
 
   buffer->size += len;
+  /* the data no longer matches the file it was read from */
+  buffer->file = NULL;
   return len;
 }
+
+void mapcache_buffer_set_file(mapcache_buffer *buffer, const char *filename, apr_off_t offset, apr_finfo_t *finfo)
+{
+  if((finfo->valid & APR_FINFO_IDENT) != APR_FINFO_IDENT) {
+    /* the file could not be told apart from one that replaced it */
+    buffer->file = NULL;
+    return;
+  }
+  buffer->file = apr_palloc(buffer->pool, sizeof(mapcache_buffer_file));
+  buffer->file->filename = apr_pstrdup(buffer->pool, filename);
+  buffer->file->offset = offset;
+  buffer->file->inode = finfo->inode;
+  buffer->file->device = finfo->device;
+}
 /* vim: ts=2 sts=2 et sw=2
 */
@@ -60,6 +60,16 @@ struct bdb_env {
   char *errmsg;
 };
 
+/* state shared by the connections of a cache in a process, created with the configuration */
+struct bdb_shared {
+  apr_pool_t *pool;
+  apr_hash_t *blanks; /* encoded blank tiles, by format, size and color */
+  apr_time_t last_flush; /* last time the log was flushed, in periodic durability mode */
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+};
+
 static apr_status_t _bdb_reslist_get_connection(void **conn_, void *params, apr_pool_t *pool)
 {
   int ret;
@@ -78,7 +88,25 @@ static apr_status_t _bdb_reslist_get_connection(void **conn_, void *params, apr_
     benv->errmsg = apr_psprintf(pool, "bdb cache failure for db->set_cachesize: %s", db_strerror(ret));
     return APR_EGENERAL;
   }
-  int env_flags = DB_INIT_CDB|DB_INIT_MPOOL|DB_CREATE;
+  /*
+   * a transactional environment, so that writes only need the log to be flushed to be
+   * durable, instead of the whole database
+   */
+  if(cache->durability != MAPCACHE_BDB_DURABILITY_SYNC) {
+    ret = benv->env->set_flags(benv->env, DB_TXN_WRITE_NOSYNC, 1);
+    if(ret) {
+      benv->errmsg = apr_psprintf(pool, "bdb cache failure for env->set_flags: %s", db_strerror(ret));
+      return APR_EGENERAL;
+    }
+  }
+  ret = benv->env->set_lk_detect(benv->env, DB_LOCK_DEFAULT);
+  if(!ret)
+    ret = benv->env->log_set_config(benv->env, DB_LOG_AUTO_REMOVE, 1);
+  if(ret) {
+    benv->errmsg = apr_psprintf(pool, "bdb cache failure for env configuration: %s", db_strerror(ret));
+    return APR_EGENERAL;
+  }
+  int env_flags = DB_INIT_TXN|DB_INIT_LOCK|DB_INIT_LOG|DB_INIT_MPOOL|DB_CREATE;
   ret = benv->env->open(benv->env,cache->basedir,env_flags,0);
   if(ret) {
     benv->errmsg = apr_psprintf(pool,"bdb cache failure for env->open: %s", db_strerror(ret));
@@ -96,7 +124,7 @@ static apr_status_t _bdb_reslist_get_connection(void **conn_, void *params, apr_
     return APR_EGENERAL;
   }
 
-  if ((ret = benv->db->open(benv->db, NULL, dbfile, NULL, mode, DB_CREATE, 0664)) != 0) {
+  if ((ret = benv->db->open(benv->db, NULL, dbfile, NULL, mode, DB_CREATE|DB_AUTO_COMMIT, 0664)) != 0) {
     benv->errmsg = apr_psprintf(pool,"bdb cache failure 1 for db->open: %s", db_strerror(ret));
     return APR_EGENERAL;
   }
@@ -115,9 +143,9 @@ static apr_status_t _bdb_reslist_free_connection(void *conn_, void *params, apr_
 
 
 
-static struct bdb_env* _bdb_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
+static struct bdb_env* _bdb_get_conn(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile* tile, int readonly) {
   apr_status_t rv;
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tile->tileset->cache;
+  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)pcache;
 
   struct bdb_env *benv;
   apr_hash_t *pool_container;
@@ -195,7 +223,7 @@ static struct bdb_env* _bdb_get_conn(mapcache_context *ctx, mapcache_tile* tile,
   return benv;
 }
 
-static void _bdb_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct bdb_env *benv)
+static void _bdb_release_conn(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct bdb_env *benv)
 {
   apr_reslist_t *pool;
   apr_hash_t *pool_container;
@@ -204,7 +232,7 @@ static void _bdb_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct
   } else {
     pool_container = rw_connection_pools;
   }
-  pool = apr_hash_get(pool_container,tile->tileset->cache->name, APR_HASH_KEY_STRING);
+  pool = apr_hash_get(pool_container,pcache->name, APR_HASH_KEY_STRING);
   if(GC_HAS_ERROR(ctx)) {
     apr_reslist_invalidate(pool,(void*)benv);
   } else {
@@ -212,13 +240,13 @@ static void _bdb_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct
   }
 }
 
-static int _mapcache_cache_bdb_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_bdb_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   int ret;
   DBT key;
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tile->tileset->cache;
+  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  struct bdb_env *benv = _bdb_get_conn(ctx,tile,1);
+  struct bdb_env *benv = _bdb_get_conn(ctx,pcache,tile,1);
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
   memset(&key, 0, sizeof(DBT));
   key.data = skey;
@@ -234,30 +262,23 @@ static int _mapcache_cache_bdb_has_tile(mapcache_context *ctx, mapcache_tile *ti
     ctx->set_error(ctx,500,"bdb backend failure on tile_exists: %s",db_strerror(ret));
     ret= MAPCACHE_FALSE;
   }
-  _bdb_release_conn(ctx,tile,benv);
+  _bdb_release_conn(ctx,pcache,tile,benv);
   return ret;
 }
 
-static void _mapcache_cache_bdb_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _bdb_put(mapcache_context *ctx, mapcache_cache_bdb *cache, struct bdb_env *benv, DBT *keys, DBT *datas, int nrecords);
+static void _mapcache_cache_bdb_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   DBT key;
-  int ret;
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tile->tileset->cache;
+  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  struct bdb_env *benv = _bdb_get_conn(ctx,tile,0);
+  struct bdb_env *benv = _bdb_get_conn(ctx,pcache,tile,0);
   GC_CHECK_ERROR(ctx);
   memset(&key, 0, sizeof(DBT));
   key.data = skey;
   key.size = strlen(skey)+1;
-  ret = benv->db->del(benv->db, NULL, &key, 0);
-  if(ret && ret != DB_NOTFOUND) {
-    ctx->set_error(ctx,500,"bdb backend failure on tile_delete: %s",db_strerror(ret));
-  } else {
-    ret = benv->db->sync(benv->db,0);
-    if(ret)
-      ctx->set_error(ctx,500,"bdb backend sync failure on tile_delete: %s",db_strerror(ret));
-  }
-  _bdb_release_conn(ctx,tile,benv);
+  _bdb_put(ctx, cache, benv, &key, NULL, 1);
+  _bdb_release_conn(ctx,pcache,tile,benv);
 }
 /* Table of CRCs of all 8-bit messages. */
 unsigned long crc_table[256];
@@ -325,52 +346,144 @@ static unsigned char empty_png[] = {
 static size_t plte_offset = 0x25;
 static size_t trns_offset = 0x34;
 
-static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * blank tiles are stored as '#' followed by their color (i.e. the raw pixel value) and,
+ * unless they are 256x256 pixels, by their width and height as native 32 bit integers
+ */
+#define BDB_BLANK_SIZE 5
+#define BDB_BLANK_SIZED_SIZE (BDB_BLANK_SIZE + 2*sizeof(apr_uint32_t))
+
+/* initial size of the buffer tiles are read into, it is enlarged to fit larger tiles */
+#define BDB_READ_BUFFER 32*1024
+
+/* number of encoded blank tiles of sizes other than 256x256 kept by a cache */
+#define BDB_BLANK_CACHE_SIZE 64
+
+/*
+ * returns the blank tile of the given size and color encoded in the format of the tileset.
+ * encoded tiles are kept for the lifetime of the configuration, so they are not encoded
+ * again for every request
+ */
+static mapcache_buffer* _bdb_blank_tile(mapcache_context *ctx, mapcache_cache_bdb *cache, mapcache_tile *tile,
+                                        unsigned char *color, apr_uint32_t width, apr_uint32_t height)
+{
+  mapcache_image_format *format = tile->tileset->format;
+  struct bdb_shared *shared = cache->shared;
+  mapcache_buffer *buf, *cached = NULL;
+  unsigned int pixel;
+  char *key;
+
+  if(!format) {
+    ctx->set_error(ctx,500,"bdb cache %s: blank tile of tileset %s has no format to be encoded to",
+                   cache->cache.name, tile->tileset->name);
+    return NULL;
+  }
+  key = apr_psprintf(ctx->pool, "%s-%u-%u-%02x%02x%02x%02x", format->name, width, height,
+                     color[0], color[1], color[2], color[3]);
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(shared->mutex);
+#endif
+  cached = apr_hash_get(shared->blanks, key, APR_HASH_KEY_STRING);
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(shared->mutex);
+#endif
+
+  if(!cached) {
+    memcpy(&pixel, color, 4);
+    cached = format->create_empty_image(ctx, format, width, height, pixel);
+    if(GC_HAS_ERROR(ctx))
+      return NULL;
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(shared->mutex);
+#endif
+    /* once full, blank tiles of new sizes or colors are encoded on each request */
+    if(apr_hash_count(shared->blanks) < BDB_BLANK_CACHE_SIZE && !apr_hash_get(shared->blanks, key, APR_HASH_KEY_STRING)) {
+      buf = mapcache_buffer_create(0, shared->pool);
+      buf->buf = apr_pmemdup(shared->pool, cached->buf, cached->size);
+      buf->size = buf->avail = cached->size;
+      apr_hash_set(shared->blanks, apr_pstrdup(shared->pool, key), APR_HASH_KEY_STRING, buf);
+    }
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(shared->mutex);
+#endif
+    return cached;
+  }
+  /* the cached data is shared, and only ever read */
+  buf = mapcache_buffer_create(0, ctx->pool);
+  buf->buf = cached->buf;
+  buf->size = buf->avail = cached->size;
+  return buf;
+}
+
+/* the 256x256 blank png of the given color, patched from a template */
+static mapcache_buffer* _bdb_blank_png(mapcache_context *ctx, unsigned char *color)
+{
+  mapcache_buffer *buf = mapcache_buffer_create(sizeof(empty_png)+4,ctx->pool);
+  unsigned char *dd = buf->buf;
+  memcpy(dd,empty_png,sizeof(empty_png));
+  dd[plte_offset+4] = color[2]; // r;
+  dd[plte_offset+5] = color[1]; // g;
+  dd[plte_offset+6] = color[0]; // b;
+  int pltecrc = crc(dd+plte_offset,7);
+  dd[plte_offset+7] = (unsigned char)((pltecrc >> 24) & 0xff);
+  dd[plte_offset+8] = (unsigned char)((pltecrc >> 16) & 0xff);
+  dd[plte_offset+9] = (unsigned char)((pltecrc >> 8) & 0xff);
+  dd[plte_offset+10] = (unsigned char)(pltecrc & 0xff);
+  if(color[3] != 255) {
+    dd[trns_offset+4] = color[3]; // a;
+    int trnscrc = crc(dd+trns_offset,5);
+    dd[trns_offset+5] = (unsigned char)((trnscrc >> 24) & 0xff);
+    dd[trns_offset+6] = (unsigned char)((trnscrc >> 16) & 0xff);
+    dd[trns_offset+7] = (unsigned char)((trnscrc >> 8) & 0xff);
+    dd[trns_offset+8] = (unsigned char)(trnscrc & 0xff);
+  }
+  buf->size = sizeof(empty_png);
+  return buf;
+}
+
+/* look up a single tile using the given connection */
+static int _bdb_tile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct bdb_env *benv)
 {
   DBT key,data;
-  struct bdb_env *benv = _bdb_get_conn(ctx,tile,1);
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tile->tileset->cache;
+  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
+  int ret;
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
   memset(&key, 0, sizeof(DBT));
   memset(&data, 0, sizeof(DBT));
-  data.flags = DB_DBT_MALLOC;
   key.data = skey;
   key.size = strlen(skey)+1;
 
-  int ret = benv->db->get(benv->db, NULL, &key, &data, 0);
-
+  /* read directly into request memory, instead of a malloc'd buffer freed by a pool cleanup */
+  data.flags = DB_DBT_USERMEM;
+  data.ulen = BDB_READ_BUFFER;
+  data.data = apr_palloc(ctx->pool, data.ulen);
+  ret = benv->db->get(benv->db, NULL, &key, &data, 0);
+  if(ret == DB_BUFFER_SMALL) {
+    /* data.size is the size of the stored tile */
+    data.ulen = data.size;
+    data.data = apr_palloc(ctx->pool, data.ulen);
+    ret = benv->db->get(benv->db, NULL, &key, &data, 0);
+  }
 
   if(ret == 0) {
-    if(((char*)(data.data))[0] == '#') {
-      tile->encoded_data = mapcache_buffer_create(sizeof(empty_png)+4,ctx->pool);
-      unsigned char *dd = tile->encoded_data->buf;
-      memcpy(dd,empty_png,sizeof(empty_png));
-      memcpy(dd+plte_offset+4,data.data+3,1); // r;
-      memcpy(dd+plte_offset+5,data.data+2,1); // g;
-      memcpy(dd+plte_offset+6,data.data+1,1); // b;
-      int pltecrc = crc(dd+plte_offset,7);
-      dd[plte_offset+7] = (unsigned char)((pltecrc >> 24) & 0xff);
-      dd[plte_offset+8] = (unsigned char)((pltecrc >> 16) & 0xff);
-      dd[plte_offset+9] = (unsigned char)((pltecrc >> 8) & 0xff);
-      dd[plte_offset+10] = (unsigned char)(pltecrc & 0xff);
-      if((unsigned char*)(data.data+4) != 255) {
-        memcpy(dd+trns_offset+4,data.data+4,1); // a;
-        int trnscrc = crc(dd+trns_offset,5);
-        dd[trns_offset+5] = (unsigned char)((trnscrc >> 24) & 0xff);
-        dd[trns_offset+6] = (unsigned char)((trnscrc >> 16) & 0xff);
-        dd[trns_offset+7] = (unsigned char)((trnscrc >> 8) & 0xff);
-        dd[trns_offset+8] = (unsigned char)(trnscrc & 0xff);
-      }
-      tile->encoded_data->size = sizeof(empty_png);
+    unsigned char *dd = (unsigned char*)data.data;
+    apr_size_t payload = data.size - sizeof(apr_time_t);
+    if(dd[0] == '#' && payload == BDB_BLANK_SIZE) {
+      tile->encoded_data = _bdb_blank_png(ctx, dd+1);
+    } else if(dd[0] == '#' && payload == BDB_BLANK_SIZED_SIZE) {
+      apr_uint32_t width, height;
+      memcpy(&width, dd+BDB_BLANK_SIZE, sizeof(apr_uint32_t));
+      memcpy(&height, dd+BDB_BLANK_SIZE+sizeof(apr_uint32_t), sizeof(apr_uint32_t));
+      tile->encoded_data = _bdb_blank_tile(ctx, cache, tile, dd+1, width, height);
+      if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
     } else {
       tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
       tile->encoded_data->buf = data.data;
-      tile->encoded_data->size = data.size-sizeof(apr_time_t);
+      tile->encoded_data->size = payload;
       tile->encoded_data->avail = data.size;
-      apr_pool_cleanup_register(ctx->pool, tile->encoded_data->buf,(void*)free, apr_pool_cleanup_null);
     }
-    tile->mtime = *((apr_time_t*)(data.data+data.size-sizeof(apr_time_t)));
+    memcpy(&tile->mtime, dd+payload, sizeof(apr_time_t));
     ret = MAPCACHE_SUCCESS;
   } else if(ret == DB_NOTFOUND) {
     ret = MAPCACHE_CACHE_MISS;
@@ -378,112 +491,165 @@ static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_tile *tile)
     ctx->set_error(ctx,500,"bdb backend failure on tile_get: %s",db_strerror(ret));
     ret = MAPCACHE_FAILURE;
   }
-  _bdb_release_conn(ctx,tile,benv);
   return ret;
 }
 
-
-static void _mapcache_cache_bdb_set(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_bdb_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  DBT key,data;
   int ret;
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tile->tileset->cache;
-  char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  struct bdb_env *benv = _bdb_get_conn(ctx,tile,0);
-  GC_CHECK_ERROR(ctx);
-  apr_time_t now = apr_time_now();
-  memset(&key, 0, sizeof(DBT));
-  memset(&data, 0, sizeof(DBT));
+  struct bdb_env *benv = _bdb_get_conn(ctx,pcache,tile,1);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+  ret = _bdb_tile_get(ctx,pcache,tile,benv);
+  _bdb_release_conn(ctx,pcache,tile,benv);
+  return ret;
+}
 
-  key.data = skey;
-  key.size = strlen(skey)+1;
+/* look up all the tiles with a single connection taken from the pool */
+static void _mapcache_cache_bdb_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i;
+  struct bdb_env *benv = _bdb_get_conn(ctx,pcache,tiles[0],1);
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    rets[i] = _bdb_tile_get(ctx,pcache,tiles[i],benv);
+    if(GC_HAS_ERROR(ctx)) break;
+  }
+  _bdb_release_conn(ctx,pcache,tiles[0],benv);
+}
 
+/* prepare the record of a tile: blank tiles of any size are reduced to their color */
+static void _bdb_tile_record(mapcache_context *ctx, mapcache_tile *tile, apr_time_t now, DBT *data)
+{
+  memset(data, 0, sizeof(DBT));
   if(!tile->raw_image) {
     tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
     GC_CHECK_ERROR(ctx);
   }
-  if(tile->raw_image->h==256 && tile->raw_image->w==256 && mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-    data.size = 5+sizeof(apr_time_t);
-    data.data = apr_palloc(ctx->pool,data.size);
-    (((char*)data.data)[0])='#';
-    memcpy(data.data+1,tile->raw_image->data,4);
-    memcpy(data.data+5,&now,sizeof(apr_time_t));
+  if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
+    apr_size_t payload = BDB_BLANK_SIZE;
+    unsigned char *dd;
+    if(tile->raw_image->w != 256 || tile->raw_image->h != 256)
+      payload = BDB_BLANK_SIZED_SIZE;
+    data->size = payload+sizeof(apr_time_t);
+    data->data = dd = apr_palloc(ctx->pool,data->size);
+    dd[0] = '#';
+    memcpy(dd+1,tile->raw_image->data,4);
+    if(payload == BDB_BLANK_SIZED_SIZE) {
+      apr_uint32_t width = tile->raw_image->w, height = tile->raw_image->h;
+      memcpy(dd+BDB_BLANK_SIZE,&width,sizeof(apr_uint32_t));
+      memcpy(dd+BDB_BLANK_SIZE+sizeof(apr_uint32_t),&height,sizeof(apr_uint32_t));
+    }
+    memcpy(dd+payload,&now,sizeof(apr_time_t));
   } else {
     if(!tile->encoded_data) {
       tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
       GC_CHECK_ERROR(ctx);
     }
     mapcache_buffer_append(tile->encoded_data,sizeof(apr_time_t),&now);
-    data.data = tile->encoded_data->buf;
-    data.size = tile->encoded_data->size;
+    data->data = tile->encoded_data->buf;
+    data->size = tile->encoded_data->size;
     tile->encoded_data->size -= sizeof(apr_time_t);
   }
-
-  ret = benv->db->put(benv->db,NULL,&key,&data,0);
-  if(ret != 0) {
-    ctx->set_error(ctx,500,"dbd backend failed on tile_set: %s", db_strerror(ret));
-  } else {
-    ret = benv->db->sync(benv->db,0);
-    if(ret)
-      ctx->set_error(ctx,500,"bdb backend sync failure on tile_set: %s",db_strerror(ret));
-  }
-  _bdb_release_conn(ctx,tile,benv);
 }
 
-static void _mapcache_cache_bdb_multiset(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+/*
+ * commit a write transaction. its durability depends on the configuration of the cache:
+ * in sync mode the commit flushes the log to disk, and concurrent commits share the same
+ * flush. in periodic mode the log is flushed by the first commit following the end of the
+ * sync interval
+ */
+static int _bdb_commit(mapcache_context *ctx, mapcache_cache_bdb *cache, struct bdb_env *benv, DB_TXN *txn)
 {
-  DBT key,data;
-  int ret,i;
-  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)tiles[0].tileset->cache;
-  struct bdb_env *benv = _bdb_get_conn(ctx,&tiles[0],0);
-  GC_CHECK_ERROR(ctx);
-  apr_time_t now = apr_time_now();
-  memset(&key, 0, sizeof(DBT));
-  memset(&data, 0, sizeof(DBT));
-
-  for(i=0; i<ntiles; i++) {
-    memset(&key, 0, sizeof(DBT));
-    memset(&data, 0, sizeof(DBT));
-    char *skey;
-    mapcache_tile *tile = &tiles[i];
-    skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-    if(!tile->raw_image) {
-      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-      GC_CHECK_ERROR(ctx);
+  int ret = txn->commit(txn, 0);
+  if(ret)
+    return ret;
+  if(cache->durability == MAPCACHE_BDB_DURABILITY_PERIODIC) {
+    struct bdb_shared *shared = cache->shared;
+    apr_time_t now = apr_time_now();
+    int flush = 0;
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(shared->mutex);
+#endif
+    if(now - shared->last_flush >= apr_time_from_sec(cache->sync_interval)) {
+      shared->last_flush = now;
+      flush = 1;
     }
-    if(tile->raw_image->h==256 && tile->raw_image->w==256 && mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-      data.size = 5+sizeof(apr_time_t);
-      data.data = apr_palloc(ctx->pool,data.size);
-      (((char*)data.data)[0])='#';
-      memcpy(data.data+1,tile->raw_image->data,4);
-      memcpy(data.data+5,&now,sizeof(apr_time_t));
-    } else {
-      if(!tile->encoded_data) {
-        tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
-        GC_CHECK_ERROR(ctx);
-      }
-      mapcache_buffer_append(tile->encoded_data,sizeof(apr_time_t),&now);
-      data.data = tile->encoded_data->buf;
-      data.size = tile->encoded_data->size;
-      tile->encoded_data->size -= sizeof(apr_time_t);
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(shared->mutex);
+#endif
+    if(flush) {
+      ret = benv->env->log_flush(benv->env, NULL);
+      if(ret)
+        return ret;
     }
-    key.data = skey;
-    key.size = strlen(skey)+1;
+  }
+  /* a no-op unless enough has been logged since the previous checkpoint */
+  return benv->env->txn_checkpoint(benv->env, 1024, 5, 0);
+}
 
-    ret = benv->db->put(benv->db,NULL,&key,&data,0);
-    if(ret != 0) {
-      ctx->set_error(ctx,500,"dbd backend failed on tile_multiset: %s", db_strerror(ret));
+/*
+ * store the given records in a single transaction, retried if it was chosen to resolve a
+ * deadlock with a concurrent writer
+ */
+static void _bdb_put(mapcache_context *ctx, mapcache_cache_bdb *cache, struct bdb_env *benv, DBT *keys, DBT *datas, int nrecords)
+{
+  int ret = 0, i, retries = 0;
+  DB_TXN *txn;
+  do {
+    ret = benv->env->txn_begin(benv->env, NULL, &txn, 0);
+    if(ret)
       break;
+    for(i=0; i<nrecords; i++) {
+      /* a NULL data is a deletion */
+      if(datas)
+        ret = benv->db->put(benv->db, txn, &keys[i], &datas[i], 0);
+      else
+        ret = benv->db->del(benv->db, txn, &keys[i], 0);
+      if(ret && ret != DB_NOTFOUND)
+        break;
+      ret = 0;
     }
+    if(ret) {
+      txn->abort(txn);
+    } else {
+      ret = _bdb_commit(ctx, cache, benv, txn);
+    }
+  } while((ret == DB_LOCK_DEADLOCK || ret == DB_LOCK_NOTGRANTED) && ++retries < 5);
+  if(ret) {
+    ctx->set_error(ctx,500,"bdb backend failure on %s: %s", datas?"tile_set":"tile_delete", db_strerror(ret));
   }
-  if(ret == 0) {
-    ret = benv->db->sync(benv->db,0);
-    if(ret)
-      ctx->set_error(ctx,500,"bdb backend sync failure on sync in tile_multiset: %s",db_strerror(ret));
+}
+
+static void _mapcache_cache_bdb_multiset(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  DBT *keys, *datas;
+  int i;
+  mapcache_cache_bdb *cache = (mapcache_cache_bdb*)pcache;
+  struct bdb_env *benv;
+  apr_time_t now = apr_time_now();
+
+  keys = (DBT*)apr_pcalloc(ctx->pool, ntiles*sizeof(DBT));
+  datas = (DBT*)apr_pcalloc(ctx->pool, ntiles*sizeof(DBT));
+  /* encode the tiles before taking the connection, so it isn't held while doing so */
+  for(i=0; i<ntiles; i++) {
+    char *skey = mapcache_util_get_tile_key(ctx,&tiles[i],cache->key_template,NULL,NULL);
+    GC_CHECK_ERROR(ctx);
+    keys[i].data = skey;
+    keys[i].size = strlen(skey)+1;
+    _bdb_tile_record(ctx, &tiles[i], now, &datas[i]);
+    GC_CHECK_ERROR(ctx);
   }
-  _bdb_release_conn(ctx,&tiles[0],benv);
+
+  benv = _bdb_get_conn(ctx,pcache,&tiles[0],0);
+  GC_CHECK_ERROR(ctx);
+  _bdb_put(ctx, cache, benv, keys, datas, ntiles);
+  _bdb_release_conn(ctx,pcache,&tiles[0],benv);
 }
 
+static void _mapcache_cache_bdb_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _mapcache_cache_bdb_multiset(ctx, pcache, tile, 1);
+}
 
 static void _mapcache_cache_bdb_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
 {
@@ -493,9 +659,31 @@ static void _mapcache_cache_bdb_configuration_parse_xml(mapcache_context *ctx, e
     dcache->basedir = apr_pstrdup(ctx->pool,cur_node->txt);
   }
   if ((cur_node = ezxml_child(node,"key_template")) != NULL) {
-    dcache->key_template = apr_pstrdup(ctx->pool,cur_node->txt);
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,cur_node->txt);
   } else {
-    dcache->key_template = apr_pstrdup(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+  }
+  if ((cur_node = ezxml_child(node,"durability")) != NULL) {
+    if(!strcmp(cur_node->txt,"sync")) {
+      dcache->durability = MAPCACHE_BDB_DURABILITY_SYNC;
+    } else if(!strcmp(cur_node->txt,"nosync")) {
+      dcache->durability = MAPCACHE_BDB_DURABILITY_NOSYNC;
+    } else if(!strcmp(cur_node->txt,"periodic")) {
+      dcache->durability = MAPCACHE_BDB_DURABILITY_PERIODIC;
+    } else {
+      ctx->set_error(ctx,400,"bdb cache \"%s\": unknown durability \"%s\", expecting \"sync\", \"nosync\" or \"periodic\"",
+                     cache->name, cur_node->txt);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node,"sync_interval")) != NULL) {
+    char *endptr;
+    dcache->sync_interval = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->sync_interval <= 0) {
+      ctx->set_error(ctx,400,"failed to parse sync_interval \"%s\" for bdb cache \"%s\", expecting a positive number of seconds",
+                     cur_node->txt, cache->name);
+      return;
+    }
   }
   if(!dcache->basedir) {
     ctx->set_error(ctx,500,"dbd cache \"%s\" is missing <base> entry",cache->name);
@@ -510,13 +698,25 @@ static void _mapcache_cache_bdb_configuration_post_config(mapcache_context *ctx,
     mapcache_cache *cache, mapcache_cfg *cfg)
 {
   mapcache_cache_bdb *dcache = (mapcache_cache_bdb*)cache;
+  struct bdb_shared *shared;
   apr_status_t rv;
   apr_dir_t *dir;
   rv = apr_dir_open(&dir, dcache->basedir, ctx->pool);
   if(rv != APR_SUCCESS) {
     char errmsg[120];
     ctx->set_error(ctx,500,"bdb failed to open directory %s:%s",dcache->basedir,apr_strerror(rv,errmsg,120));
+    return;
   }
+  shared = apr_pcalloc(ctx->pool, sizeof(struct bdb_shared));
+  apr_pool_create(&shared->pool, ctx->pool);
+  shared->blanks = apr_hash_make(shared->pool);
+#ifdef APR_HAS_THREADS
+  if(apr_thread_mutex_create(&shared->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"bdb cache %s: failed to create lock",cache->name);
+    return;
+  }
+#endif
+  dcache->shared = shared;
 }
 
 /**
@@ -536,10 +736,13 @@ mapcache_cache* mapcache_cache_bdb_create(mapcache_context *ctx)
   cache->cache.tile_exists = _mapcache_cache_bdb_has_tile;
   cache->cache.tile_set = _mapcache_cache_bdb_set;
   cache->cache.tile_multi_set = _mapcache_cache_bdb_multiset;
+  cache->cache.tile_multi_get = _mapcache_cache_bdb_multi_get;
   cache->cache.configuration_post_config = _mapcache_cache_bdb_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_bdb_configuration_parse_xml;
   cache->basedir = NULL;
   cache->key_template = NULL;
+  cache->durability = MAPCACHE_BDB_DURABILITY_SYNC;
+  cache->sync_interval = 1;
   return (mapcache_cache*)cache;
 }
 
@@ -0,0 +1,771 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: compact bundle cache backend
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * a bundle file stores the tiles of a bundle_size x bundle_size block of a grid level,
+ * in the spirit of arcgis compact caches:
+ *
+ * - a 16 byte header: the "MCBUNDLE" magic, the format version and the bundle size
+ * - a fixed size index of bundle_size*bundle_size 64bit entries, row by row. an entry
+ *   holds the offset of the tile's record in its lower 40 bits, and the size of the
+ *   tile data in its upper 24 bits. an empty entry means the tile isn't cached
+ * - the tile records, each being the tile's apr_time_t modification time followed
+ *   by the tile data
+ *
+ * integers are stored in the native byte order. records are only ever appended, and
+ * their index entry is updated once the data is written, so that readers never need a
+ * lock. writers hold an exclusive lock on the bundle file, which serializes them across
+ * processes whichever locker is configured. the space used by replaced or deleted tiles
+ * is reclaimed by compacting the bundle, i.e. rewriting it with its live tiles only (see
+ * mapcache_seed -m compact)
+ */
+
+#include "mapcache.h"
+#include <apr_file_info.h>
+#include <apr_strings.h>
+#include <apr_file_io.h>
+#include <apr_mmap.h>
+#define APR_WANT_IOVEC
+#include <apr_want.h>
+#include <string.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#define MAPCACHE_BUNDLE_MAGIC "MCBUNDLE"
+#define MAPCACHE_BUNDLE_VERSION 1
+#define MAPCACHE_BUNDLE_HEADER_SIZE 16
+#define MAPCACHE_BUNDLE_OFFSET_BITS 40
+#define MAPCACHE_BUNDLE_MAX_TILE_SIZE ((1<<24)-1)
+#define MAPCACHE_BUNDLE_RECORD_HEADER_SIZE sizeof(apr_time_t)
+
+#define BUNDLE_ENTRY_OFFSET(e) ((apr_off_t)((e) & ((((apr_uint64_t)1)<<MAPCACHE_BUNDLE_OFFSET_BITS)-1)))
+#define BUNDLE_ENTRY_SIZE(e) ((apr_size_t)((e) >> MAPCACHE_BUNDLE_OFFSET_BITS))
+#define BUNDLE_ENTRY(offset,size) (((apr_uint64_t)(offset)) | (((apr_uint64_t)(size))<<MAPCACHE_BUNDLE_OFFSET_BITS))
+
+typedef struct {
+  char magic[8];
+  apr_uint32_t version;
+  apr_uint32_t bundle_size;
+} _bundle_header;
+
+/**
+ * \brief an open bundle file, with its index mapped in memory
+ */
+typedef struct {
+  char *filename;
+  apr_file_t *f;
+  apr_mmap_t *mm;
+  apr_uint64_t *index;
+  apr_off_t fsize;
+  apr_finfo_t finfo;
+} _bundle;
+
+static apr_size_t _bundle_index_size(mapcache_cache_bundle *dcache)
+{
+  return dcache->bundle_size * dcache->bundle_size * sizeof(apr_uint64_t);
+}
+
+static int _bundle_tile_index(mapcache_cache_bundle *dcache, mapcache_tile *tile)
+{
+  return (tile->y % dcache->bundle_size) * dcache->bundle_size + (tile->x % dcache->bundle_size);
+}
+
+/**
+ * \brief return the filename of the bundle a tile is stored in
+ *
+ * bundles are named after the row and column of their first tile, e.g.
+ * base/tileset/grid/L05/R0080C0100.bundle
+ * \private \memberof mapcache_cache_bundle
+ */
+static char* _bundle_filename(mapcache_context *ctx, mapcache_cache_bundle *dcache, mapcache_tile *tile)
+{
+  char *path = apr_pstrcat(ctx->pool,
+                           dcache->base_directory,"/",
+                           tile->tileset->name,"/",
+                           tile->grid_link->grid->name,
+                           NULL);
+  if(tile->dimensions) {
+    const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+    int i = elts->nelts;
+    while(i--) {
+      apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+      const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+      path = apr_pstrcat(ctx->pool,path,"/",dimval,NULL);
+    }
+  }
+  return apr_psprintf(ctx->pool,"%s/L%02d/R%04xC%04x.bundle", path, tile->z,
+                      tile->y / dcache->bundle_size * dcache->bundle_size,
+                      tile->x / dcache->bundle_size * dcache->bundle_size);
+}
+
+/**
+ * \brief open a bundle and map its index
+ *
+ * \returns MAPCACHE_CACHE_MISS if the bundle does not exist
+ * \private \memberof mapcache_cache_bundle
+ */
+static int _bundle_open(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename, int writable, _bundle *bundle)
+{
+  apr_status_t rv;
+  apr_finfo_t finfo;
+  char errmsg[120];
+  _bundle_header *header;
+  apr_size_t mapsize = MAPCACHE_BUNDLE_HEADER_SIZE + _bundle_index_size(dcache);
+
+  memset(bundle, 0, sizeof(_bundle));
+  bundle->filename = filename;
+  rv = apr_file_open(&bundle->f, filename, writable?(APR_FOPEN_READ|APR_FOPEN_WRITE|APR_FOPEN_BINARY):(APR_FOPEN_READ|APR_FOPEN_BINARY),
+                     APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      return MAPCACHE_CACHE_MISS;
+    }
+    ctx->set_error(ctx, 500, "failed to open bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    return MAPCACHE_FAILURE;
+  }
+  rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_IDENT, bundle->f);
+  if((rv != APR_SUCCESS && rv != APR_INCOMPLETE) || !(finfo.valid & APR_FINFO_SIZE) || finfo.size < mapsize) {
+    ctx->set_error(ctx, 500, "bundle %s is truncated", filename);
+    apr_file_close(bundle->f);
+    return MAPCACHE_FAILURE;
+  }
+  bundle->fsize = finfo.size;
+  bundle->finfo = finfo;
+  rv = apr_mmap_create(&bundle->mm, bundle->f, 0, mapsize, writable?(APR_MMAP_READ|APR_MMAP_WRITE):APR_MMAP_READ, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to mmap index of bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    apr_file_close(bundle->f);
+    return MAPCACHE_FAILURE;
+  }
+  header = (_bundle_header*)bundle->mm->mm;
+  if(memcmp(header->magic, MAPCACHE_BUNDLE_MAGIC, 8) || header->version != MAPCACHE_BUNDLE_VERSION ||
+      header->bundle_size != dcache->bundle_size) {
+    ctx->set_error(ctx, 500, "%s is not a version %d bundle of size %d", filename, MAPCACHE_BUNDLE_VERSION, dcache->bundle_size);
+    apr_mmap_delete(bundle->mm);
+    apr_file_close(bundle->f);
+    return MAPCACHE_FAILURE;
+  }
+  bundle->index = (apr_uint64_t*)((char*)bundle->mm->mm + MAPCACHE_BUNDLE_HEADER_SIZE);
+  return MAPCACHE_SUCCESS;
+}
+
+static void _bundle_close(_bundle *bundle)
+{
+  apr_mmap_delete(bundle->mm);
+  apr_file_close(bundle->f);
+}
+
+/**
+ * \brief write the header and index of a bundle to a temporary file next to filename
+ *
+ * must be called with the bundle locked.
+ * \returns the open temporary file, positioned after the index
+ * \private \memberof mapcache_cache_bundle
+ */
+static apr_file_t* _bundle_create_tmp(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename,
+                                      apr_uint64_t *index, char **tmpname)
+{
+  apr_file_t *f;
+  apr_status_t rv;
+  apr_size_t len;
+  char errmsg[120];
+  _bundle_header header;
+  apr_size_t index_size = _bundle_index_size(dcache);
+  void *empty = NULL;
+
+  /* unique to the process, the writers of a process are serialized by the mapcache lock */
+  *tmpname = apr_psprintf(ctx->pool, "%s.%d.tmp", filename, (int)getpid());
+  rv = apr_file_open(&f, *tmpname, APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_TRUNCATE|APR_FOPEN_BINARY, APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create bundle %s: %s", *tmpname, apr_strerror(rv,errmsg,120));
+    return NULL;
+  }
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, MAPCACHE_BUNDLE_MAGIC, 8);
+  header.version = MAPCACHE_BUNDLE_VERSION;
+  header.bundle_size = dcache->bundle_size;
+  if(!index) {
+    index = empty = calloc(1, index_size);
+  }
+  len = MAPCACHE_BUNDLE_HEADER_SIZE;
+  rv = apr_file_write_full(f, &header, len, &len);
+  if(rv == APR_SUCCESS) {
+    len = index_size;
+    rv = apr_file_write_full(f, index, len, &len);
+  }
+  free(empty);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to write bundle %s: %s", *tmpname, apr_strerror(rv,errmsg,120));
+    apr_file_close(f);
+    apr_file_remove(*tmpname, ctx->pool);
+    return NULL;
+  }
+  return f;
+}
+
+/**
+ * \brief atomically replace filename with the given temporary bundle file
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_commit_tmp(mapcache_context *ctx, apr_file_t *f, char *tmpname, char *filename)
+{
+  apr_status_t rv;
+  char errmsg[120];
+  apr_file_close(f);
+  rv = apr_file_rename(tmpname, filename, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to rename bundle %s to %s: %s", tmpname, filename, apr_strerror(rv,errmsg,120));
+    apr_file_remove(tmpname, ctx->pool);
+  }
+}
+
+/**
+ * \brief create filename from the given empty temporary bundle file, unless it exists
+ *
+ * another process may have created the bundle and appended to it meanwhile, so it must
+ * not be replaced
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_create_commit_tmp(mapcache_context *ctx, apr_file_t *f, char *tmpname, char *filename)
+{
+  apr_status_t rv;
+  char errmsg[120];
+  apr_file_close(f);
+  rv = apr_file_link(tmpname, filename);
+  if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+    ctx->set_error(ctx, 500, "failed to link bundle %s to %s: %s", tmpname, filename, apr_strerror(rv,errmsg,120));
+  }
+  apr_file_remove(tmpname, ctx->pool);
+}
+
+/**
+ * \brief open a bundle with an exclusive lock on its file
+ *
+ * the lock serializes the writers of all the processes, even when they do not share the
+ * locker's lock table. a bundle that was replaced by a compaction while waiting for the
+ * lock is reopened, so that nothing is written to the replaced file.
+ * \private \memberof mapcache_cache_bundle
+ */
+static int _bundle_open_locked(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename, int writable, _bundle *bundle)
+{
+  apr_status_t rv;
+  apr_finfo_t finfo;
+  char errmsg[120];
+  int ret;
+  while(1) {
+    ret = _bundle_open(ctx, dcache, filename, writable, bundle);
+    if(ret != MAPCACHE_SUCCESS)
+      return ret;
+    rv = apr_file_lock(bundle->f, APR_FLOCK_EXCLUSIVE);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to lock bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+      _bundle_close(bundle);
+      return MAPCACHE_FAILURE;
+    }
+    if(!(bundle->finfo.valid & APR_FINFO_IDENT))
+      break;
+    rv = apr_stat(&finfo, filename, APR_FINFO_IDENT, ctx->pool);
+    if((rv == APR_SUCCESS || rv == APR_INCOMPLETE) && (finfo.valid & APR_FINFO_IDENT) &&
+        finfo.inode == bundle->finfo.inode && finfo.device == bundle->finfo.device)
+      break;
+    /* closing the file releases the lock */
+    _bundle_close(bundle);
+  }
+  /* records may have been appended while waiting for the lock */
+  if(apr_file_info_get(&finfo, APR_FINFO_SIZE, bundle->f) == APR_SUCCESS)
+    bundle->fsize = finfo.size;
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \brief read tiles from a bundle
+ *
+ * looks up the given tiles, which must all be stored in the given bundle, in its index.
+ * if with_data is set, the found tiles point into a read-only mapping of the bundle that
+ * lives as long as the request, so that their data is only paged in if it is used. tiles
+ * appended after the bundle was mapped are read with a seek and a read.
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_read(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename,
+                         mapcache_tile **tiles, int ntiles, int *rets, int with_data)
+{
+  _bundle bundle;
+  apr_mmap_t *data_mm = NULL;
+  int i, ret;
+  ret = _bundle_open(ctx, dcache, filename, 0, &bundle);
+  if(ret != MAPCACHE_SUCCESS) {
+    for(i=0; i<ntiles; i++) rets[i] = ret;
+    return;
+  }
+  if(with_data) {
+    /* on failure, e.g. for lack of address space, the tiles are read instead */
+    if(apr_mmap_create(&data_mm, bundle.f, 0, bundle.fsize, APR_MMAP_READ, ctx->pool) != APR_SUCCESS)
+      data_mm = NULL;
+  }
+  for(i=0; i<ntiles; i++) {
+    apr_uint64_t entry = bundle.index[_bundle_tile_index(dcache, tiles[i])];
+    apr_off_t offset = BUNDLE_ENTRY_OFFSET(entry);
+    apr_size_t size = BUNDLE_ENTRY_SIZE(entry);
+    apr_size_t len = size + MAPCACHE_BUNDLE_RECORD_HEADER_SIZE;
+    apr_status_t rv;
+    char *record;
+    if(!entry) {
+      rets[i] = MAPCACHE_CACHE_MISS;
+      continue;
+    }
+    if(offset + len > bundle.fsize) {
+      /* the record was appended after we opened the bundle */
+      apr_finfo_t finfo;
+      if(apr_file_info_get(&finfo, APR_FINFO_SIZE, bundle.f) == APR_SUCCESS)
+        bundle.fsize = finfo.size;
+      if(offset + len > bundle.fsize) {
+        ctx->set_error(ctx, 500, "bundle %s has an index entry beyond its end", filename);
+        rets[i] = MAPCACHE_FAILURE;
+        break;
+      }
+    }
+    if(!with_data) {
+      rets[i] = MAPCACHE_SUCCESS;
+      continue;
+    }
+    if(data_mm && offset + len <= data_mm->size) {
+      record = (char*)data_mm->mm + offset;
+    } else {
+      apr_off_t seek = offset;
+      record = apr_palloc(ctx->pool, len);
+      rv = apr_file_seek(bundle.f, APR_SET, &seek);
+      if(rv == APR_SUCCESS)
+        rv = apr_file_read_full(bundle.f, record, len, &len);
+      if(rv != APR_SUCCESS) {
+        char errmsg[120];
+        ctx->set_error(ctx, 500, "failed to read tile from bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+        rets[i] = MAPCACHE_FAILURE;
+        break;
+      }
+    }
+    memcpy(&tiles[i]->mtime, record, sizeof(apr_time_t));
+    tiles[i]->encoded_data = mapcache_buffer_create(0, ctx->pool);
+    tiles[i]->encoded_data->buf = record + MAPCACHE_BUNDLE_RECORD_HEADER_SIZE;
+    tiles[i]->encoded_data->size = tiles[i]->encoded_data->avail = size;
+    /* lets the server modules send the tile straight from the bundle */
+    mapcache_buffer_set_file(tiles[i]->encoded_data, filename, offset + MAPCACHE_BUNDLE_RECORD_HEADER_SIZE, &bundle.finfo);
+    rets[i] = MAPCACHE_SUCCESS;
+  }
+  _bundle_close(&bundle);
+}
+
+static int _mapcache_cache_bundle_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)pcache;
+  int ret;
+  char *filename = _bundle_filename(ctx, dcache, tile);
+  _bundle_read(ctx, dcache, filename, &tile, 1, &ret, 0);
+  return (ret == MAPCACHE_SUCCESS)?MAPCACHE_TRUE:MAPCACHE_FALSE;
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_bundle_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)pcache;
+  int ret;
+  char *filename = _bundle_filename(ctx, dcache, tile);
+  _bundle_read(ctx, dcache, filename, &tile, 1, &ret, 1);
+  return ret;
+}
+
+/**
+ * \brief group tiles by bundle
+ *
+ * calls func once for each bundle the given tiles are stored in
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_foreach(mapcache_context *ctx, mapcache_cache_bundle *dcache, mapcache_tile **tiles, int ntiles, int *rets,
+                            void (*func)(mapcache_context*, mapcache_cache_bundle*, char*, mapcache_tile**, int, int*))
+{
+  char **filenames = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+  mapcache_tile **bundletiles = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  int *bundlerets = apr_palloc(ctx->pool, ntiles * sizeof(int));
+  int *positions = apr_palloc(ctx->pool, ntiles * sizeof(int));
+  int first, i, n;
+  for(i=0; i<ntiles; i++) {
+    filenames[i] = _bundle_filename(ctx, dcache, tiles[i]);
+  }
+  for(first=0; first<ntiles; first++) {
+    char *filename = filenames[first];
+    if(!filename) continue; /* already handled */
+    n = 0;
+    for(i=first; i<ntiles; i++) {
+      if(filenames[i] && !strcmp(filenames[i], filename)) {
+        positions[n] = i;
+        bundletiles[n++] = tiles[i];
+        filenames[i] = NULL;
+      }
+    }
+    func(ctx, dcache, filename, bundletiles, n, bundlerets);
+    if(rets) {
+      for(i=0; i<n; i++) rets[positions[i]] = bundlerets[i];
+    }
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _bundle_read_data(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename,
+                              mapcache_tile **tiles, int ntiles, int *rets)
+{
+  _bundle_read(ctx, dcache, filename, tiles, ntiles, rets, 1);
+}
+
+/**
+ * \brief get the content of multiple tiles, opening each bundle once
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_bundle_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  _bundle_foreach(ctx, (mapcache_cache_bundle*)pcache, tiles, ntiles, rets, _bundle_read_data);
+}
+
+/**
+ * \brief store tiles into a bundle
+ *
+ * appends the records of the given tiles, which must all be stored in the given bundle,
+ * with a single write, then points their index entries to them. the bundle is created
+ * if needed.
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _bundle_write(mapcache_context *ctx, mapcache_cache_bundle *dcache, char *filename,
+                          mapcache_tile **tiles, int ntiles, int *rets)
+{
+  _bundle bundle;
+  apr_status_t rv;
+  char errmsg[120];
+  struct iovec *iov;
+  apr_size_t written;
+  apr_off_t offset = 0;
+  apr_time_t now = apr_time_now();
+  int i, ret;
+  char *dir;
+
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = tiles[i];
+    if(!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(tile->encoded_data->size > MAPCACHE_BUNDLE_MAX_TILE_SIZE) {
+      ctx->set_error(ctx, 500, "tile of %d bytes is too large to be stored in a bundle", (int)tile->encoded_data->size);
+      return;
+    }
+  }
+
+  dir = apr_pstrdup(ctx->pool, filename);
+  *strrchr(dir,'/') = '\0';
+  rv = apr_dir_make_recursive(dir, APR_OS_DEFAULT, ctx->pool);
+  if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+    ctx->set_error(ctx, 500, "failed to create directory %s: %s", dir, apr_strerror(rv,errmsg,120));
+    return;
+  }
+
+  /*
+   * writers of a bundle are serialized, readers go without a lock. the mapcache lock
+   * serializes the threads of a process, the lock on the file the processes
+   */
+  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE && !GC_HAS_ERROR(ctx));
+  GC_CHECK_ERROR(ctx);
+
+  ret = _bundle_open_locked(ctx, dcache, filename, 1, &bundle);
+  if(ret == MAPCACHE_CACHE_MISS) {
+    char *tmpname;
+    apr_file_t *f = _bundle_create_tmp(ctx, dcache, filename, NULL, &tmpname);
+    if(f) {
+      _bundle_create_commit_tmp(ctx, f, tmpname, filename);
+    }
+    if(!GC_HAS_ERROR(ctx)) {
+      ret = _bundle_open_locked(ctx, dcache, filename, 1, &bundle);
+    }
+  }
+  if(ret != MAPCACHE_SUCCESS) {
+    if(!GC_HAS_ERROR(ctx)) {
+      ctx->set_error(ctx, 500, "failed to open bundle %s", filename);
+    }
+    goto unlock;
+  }
+
+  iov = apr_palloc(ctx->pool, 2 * ntiles * sizeof(struct iovec));
+  for(i=0; i<ntiles; i++) {
+    iov[2*i].iov_base = (void*)&now;
+    iov[2*i].iov_len = MAPCACHE_BUNDLE_RECORD_HEADER_SIZE;
+    iov[2*i+1].iov_base = (void*)tiles[i]->encoded_data->buf;
+    iov[2*i+1].iov_len = tiles[i]->encoded_data->size;
+  }
+  rv = apr_file_seek(bundle.f, APR_END, &offset);
+  if(rv == APR_SUCCESS) {
+    apr_off_t end = offset;
+    for(i=0; i<ntiles; i++) {
+      end += MAPCACHE_BUNDLE_RECORD_HEADER_SIZE + tiles[i]->encoded_data->size;
+    }
+    /* the index entries can only address the first 2^40 bytes of the bundle */
+    if(end > ((apr_off_t)1 << MAPCACHE_BUNDLE_OFFSET_BITS)) {
+      ctx->set_error(ctx, 500, "bundle %s is full, it must be compacted or use a smaller <bundle_size>", filename);
+      _bundle_close(&bundle);
+      goto unlock;
+    }
+    rv = apr_file_writev_full(bundle.f, iov, 2 * ntiles, &written);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to append to bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    _bundle_close(&bundle);
+    goto unlock;
+  }
+
+  /* the data is in place, the tiles can now be made visible to readers */
+  for(i=0; i<ntiles; i++) {
+    bundle.index[_bundle_tile_index(dcache, tiles[i])] = BUNDLE_ENTRY(offset, tiles[i]->encoded_data->size);
+    offset += MAPCACHE_BUNDLE_RECORD_HEADER_SIZE + tiles[i]->encoded_data->size;
+  }
+  _bundle_close(&bundle);
+
+unlock:
+  mapcache_unlock_resource(ctx,filename);
+}
+
+/**
+ * \brief write tile data to a bundle
+ *
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_bundle_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)pcache;
+  char *filename = _bundle_filename(ctx, dcache, tile);
+  _bundle_write(ctx, dcache, filename, &tile, 1, NULL);
+}
+
+/**
+ * \brief write the tiles of a metatile, with a single lock and append per bundle
+ *
+ * \private \memberof mapcache_cache_bundle
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_bundle_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_tile **ptiles = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  int i;
+  for(i=0; i<ntiles; i++) {
+    ptiles[i] = &tiles[i];
+  }
+  _bundle_foreach(ctx, (mapcache_cache_bundle*)pcache, ptiles, ntiles, NULL, _bundle_write);
+}
+
+/**
+ * \brief remove a tile from its bundle's index
+ *
+ * the space used by the tile is reclaimed when the bundle is compacted
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)pcache;
+  _bundle bundle;
+  char *filename = _bundle_filename(ctx, dcache, tile);
+
+  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE && !GC_HAS_ERROR(ctx));
+  GC_CHECK_ERROR(ctx);
+  if(_bundle_open_locked(ctx, dcache, filename, 1, &bundle) == MAPCACHE_SUCCESS) {
+    bundle.index[_bundle_tile_index(dcache, tile)] = 0;
+    _bundle_close(&bundle);
+  }
+  mapcache_unlock_resource(ctx,filename);
+}
+
+/**
+ * \brief rewrite the bundle containing the given tile without its dead records
+ *
+ * \param reclaimed set to the number of bytes freed
+ * \returns MAPCACHE_CACHE_MISS if the bundle does not exist or has nothing to reclaim
+ * \memberof mapcache_cache_bundle
+ */
+int mapcache_cache_bundle_compact(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, apr_off_t *reclaimed)
+{
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)pcache;
+  _bundle bundle;
+  apr_uint64_t *index;
+  apr_file_t *f;
+  apr_status_t rv = APR_SUCCESS;
+  char errmsg[120];
+  char *tmpname;
+  int i, ret, nentries = dcache->bundle_size * dcache->bundle_size;
+  apr_off_t offset, live = MAPCACHE_BUNDLE_HEADER_SIZE + _bundle_index_size(dcache);
+  char *filename = _bundle_filename(ctx, dcache, tile);
+  char *record = NULL;
+  apr_size_t record_avail = 0;
+
+  *reclaimed = 0;
+  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE && !GC_HAS_ERROR(ctx));
+  if(GC_HAS_ERROR(ctx))
+    return MAPCACHE_FAILURE;
+  /* the lock on the old file is held until it has been replaced. locking needs write access */
+  ret = _bundle_open_locked(ctx, dcache, filename, 1, &bundle);
+  if(ret != MAPCACHE_SUCCESS) {
+    goto unlock;
+  }
+  for(i=0; i<nentries; i++) {
+    if(bundle.index[i])
+      live += MAPCACHE_BUNDLE_RECORD_HEADER_SIZE + BUNDLE_ENTRY_SIZE(bundle.index[i]);
+  }
+  if(live >= bundle.fsize) {
+    /* no dead records */
+    ret = MAPCACHE_CACHE_MISS;
+    _bundle_close(&bundle);
+    goto unlock;
+  }
+
+  /* compute the new index, the records are copied in the order of the index */
+  index = apr_palloc(ctx->pool, _bundle_index_size(dcache));
+  offset = MAPCACHE_BUNDLE_HEADER_SIZE + _bundle_index_size(dcache);
+  for(i=0; i<nentries; i++) {
+    if(bundle.index[i]) {
+      index[i] = BUNDLE_ENTRY(offset, BUNDLE_ENTRY_SIZE(bundle.index[i]));
+      offset += MAPCACHE_BUNDLE_RECORD_HEADER_SIZE + BUNDLE_ENTRY_SIZE(bundle.index[i]);
+    } else {
+      index[i] = 0;
+    }
+  }
+
+  f = _bundle_create_tmp(ctx, dcache, filename, index, &tmpname);
+  if(!f) {
+    ret = MAPCACHE_FAILURE;
+    _bundle_close(&bundle);
+    goto unlock;
+  }
+  for(i=0; i<nentries && rv == APR_SUCCESS; i++) {
+    apr_size_t len;
+    if(!bundle.index[i]) continue;
+    offset = BUNDLE_ENTRY_OFFSET(bundle.index[i]);
+    len = MAPCACHE_BUNDLE_RECORD_HEADER_SIZE + BUNDLE_ENTRY_SIZE(bundle.index[i]);
+    if(len > record_avail) {
+      record = apr_palloc(ctx->pool, len);
+      record_avail = len;
+    }
+    rv = apr_file_seek(bundle.f, APR_SET, &offset);
+    if(rv == APR_SUCCESS)
+      rv = apr_file_read_full(bundle.f, record, len, &len);
+    if(rv == APR_SUCCESS)
+      rv = apr_file_write_full(f, record, len, &len);
+  }
+  *reclaimed = bundle.fsize - live;
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to compact bundle %s: %s", filename, apr_strerror(rv,errmsg,120));
+    apr_file_close(f);
+    apr_file_remove(tmpname, ctx->pool);
+    _bundle_close(&bundle);
+    ret = MAPCACHE_FAILURE;
+    goto unlock;
+  }
+  _bundle_commit_tmp(ctx, f, tmpname, filename);
+  /* writers waiting for the lock notice the bundle has been replaced once it is released */
+  _bundle_close(&bundle);
+  ret = GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
+
+unlock:
+  mapcache_unlock_resource(ctx,filename);
+  return ret;
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_bundle *dcache = (mapcache_cache_bundle*)cache;
+
+  if ((cur_node = ezxml_child(node,"base")) != NULL) {
+    dcache->base_directory = apr_pstrdup(ctx->pool,cur_node->txt);
+  }
+  if ((cur_node = ezxml_child(node,"bundle_size")) != NULL) {
+    char *endptr;
+    dcache->bundle_size = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->bundle_size <= 0 || dcache->bundle_size > 1024) {
+      ctx->set_error(ctx, 400, "failed to parse bundle_size \"%s\" for cache \"%s\". Expecting an integer between 1 and 1024",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if(!dcache->base_directory) {
+    ctx->set_error(ctx, 400, "bundle cache \"%s\" is missing <base> entry", cache->name);
+    return;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_bundle
+ */
+static void _mapcache_cache_bundle_configuration_post_config(mapcache_context *ctx, mapcache_cache *cache,
+    mapcache_cfg *cfg)
+{
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_bundle
+ */
+mapcache_cache* mapcache_cache_bundle_create(mapcache_context *ctx)
+{
+  mapcache_cache_bundle *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_bundle));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate bundle cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_BUNDLE;
+  cache->bundle_size = 128;
+  cache->cache.tile_delete = _mapcache_cache_bundle_delete;
+  cache->cache.tile_get = _mapcache_cache_bundle_get;
+  cache->cache.tile_multi_get = _mapcache_cache_bundle_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_bundle_has_tile;
+  cache->cache.tile_set = _mapcache_cache_bundle_set;
+  cache->cache.tile_multi_set = _mapcache_cache_bundle_multi_set;
+  cache->cache.configuration_post_config = _mapcache_cache_bundle_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_bundle_configuration_parse_xml;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -0,0 +1,525 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: composite multi-tier cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <string.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
+/*
+ * a composite cache chains several caches, fastest first. reads go down the tiers until
+ * the tile is found, and promote it to the tiers above. writes go synchronously to the
+ * first tier, and are queued to be written to the lower tiers by a background task.
+ */
+
+/*
+ * the tiles of a single tile_set or tile_multi_set call, waiting to be written to the
+ * lower tiers. they are copied to their own pool, as the request is gone by the time
+ * they are written
+ */
+typedef struct _composite_job _composite_job;
+struct _composite_job {
+  apr_pool_t *pool;
+  mapcache_tile *tiles;
+  int ntiles;
+  _composite_job *next;
+};
+
+/*
+ * the queue is created with the configuration, and is private to each process once the
+ * server has forked
+ */
+typedef struct {
+  mapcache_cache_composite *cache;
+  _composite_job *head, *tail;
+  int queued; /* number of tiles waiting in the queue */
+  int flushing; /* number of tasks emptying the queue */
+  int closed; /* the process is exiting, tiles are written synchronously */
+  mapcache_context *drain_ctx; /* context used to empty the queue when the process exits */
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *flushed; /* signaled when a task is done emptying the queue */
+#endif
+} _composite_queue;
+
+static void _composite_queue_lock(_composite_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(queue->mutex);
+#endif
+}
+
+static void _composite_queue_unlock(_composite_queue *queue)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(queue->mutex);
+#endif
+}
+
+static mapcache_cache* _composite_tier(mapcache_cache_composite *cache, int i)
+{
+  return APR_ARRAY_IDX(cache->caches, i, mapcache_cache*);
+}
+
+/* write tiles to a single tier, in one operation if it supports it */
+static void _composite_write(mapcache_context *ctx, mapcache_cache *tier, mapcache_tile *tiles, int ntiles)
+{
+  int i;
+  if(tier->tile_multi_set && ntiles > 1) {
+    tier->tile_multi_set(ctx, tier, tiles, ntiles);
+    return;
+  }
+  for(i=0; i<ntiles; i++) {
+    tier->tile_set(ctx, tier, &tiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _composite_write_tiers(mapcache_context *ctx, mapcache_cache_composite *cache,
+                                   mapcache_tile *tiles, int ntiles, int first, int last)
+{
+  int i;
+  for(i=first; i<last; i++) {
+    _composite_write(ctx, _composite_tier(cache,i), tiles, ntiles);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/*
+ * store tiles found in a lower tier into the tiers above it. a failure to do so does not
+ * prevent the tiles from being returned
+ */
+static void _composite_promote(mapcache_context *ctx, mapcache_cache_composite *cache,
+                               mapcache_tile *tiles, int ntiles, int tier)
+{
+  _composite_write_tiers(ctx, cache, tiles, ntiles, 0, tier);
+  if(GC_HAS_ERROR(ctx)) {
+    ctx->log(ctx, MAPCACHE_WARN, "composite cache %s: failed to promote tiles from cache %s: %s",
+             cache->cache.name, _composite_tier(cache,tier)->name, ctx->get_error_message(ctx));
+    ctx->clear_errors(ctx);
+  }
+}
+
+/*
+ * background task writing the queued tiles to the lower tiers, in batches of at most
+ * write_behind_batch tiles (unless a single job is larger), until the queue is empty
+ */
+static void _composite_flush(mapcache_context *ctx, void *data)
+{
+  _composite_queue *queue = (_composite_queue*)data;
+  mapcache_cache_composite *cache = queue->cache;
+  apr_pool_t *pool = ctx->pool;
+
+  while(1) {
+    _composite_job *jobs, *job;
+    mapcache_tile *batch;
+    int nbatch = 0;
+
+    _composite_queue_lock(queue);
+    jobs = job = queue->head;
+    while(queue->head && (!nbatch || nbatch + queue->head->ntiles <= cache->write_behind_batch)) {
+      job = queue->head;
+      nbatch += job->ntiles;
+      queue->head = job->next;
+    }
+    if(!nbatch) {
+      queue->flushing--;
+#ifdef APR_HAS_THREADS
+      apr_thread_cond_broadcast(queue->flushed);
+#endif
+      _composite_queue_unlock(queue);
+      return;
+    }
+    job->next = NULL;
+    if(!queue->head)
+      queue->tail = NULL;
+    queue->queued -= nbatch;
+    _composite_queue_unlock(queue);
+
+    apr_pool_create(&ctx->pool, pool);
+    if(!jobs->next) {
+      batch = jobs->tiles;
+    } else {
+      batch = (mapcache_tile*)apr_palloc(ctx->pool, nbatch*sizeof(mapcache_tile));
+      nbatch = 0;
+      for(job=jobs; job; job=job->next) {
+        memcpy(&batch[nbatch], job->tiles, job->ntiles*sizeof(mapcache_tile));
+        nbatch += job->ntiles;
+      }
+    }
+    _composite_write_tiers(ctx, cache, batch, nbatch, 1, cache->caches->nelts);
+    if(GC_HAS_ERROR(ctx)) {
+      ctx->log(ctx, MAPCACHE_WARN, "composite cache %s: failed to write %d tiles to the lower caches: %s",
+               cache->cache.name, nbatch, ctx->get_error_message(ctx));
+      ctx->clear_errors(ctx);
+    }
+    apr_pool_destroy(ctx->pool);
+    ctx->pool = pool;
+    while(jobs) {
+      job = jobs->next;
+      apr_pool_destroy(jobs->pool);
+      jobs = job;
+    }
+  }
+}
+
+/*
+ * runs before the pools of the exiting process are destroyed, i.e. while the thread pool
+ * and the connections to the lower tiers are still usable. the tiles still queued are
+ * written synchronously, and the background task is waited for.
+ */
+static apr_status_t _composite_queue_drain(void *data)
+{
+  _composite_queue *queue = (_composite_queue*)data;
+  mapcache_context *ctx = queue->drain_ctx;
+  _composite_queue_lock(queue);
+  queue->closed = 1;
+  queue->flushing++;
+  _composite_queue_unlock(queue);
+
+  _composite_flush(ctx, queue);
+
+  _composite_queue_lock(queue);
+#ifdef APR_HAS_THREADS
+  while(queue->flushing)
+    apr_thread_cond_wait(queue->flushed, queue->mutex);
+#endif
+  queue->drain_ctx = NULL;
+  _composite_queue_unlock(queue);
+  apr_pool_destroy(ctx->pool);
+  return APR_SUCCESS;
+}
+
+/* copy tiles so they outlive the request, with their encoded data and dimensions */
+static _composite_job* _composite_job_create(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+{
+  _composite_job *job;
+  apr_pool_t *pool;
+  int i;
+  if(apr_pool_create(&pool, NULL) != APR_SUCCESS)
+    return NULL;
+  job = apr_pcalloc(pool, sizeof(_composite_job));
+  job->pool = pool;
+  job->ntiles = ntiles;
+  job->tiles = (mapcache_tile*)apr_palloc(pool, ntiles*sizeof(mapcache_tile));
+  for(i=0; i<ntiles; i++) {
+    mapcache_tile *tile = &job->tiles[i];
+    if(!tiles[i].encoded_data) {
+      tiles[i].encoded_data = tiles[i].tileset->format->write(ctx, tiles[i].raw_image, tiles[i].tileset->format);
+      if(GC_HAS_ERROR(ctx)) {
+        apr_pool_destroy(pool);
+        return NULL;
+      }
+    }
+    *tile = tiles[i];
+    tile->raw_image = NULL;
+    tile->encoded_data = mapcache_buffer_create(tiles[i].encoded_data->size, pool);
+    mapcache_buffer_append(tile->encoded_data, tiles[i].encoded_data->size, tiles[i].encoded_data->buf);
+    if(tiles[i].dimensions)
+      tile->dimensions = apr_table_clone(pool, tiles[i].dimensions);
+  }
+  return job;
+}
+
+/*
+ * queue tiles to be written to the lower tiers. returns MAPCACHE_FAILURE if the tiles
+ * were not queued, in which case they should be written synchronously: write-behind
+ * is disabled, the queue is full, or the background task could not be started.
+ */
+static int _composite_write_behind(mapcache_context *ctx, mapcache_cache_composite *cache,
+                                   mapcache_tile *tiles, int ntiles)
+{
+  _composite_queue *queue = (_composite_queue*)cache->queue;
+  _composite_job *job;
+
+  /*
+   * contexts that cannot be cloned (i.e. the seeder's) write synchronously, as they have
+   * no background task to write the queued tiles
+   */
+  if(!queue || !ctx->clone || !ctx->process_pool)
+    return MAPCACHE_FAILURE;
+
+  _composite_queue_lock(queue);
+  if(queue->closed || queue->queued + ntiles > cache->write_behind) {
+    _composite_queue_unlock(queue);
+    return MAPCACHE_FAILURE;
+  }
+  _composite_queue_unlock(queue);
+
+  /* copy outside of the lock, the queue is checked again before the job is added */
+  job = _composite_job_create(ctx, tiles, ntiles);
+  if(!job)
+    return MAPCACHE_FAILURE;
+
+  _composite_queue_lock(queue);
+  if(queue->closed || queue->queued + ntiles > cache->write_behind) {
+    _composite_queue_unlock(queue);
+    apr_pool_destroy(job->pool);
+    return MAPCACHE_FAILURE;
+  }
+  if(!queue->flushing) {
+    /* the task waits for the lock we hold before looking at the queue */
+    mapcache_context *dctx = mapcache_core_detached_context(ctx);
+    if(!dctx || mapcache_core_run_detached(ctx, dctx, _composite_flush, queue) != MAPCACHE_SUCCESS) {
+      _composite_queue_unlock(queue);
+      apr_pool_destroy(job->pool);
+      return MAPCACHE_FAILURE;
+    }
+    queue->flushing = 1;
+    if(!queue->drain_ctx) {
+      /* first tiles queued by this process */
+      queue->drain_ctx = mapcache_core_detached_context(ctx);
+      if(queue->drain_ctx)
+        apr_pool_pre_cleanup_register(ctx->process_pool, queue, _composite_queue_drain);
+    }
+  }
+  if(queue->tail)
+    queue->tail->next = job;
+  else
+    queue->head = job;
+  queue->tail = job;
+  queue->queued += ntiles;
+  _composite_queue_unlock(queue);
+  return MAPCACHE_SUCCESS;
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * looks the tile up in each tier in turn. a tile found in a lower tier is stored in
+ * the tiers above it.
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_composite_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int i, ret;
+  for(i=0; i<cache->caches->nelts; i++) {
+    mapcache_cache *tier = _composite_tier(cache,i);
+    ret = tier->tile_get(ctx, tier, tile);
+    if(ret == MAPCACHE_CACHE_MISS)
+      continue;
+    if(ret == MAPCACHE_SUCCESS && i > 0)
+      _composite_promote(ctx, cache, tile, 1, i);
+    return ret;
+  }
+  return MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \brief get the content of multiple tiles
+ *
+ * each tier is queried in a single operation for the tiles missing from the tiers above it
+ * \private \memberof mapcache_cache_composite
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_composite_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  mapcache_tile **misses = (mapcache_tile**)apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  mapcache_tile *hits = (mapcache_tile*)apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile));
+  int *missidx = (int*)apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *missrets = (int*)apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int i, t, nmisses = ntiles;
+
+  for(i=0; i<ntiles; i++) {
+    missidx[i] = i;
+    misses[i] = tiles[i];
+    rets[i] = MAPCACHE_CACHE_MISS;
+  }
+  for(t=0; t<cache->caches->nelts && nmisses; t++) {
+    mapcache_cache *tier = _composite_tier(cache,t);
+    int nhits = 0, nremaining = 0;
+    for(i=0; i<nmisses; i++) {
+      missrets[i] = MAPCACHE_CACHE_MISS;
+    }
+    if(tier->tile_multi_get && nmisses > 1) {
+      tier->tile_multi_get(ctx, tier, misses, nmisses, missrets);
+      GC_CHECK_ERROR(ctx);
+    } else {
+      for(i=0; i<nmisses; i++) {
+        missrets[i] = tier->tile_get(ctx, tier, misses[i]);
+        GC_CHECK_ERROR(ctx);
+      }
+    }
+    for(i=0; i<nmisses; i++) {
+      rets[missidx[i]] = missrets[i];
+      if(missrets[i] == MAPCACHE_CACHE_MISS) {
+        missidx[nremaining] = missidx[i];
+        misses[nremaining++] = misses[i];
+      } else if(missrets[i] == MAPCACHE_SUCCESS) {
+        hits[nhits++] = *misses[i];
+      }
+    }
+    nmisses = nremaining;
+    if(nhits && t > 0)
+      _composite_promote(ctx, cache, hits, nhits, t);
+  }
+}
+
+static int _mapcache_cache_composite_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int i;
+  for(i=0; i<cache->caches->nelts; i++) {
+    mapcache_cache *tier = _composite_tier(cache,i);
+    if(tier->tile_exists(ctx, tier, tile) == MAPCACHE_TRUE)
+      return MAPCACHE_TRUE;
+    if(GC_HAS_ERROR(ctx))
+      return MAPCACHE_FALSE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+/*
+ * tiles are deleted from every tier. note that a tile still queued for writing to the lower
+ * tiers may be written back after having been deleted
+ */
+static void _mapcache_cache_composite_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  int i;
+  for(i=0; i<cache->caches->nelts; i++) {
+    mapcache_cache *tier = _composite_tier(cache,i);
+    tier->tile_delete(ctx, tier, tile);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _mapcache_cache_composite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  _composite_write(ctx, _composite_tier(cache,0), tiles, ntiles);
+  GC_CHECK_ERROR(ctx);
+  if(cache->caches->nelts > 1 && _composite_write_behind(ctx, cache, tiles, ntiles) != MAPCACHE_SUCCESS) {
+    GC_CHECK_ERROR(ctx);
+    _composite_write_tiers(ctx, cache, tiles, ntiles, 1, cache->caches->nelts);
+  }
+}
+
+static void _mapcache_cache_composite_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  _mapcache_cache_composite_multi_set(ctx, pcache, tile, 1);
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  for(cur_node = ezxml_child(node,"cache"); cur_node; cur_node = cur_node->next) {
+    mapcache_cache *tier = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!tier) {
+      ctx->set_error(ctx, 400, "composite cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint: referenced caches must be declared before this composite cache in the xml file)",
+                     pcache->name, cur_node->txt);
+      return;
+    }
+    APR_ARRAY_PUSH(cache->caches,mapcache_cache*) = tier;
+  }
+  if(!cache->caches->nelts) {
+    ctx->set_error(ctx, 400, "composite cache \"%s\" has no <cache> to store its tiles to", pcache->name);
+    return;
+  }
+  if ((cur_node = ezxml_child(node,"write_behind")) != NULL) {
+    char *endptr;
+    cache->write_behind = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->write_behind < 0) {
+      ctx->set_error(ctx, 400, "failed to parse write_behind \"%s\" for composite cache \"%s\". Expecting a positive integer or 0",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node,"write_behind_batch")) != NULL) {
+    char *endptr;
+    cache->write_behind_batch = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->write_behind_batch <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse write_behind_batch \"%s\" for composite cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_composite
+ */
+static void _mapcache_cache_composite_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_composite *cache = (mapcache_cache_composite*)pcache;
+  _composite_queue *queue;
+  if(!cache->write_behind || cache->caches->nelts < 2)
+    return;
+  queue = apr_pcalloc(ctx->pool, sizeof(_composite_queue));
+  queue->cache = cache;
+#ifdef APR_HAS_THREADS
+  if(apr_thread_mutex_create(&queue->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&queue->flushed, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "composite cache \"%s\": failed to create write-behind queue lock", pcache->name);
+    return;
+  }
+#endif
+  cache->queue = queue;
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_composite
+ */
+mapcache_cache* mapcache_cache_composite_create(mapcache_context *ctx)
+{
+  mapcache_cache_composite *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_composite));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate composite cache");
+    return NULL;
+  }
+  cache->caches = apr_array_make(ctx->pool,3,sizeof(mapcache_cache*));
+  cache->write_behind = 1024;
+  cache->write_behind_batch = 64;
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_COMPOSITE;
+  cache->cache.tile_get = _mapcache_cache_composite_get;
+  cache->cache.tile_multi_get = _mapcache_cache_composite_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_composite_has_tile;
+  cache->cache.tile_set = _mapcache_cache_composite_set;
+  cache->cache.tile_multi_set = _mapcache_cache_composite_multi_set;
+  cache->cache.tile_delete = _mapcache_cache_composite_delete;
+  cache->cache.configuration_post_config = _mapcache_cache_composite_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_composite_configuration_parse_xml;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
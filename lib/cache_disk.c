@@ -33,9 +33,18 @@
 #include <apr_file_io.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <apr_mmap.h>
 
-#ifdef HAVE_SYMLINK
+#include <apr_hash.h>
+#include <apr_atomic.h>
+#include <apr_thread_mutex.h>
+#include <apr_sha1.h>
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
 #include <unistd.h>
 #endif
 
@@ -111,10 +120,10 @@ char* relative_path(mapcache_context *ctx, char* tilename, char* blankname)
  * \param path pointer to a char* that will contain the filename
  * \private \memberof mapcache_cache_disk
  */
-static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
   *path = apr_pstrcat(ctx->pool,
-                      ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,"/",
+                      dcache->base_directory,"/",
                       tile->tileset->name,"/",
                       tile->grid_link->grid->name,
                       NULL);
@@ -129,11 +138,11 @@ static void _mapcache_cache_disk_base_tile_key(mapcache_context *ctx, mapcache_t
   }
 }
 
-static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_tile *tile, unsigned char *color, char **path)
+static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, unsigned char *color, char **path)
 {
   /* not implemented for template caches, as symlink_blank will never be set */
   *path = apr_psprintf(ctx->pool,"%s/%s/%s/blanks/%02X%02X%02X%02X.%s",
-                       ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
+                       dcache->base_directory,
                        tile->tileset->name,
                        tile->grid_link->grid->name,
                        color[0],
@@ -146,117 +155,44 @@ static void _mapcache_cache_disk_blank_tile_key(mapcache_context *ctx, mapcache_
   }
 }
 
+#ifdef HAVE_SYMLINK
 /**
- * \brief return filename for given tile
+ * \brief returns the path of the deduplication object holding the encoded data of the tile
  *
- * \param tile the tile to get the key from
- * \param path pointer to a char* that will contain the filename
- * \param r
- * \private \memberof mapcache_cache_disk
+ * objects are named after the sha1 of their content, and spread over 256 directories
  */
-static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_object_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
-  if(dcache->base_directory) {
-    char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
-    *path = apr_psprintf(ctx->pool,"%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
-                         start,
-                         tile->z,
-                         tile->x / 1000000,
-                         (tile->x / 1000) % 1000,
-                         tile->x % 1000,
-                         tile->y / 1000000,
-                         (tile->y / 1000) % 1000,
-                         tile->y % 1000,
-                         tile->tileset->format?tile->tileset->format->extension:"png");
-  } else {
-    *path = dcache->filename_template;
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{ext}",
-                                      tile->tileset->format?tile->tileset->format->extension:"png");
-    if(strstr(*path,"{x}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-                                        apr_psprintf(ctx->pool,"%d",tile->x));
-    else
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-                                        apr_psprintf(ctx->pool,"%d",
-                                            tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-    if(strstr(*path,"{y}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-                                        apr_psprintf(ctx->pool,"%d",tile->y));
-    else
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-                                        apr_psprintf(ctx->pool,"%d",
-                                            tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-    if(strstr(*path,"{z}"))
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-                                        apr_psprintf(ctx->pool,"%d",tile->z));
-    else
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_z}",
-                                        apr_psprintf(ctx->pool,"%d",
-                                            tile->grid_link->grid->nlevels - tile->z - 1));
-    if(tile->dimensions) {
-      char *dimstring="";
-      const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
-      int i = elts->nelts;
-      while(i--) {
-        apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
-        char *dimval = apr_pstrdup(ctx->pool,entry->val);
-        char *iter = dimval;
-        while(*iter) {
-          /* replace dangerous characters by '#' */
-          if(*iter == '.' || *iter == '/') {
-            *iter = '#';
-          }
-          iter++;
-        }
-        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->key,"#",dimval,NULL);
-      }
-      *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
-    }
-  }
-  if(!*path) {
-    ctx->set_error(ctx,500, "failed to allocate tile key");
+  static const char hex[] = "0123456789abcdef";
+  unsigned char digest[APR_SHA1_DIGESTSIZE];
+  char hash[APR_SHA1_DIGESTSIZE*2+1];
+  apr_sha1_ctx_t sha1;
+  int i;
+
+  apr_sha1_init(&sha1);
+  apr_sha1_update_binary(&sha1, tile->encoded_data->buf, tile->encoded_data->size);
+  apr_sha1_final(digest, &sha1);
+  for(i=0; i<APR_SHA1_DIGESTSIZE; i++) {
+    hash[i*2] = hex[digest[i]>>4];
+    hash[i*2+1] = hex[digest[i]&0xf];
   }
+  hash[APR_SHA1_DIGESTSIZE*2] = '\0';
+  *path = apr_psprintf(ctx->pool,"%s/%s/%s/objects/%.2s/%s.%s",
+                       dcache->base_directory,
+                       tile->tileset->name,
+                       tile->grid_link->grid->name,
+                       hash, hash+2,
+                       tile->tileset->format?tile->tileset->format->extension:"png");
 }
+#endif
 
-static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
-
-  *path = dcache->filename_template;
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}", tile->tileset->name);
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}", tile->grid_link->grid->name);
-  *path = mapcache_util_str_replace(ctx->pool,*path, "{ext}",
-                                    tile->tileset->format?tile->tileset->format->extension:"png");
-
-  if(strstr(*path,"{x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-                                      apr_psprintf(ctx->pool,"%d",tile->x));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1));
-  if(strstr(*path,"{y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-                                      apr_psprintf(ctx->pool,"%d",tile->y));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1));
-  if(strstr(*path,"{z}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-                                      apr_psprintf(ctx->pool,"%d",tile->z));
-  else
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_z}",
-                                      apr_psprintf(ctx->pool,"%d",
-                                          tile->grid_link->grid->nlevels - tile->z - 1));
-  if(tile->dimensions) {
-    char *dimstring="";
+  char *dimstring = NULL;
+  if(tile->dimensions && dcache->template->has_dim) {
     const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
     int i = elts->nelts;
+    dimstring = "";
     while(i--) {
       apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
       char *dimval = apr_pstrdup(ctx->pool,entry->val);
@@ -270,20 +206,50 @@ static void _mapcache_cache_disk_template_tile_key(mapcache_context *ctx, mapcac
       }
       dimstring = apr_pstrcat(ctx->pool,dimstring,"#",entry->key,"#",dimval,NULL);
     }
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
   }
+  *path = mapcache_key_template_render(ctx, dcache->template, tile, dimstring);
 
   if(!*path) {
     ctx->set_error(ctx,500, "failed to allocate tile key");
   }
 }
 
-static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+/**
+ * \brief return filename for given tile
+ *
+ * \param tile the tile to get the key from
+ * \param path pointer to a char* that will contain the filename
+ * \param r
+ * \private \memberof mapcache_cache_disk
+ */
+static void _mapcache_cache_disk_tilecache_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
+{
+  if(dcache->base_directory) {
+    char *start;
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
+    *path = apr_psprintf(ctx->pool,"%s/%02d/%03d/%03d/%03d/%03d/%03d/%03d.%s",
+                         start,
+                         tile->z,
+                         tile->x / 1000000,
+                         (tile->x / 1000) % 1000,
+                         tile->x % 1000,
+                         tile->y / 1000000,
+                         (tile->y / 1000) % 1000,
+                         tile->y % 1000,
+                         tile->tileset->format?tile->tileset->format->extension:"png");
+  } else {
+    _mapcache_cache_disk_template_tile_key(ctx, dcache, tile, path);
+  }
+  if(!*path) {
+    ctx->set_error(ctx,500, "failed to allocate tile key");
+  }
+}
+
+static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_disk *dcache = (mapcache_cache_disk*)tile->tileset->cache;
   if(dcache->base_directory) {
     char *start;
-    _mapcache_cache_disk_base_tile_key(ctx, tile, &start);
+    _mapcache_cache_disk_base_tile_key(ctx, dcache, tile, &start);
     *path = apr_psprintf(ctx->pool,"%s/L%02d/R%08x/C%08x.%s" ,
                          start,
                          tile->z,
@@ -298,12 +264,13 @@ static void _mapcache_cache_disk_arcgis_tile_key(mapcache_context *ctx, mapcache
 }
 
 
-static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
   apr_finfo_t finfo;
   int rv;
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  dcache->tile_key(ctx, dcache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
@@ -315,12 +282,13 @@ static int _mapcache_cache_disk_has_tile(mapcache_context *ctx, mapcache_tile *t
   }
 }
 
-static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   apr_status_t ret;
   char errmsg[120];
   char *filename;
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
+  dcache->tile_key(ctx, dcache, tile, &filename);
   GC_CHECK_ERROR(ctx);
 
   ret = apr_file_remove(filename,ctx->pool);
@@ -337,7 +305,7 @@ static void _mapcache_cache_disk_delete(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_disk
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
   apr_file_t *f;
@@ -345,8 +313,9 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
   apr_status_t rv;
   apr_size_t size;
   apr_mmap_t *tilemmap;
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
+  dcache->tile_key(ctx, dcache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FAILURE;
   }
@@ -357,7 +326,7 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
                        APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
 #endif
                        ctx->pool)) == APR_SUCCESS) {
-    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME, f);
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE|APR_FINFO_MTIME|APR_FINFO_IDENT, f);
     if(!finfo.size) {
       ctx->set_error(ctx, 500, "tile %s has no data",filename);
       return MAPCACHE_FAILURE;
@@ -366,13 +335,20 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
     size = finfo.size;
     /*
      * at this stage, we have a handle to an open file that contains data.
-     * idealy, we should aquire a read lock, in case the data contained inside the file
-     * is incomplete (i.e. if another process is currently writing to the tile).
-     * currently such a lock is not set, as we don't want to loose performance on tile accesses.
-     * any error that might happen at this stage should only occur if the tile isn't already cached,
-     * i.e. normally only once.
+     * tiles are written to a temporary file that is renamed into place once complete, so
+     * the data cannot be partially written and no read lock is needed.
      */
     tile->mtime = finfo.mtime;
+#ifdef HAVE_SYMLINK
+    if(dcache->dedup == MAPCACHE_DISK_DEDUP_SYMLINK) {
+      /* the object is shared by many tiles, the link records when this tile was written */
+      apr_finfo_t linfo;
+      if(apr_stat(&linfo, filename, APR_FINFO_LINK|APR_FINFO_TYPE|APR_FINFO_MTIME, ctx->pool) == APR_SUCCESS &&
+          linfo.filetype == APR_LNK) {
+        tile->mtime = linfo.mtime;
+      }
+    }
+#endif
     tile->encoded_data = mapcache_buffer_create(size,ctx->pool);
 
 #ifndef NOMMAP
@@ -396,6 +372,8 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
       ctx->set_error(ctx, 500,  "failed to copy image data, got %d of %d bytes",(int)size, (int)finfo.size);
       return MAPCACHE_FAILURE;
     }
+    /* lets the server modules send the tile straight from the file */
+    mapcache_buffer_set_file(tile->encoded_data, filename, 0, &finfo);
     return MAPCACHE_SUCCESS;
   } else {
     if(APR_STATUS_IS_ENOENT(rv)) {
@@ -409,166 +387,355 @@ static int _mapcache_cache_disk_get(mapcache_context *ctx, mapcache_tile *tile)
   }
 }
 
+typedef struct {
+  mapcache_cache *cache;
+  mapcache_tile **tiles;
+  int *rets;
+} _disk_multi_get;
+
+static void _mapcache_cache_disk_get_task(mapcache_context *ctx, void *data, int i)
+{
+  _disk_multi_get *mg = (_disk_multi_get*)data;
+  mg->rets[i] = _mapcache_cache_disk_get(ctx, mg->cache, mg->tiles[i]);
+}
+
 /**
- * \brief write tile data to disk
+ * \brief get the content of multiple tiles
  *
- * writes the content of mapcache_tile::data to disk.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to disk
+ * the files are read concurrently, so that the latency of a cold page cache or of a
+ * network filesystem is paid once per batch instead of once per tile
  * \private \memberof mapcache_cache_disk
- * \sa mapcache_cache::tile_set()
+ * \sa mapcache_cache::tile_multi_get()
  */
-static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_disk_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
 {
-  apr_size_t bytes;
-  apr_file_t *f;
-  apr_status_t ret;
-  char errmsg[120];
-  char *filename, *hackptr1, *hackptr2=NULL;
-  const int creation_retry = ((mapcache_cache_disk*)tile->tileset->cache)->creation_retry;
+  _disk_multi_get mg;
+  mg.cache = pcache;
+  mg.tiles = tiles;
+  mg.rets = rets;
+  mapcache_core_run_tasks(ctx, _mapcache_cache_disk_get_task, &mg, ntiles);
+}
 
-#ifdef DEBUG
-  /* all this should be checked at a higher level */
-  if(!tile->encoded_data && !tile->raw_image) {
-    ctx->set_error(ctx,500,"attempting to write empty tile to disk");
-    return;
-  }
-  if(!tile->encoded_data && !tile->tileset->format) {
-    ctx->set_error(ctx,500,"received a raw tile image for a tileset with no format");
-    return;
-  }
+/*
+ * number of directories a process remembers as existing before starting afresh
+ */
+#define MAPCACHE_DISK_DIR_CACHE_SIZE 4096
+
+/*
+ * temporary files older than this are left over by writers that crashed, and are removed
+ * by mapcache_cache_disk_gc()
+ */
+#define MAPCACHE_DISK_STALE_TMP_AGE apr_time_from_sec(3600)
+
+/*
+ * the directories known to exist, created with the configuration. each process gets its
+ * own copy once the server has forked
+ */
+typedef struct {
+  apr_pool_t *pool;
+  apr_hash_t *dirs;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
 #endif
+} _disk_dirs;
 
-  ((mapcache_cache_disk*)tile->tileset->cache)->tile_key(ctx, tile, &filename);
-  GC_CHECK_ERROR(ctx);
+static apr_uint32_t disk_tmp_counter = 0;
 
-  /* find the location of the last '/' in the string */
-  hackptr1 = filename;
-  while(*hackptr1) {
-    if(*hackptr1 == '/')
-      hackptr2 = hackptr1;
-    hackptr1++;
+static void _disk_dirs_lock(_disk_dirs *dirs)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(dirs->mutex);
+#endif
+}
+
+static void _disk_dirs_unlock(_disk_dirs *dirs)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(dirs->mutex);
+#endif
+}
+
+/**
+ * \brief create a directory, unless this process already knows it exists
+ *
+ * directories that have been created or found to exist are remembered, so that writing
+ * tiles to an existing directory does not cost an extra mkdir per tile. the remembered
+ * set is bounded, and simply forgotten once full.
+ * \param force create the directory even if it is known, e.g. if it has been removed since
+ */
+static void _mapcache_cache_disk_make_dir(mapcache_context *ctx, mapcache_cache_disk *dcache, char *dirname, int force)
+{
+  _disk_dirs *dirs = (_disk_dirs*)dcache->dirs;
+  apr_status_t ret;
+  char errmsg[120];
+  int known = MAPCACHE_FALSE;
+
+  if(!force && dirs) {
+    _disk_dirs_lock(dirs);
+    if(apr_hash_get(dirs->dirs, dirname, APR_HASH_KEY_STRING))
+      known = MAPCACHE_TRUE;
+    _disk_dirs_unlock(dirs);
+    if(known)
+      return;
   }
-  *hackptr2 = '\0';
 
-  if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
+  if(APR_SUCCESS != (ret = apr_dir_make_recursive(dirname,APR_OS_DEFAULT,ctx->pool))) {
     /*
      * apr_dir_make_recursive sometimes sends back this error, although it should not.
      * ignore this one
      */
     if(!APR_STATUS_IS_EEXIST(ret)) {
-      ctx->set_error(ctx, 500, "failed to create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
+      ctx->set_error(ctx, 500, "failed to create directory %s: %s",dirname, apr_strerror(ret,errmsg,120));
       return;
     }
   }
-  *hackptr2 = '/';
 
-  ret = apr_file_remove(filename,ctx->pool);
-  if(ret != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
-    ctx->set_error(ctx, 500,  "failed to remove file %s: %s",filename, apr_strerror(ret,errmsg,120));
+  if(!dirs)
+    return;
+  _disk_dirs_lock(dirs);
+  if(apr_hash_count(dirs->dirs) >= MAPCACHE_DISK_DIR_CACHE_SIZE) {
+    apr_pool_clear(dirs->pool);
+    dirs->dirs = apr_hash_make(dirs->pool);
+  }
+  apr_hash_set(dirs->dirs, apr_pstrdup(dirs->pool,dirname), APR_HASH_KEY_STRING, "");
+  _disk_dirs_unlock(dirs);
+}
+
+/*
+ * a name for the temporary file a tile is written to before being renamed into place.
+ * it lives in the same directory as the tile so that the rename stays atomic
+ */
+static char* _mapcache_cache_disk_tmpname(mapcache_context *ctx, const char *filename)
+{
+  return apr_psprintf(ctx->pool, "%s.%d.%u.tmp", filename, (int)getpid(),
+                      (unsigned int)apr_atomic_inc32(&disk_tmp_counter));
+}
+
+/*
+ * called when creating a temporary file or link failed with status ret. returns MAPCACHE_TRUE
+ * if the creation should be retried, MAPCACHE_FALSE once the retries are exhausted.
+ * a missing directory is re-created once without counting as a retry, as it may have been
+ * removed since it was remembered. other failures are retried creation_retry times, as they
+ * can happen on nfs mounted network storage, with the containing directory created again.
+ */
+static int _mapcache_cache_disk_retry_create(mapcache_context *ctx, mapcache_cache_disk *dcache,
+    char *filename, apr_status_t ret, int *retry_count, int *dir_created)
+{
+  char *dirsep;
+  if(APR_STATUS_IS_ENOENT(ret) && !*dir_created) {
+    *dir_created = 1;
+  } else if(++(*retry_count) > dcache->creation_retry) {
+    return MAPCACHE_FALSE;
   }
+  dirsep = strrchr(filename,'/');
+  *dirsep = '\0';
+  _mapcache_cache_disk_make_dir(ctx,dcache,filename,1);
+  *dirsep = '/';
+  return GC_HAS_ERROR(ctx)?MAPCACHE_FALSE:MAPCACHE_TRUE;
+}
 
+/**
+ * \brief atomically write data to filename
+ *
+ * the data is written to a temporary file in the destination directory, which is then renamed
+ * over filename. readers thus either find the previous file or the complete new one, never a
+ * partially written one, and the previous file does not need to be removed beforehand.
+ */
+static void _mapcache_cache_disk_write_file(mapcache_context *ctx, mapcache_cache_disk *dcache, char *filename, mapcache_buffer *data)
+{
+  apr_file_t *f;
+  apr_status_t ret;
+  apr_size_t bytes;
+  char errmsg[120];
+  char *tmpname;
+  int retry_count = 0, dir_created = 0, collisions = 0;
+
+  while(1) {
+    tmpname = _mapcache_cache_disk_tmpname(ctx,filename);
+    ret = apr_file_open(&f, tmpname,
+                        APR_FOPEN_CREATE|APR_FOPEN_EXCL|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
+                        APR_OS_DEFAULT, ctx->pool);
+    if(ret == APR_SUCCESS)
+      break;
+    /* a leftover from a writer that died before renaming its file, pick another name */
+    if(APR_STATUS_IS_EEXIST(ret) && ++collisions < 10)
+      continue;
+    if(!_mapcache_cache_disk_retry_create(ctx,dcache,filename,ret,&retry_count,&dir_created)) {
+      if(!GC_HAS_ERROR(ctx))
+        ctx->set_error(ctx, 500, "failed to create file %s: %s",tmpname, apr_strerror(ret,errmsg,120));
+      return; /* we could not create the file */
+    }
+  }
+
+  bytes = (apr_size_t)data->size;
+  ret = apr_file_write(f,(void*)data->buf,&bytes);
+  if(ret != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",tmpname, (int)bytes, (int)data->size, apr_strerror(ret,errmsg,120));
+  } else if(bytes != data->size) {
+    ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", tmpname, (int)bytes, (int)data->size);
+  }
+  ret = apr_file_close(f);
+  if(!GC_HAS_ERROR(ctx) && ret != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to close file %s:%s",tmpname, apr_strerror(ret,errmsg,120));
+  }
+  if(!GC_HAS_ERROR(ctx) && (ret = apr_file_rename(tmpname,filename,ctx->pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to rename %s to %s: %s",tmpname, filename, apr_strerror(ret,errmsg,120));
+  }
+  if(GC_HAS_ERROR(ctx)) {
+    apr_file_remove(tmpname,ctx->pool);
+  }
+}
 
 #ifdef HAVE_SYMLINK
-  if(((mapcache_cache_disk*)tile->tileset->cache)->symlink_blank) {
-    if(!tile->raw_image) {
-      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-      GC_CHECK_ERROR(ctx);
+/**
+ * \brief atomically make filename a link to target
+ *
+ * as for _mapcache_cache_disk_write_file(), the link is created under a temporary name and
+ * renamed over filename.
+ * \param hard create a hard link instead of a symbolic link relative to filename
+ */
+static void _mapcache_cache_disk_link_file(mapcache_context *ctx, mapcache_cache_disk *dcache, char *filename, char *target, int hard)
+{
+  char *tmpname, *target_rel = NULL;
+  char errmsg[120];
+  apr_status_t ret;
+  int rv, retry_count = 0, dir_created = 0, collisions = 0;
+
+  if(!hard) {
+    /*
+     * compute the relative path between tile and target
+     */
+    target_rel = relative_path(ctx, filename, target);
+    GC_CHECK_ERROR(ctx);
+  }
+
+  while(1) {
+    tmpname = _mapcache_cache_disk_tmpname(ctx,filename);
+    rv = hard ? link(target, tmpname) : symlink(target_rel, tmpname);
+    if(rv == 0)
+      break;
+    ret = APR_FROM_OS_ERROR(errno);
+    if(APR_STATUS_IS_EEXIST(ret) && ++collisions < 10)
+      continue;
+    if(!_mapcache_cache_disk_retry_create(ctx,dcache,filename,ret,&retry_count,&dir_created)) {
+      if(!GC_HAS_ERROR(ctx))
+        ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, target, apr_strerror(ret,errmsg,120));
+      return;
     }
-    if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
-      char *blankname;
-      _mapcache_cache_disk_blank_tile_key(ctx,tile,tile->raw_image->data,&blankname);
-      if(apr_file_open(&f, blankname, APR_FOPEN_READ, APR_OS_DEFAULT, ctx->pool) != APR_SUCCESS) {
-        if(!tile->encoded_data) {
-          tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
-          GC_CHECK_ERROR(ctx);
-        }
-        /* create the blank file */
-        char *blankdirname = apr_psprintf(ctx->pool, "%s/%s/%s/blanks",
-                                          ((mapcache_cache_disk*)tile->tileset->cache)->base_directory,
-                                          tile->tileset->name,
-                                          tile->grid_link->grid->name);
-        if(APR_SUCCESS != (ret = apr_dir_make_recursive(
-                                   blankdirname, APR_OS_DEFAULT,ctx->pool))) {
-          if(!APR_STATUS_IS_EEXIST(ret)) {
-            ctx->set_error(ctx, 500,  "failed to create directory %s for blank tiles",blankdirname, apr_strerror(ret,errmsg,120));
-            return;
-          }
-        }
+  }
+  if((ret = apr_file_rename(tmpname,filename,ctx->pool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500,  "failed to rename %s to %s: %s",tmpname, filename, apr_strerror(ret,errmsg,120));
+    apr_file_remove(tmpname,ctx->pool);
+  } else if(hard) {
+    /* renaming a hard link over another link to the same file leaves both names in place */
+    apr_file_remove(tmpname,ctx->pool);
+  }
+}
 
-        /* aquire a lock on the blank file */
-        int isLocked = mapcache_lock_or_wait_for_resource(ctx,blankname);
-
-        if(isLocked == MAPCACHE_TRUE) {
-
-          if((ret = apr_file_open(&f, blankname,
-                                  APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-                                  APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
-            ctx->set_error(ctx, 500,  "failed to create file %s: %s",blankname, apr_strerror(ret,errmsg,120));
-            mapcache_unlock_resource(ctx,blankname);
-            return; /* we could not create the file */
-          }
-
-          bytes = (apr_size_t)tile->encoded_data->size;
-          ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-          if(ret != APR_SUCCESS) {
-            ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",blankname, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-            mapcache_unlock_resource(ctx,blankname);
-            return; /* we could not create the file */
-          }
-
-          if(bytes != tile->encoded_data->size) {
-            ctx->set_error(ctx, 500,  "failed to write image data to %s, wrote %d of %d bytes", blankname, (int)bytes, (int)tile->encoded_data->size);
-            mapcache_unlock_resource(ctx,blankname);
-            return;
-          }
-          apr_file_close(f);
-          mapcache_unlock_resource(ctx,blankname);
+/**
+ * \brief store a tile as a link to a file shared by all the tiles with the same content
+ *
+ * the shared file is written first if it does not exist yet. as it is written atomically,
+ * concurrent writers of the same content can both create it without locking. an existing
+ * shared file is left untouched, as its modification time is also the one of the tiles
+ * hard linked to it.
+ * \param sharedname the blank tile or the content-addressed object
+ * \param object sharedname is a deduplication object, i.e. is linked as configured by
+ * mapcache_cache_disk::dedup and is subject to mapcache_cache_disk_gc()
+ */
+static void _mapcache_cache_disk_set_shared(mapcache_context *ctx, mapcache_cache_disk *dcache, mapcache_tile *tile,
+    char *filename, char *sharedname, int object)
+{
+  apr_finfo_t finfo;
+  char *dirsep;
+  int hard = object && dcache->dedup == MAPCACHE_DISK_DEDUP_HARDLINK;
+  int written = 0;
+
+retry:
+  if(apr_stat(&finfo, sharedname, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS) {
+    if(!tile->encoded_data) {
+      tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+      GC_CHECK_ERROR(ctx);
+    }
+    dirsep = strrchr(sharedname,'/');
+    *dirsep = '\0';
+    _mapcache_cache_disk_make_dir(ctx,dcache,sharedname,0);
+    *dirsep = '/';
+    GC_CHECK_ERROR(ctx);
+    _mapcache_cache_disk_write_file(ctx,dcache,sharedname,tile->encoded_data);
+    GC_CHECK_ERROR(ctx);
+    written = 1;
 #ifdef DEBUG
-          ctx->log(ctx,MAPCACHE_DEBUG,"created blank tile %s",blankname);
+    ctx->log(ctx,MAPCACHE_DEBUG,"created shared tile %s",sharedname);
 #endif
-        }
-      } else {
-        apr_file_close(f);
-      }
+  } else if(object && !hard) {
+    /*
+     * tiles that are symbolic links have their own modification time. the one of the object
+     * only tells the garbage collection not to remove an object that is being linked to
+     */
+    apr_file_mtime_set(sharedname, apr_time_now(), ctx->pool);
+  }
 
-      int retry_count_create_symlink = 0;
+  _mapcache_cache_disk_link_file(ctx, dcache, filename, sharedname, hard);
+  if(GC_HAS_ERROR(ctx) && hard && !written &&
+      apr_stat(&finfo, sharedname, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS) {
+    /* the object was garbage collected before we could link to it */
+    ctx->clear_errors(ctx);
+    goto retry;
+  }
+  GC_CHECK_ERROR(ctx);
+#ifdef DEBUG
+  ctx->log(ctx, MAPCACHE_DEBUG, "linked tile %s to %s",filename,sharedname);
+#endif
+}
+#endif /*HAVE_SYMLINK*/
 
-      /*
-       * compute the relative path between tile and blank tile
-       */
-      char *blankname_rel = NULL;
-      blankname_rel = relative_path(ctx,filename, blankname);
-      GC_CHECK_ERROR(ctx);
+/**
+ * \brief write tile data to disk
+ *
+ * writes the content of mapcache_tile::data to disk.
+ * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
+ * \returns MAPCACHE_SUCCESS if the tile has been successfully written to disk
+ * \private \memberof mapcache_cache_disk
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename, *dirsep;
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)pcache;
 
-      /*
-       * depending on configuration symlink creation will retry if it fails.
-       * this can happen on nfs mounted network storage.
-       * the solution is to create the containing directory again and retry the symlink creation.
-       */
-      while(symlink(blankname_rel, filename) != 0) {
-        retry_count_create_symlink++;
-
-        if(retry_count_create_symlink > creation_retry) {
-          char *error = strerror(errno);
-          ctx->set_error(ctx, 500, "failed to link tile %s to %s: %s",filename, blankname_rel, error);
-          return; /* we could not create the file */
-        }
+#ifdef DEBUG
+  /* all this should be checked at a higher level */
+  if(!tile->encoded_data && !tile->raw_image) {
+    ctx->set_error(ctx,500,"attempting to write empty tile to disk");
+    return;
+  }
+  if(!tile->encoded_data && !tile->tileset->format) {
+    ctx->set_error(ctx,500,"received a raw tile image for a tileset with no format");
+    return;
+  }
+#endif
 
-        *hackptr2 = '\0';
+  dcache->tile_key(ctx, dcache, tile, &filename);
+  GC_CHECK_ERROR(ctx);
 
-        if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-          if(!APR_STATUS_IS_EEXIST(ret)) {
-            ctx->set_error(ctx, 500, "failed to create symlink, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-            return; /* we could not create the file */
-          }
-        }
+  dirsep = strrchr(filename,'/');
+  *dirsep = '\0';
+  _mapcache_cache_disk_make_dir(ctx,dcache,filename,0);
+  *dirsep = '/';
+  GC_CHECK_ERROR(ctx);
 
-        *hackptr2 = '/';
-      }
-#ifdef DEBUG
-      ctx->log(ctx, MAPCACHE_DEBUG, "linked blank tile %s to %s",filename,blankname);
-#endif
+#ifdef HAVE_SYMLINK
+  if(dcache->symlink_blank) {
+    if(!tile->raw_image) {
+      tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
+      GC_CHECK_ERROR(ctx);
+    }
+    if(mapcache_image_blank_color(tile->raw_image) != MAPCACHE_FALSE) {
+      char *blankname;
+      _mapcache_cache_disk_blank_tile_key(ctx,dcache,tile,tile->raw_image->data,&blankname);
+      GC_CHECK_ERROR(ctx);
+      _mapcache_cache_disk_set_shared(ctx,dcache,tile,filename,blankname,MAPCACHE_FALSE);
       return;
     }
   }
@@ -581,51 +748,254 @@ static void _mapcache_cache_disk_set(mapcache_context *ctx, mapcache_tile *tile)
     GC_CHECK_ERROR(ctx);
   }
 
-  int retry_count_create_file = 0;
-  /*
-   * depending on configuration file creation will retry if it fails.
-   * this can happen on nfs mounted network storage.
-   * the solution is to create the containing directory again and retry the file creation.
-   */
-  while((ret = apr_file_open(&f, filename,
-                             APR_FOPEN_CREATE|APR_FOPEN_WRITE|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,
-                             APR_OS_DEFAULT, ctx->pool)) != APR_SUCCESS) {
+#ifdef HAVE_SYMLINK
+  if(dcache->dedup != MAPCACHE_DISK_DEDUP_NONE) {
+    char *objectname;
+    _mapcache_cache_disk_object_key(ctx,dcache,tile,&objectname);
+    GC_CHECK_ERROR(ctx);
+    _mapcache_cache_disk_set_shared(ctx,dcache,tile,filename,objectname,MAPCACHE_TRUE);
+    return;
+  }
+#endif /*HAVE_SYMLINK*/
 
-    retry_count_create_file++;
+  _mapcache_cache_disk_write_file(ctx,dcache,filename,tile->encoded_data);
+}
 
-    if(retry_count_create_file > creation_retry) {
-      ctx->set_error(ctx, 500, "failed to create file %s: %s",filename, apr_strerror(ret,errmsg,120));
-      return; /* we could not create the file */
-    }
+/* the temporary files of _mapcache_cache_disk_tmpname(), i.e. named <file>.<pid>.<counter>.tmp */
+static int _mapcache_cache_disk_is_tmp(const char *name)
+{
+  const char *c;
+  int i;
+  size_t len = strlen(name);
+  if(len < 8 || strcmp(name + len - 4, ".tmp"))
+    return MAPCACHE_FALSE;
+  c = name + len - 5;
+  for(i=0; i<2; i++) {
+    if(c < name || !isdigit((unsigned char)*c))
+      return MAPCACHE_FALSE;
+    while(c > name && isdigit((unsigned char)*c))
+      c--;
+    if(*c != '.')
+      return MAPCACHE_FALSE;
+    c--;
+  }
+  return MAPCACHE_TRUE;
+}
+
+/*
+ * removes a temporary file last modified before stale, i.e. left over by a writer that
+ * crashed before renaming it into place
+ */
+static void _mapcache_cache_disk_gc_tmp(mapcache_context *ctx, apr_pool_t *pool, const char *path,
+                                        apr_finfo_t *finfo, apr_time_t stale, int *removed, apr_off_t *reclaimed)
+{
+  apr_status_t ret;
+  char errmsg[120];
+  if(finfo->mtime >= stale)
+    return;
+  if((ret = apr_file_remove(path, pool)) != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
+    ctx->set_error(ctx, 500, "failed to remove %s: %s", path, apr_strerror(ret,errmsg,120));
+    return;
+  }
+  (*removed)++;
+  *reclaimed += finfo->size;
+}
 
-    *hackptr2 = '\0';
+/*
+ * removes the stale temporary files found under dirname, and records the objects referenced
+ * by the symbolic links unless refs is NULL
+ * \param skip_objects do not descend in the objects directory found directly under dirname
+ */
+static void _mapcache_cache_disk_gc_mark(mapcache_context *ctx, apr_pool_t *pool, const char *dirname, int skip_objects, apr_hash_t *refs,
+    apr_time_t stale, int *removed, apr_off_t *reclaimed)
+{
+  apr_dir_t *dir;
+  apr_finfo_t finfo;
+  apr_status_t ret;
+  apr_pool_t *subpool;
+  char errmsg[120];
+#ifdef HAVE_SYMLINK
+  char target[4096];
+#endif
 
-    if(APR_SUCCESS != (ret = apr_dir_make_recursive(filename,APR_OS_DEFAULT,ctx->pool))) {
-      if(!APR_STATUS_IS_EEXIST(ret)) {
-        ctx->set_error(ctx, 500, "failed to create file, can not create directory %s: %s",filename, apr_strerror(ret,errmsg,120));
-        return; /* we could not create the file */
+  apr_pool_create(&subpool, pool);
+  if((ret = apr_dir_open(&dir, dirname, subpool)) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to open directory %s: %s", dirname, apr_strerror(ret,errmsg,120));
+    apr_pool_destroy(subpool);
+    return;
+  }
+  while(!GC_HAS_ERROR(ctx) && apr_dir_read(&finfo, APR_FINFO_NAME|APR_FINFO_TYPE|APR_FINFO_MTIME|APR_FINFO_SIZE, dir) == APR_SUCCESS) {
+    char *path;
+    if(!strcmp(finfo.name,".") || !strcmp(finfo.name,".."))
+      continue;
+    if(skip_objects && !strcmp(finfo.name,"objects"))
+      continue;
+    path = apr_pstrcat(subpool, dirname, "/", finfo.name, NULL);
+    if(finfo.filetype == APR_DIR) {
+      _mapcache_cache_disk_gc_mark(ctx, subpool, path, MAPCACHE_FALSE, refs, stale, removed, reclaimed);
+    } else if(_mapcache_cache_disk_is_tmp(finfo.name)) {
+      if(finfo.filetype == APR_REG || finfo.filetype == APR_LNK)
+        _mapcache_cache_disk_gc_tmp(ctx, subpool, path, &finfo, stale, removed, reclaimed);
+    }
+#ifdef HAVE_SYMLINK
+    else if(refs && finfo.filetype == APR_LNK) {
+      ssize_t len = readlink(path, target, sizeof(target)-1);
+      char *objectname;
+      if(len <= 0)
+        continue;
+      target[len] = '\0';
+      if(!strstr(target,"/objects/"))
+        continue;
+      objectname = strrchr(target,'/') + 1;
+      if(!apr_hash_get(refs, objectname, APR_HASH_KEY_STRING)) {
+        objectname = apr_pstrdup(ctx->pool, objectname);
+        apr_hash_set(refs, objectname, APR_HASH_KEY_STRING, objectname);
       }
     }
-
-    *hackptr2 = '/';
+#endif
   }
+  apr_dir_close(dir);
+  apr_pool_destroy(subpool);
+}
 
-  bytes = (apr_size_t)tile->encoded_data->size;
-  ret = apr_file_write(f,(void*)tile->encoded_data->buf,&bytes);
-  if(ret != APR_SUCCESS) {
-    ctx->set_error(ctx, 500,  "failed to write data to file %s (wrote %d of %d bytes): %s",filename, (int)bytes, (int)tile->encoded_data->size, apr_strerror(ret,errmsg,120));
-    return; /* we could not create the file */
+/**
+ * \brief remove the temporary files left over by writers that crashed
+ *
+ * the files of the tileset and grid are walked, and the temporary files older than
+ * MAPCACHE_DISK_STALE_TMP_AGE are removed. for caches using a filename template, the
+ * directory preceding the first template key is walked.
+ * \param removed the number of removed files
+ * \param reclaimed the number of bytes freed
+ * \memberof mapcache_cache_disk
+ */
+int mapcache_cache_disk_sweep(mapcache_context *ctx, mapcache_cache *cache, mapcache_tileset *tileset, mapcache_grid *grid,
+                              int *removed, apr_off_t *reclaimed)
+{
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)cache;
+  apr_finfo_t finfo;
+  char *basedir;
+
+  *removed = 0;
+  *reclaimed = 0;
+  if(cache->type != MAPCACHE_CACHE_DISK) {
+    ctx->set_error(ctx, 400, "cache %s is not a disk cache", cache->name);
+    return MAPCACHE_FAILURE;
   }
+  if(dcache->base_directory) {
+    basedir = apr_pstrcat(ctx->pool, dcache->base_directory, "/", tileset->name, "/", grid->name, NULL);
+  } else {
+    char *sep;
+    basedir = apr_pstrdup(ctx->pool, dcache->filename_template);
+    if((sep = strchr(basedir,'{')) != NULL)
+      *sep = '\0';
+    if((sep = strrchr(basedir,'/')) == NULL || sep == basedir) {
+      ctx->set_error(ctx, 400, "cache %s: cannot find the directory of template %s", cache->name, dcache->filename_template);
+      return MAPCACHE_FAILURE;
+    }
+    *sep = '\0';
+  }
+  /* a cache that was never written to has nothing to sweep */
+  if(apr_stat(&finfo, basedir, APR_FINFO_TYPE, ctx->pool) != APR_SUCCESS)
+    return MAPCACHE_SUCCESS;
+  _mapcache_cache_disk_gc_mark(ctx, ctx->pool, basedir, MAPCACHE_FALSE, NULL,
+                               apr_time_now() - MAPCACHE_DISK_STALE_TMP_AGE, removed, reclaimed);
+  return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
+}
 
-  if(bytes != tile->encoded_data->size) {
-    ctx->set_error(ctx, 500, "failed to write image data to %s, wrote %d of %d bytes", filename, (int)bytes, (int)tile->encoded_data->size);
+/**
+ * \brief remove the deduplication objects that are no longer referenced by any tile
+ *
+ * no reference counts are kept: objects with no other hard link are unreferenced, and
+ * references through symbolic links are found by walking the tiles of the tileset and grid.
+ * objects modified (or, when hard linked, whose link count changed) after \p before are kept,
+ * as they may be in the process of being linked to.
+ * the temporary files left over by crashed writers are removed as well, as by
+ * mapcache_cache_disk_sweep().
+ * \param removed the number of removed objects and temporary files
+ * \param reclaimed the number of bytes freed
+ * \memberof mapcache_cache_disk
+ */
+int mapcache_cache_disk_gc(mapcache_context *ctx, mapcache_cache *cache, mapcache_tileset *tileset, mapcache_grid *grid,
+                           apr_time_t before, int *removed, apr_off_t *reclaimed)
+{
+#ifdef HAVE_SYMLINK
+  mapcache_cache_disk *dcache = (mapcache_cache_disk*)cache;
+  apr_hash_t *refs = apr_hash_make(ctx->pool);
+  apr_dir_t *dir, *subdir;
+  apr_finfo_t finfo, objinfo;
+  apr_status_t ret;
+  apr_pool_t *subpool;
+  char errmsg[120];
+  char *basedir, *objectsdir;
+  apr_time_t stale = apr_time_now() - MAPCACHE_DISK_STALE_TMP_AGE;
+
+  *removed = 0;
+  *reclaimed = 0;
+  if(cache->type != MAPCACHE_CACHE_DISK || dcache->dedup == MAPCACHE_DISK_DEDUP_NONE) {
+    ctx->set_error(ctx, 400, "cache %s does not deduplicate tiles", cache->name);
+    return MAPCACHE_FAILURE;
   }
-  ret = apr_file_close(f);
-  if(ret != APR_SUCCESS) {
-    ctx->set_error(ctx, 500,  "failed to close file %s:%s",filename, apr_strerror(ret,errmsg,120));
-    return; /* we could not create the file */
+  basedir = apr_pstrcat(ctx->pool, dcache->base_directory, "/", tileset->name, "/", grid->name, NULL);
+  objectsdir = apr_pstrcat(ctx->pool, basedir, "/objects", NULL);
+
+  /* a cache that was never written to has nothing to collect */
+  if(apr_dir_open(&dir, objectsdir, ctx->pool) != APR_SUCCESS)
+    return MAPCACHE_SUCCESS;
+
+  /* hard linked objects are referenced by their link count alone */
+  _mapcache_cache_disk_gc_mark(ctx, ctx->pool, basedir, MAPCACHE_TRUE,
+                               dcache->dedup == MAPCACHE_DISK_DEDUP_SYMLINK ? refs : NULL,
+                               stale, removed, reclaimed);
+  if(GC_HAS_ERROR(ctx)) {
+    apr_dir_close(dir);
+    return MAPCACHE_FAILURE;
   }
 
+  apr_pool_create(&subpool, ctx->pool);
+  while(apr_dir_read(&finfo, APR_FINFO_NAME|APR_FINFO_TYPE, dir) == APR_SUCCESS) {
+    char *subdirname;
+    if(finfo.filetype != APR_DIR || finfo.name[0] == '.')
+      continue;
+    apr_pool_clear(subpool);
+    subdirname = apr_pstrcat(subpool, objectsdir, "/", finfo.name, NULL);
+    if((ret = apr_dir_open(&subdir, subdirname, subpool)) != APR_SUCCESS) {
+      ctx->set_error(ctx, 500, "failed to open directory %s: %s", subdirname, apr_strerror(ret,errmsg,120));
+      break;
+    }
+    while(apr_dir_read(&objinfo, APR_FINFO_NAME|APR_FINFO_TYPE|APR_FINFO_MTIME|APR_FINFO_CTIME|APR_FINFO_NLINK|APR_FINFO_SIZE, subdir) == APR_SUCCESS) {
+      char *objectname;
+      /* hard linked objects keep the modification time of their content */
+      apr_time_t used = dcache->dedup == MAPCACHE_DISK_DEDUP_HARDLINK ? objinfo.ctime : objinfo.mtime;
+      if(objinfo.filetype != APR_REG)
+        continue;
+      objectname = apr_pstrcat(subpool, subdirname, "/", objinfo.name, NULL);
+      if(_mapcache_cache_disk_is_tmp(objinfo.name)) {
+        _mapcache_cache_disk_gc_tmp(ctx, subpool, objectname, &objinfo, stale, removed, reclaimed);
+        if(GC_HAS_ERROR(ctx))
+          break;
+        continue;
+      }
+      /* skip objects still in use */
+      if(used >= before || objinfo.nlink > 1 || apr_hash_get(refs, objinfo.name, APR_HASH_KEY_STRING))
+        continue;
+      if((ret = apr_file_remove(objectname, subpool)) != APR_SUCCESS && !APR_STATUS_IS_ENOENT(ret)) {
+        ctx->set_error(ctx, 500, "failed to remove %s: %s", objectname, apr_strerror(ret,errmsg,120));
+        break;
+      }
+      (*removed)++;
+      *reclaimed += objinfo.size;
+    }
+    apr_dir_close(subdir);
+    if(GC_HAS_ERROR(ctx))
+      break;
+  }
+  apr_dir_close(dir);
+  apr_pool_destroy(subpool);
+  return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_SUCCESS;
+#else
+  ctx->set_error(ctx, 400, "tile deduplication is not supported on this platform");
+  return MAPCACHE_FAILURE;
+#endif
 }
 
 /**
@@ -648,6 +1018,7 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     template_layout = MAPCACHE_TRUE;
     if ((cur_node = ezxml_child(node,"template")) != NULL) {
       dcache->filename_template = apr_pstrdup(ctx->pool,cur_node->txt);
+      dcache->template = mapcache_key_template_compile(ctx->pool,dcache->filename_template);
     } else {
       ctx->set_error(ctx, 400, "no template specified for cache \"%s\"", cache->name);
       return;
@@ -672,6 +1043,24 @@ static void _mapcache_cache_disk_configuration_parse_xml(mapcache_context *ctx,
     }
   }
 
+  if (!template_layout && (cur_node = ezxml_child(node,"dedup")) != NULL) {
+    if(!strcasecmp(cur_node->txt,"symlink")) {
+      dcache->dedup = MAPCACHE_DISK_DEDUP_SYMLINK;
+    } else if(!strcasecmp(cur_node->txt,"hardlink")) {
+      dcache->dedup = MAPCACHE_DISK_DEDUP_HARDLINK;
+    } else if(strcasecmp(cur_node->txt,"false") && strcasecmp(cur_node->txt,"none")) {
+      ctx->set_error(ctx,400,"cache %s: unknown dedup mode \"%s\", expecting \"symlink\", \"hardlink\" or \"none\"",
+                     cache->name, cur_node->txt);
+      return;
+    }
+#ifndef HAVE_SYMLINK
+    if(dcache->dedup != MAPCACHE_DISK_DEDUP_NONE) {
+      ctx->set_error(ctx,400,"cache %s: host system does not support file linking",cache->name);
+      return;
+    }
+#endif
+  }
+
   if ((cur_node = ezxml_child(node,"creation_retry")) != NULL) {
     dcache->creation_retry = atoi(cur_node->txt);
   }
@@ -684,12 +1073,23 @@ static void _mapcache_cache_disk_configuration_post_config(mapcache_context *ctx
     mapcache_cfg *cfg)
 {
   mapcache_cache_disk *dcache = (mapcache_cache_disk*)cache;
+  _disk_dirs *dirs;
   /* check all required parameters are configured */
   if((!dcache->base_directory || !strlen(dcache->base_directory)) &&
       (!dcache->filename_template || !strlen(dcache->filename_template))) {
     ctx->set_error(ctx, 400, "disk cache %s has no base directory or template",dcache->cache.name);
     return;
   }
+  dirs = apr_pcalloc(ctx->pool, sizeof(_disk_dirs));
+  apr_pool_create(&dirs->pool, ctx->pool);
+  dirs->dirs = apr_hash_make(dirs->pool);
+#ifdef APR_HAS_THREADS
+  if(apr_thread_mutex_create(&dirs->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "disk cache %s: failed to create directory cache lock",dcache->cache.name);
+    return;
+  }
+#endif
+  dcache->dirs = dirs;
 }
 
 /**
@@ -703,11 +1103,13 @@ mapcache_cache* mapcache_cache_disk_create(mapcache_context *ctx)
     return NULL;
   }
   cache->symlink_blank = 0;
+  cache->dedup = MAPCACHE_DISK_DEDUP_NONE;
   cache->creation_retry = 0;
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_DISK;
   cache->cache.tile_delete = _mapcache_cache_disk_delete;
   cache->cache.tile_get = _mapcache_cache_disk_get;
+  cache->cache.tile_multi_get = _mapcache_cache_disk_multi_get;
   cache->cache.tile_exists = _mapcache_cache_disk_has_tile;
   cache->cache.tile_set = _mapcache_cache_disk_set;
   cache->cache.configuration_post_config = _mapcache_cache_disk_configuration_post_config;
@@ -0,0 +1,494 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: LMDB cache backend
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * tiles are stored in a single lmdb database file per cache, keyed on the cache's key
+ * template, with the tile modification time appended to the tile data as done by the
+ * berkeley db cache.
+ *
+ * readers never block, neither each other nor the writer. the tiles that are read are
+ * not copied: their buffers point into lmdb's read-only memory map, and the read
+ * transaction that guarantees they stay valid is kept open until the request is done.
+ */
+
+#ifdef USE_LMDB
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_file_info.h>
+#include <apr_hash.h>
+#include <string.h>
+#include <errno.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+#include <lmdb.h>
+
+struct lmdb_env {
+  MDB_env *env;
+  MDB_dbi dbi;
+};
+
+static apr_hash_t *lmdb_envs = NULL;
+
+static apr_status_t _lmdb_envs_cleanup(void *data)
+{
+  apr_hash_index_t *hi;
+  for(hi = apr_hash_first(NULL, lmdb_envs); hi; hi = apr_hash_next(hi)) {
+    struct lmdb_env *lenv;
+    apr_hash_this(hi, NULL, NULL, (void**)&lenv);
+    mdb_env_close(lenv->env);
+  }
+  lmdb_envs = NULL;
+  return APR_SUCCESS;
+}
+
+static struct lmdb_env* _lmdb_env_open(mapcache_context *ctx, mapcache_cache_lmdb *cache)
+{
+  int rc;
+  MDB_txn *txn;
+  char *dbfile = apr_pstrcat(ctx->process_pool, cache->basedir, "/", cache->cache.name, ".mdb", NULL);
+  struct lmdb_env *lenv = apr_pcalloc(ctx->process_pool, sizeof(struct lmdb_env));
+
+  rc = mdb_env_create(&lenv->env);
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb cache failure for mdb_env_create: %s", mdb_strerror(rc));
+    return NULL;
+  }
+  rc = mdb_env_set_mapsize(lenv->env, cache->max_size);
+  if(!rc)
+    rc = mdb_env_set_maxreaders(lenv->env, cache->max_readers);
+  /*
+   * MDB_NOTLS: read transactions are tied to requests rather than threads, and a thread
+   * may hold more than one of them
+   */
+  if(!rc)
+    rc = mdb_env_open(lenv->env, dbfile, MDB_NOSUBDIR|MDB_NOTLS, 0664);
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb cache failure for env open on %s: %s", dbfile, mdb_strerror(rc));
+    mdb_env_close(lenv->env);
+    return NULL;
+  }
+  rc = mdb_txn_begin(lenv->env, NULL, 0, &txn);
+  if(!rc) {
+    rc = mdb_dbi_open(txn, NULL, 0, &lenv->dbi);
+    if(rc)
+      mdb_txn_abort(txn);
+    else
+      rc = mdb_txn_commit(txn);
+  }
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb cache failure for database open on %s: %s", dbfile, mdb_strerror(rc));
+    mdb_env_close(lenv->env);
+    return NULL;
+  }
+  return lenv;
+}
+
+static struct lmdb_env* _lmdb_get_env(mapcache_context *ctx, mapcache_cache_lmdb *cache)
+{
+  struct lmdb_env *lenv = NULL;
+  if(lmdb_envs)
+    lenv = apr_hash_get(lmdb_envs, cache->cache.name, APR_HASH_KEY_STRING);
+  if(lenv)
+    return lenv;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!lmdb_envs) {
+    lmdb_envs = apr_hash_make(ctx->process_pool);
+    apr_pool_cleanup_register(ctx->process_pool, NULL, _lmdb_envs_cleanup, apr_pool_cleanup_null);
+  }
+  /* probably doesn't exist, unless the previous mutex locked us, so we check */
+  lenv = apr_hash_get(lmdb_envs, cache->cache.name, APR_HASH_KEY_STRING);
+  if(!lenv) {
+    lenv = _lmdb_env_open(ctx, cache);
+    if(lenv)
+      apr_hash_set(lmdb_envs, cache->cache.name, APR_HASH_KEY_STRING, lenv);
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return lenv;
+}
+
+static apr_status_t _lmdb_txn_abort(void *txn)
+{
+  mdb_txn_abort((MDB_txn*)txn);
+  return APR_SUCCESS;
+}
+
+/* the read transaction shared by the reads of a request */
+struct lmdb_read {
+  MDB_txn *txn;
+  int refs; /* number of tiles returned by the request that point into the transaction */
+};
+
+static apr_status_t _lmdb_read_begin(mapcache_context *ctx, struct lmdb_env *lenv, struct lmdb_read *rd)
+{
+  int rc = mdb_txn_begin(lenv->env, NULL, MDB_RDONLY, &rd->txn);
+  if(rc) {
+    rd->txn = NULL;
+    ctx->set_error(ctx,500,"lmdb backend failed to begin read transaction: %s", mdb_strerror(rc));
+    return APR_EGENERAL;
+  }
+  rd->refs = 0;
+  apr_pool_cleanup_register(ctx->pool, rd->txn, _lmdb_txn_abort, apr_pool_cleanup_null);
+  return APR_SUCCESS;
+}
+
+/* returns the read transaction of the request, started on first use */
+static struct lmdb_read* _lmdb_read_get(mapcache_context *ctx, mapcache_cache_lmdb *cache, struct lmdb_env *lenv)
+{
+  struct lmdb_read *rd = NULL;
+  char *key = apr_pstrcat(ctx->pool, "mapcache_lmdb_txn_", cache->cache.name, NULL);
+  apr_pool_userdata_get((void**)&rd, key, ctx->pool);
+  if(rd)
+    return rd;
+  rd = apr_pcalloc(ctx->pool, sizeof(struct lmdb_read));
+  if(_lmdb_read_begin(ctx, lenv, rd) != APR_SUCCESS)
+    return NULL;
+  apr_pool_userdata_setn(rd, key, NULL, ctx->pool);
+  return rd;
+}
+
+/*
+ * moves the read transaction of the request to the latest snapshot, if a write has been
+ * committed since it was started. returns 0 if it was already up to date. a transaction no
+ * returned tile points into is renewed in place, so that it keeps its reader slot, otherwise
+ * it is left open until the end of the request and a new one is started
+ */
+static int _lmdb_read_refresh(mapcache_context *ctx, struct lmdb_env *lenv, struct lmdb_read *rd)
+{
+  MDB_envinfo info;
+  int rc;
+  if(mdb_env_info(lenv->env, &info) || info.me_last_txnid <= mdb_txn_id(rd->txn))
+    return 0;
+  if(rd->refs == 0) {
+    mdb_txn_reset(rd->txn);
+    rc = mdb_txn_renew(rd->txn);
+    if(rc) {
+      /* the transaction handle is freed by the cleanup */
+      apr_pool_cleanup_run(ctx->pool, rd->txn, _lmdb_txn_abort);
+      rd->txn = NULL;
+      ctx->set_error(ctx,500,"lmdb backend failed to renew read transaction: %s", mdb_strerror(rc));
+      return 0;
+    }
+    return 1;
+  }
+  _lmdb_read_begin(ctx, lenv, rd);
+  return 1;
+}
+
+/*
+ * looks up the value stored for a tile. if pin is set, the value is used by the caller
+ * and must stay valid until the end of the request
+ */
+static int _lmdb_lookup(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, MDB_val *data, int pin)
+{
+  mapcache_cache_lmdb *cache = (mapcache_cache_lmdb*)pcache;
+  struct lmdb_env *lenv;
+  struct lmdb_read *rd;
+  MDB_val key;
+  int rc;
+  char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+  lenv = _lmdb_get_env(ctx, cache);
+  if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+  rd = _lmdb_read_get(ctx, cache, lenv);
+  if(GC_HAS_ERROR(ctx) || !rd->txn) return MAPCACHE_FAILURE;
+
+  key.mv_data = skey;
+  key.mv_size = strlen(skey);
+  rc = mdb_get(rd->txn, lenv->dbi, &key, data);
+  /* the tile may have been written after the request's snapshot was taken */
+  if(rc == MDB_NOTFOUND && _lmdb_read_refresh(ctx, lenv, rd)) {
+    if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
+    rc = mdb_get(rd->txn, lenv->dbi, &key, data);
+  }
+  if(rc == MDB_NOTFOUND) {
+    return MAPCACHE_CACHE_MISS;
+  } else if(rc) {
+    ctx->set_error(ctx,500,"lmdb backend failure on tile lookup: %s", mdb_strerror(rc));
+    return MAPCACHE_FAILURE;
+  }
+  if(data->mv_size <= sizeof(apr_time_t)) {
+    ctx->set_error(ctx,500,"lmdb backend found corrupted tile %s", skey);
+    return MAPCACHE_FAILURE;
+  }
+  if(pin)
+    rd->refs++;
+  return MAPCACHE_SUCCESS;
+}
+
+static int _mapcache_cache_lmdb_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  MDB_val data;
+  if(_lmdb_lookup(ctx, pcache, tile, &data, 0) == MAPCACHE_SUCCESS)
+    return MAPCACHE_TRUE;
+  return MAPCACHE_FALSE;
+}
+
+static int _mapcache_cache_lmdb_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  MDB_val data;
+  int ret = _lmdb_lookup(ctx, pcache, tile, &data, 1);
+  if(ret != MAPCACHE_SUCCESS)
+    return ret;
+  /* the tile data is used in place in the memory map, which must not be written to */
+  tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
+  tile->encoded_data->buf = data.mv_data;
+  tile->encoded_data->size = data.mv_size - sizeof(apr_time_t);
+  tile->encoded_data->avail = tile->encoded_data->size;
+  memcpy(&tile->mtime, (char*)data.mv_data + tile->encoded_data->size, sizeof(apr_time_t));
+  return MAPCACHE_SUCCESS;
+}
+
+/* the reads of a request all share its read transaction, so there is nothing more to batch */
+static void _mapcache_cache_lmdb_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i;
+  for(i=0; i<ntiles; i++) {
+    rets[i] = _mapcache_cache_lmdb_get(ctx, pcache, tiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _mapcache_cache_lmdb_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_lmdb *cache = (mapcache_cache_lmdb*)pcache;
+  struct lmdb_env *lenv;
+  MDB_txn *txn;
+  MDB_val key;
+  int rc;
+  char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
+  GC_CHECK_ERROR(ctx);
+  lenv = _lmdb_get_env(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  rc = mdb_txn_begin(lenv->env, NULL, 0, &txn);
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb backend failed to begin write transaction: %s", mdb_strerror(rc));
+    return;
+  }
+  key.mv_data = skey;
+  key.mv_size = strlen(skey);
+  rc = mdb_del(txn, lenv->dbi, &key, NULL);
+  if(rc && rc != MDB_NOTFOUND) {
+    mdb_txn_abort(txn);
+    ctx->set_error(ctx,500,"lmdb backend failure on tile_delete: %s", mdb_strerror(rc));
+    return;
+  }
+  rc = mdb_txn_commit(txn);
+  if(rc)
+    ctx->set_error(ctx,500,"lmdb backend commit failure on tile_delete: %s", mdb_strerror(rc));
+}
+
+/* encodes the tile if needed. done before entering the write transaction, which is exclusive */
+static void _lmdb_prepare_tile(mapcache_context *ctx, mapcache_tile *tile)
+{
+  if(!tile->encoded_data) {
+    tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+  }
+}
+
+static void _lmdb_put_tile(mapcache_context *ctx, mapcache_cache_lmdb *cache, struct lmdb_env *lenv, MDB_txn *txn,
+                           mapcache_tile *tile, apr_time_t now)
+{
+  MDB_val key, data;
+  int rc;
+  char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
+  GC_CHECK_ERROR(ctx);
+  key.mv_data = skey;
+  key.mv_size = strlen(skey);
+  data.mv_size = tile->encoded_data->size + sizeof(apr_time_t);
+  /* reserve the space in the database, and write the data and its mtime to it directly */
+  rc = mdb_put(txn, lenv->dbi, &key, &data, MDB_RESERVE);
+  if(rc) {
+    if(rc == MDB_MAP_FULL) {
+      ctx->set_error(ctx,500,"lmdb cache %s is full, consider increasing its <max_size>", cache->cache.name);
+    } else {
+      ctx->set_error(ctx,500,"lmdb backend failed on tile_set: %s", mdb_strerror(rc));
+    }
+    return;
+  }
+  memcpy(data.mv_data, tile->encoded_data->buf, tile->encoded_data->size);
+  memcpy((char*)data.mv_data + tile->encoded_data->size, &now, sizeof(apr_time_t));
+}
+
+static void _lmdb_commit(mapcache_context *ctx, mapcache_cache_lmdb *cache, MDB_txn *txn)
+{
+  int rc;
+  if(GC_HAS_ERROR(ctx)) {
+    mdb_txn_abort(txn);
+    return;
+  }
+  rc = mdb_txn_commit(txn);
+  if(rc) {
+    if(rc == MDB_MAP_FULL) {
+      ctx->set_error(ctx,500,"lmdb cache %s is full, consider increasing its <max_size>", cache->cache.name);
+    } else {
+      ctx->set_error(ctx,500,"lmdb backend commit failure on tile_set: %s", mdb_strerror(rc));
+    }
+  }
+}
+
+static void _mapcache_cache_lmdb_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_lmdb *cache = (mapcache_cache_lmdb*)pcache;
+  struct lmdb_env *lenv;
+  MDB_txn *txn;
+  int rc;
+  _lmdb_prepare_tile(ctx, tile);
+  GC_CHECK_ERROR(ctx);
+  lenv = _lmdb_get_env(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  rc = mdb_txn_begin(lenv->env, NULL, 0, &txn);
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb backend failed to begin write transaction: %s", mdb_strerror(rc));
+    return;
+  }
+  _lmdb_put_tile(ctx, cache, lenv, txn, tile, apr_time_now());
+  _lmdb_commit(ctx, cache, txn);
+}
+
+/* all the tiles are written in a single write transaction */
+static void _mapcache_cache_lmdb_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_lmdb *cache = (mapcache_cache_lmdb*)pcache;
+  struct lmdb_env *lenv;
+  MDB_txn *txn;
+  apr_time_t now = apr_time_now();
+  int i, rc;
+  for(i=0; i<ntiles; i++) {
+    _lmdb_prepare_tile(ctx, &tiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+  lenv = _lmdb_get_env(ctx, cache);
+  GC_CHECK_ERROR(ctx);
+  rc = mdb_txn_begin(lenv->env, NULL, 0, &txn);
+  if(rc) {
+    ctx->set_error(ctx,500,"lmdb backend failed to begin write transaction: %s", mdb_strerror(rc));
+    return;
+  }
+  for(i=0; i<ntiles; i++) {
+    _lmdb_put_tile(ctx, cache, lenv, txn, &tiles[i], now);
+    if(GC_HAS_ERROR(ctx)) break;
+  }
+  _lmdb_commit(ctx, cache, txn);
+}
+
+static void _mapcache_cache_lmdb_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_lmdb *dcache = (mapcache_cache_lmdb*)cache;
+  if ((cur_node = ezxml_child(node,"base")) != NULL) {
+    dcache->basedir = apr_pstrdup(ctx->pool,cur_node->txt);
+  }
+  if ((cur_node = ezxml_child(node,"key_template")) != NULL) {
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,cur_node->txt);
+  } else {
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+  }
+  if ((cur_node = ezxml_child(node,"max_size")) != NULL) {
+    char *endptr;
+    apr_int64_t size = apr_strtoi64(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || size <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse max_size \"%s\" for lmdb cache \"%s\". Expecting a positive number of bytes",
+                     cur_node->txt, cache->name);
+      return;
+    }
+    dcache->max_size = (size_t)size;
+  }
+  if ((cur_node = ezxml_child(node,"max_readers")) != NULL) {
+    char *endptr;
+    dcache->max_readers = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->max_readers <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse max_readers \"%s\" for lmdb cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if(!dcache->basedir) {
+    ctx->set_error(ctx,500,"lmdb cache \"%s\" is missing <base> entry",cache->name);
+    return;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_lmdb
+ */
+static void _mapcache_cache_lmdb_configuration_post_config(mapcache_context *ctx,
+    mapcache_cache *cache, mapcache_cfg *cfg)
+{
+  mapcache_cache_lmdb *dcache = (mapcache_cache_lmdb*)cache;
+  apr_status_t rv;
+  apr_dir_t *dir;
+  rv = apr_dir_open(&dir, dcache->basedir, ctx->pool);
+  if(rv != APR_SUCCESS) {
+    char errmsg[120];
+    ctx->set_error(ctx,500,"lmdb failed to open directory %s:%s",dcache->basedir,apr_strerror(rv,errmsg,120));
+    return;
+  }
+  apr_dir_close(dir);
+}
+
+/**
+ * \brief creates and initializes a mapcache_lmdb_cache
+ */
+mapcache_cache* mapcache_cache_lmdb_create(mapcache_context *ctx)
+{
+  mapcache_cache_lmdb *cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_lmdb));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate lmdb cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_LMDB;
+  cache->cache.tile_delete = _mapcache_cache_lmdb_delete;
+  cache->cache.tile_get = _mapcache_cache_lmdb_get;
+  cache->cache.tile_multi_get = _mapcache_cache_lmdb_multi_get;
+  cache->cache.tile_exists = _mapcache_cache_lmdb_has_tile;
+  cache->cache.tile_set = _mapcache_cache_lmdb_set;
+  cache->cache.tile_multi_set = _mapcache_cache_lmdb_multi_set;
+  cache->cache.configuration_post_config = _mapcache_cache_lmdb_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_lmdb_configuration_parse_xml;
+  cache->basedir = NULL;
+  cache->key_template = NULL;
+  cache->max_size = (size_t)1024*1024*1024;
+  cache->max_readers = 512;
+  return (mapcache_cache*)cache;
+}
+
+#endif
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -30,43 +30,82 @@
 #ifdef USE_MEMCACHE
 
 #include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_md5.h>
+#include <stdlib.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+/* number of points on the hashing ring per unit of server weight */
+#define MEMCACHE_RING_POINTS 160
+
+/*
+ * a small marker key is stored next to each tile, so that checking for the existence of a
+ * tile does not transfer its data: the memcached text protocol has no command returning the
+ * metadata of a key only. tiles stored before the markers were introduced are reported as
+ * missing until they are stored again.
+ */
+#define MEMCACHE_EXISTS_SUFFIX "#exists"
 
-static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static char* _mapcache_cache_memcache_exists_key(mapcache_context *ctx, const char *key)
 {
-  char *key;
-  char *tmpdata;
+  return apr_pstrcat(ctx->pool, key, MEMCACHE_EXISTS_SUFFIX, NULL);
+}
+
+static int _mapcache_cache_memcache_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *key, *data;
+  apr_size_t size;
   int rv;
-  size_t tmpdatasize;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
-  rv = apr_memcache_getp(cache->memcache,ctx->pool,key,&tmpdata,&tmpdatasize,NULL);
+  rv = apr_memcache_getp(cache->memcache,ctx->pool,_mapcache_cache_memcache_exists_key(ctx,key),&data,&size,NULL);
   if(rv != APR_SUCCESS) {
     return MAPCACHE_FALSE;
   }
-  if(tmpdatasize == 0) {
-    return MAPCACHE_FALSE;
-  }
   return MAPCACHE_TRUE;
 }
 
-static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   int rv;
   char errmsg[120];
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
-  rv = apr_memcache_delete(cache->memcache,key,0);
+  rv = apr_memcache_delete(cache->memcache,_mapcache_cache_memcache_exists_key(ctx,key),0);
+  if(rv == APR_SUCCESS || rv == APR_NOTFOUND) {
+    rv = apr_memcache_delete(cache->memcache,key,0);
+  }
   if(rv != APR_SUCCESS && rv!= APR_NOTFOUND) {
     int code = 500;
     ctx->set_error(ctx,code,"memcache: failed to delete key %s: %s", key, apr_strerror(rv,errmsg,120));
   }
 }
 
+/* check the data fetched from memcache for a tile, and strip the modification time appended to it */
+static int _mapcache_cache_memcache_extract(mapcache_context *ctx, mapcache_tile *tile)
+{
+  if(tile->encoded_data->size <= sizeof(apr_time_t)) {
+    ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
+    return MAPCACHE_FAILURE;
+  }
+  /* extract the tile modification time from the end of the data returned */
+  memcpy(
+    &tile->mtime,
+    &(((char*)tile->encoded_data->buf)[tile->encoded_data->size-sizeof(apr_time_t)]),
+    sizeof(apr_time_t));
+  tile->encoded_data->avail = tile->encoded_data->size;
+  tile->encoded_data->size -= sizeof(apr_time_t);
+  ((char*)tile->encoded_data->buf)[tile->encoded_data->size]='\0';
+  return MAPCACHE_SUCCESS;
+}
+
 /**
  * \brief get content of given tile
  *
@@ -74,11 +113,11 @@ static void _mapcache_cache_memcache_delete(mapcache_context *ctx, mapcache_tile
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   int rv;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FAILURE;
@@ -88,19 +127,42 @@ static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *ti
   if(rv != APR_SUCCESS) {
     return MAPCACHE_CACHE_MISS;
   }
-  if(tile->encoded_data->size == 0) {
-    ctx->set_error(ctx,500,"memcache cache returned 0-length data for tile %d %d %d\n",tile->x,tile->y,tile->z);
-    return MAPCACHE_FAILURE;
+  return _mapcache_cache_memcache_extract(ctx, tile);
+}
+
+/**
+ * \brief get the content of multiple tiles with a single request per memcache server
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_get()
+ */
+static void _mapcache_cache_memcache_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  int i;
+  apr_status_t rv;
+  char **keys;
+  apr_hash_t *values = NULL;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
+  keys = (char**)apr_pcalloc(ctx->pool, ntiles*sizeof(char*));
+  for(i=0; i<ntiles; i++) {
+    keys[i] = mapcache_util_get_tile_key(ctx, tiles[i],NULL," \r\n\t\f\e\a\b","#");
+    GC_CHECK_ERROR(ctx);
+    apr_memcache_add_multget_key(ctx->pool, keys[i], &values);
+  }
+  rv = apr_memcache_multgetp(cache->memcache, ctx->pool, ctx->pool, values);
+  for(i=0; i<ntiles; i++) {
+    apr_memcache_value_t *value = NULL;
+    if(rv == APR_SUCCESS)
+      value = apr_hash_get(values, keys[i], APR_HASH_KEY_STRING);
+    if(!value || value->status != APR_SUCCESS) {
+      rets[i] = MAPCACHE_CACHE_MISS;
+      continue;
+    }
+    tiles[i]->encoded_data = mapcache_buffer_create(0,ctx->pool);
+    tiles[i]->encoded_data->buf = value->data;
+    tiles[i]->encoded_data->size = value->len;
+    rets[i] = _mapcache_cache_memcache_extract(ctx, tiles[i]);
+    GC_CHECK_ERROR(ctx);
   }
-  /* extract the tile modification time from the end of the data returned */
-  memcpy(
-    &tile->mtime,
-    &(((char*)tile->encoded_data->buf)[tile->encoded_data->size-sizeof(apr_time_t)]),
-    sizeof(apr_time_t));
-  ((char*)tile->encoded_data->buf)[tile->encoded_data->size+sizeof(apr_time_t)]='\0';
-  tile->encoded_data->avail = tile->encoded_data->size;
-  tile->encoded_data->size -= sizeof(apr_time_t);
-  return MAPCACHE_SUCCESS;
 }
 
 /**
@@ -112,7 +174,7 @@ static int _mapcache_cache_memcache_get(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_memcache
  * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *key;
   int rv;
@@ -120,7 +182,7 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
   int expires = 86400;
   if(tile->tileset->auto_expire)
     expires = tile->tileset->auto_expire;
-  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)tile->tileset->cache;
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)pcache;
   key = mapcache_util_get_tile_key(ctx, tile,NULL," \r\n\t\f\e\a\b","#");
   GC_CHECK_ERROR(ctx);
 
@@ -129,15 +191,27 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
     GC_CHECK_ERROR(ctx);
   }
 
-  /* concatenate the current time to the end of the memcache data so we can extract it out
-   * when we re-get the tile */
-  char *data = calloc(1,tile->encoded_data->size+sizeof(apr_time_t));
+  /*
+   * concatenate the current time to the end of the memcache data so we can extract it out
+   * when we re-get the tile. the encoded data usually has room left in its buffer for it,
+   * in which case it is written there without copying the tile. this leaves the size of
+   * the buffer unchanged. buffers pointing to memory not owned by the tile (i.e. read
+   * without copy from another cache) have no room left, and are copied.
+   */
   apr_time_t now = apr_time_now();
-  apr_pool_cleanup_register(ctx->pool, data, (void*)free, apr_pool_cleanup_null);
-  memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
+  char *data;
+  if(tile->encoded_data->avail >= tile->encoded_data->size + sizeof(apr_time_t)) {
+    data = (char*)tile->encoded_data->buf;
+  } else {
+    data = apr_palloc(ctx->pool, tile->encoded_data->size + sizeof(apr_time_t));
+    memcpy(data,tile->encoded_data->buf,tile->encoded_data->size);
+  }
   memcpy(&(data[tile->encoded_data->size]),&now,sizeof(apr_time_t));
 
   rv = apr_memcache_set(cache->memcache,key,data,tile->encoded_data->size+sizeof(apr_time_t),expires,0);
+  if(rv == APR_SUCCESS) {
+    rv = apr_memcache_set(cache->memcache,_mapcache_cache_memcache_exists_key(ctx,key),(char*)"1",1,expires,0);
+  }
   if(rv != APR_SUCCESS) {
     ctx->set_error(ctx,500,"failed to store tile %d %d %d to memcache cache %s",
                    tile->x,tile->y,tile->z,cache->cache.name);
@@ -145,6 +219,122 @@ static void _mapcache_cache_memcache_set(mapcache_context *ctx, mapcache_tile *t
   }
 }
 
+typedef struct {
+  mapcache_cache *cache;
+  mapcache_tile *tiles;
+} _memcache_multi_set;
+
+static void _mapcache_cache_memcache_set_task(mapcache_context *ctx, void *data, int i)
+{
+  _memcache_multi_set *ms = (_memcache_multi_set*)data;
+  _mapcache_cache_memcache_set(ctx, ms->cache, &ms->tiles[i]);
+}
+
+/**
+ * \brief push the tiles of a metatile to memcached
+ *
+ * apr_memcache waits for the reply of each store before sending the next one on a
+ * connection. the tiles are therefore stored concurrently over the pooled connections
+ * to the servers, so the round trips overlap instead of adding up.
+ * \private \memberof mapcache_cache_memcache
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_memcache_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  _memcache_multi_set ms;
+  ms.cache = pcache;
+  ms.tiles = tiles;
+  mapcache_core_run_tasks(ctx, _mapcache_cache_memcache_set_task, &ms, ntiles);
+}
+
+static int _memcache_ring_cmp(const void *a, const void *b)
+{
+  apr_uint32_t ha = ((const mapcache_memcache_ring_point*)a)->hash;
+  apr_uint32_t hb = ((const mapcache_memcache_ring_point*)b)->hash;
+  return (ha > hb) - (ha < hb);
+}
+
+/*
+ * apr_memcache server selection callback: the server owning a key is the one of the first
+ * point of the ring at or after the hash of the key. dead servers are skipped, and retried
+ * every 5 seconds as apr_memcache does by default, under the lock of the server as it does.
+ */
+static apr_memcache_server_t* _mapcache_cache_memcache_find_server(void *baton, apr_memcache_t *mc, const apr_uint32_t hash)
+{
+  mapcache_cache_memcache *cache = (mapcache_cache_memcache*)baton;
+  int lo = 0, hi = cache->nring, i;
+  while(lo < hi) {
+    int mid = (lo + hi) / 2;
+    if(cache->ring[mid].hash < hash)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for(i=0; i<cache->nring; i++) {
+    apr_memcache_server_t *ms = cache->ring[(lo + i) % cache->nring].server;
+    apr_time_t now;
+    int alive = 0;
+    if(ms->status == APR_MC_SERVER_LIVE)
+      return ms;
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_lock(ms->lock);
+#endif
+    now = apr_time_now();
+    if(now - ms->btime > apr_time_from_sec(5)) {
+      apr_pool_t *pool;
+      char *version;
+      ms->btime = now;
+      if(apr_pool_create(&pool, NULL) == APR_SUCCESS) {
+        alive = (apr_memcache_version(ms, pool, &version) == APR_SUCCESS);
+        apr_pool_destroy(pool);
+      }
+      if(alive) {
+        apr_memcache_enable_server(mc, ms);
+      }
+    }
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_unlock(ms->lock);
+#endif
+    if(alive)
+      return ms;
+  }
+  return NULL;
+}
+
+/*
+ * place MEMCACHE_RING_POINTS points per unit of weight for each server on the hashing ring,
+ * derived from the md5 of the server address as ketama does
+ */
+static void _mapcache_cache_memcache_build_ring(mapcache_context *ctx, mapcache_cache_memcache *cache, int *weights)
+{
+  apr_memcache_t *mc = cache->memcache;
+  int i, j, k, npoints = 0;
+  for(i=0; i<mc->ntotal; i++) {
+    npoints += weights[i] * MEMCACHE_RING_POINTS;
+  }
+  cache->ring = (mapcache_memcache_ring_point*)apr_palloc(ctx->pool, npoints*sizeof(mapcache_memcache_ring_point));
+  cache->nring = 0;
+  for(i=0; i<mc->ntotal; i++) {
+    apr_memcache_server_t *ms = mc->live_servers[i];
+    for(j=0; j<weights[i] * MEMCACHE_RING_POINTS / 4; j++) {
+      unsigned char digest[APR_MD5_DIGESTSIZE];
+      char *id = apr_psprintf(ctx->pool, "%s:%d-%d", ms->host, (int)ms->port, j);
+      apr_md5(digest, id, strlen(id));
+      for(k=0; k<4; k++) {
+        cache->ring[cache->nring].hash = ((apr_uint32_t)digest[k*4+3] << 24) | ((apr_uint32_t)digest[k*4+2] << 16) |
+                                         ((apr_uint32_t)digest[k*4+1] << 8) | digest[k*4];
+        cache->ring[cache->nring++].server = ms;
+      }
+    }
+  }
+  qsort(cache->ring, cache->nring, sizeof(mapcache_memcache_ring_point), _memcache_ring_cmp);
+  /* the default hash function only returns 15 bits */
+  mc->hash_func = apr_memcache_hash_crc32;
+  mc->hash_baton = NULL;
+  mc->server_func = _mapcache_cache_memcache_find_server;
+  mc->server_baton = cache;
+}
+
 /**
  * \private \memberof mapcache_cache_memcache
  */
@@ -152,7 +342,7 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
 {
   ezxml_t cur_node;
   mapcache_cache_memcache *dcache = (mapcache_cache_memcache*)cache;
-  int servercount = 0;
+  int servercount = 0, *weights;
   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
     servercount++;
   }
@@ -164,9 +354,12 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
     ctx->set_error(ctx,400,"cache %s: failed to create memcache backend", cache->name);
     return;
   }
+  weights = (int*)apr_pcalloc(ctx->pool, servercount*sizeof(int));
+  servercount = 0;
   for(cur_node = ezxml_child(node,"server"); cur_node; cur_node = cur_node->next) {
     ezxml_t xhost = ezxml_child(cur_node,"host");
     ezxml_t xport = ezxml_child(cur_node,"port");
+    ezxml_t xweight = ezxml_child(cur_node,"weight");
     const char *host;
     apr_memcache_server_t *server;
     apr_port_t port;
@@ -189,6 +382,17 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
       }
       port = iport;
     }
+
+    weights[servercount] = 1;
+    if(xweight && xweight->txt && *xweight->txt) {
+      char *endptr;
+      weights[servercount] = (int)strtol(xweight->txt,&endptr,10);
+      if(*endptr != 0 || weights[servercount] <= 0) {
+        ctx->set_error(ctx,400,"failed to parse weight %s for memcache cache %s, expecting a positive integer", xweight->txt,cache->name);
+        return;
+      }
+    }
+    servercount++;
     if(APR_SUCCESS != apr_memcache_server_create(ctx->pool,host,port,4,5,50,10000,&server)) {
       ctx->set_error(ctx,400,"cache %s: failed to create server %s:%d",cache->name,host,port);
       return;
@@ -202,6 +406,7 @@ static void _mapcache_cache_memcache_configuration_parse_xml(mapcache_context *c
       return;
     }
   }
+  _mapcache_cache_memcache_build_ring(ctx, dcache, weights);
 }
 
 /**
@@ -230,8 +435,10 @@ mapcache_cache* mapcache_cache_memcache_create(mapcache_context *ctx)
   cache->cache.metadata = apr_table_make(ctx->pool,3);
   cache->cache.type = MAPCACHE_CACHE_MEMCACHE;
   cache->cache.tile_get = _mapcache_cache_memcache_get;
+  cache->cache.tile_multi_get = _mapcache_cache_memcache_multi_get;
   cache->cache.tile_exists = _mapcache_cache_memcache_has_tile;
   cache->cache.tile_set = _mapcache_cache_memcache_set;
+  cache->cache.tile_multi_set = _mapcache_cache_memcache_multi_set;
   cache->cache.tile_delete = _mapcache_cache_memcache_delete;
   cache->cache.configuration_post_config = _mapcache_cache_memcache_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_memcache_configuration_parse_xml;
@@ -0,0 +1,702 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching support file: shared memory cache backend.
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_shm.h>
+#include <apr_atomic.h>
+#include <string.h>
+
+/*
+ * layout of the shared memory segment:
+ *
+ * [header][segment 0][segment 1]...[segment n-1]
+ *
+ * each segment is independently locked by a process-shared mutex and contains:
+ *
+ * [segment header][mutex][buckets][entries][block chains][data blocks]
+ *
+ * tile data (prefixed by its key) is stored in a chain of fixed size blocks. there
+ * are as many entries as blocks, as an entry uses at least one block. all references
+ * are stored as indexes rather than pointers, as the segment is not necessarily mapped
+ * at the same address in all the processes using it.
+ *
+ * eviction uses the CLOCK algorithm: a hit sets the reference bit of an entry, and
+ * the clock hand clears reference bits until it finds an unreferenced entry to evict.
+ */
+
+#define SHM_MAGIC 0x4d435332 /* "MCS2" */
+#define SHM_BLOCK_SIZE 4096
+#define SHM_NO_INDEX 0xffffffff
+
+/* log the usage counters every SHM_STATS_INTERVAL lookups */
+#define SHM_STATS_INTERVAL 10000
+
+/* shared memory used by each block: the data, an entry, a bucket and a block chain link */
+#define SHM_BLOCK_COST (SHM_BLOCK_SIZE + sizeof(_shm_entry) + 2 * sizeof(apr_uint32_t))
+
+/* space used by a segment header and its mutex */
+#define SHM_SEGMENT_HEADER_SIZE (APR_ALIGN_DEFAULT(sizeof(_shm_segment)) + APR_ALIGN_DEFAULT(mapcache_shm_mutex_size()))
+
+typedef struct {
+  apr_uint32_t magic;
+  apr_uint32_t nsegments;
+  apr_size_t size;
+  apr_size_t segment_size;
+  volatile apr_uint32_t hits;
+  volatile apr_uint32_t misses;
+  volatile apr_uint32_t evictions;
+  volatile apr_uint32_t insertions;
+} _shm_header;
+
+typedef struct {
+  apr_uint32_t nblocks;
+  apr_uint32_t free_blocks; /* number of blocks in the free list */
+  apr_uint32_t free_block; /* head of the free block list */
+  apr_uint32_t free_entry; /* head of the free entry list */
+  apr_uint32_t clock_hand; /* next entry examined for eviction */
+} _shm_segment;
+
+typedef struct {
+  apr_time_t mtime;
+  apr_uint32_t hash;
+  apr_uint32_t keylen;
+  apr_uint32_t size; /* size of the tile data, key excluded */
+  apr_uint32_t first_block;
+  apr_uint32_t next; /* next entry in the bucket chain, or in the free list */
+  apr_uint32_t referenced;
+  apr_uint32_t used;
+} _shm_entry;
+
+/* process-local pointers into a segment */
+typedef struct {
+  _shm_segment *seg;
+  void *mutex;
+  apr_uint32_t *buckets;
+  _shm_entry *entries;
+  apr_uint32_t *block_next;
+  char *data;
+} _shm_view;
+
+static _shm_header* _shm_get_header(mapcache_cache_shm *cache)
+{
+  return (_shm_header*)apr_shm_baseaddr_get(cache->shm);
+}
+
+static void _shm_get_view(mapcache_cache_shm *cache, apr_uint32_t index, _shm_view *view)
+{
+  _shm_header *header = _shm_get_header(cache);
+  char *base = (char*)header + APR_ALIGN_DEFAULT(sizeof(_shm_header)) + index * header->segment_size;
+  apr_uint32_t nblocks;
+  view->seg = (_shm_segment*)base;
+  nblocks = view->seg->nblocks;
+  view->mutex = base + APR_ALIGN_DEFAULT(sizeof(_shm_segment));
+  base += SHM_SEGMENT_HEADER_SIZE;
+  view->buckets = (apr_uint32_t*)base;
+  base += APR_ALIGN_DEFAULT(nblocks * sizeof(apr_uint32_t));
+  view->entries = (_shm_entry*)base;
+  base += APR_ALIGN_DEFAULT(nblocks * sizeof(_shm_entry));
+  view->block_next = (apr_uint32_t*)base;
+  base += APR_ALIGN_DEFAULT(nblocks * sizeof(apr_uint32_t));
+  view->data = base;
+}
+
+/*
+ * (re)initialize a segment, dropping all its entries. The caller must either hold
+ * the segment lock, or be the only user of the segment
+ */
+static void _shm_segment_init(_shm_view *view)
+{
+  apr_uint32_t i, nblocks = view->seg->nblocks;
+  for(i=0; i<nblocks; i++) {
+    view->buckets[i] = SHM_NO_INDEX;
+    view->entries[i].used = 0;
+    view->entries[i].next = (i+1 < nblocks) ? i+1 : SHM_NO_INDEX;
+    view->block_next[i] = (i+1 < nblocks) ? i+1 : SHM_NO_INDEX;
+  }
+  view->seg->free_blocks = nblocks;
+  view->seg->free_block = 0;
+  view->seg->free_entry = 0;
+  view->seg->clock_hand = 0;
+}
+
+static int _shm_lock(mapcache_context *ctx, _shm_view *view)
+{
+  int recovered;
+  if(mapcache_shm_mutex_lock(ctx, view->mutex, &recovered) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FAILURE;
+  }
+  if(recovered) {
+    /* a process died while updating the segment, its contents may be inconsistent */
+    ctx->log(ctx, MAPCACHE_WARN, "shm cache: dropping the contents of a segment left locked by a dead process");
+    _shm_segment_init(view);
+  }
+  return MAPCACHE_SUCCESS;
+}
+
+static void _shm_unlock(_shm_view *view)
+{
+  mapcache_shm_mutex_unlock(view->mutex);
+}
+
+/* 32 bit FNV-1a hash */
+static apr_uint32_t _shm_hash(const char *key, apr_size_t keylen)
+{
+  apr_uint32_t hash = 2166136261U;
+  while(keylen--) {
+    hash ^= (unsigned char)*key++;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+static char* _shm_tile_key(mapcache_context *ctx, mapcache_tile *tile)
+{
+  return mapcache_util_get_tile_key(ctx, tile, NULL, NULL, NULL);
+}
+
+static apr_uint32_t _shm_find(_shm_view *view, apr_uint32_t hash, const char *key, apr_uint32_t keylen)
+{
+  apr_uint32_t idx = view->buckets[hash % view->seg->nblocks];
+  while(idx != SHM_NO_INDEX) {
+    _shm_entry *entry = &view->entries[idx];
+    if(entry->hash == hash && entry->keylen == keylen &&
+        !memcmp(view->data + (apr_size_t)entry->first_block * SHM_BLOCK_SIZE, key, keylen)) {
+      return idx;
+    }
+    idx = entry->next;
+  }
+  return SHM_NO_INDEX;
+}
+
+static void _shm_remove(_shm_view *view, apr_uint32_t idx)
+{
+  _shm_entry *entry = &view->entries[idx];
+  apr_uint32_t *link = &view->buckets[entry->hash % view->seg->nblocks];
+  apr_uint32_t block, last;
+
+  /* unlink from the bucket chain */
+  while(*link != idx) {
+    link = &view->entries[*link].next;
+  }
+  *link = entry->next;
+
+  /* return the block chain to the free list */
+  block = last = entry->first_block;
+  view->seg->free_blocks++;
+  while(view->block_next[last] != SHM_NO_INDEX) {
+    last = view->block_next[last];
+    view->seg->free_blocks++;
+  }
+  view->block_next[last] = view->seg->free_block;
+  view->seg->free_block = block;
+
+  entry->used = 0;
+  entry->next = view->seg->free_entry;
+  view->seg->free_entry = idx;
+}
+
+/* evict entries with the clock algorithm until at least nblocks blocks are free */
+static int _shm_make_room(_shm_view *view, apr_uint32_t nblocks)
+{
+  int evicted = 0;
+  while(view->seg->free_blocks < nblocks) {
+    _shm_entry *entry = &view->entries[view->seg->clock_hand];
+    if(entry->used) {
+      if(entry->referenced) {
+        entry->referenced = 0;
+      } else {
+        _shm_remove(view, view->seg->clock_hand);
+        evicted++;
+      }
+    }
+    view->seg->clock_hand = (view->seg->clock_hand + 1) % view->seg->nblocks;
+  }
+  return evicted;
+}
+
+static void _shm_copy_out(_shm_view *view, _shm_entry *entry, char *dst)
+{
+  apr_uint32_t block = entry->first_block;
+  apr_size_t offset = entry->keylen;
+  apr_size_t remaining = entry->size;
+  while(remaining) {
+    apr_size_t len = SHM_BLOCK_SIZE - offset;
+    if(len > remaining) len = remaining;
+    memcpy(dst, view->data + (apr_size_t)block * SHM_BLOCK_SIZE + offset, len);
+    dst += len;
+    remaining -= len;
+    offset = 0;
+    block = view->block_next[block];
+  }
+}
+
+/**
+ * \brief store the encoded data of a tile in the shared memory segment
+ *
+ * tiles that would take more than a quarter of a segment are not stored.
+ */
+static void _shm_store(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_tile *tile)
+{
+  _shm_header *header = _shm_get_header(cache);
+  _shm_view view;
+  char *key;
+  apr_uint32_t keylen, hash, idx, nblocks, block, prev = SHM_NO_INDEX, i;
+  apr_size_t remaining, offset;
+  const char *src;
+  int evicted;
+
+  if(!tile->encoded_data || !tile->encoded_data->size) {
+    return;
+  }
+  key = _shm_tile_key(ctx, tile);
+  keylen = strlen(key);
+  if(keylen > SHM_BLOCK_SIZE / 4) {
+    return;
+  }
+  hash = _shm_hash(key, keylen);
+  _shm_get_view(cache, hash % header->nsegments, &view);
+  nblocks = (keylen + tile->encoded_data->size + SHM_BLOCK_SIZE - 1) / SHM_BLOCK_SIZE;
+  if(nblocks > view.seg->nblocks / 4) {
+    return;
+  }
+  hash /= header->nsegments;
+
+  if(_shm_lock(ctx, &view) != MAPCACHE_SUCCESS) {
+    return;
+  }
+  idx = _shm_find(&view, hash, key, keylen);
+  if(idx != SHM_NO_INDEX) {
+    _shm_remove(&view, idx);
+  }
+  evicted = _shm_make_room(&view, nblocks);
+
+  /* pop an entry and the needed blocks from the free lists */
+  idx = view.seg->free_entry;
+  view.seg->free_entry = view.entries[idx].next;
+  block = view.seg->free_block;
+  for(i=0; i<nblocks; i++) {
+    prev = view.seg->free_block;
+    view.seg->free_block = view.block_next[prev];
+  }
+  view.block_next[prev] = SHM_NO_INDEX;
+  view.seg->free_blocks -= nblocks;
+
+  view.entries[idx].hash = hash;
+  view.entries[idx].keylen = keylen;
+  view.entries[idx].size = tile->encoded_data->size;
+  view.entries[idx].mtime = tile->mtime ? tile->mtime : apr_time_now();
+  view.entries[idx].first_block = block;
+  view.entries[idx].referenced = 0;
+  view.entries[idx].used = 1;
+
+  /* copy the key and the data into the block chain */
+  memcpy(view.data + (apr_size_t)block * SHM_BLOCK_SIZE, key, keylen);
+  offset = keylen;
+  src = (const char*)tile->encoded_data->buf;
+  remaining = tile->encoded_data->size;
+  while(remaining) {
+    apr_size_t len = SHM_BLOCK_SIZE - offset;
+    if(len > remaining) len = remaining;
+    memcpy(view.data + (apr_size_t)block * SHM_BLOCK_SIZE + offset, src, len);
+    src += len;
+    remaining -= len;
+    offset = 0;
+    block = view.block_next[block];
+  }
+
+  view.entries[idx].next = view.buckets[hash % view.seg->nblocks];
+  view.buckets[hash % view.seg->nblocks] = idx;
+  _shm_unlock(&view);
+
+  apr_atomic_inc32(&header->insertions);
+  if(evicted) {
+    apr_atomic_add32(&header->evictions, evicted);
+  }
+}
+
+static void _shm_invalidate(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_tile *tile)
+{
+  _shm_header *header = _shm_get_header(cache);
+  _shm_view view;
+  char *key = _shm_tile_key(ctx, tile);
+  apr_uint32_t keylen = strlen(key);
+  apr_uint32_t hash = _shm_hash(key, keylen), idx;
+  _shm_get_view(cache, hash % header->nsegments, &view);
+  hash /= header->nsegments;
+  if(_shm_lock(ctx, &view) != MAPCACHE_SUCCESS) {
+    return;
+  }
+  idx = _shm_find(&view, hash, key, keylen);
+  if(idx != SHM_NO_INDEX) {
+    _shm_remove(&view, idx);
+  }
+  _shm_unlock(&view);
+}
+
+static int _mapcache_cache_shm_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  _shm_header *header = _shm_get_header(cache);
+  _shm_view view;
+  char *key = _shm_tile_key(ctx, tile);
+  apr_uint32_t keylen = strlen(key);
+  apr_uint32_t hash = _shm_hash(key, keylen), idx;
+  _shm_get_view(cache, hash % header->nsegments, &view);
+  hash /= header->nsegments;
+  if(_shm_lock(ctx, &view) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FALSE;
+  }
+  idx = _shm_find(&view, hash, key, keylen);
+  _shm_unlock(&view);
+  if(idx != SHM_NO_INDEX) {
+    return MAPCACHE_TRUE;
+  }
+  return cache->child->tile_exists(ctx, cache->child, tile);
+}
+
+static void _mapcache_cache_shm_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  _shm_invalidate(ctx, cache, tile);
+  GC_CHECK_ERROR(ctx);
+  cache->child->tile_delete(ctx, cache->child, tile);
+}
+
+static void _shm_log_stats(mapcache_context *ctx, mapcache_cache_shm *cache)
+{
+  _shm_header *header = _shm_get_header(cache);
+  mapcache_cache_shm_stats stats;
+  if((apr_atomic_read32(&header->hits) + apr_atomic_read32(&header->misses)) % SHM_STATS_INTERVAL) {
+    return;
+  }
+  mapcache_cache_shm_get_stats(ctx, cache, &stats);
+  ctx->log(ctx, MAPCACHE_INFO, "shm cache %s: %u hits, %u misses, %u insertions, %u evictions, %u/%u blocks used",
+           cache->cache.name, stats.hits, stats.misses, stats.insertions, stats.evictions,
+           stats.used_blocks, stats.total_blocks);
+}
+
+/* look up a tile in the shared memory segment only */
+static int _shm_lookup(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_tile *tile)
+{
+  _shm_header *header = _shm_get_header(cache);
+  _shm_view view;
+  char *key = _shm_tile_key(ctx, tile);
+  apr_uint32_t keylen = strlen(key);
+  apr_uint32_t hash = _shm_hash(key, keylen), idx;
+  _shm_get_view(cache, hash % header->nsegments, &view);
+  hash /= header->nsegments;
+
+  if(_shm_lock(ctx, &view) != MAPCACHE_SUCCESS) {
+    return MAPCACHE_FAILURE;
+  }
+  idx = _shm_find(&view, hash, key, keylen);
+  if(idx != SHM_NO_INDEX) {
+    _shm_entry *entry = &view.entries[idx];
+    entry->referenced = 1;
+    tile->encoded_data = mapcache_buffer_create(entry->size, ctx->pool);
+    _shm_copy_out(&view, entry, (char*)tile->encoded_data->buf);
+    tile->encoded_data->size = entry->size;
+    tile->mtime = entry->mtime;
+    _shm_unlock(&view);
+    apr_atomic_inc32(&header->hits);
+    _shm_log_stats(ctx, cache);
+    return MAPCACHE_SUCCESS;
+  }
+  _shm_unlock(&view);
+  apr_atomic_inc32(&header->misses);
+  _shm_log_stats(ctx, cache);
+  return MAPCACHE_CACHE_MISS;
+}
+
+/**
+ * \brief get content of given tile
+ *
+ * looks the tile up in the shared memory segment, and falls back to the child cache
+ * on a miss. tiles found in the child cache are then stored in the shared memory segment.
+ * \private \memberof mapcache_cache_shm
+ * \sa mapcache_cache::tile_get()
+ */
+static int _mapcache_cache_shm_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  int ret;
+  if(_shm_lookup(ctx, cache, tile) == MAPCACHE_SUCCESS)
+    return MAPCACHE_SUCCESS;
+  if(GC_HAS_ERROR(ctx))
+    return MAPCACHE_FAILURE;
+  ret = cache->child->tile_get(ctx, cache->child, tile);
+  if(ret == MAPCACHE_SUCCESS) {
+    _shm_store(ctx, cache, tile);
+  }
+  return ret;
+}
+
+/* the tiles missing from shared memory are looked up in a single batch from the child cache */
+static void _mapcache_cache_shm_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  mapcache_tile **misses = (mapcache_tile**)apr_palloc(ctx->pool, ntiles*sizeof(mapcache_tile*));
+  int *missidx = (int*)apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int *missrets = (int*)apr_palloc(ctx->pool, ntiles*sizeof(int));
+  int i, nmisses = 0;
+  for(i=0; i<ntiles; i++) {
+    rets[i] = _shm_lookup(ctx, cache, tiles[i]);
+    GC_CHECK_ERROR(ctx);
+    if(rets[i] != MAPCACHE_SUCCESS) {
+      missidx[nmisses] = i;
+      missrets[nmisses] = MAPCACHE_CACHE_MISS;
+      misses[nmisses++] = tiles[i];
+    }
+  }
+  if(!nmisses)
+    return;
+  if(cache->child->tile_multi_get && nmisses > 1) {
+    cache->child->tile_multi_get(ctx, cache->child, misses, nmisses, missrets);
+    GC_CHECK_ERROR(ctx);
+  } else {
+    for(i=0; i<nmisses; i++) {
+      missrets[i] = cache->child->tile_get(ctx, cache->child, misses[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  for(i=0; i<nmisses; i++) {
+    rets[missidx[i]] = missrets[i];
+    if(missrets[i] == MAPCACHE_SUCCESS) {
+      _shm_store(ctx, cache, misses[i]);
+    }
+  }
+}
+
+static void _mapcache_cache_shm_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  cache->child->tile_set(ctx, cache->child, tile);
+  GC_CHECK_ERROR(ctx);
+  _shm_store(ctx, cache, tile);
+}
+
+static void _mapcache_cache_shm_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  int i;
+  if(cache->child->tile_multi_set) {
+    cache->child->tile_multi_set(ctx, cache->child, tiles, ntiles);
+  } else {
+    for(i=0; i<ntiles; i++) {
+      cache->child->tile_set(ctx, cache->child, &tiles[i]);
+      GC_CHECK_ERROR(ctx);
+    }
+  }
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    _shm_store(ctx, cache, &tiles[i]);
+  }
+}
+
+void mapcache_cache_shm_get_stats(mapcache_context *ctx, mapcache_cache_shm *cache, mapcache_cache_shm_stats *stats)
+{
+  _shm_header *header = _shm_get_header(cache);
+  apr_uint32_t i;
+  memset(stats, 0, sizeof(mapcache_cache_shm_stats));
+  stats->hits = apr_atomic_read32(&header->hits);
+  stats->misses = apr_atomic_read32(&header->misses);
+  stats->evictions = apr_atomic_read32(&header->evictions);
+  stats->insertions = apr_atomic_read32(&header->insertions);
+  for(i=0; i<header->nsegments; i++) {
+    _shm_view view;
+    _shm_get_view(cache, i, &view);
+    stats->total_blocks += view.seg->nblocks;
+    stats->used_blocks += view.seg->nblocks - view.seg->free_blocks;
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ */
+static void _mapcache_cache_shm_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *pcache, mapcache_cfg *config)
+{
+  ezxml_t cur_node;
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  if ((cur_node = ezxml_child(node,"cache")) != NULL && cur_node->txt && *cur_node->txt) {
+    cache->child = mapcache_configuration_get_cache(config, cur_node->txt);
+    if(!cache->child) {
+      ctx->set_error(ctx, 400, "shm cache \"%s\" references cache \"%s\","
+                     " but it is not configured (hint: referenced caches must be declared before this shm cache in the xml file)",
+                     pcache->name, cur_node->txt);
+      return;
+    }
+  } else {
+    ctx->set_error(ctx, 400, "shm cache \"%s\" has no <cache> to store its tiles to", pcache->name);
+    return;
+  }
+  if ((cur_node = ezxml_child(node,"size")) != NULL) {
+    char *endptr;
+    apr_int64_t size = apr_strtoi64(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || size <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse size \"%s\" for shm cache \"%s\". Expecting a positive number of bytes",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+    cache->size = (apr_size_t)size;
+  }
+  if ((cur_node = ezxml_child(node,"segments")) != NULL) {
+    char *endptr;
+    cache->nsegments = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || cache->nsegments <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse segments \"%s\" for shm cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, pcache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node,"filename")) != NULL && cur_node->txt && *cur_node->txt) {
+    cache->filename = apr_pstrdup(ctx->pool, cur_node->txt);
+  }
+}
+
+/**
+ * \private \memberof mapcache_cache_shm
+ *
+ * creates or attaches to the shared memory segment. As this is done at configuration
+ * time, an anonymous segment is shared with the server processes that are later
+ * forked from the configuring process.
+ */
+static void _mapcache_cache_shm_configuration_post_config(mapcache_context *ctx, mapcache_cache *pcache,
+    mapcache_cfg *cfg)
+{
+  mapcache_cache_shm *cache = (mapcache_cache_shm*)pcache;
+  apr_status_t rv;
+  apr_size_t segment_size;
+  apr_uint32_t nblocks, i;
+  _shm_header *header;
+  char errmsg[120];
+  int created = 1;
+
+  /* round down to keep the segments aligned, and leave room for the alignment of the segment arrays */
+  segment_size = cache->size / cache->nsegments;
+  segment_size -= segment_size % APR_ALIGN_DEFAULT(1);
+  nblocks = 0;
+  if(segment_size > SHM_SEGMENT_HEADER_SIZE + 4 * APR_ALIGN_DEFAULT(1)) {
+    nblocks = (segment_size - SHM_SEGMENT_HEADER_SIZE - 4 * APR_ALIGN_DEFAULT(1)) / SHM_BLOCK_COST;
+  }
+  if(nblocks < 16) {
+    ctx->set_error(ctx, 400, "shm cache \"%s\": size %"APR_SIZE_T_FMT" is too small for %d segments",
+                   pcache->name, cache->size, cache->nsegments);
+    return;
+  }
+
+  if(cache->filename) {
+    rv = apr_shm_attach(&cache->shm, cache->filename, ctx->pool);
+    if(rv == APR_SUCCESS) {
+      created = 0;
+    } else {
+      rv = apr_shm_create(&cache->shm, APR_ALIGN_DEFAULT(sizeof(_shm_header)) + segment_size * cache->nsegments,
+                          cache->filename, ctx->pool);
+      if(APR_STATUS_IS_EEXIST(rv)) {
+        /* stale segment name left over from a previous run */
+        apr_shm_remove(cache->filename, ctx->pool);
+        rv = apr_shm_create(&cache->shm, APR_ALIGN_DEFAULT(sizeof(_shm_header)) + segment_size * cache->nsegments,
+                            cache->filename, ctx->pool);
+      }
+    }
+  } else {
+    rv = apr_shm_create(&cache->shm, APR_ALIGN_DEFAULT(sizeof(_shm_header)) + segment_size * cache->nsegments,
+                        NULL, ctx->pool);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "shm cache \"%s\": failed to create shared memory segment: %s",
+                   pcache->name, apr_strerror(rv,errmsg,120));
+    return;
+  }
+
+  header = _shm_get_header(cache);
+  if(!created) {
+    /* give the creating process some time to initialize the segment */
+    for(i=0; i<100 && header->magic != SHM_MAGIC; i++) {
+      apr_sleep(10000);
+    }
+    if(header->magic != SHM_MAGIC || header->size != cache->size || header->nsegments != (apr_uint32_t)cache->nsegments) {
+      ctx->set_error(ctx, 500, "shm cache \"%s\": existing shared memory segment %s has an incompatible layout",
+                     pcache->name, cache->filename);
+    }
+    return;
+  }
+
+  header->magic = 0;
+  header->size = cache->size;
+  header->nsegments = cache->nsegments;
+  header->segment_size = segment_size;
+  header->hits = header->misses = header->evictions = header->insertions = 0;
+  for(i=0; i<header->nsegments; i++) {
+    _shm_view view;
+    _shm_segment *seg = (_shm_segment*)((char*)header + APR_ALIGN_DEFAULT(sizeof(_shm_header)) + i * segment_size);
+    seg->nblocks = nblocks;
+    _shm_get_view(cache, i, &view);
+    if(mapcache_shm_mutex_init(ctx, view.mutex) != MAPCACHE_SUCCESS) {
+      return;
+    }
+    _shm_segment_init(&view);
+  }
+  header->magic = SHM_MAGIC;
+}
+
+/**
+ * \brief creates and initializes a mapcache_cache_shm
+ */
+mapcache_cache* mapcache_cache_shm_create(mapcache_context *ctx)
+{
+  mapcache_cache_shm *cache;
+  if(!mapcache_shm_mutex_size()) {
+    ctx->set_error(ctx, 400, "shm cache is not supported on this platform (requires process-shared pthread mutexes)");
+    return NULL;
+  }
+  cache = apr_pcalloc(ctx->pool,sizeof(mapcache_cache_shm));
+  if(!cache) {
+    ctx->set_error(ctx, 500, "failed to allocate shm cache");
+    return NULL;
+  }
+  cache->cache.metadata = apr_table_make(ctx->pool,3);
+  cache->cache.type = MAPCACHE_CACHE_SHM;
+  cache->cache.tile_delete = _mapcache_cache_shm_delete;
+  cache->cache.tile_get = _mapcache_cache_shm_get;
+  cache->cache.tile_exists = _mapcache_cache_shm_has_tile;
+  cache->cache.tile_set = _mapcache_cache_shm_set;
+  cache->cache.tile_multi_set = _mapcache_cache_shm_multi_set;
+  cache->cache.tile_multi_get = _mapcache_cache_shm_multi_get;
+  cache->cache.configuration_post_config = _mapcache_cache_shm_configuration_post_config;
+  cache->cache.configuration_parse_xml = _mapcache_cache_shm_configuration_parse_xml;
+  cache->size = 64*1024*1024;
+  cache->nsegments = 16;
+  cache->filename = NULL;
+  cache->shm = NULL;
+  return (mapcache_cache*)cache;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -36,6 +36,7 @@
 #include <time.h>
 #include <apr_reslist.h>
 #include <apr_hash.h>
+#include <apr_file_io.h>
 #ifdef APR_HAS_THREADS
 #include <apr_thread_mutex.h>
 #endif
@@ -46,8 +47,38 @@
 
 #include <sqlite3.h>
 
-static apr_hash_t *ro_connection_pools = NULL;
-static apr_hash_t *rw_connection_pools = NULL;
+#ifndef MAPCACHE_SQLITE_MMAP_SIZE
+/* number of bytes of each database file that connections of read_heavy caches memory map */
+#define MAPCACHE_SQLITE_MMAP_SIZE (256*1024*1024)
+#endif
+
+/*
+ * a sqlite cache can be spread over multiple database files, its dbfile being a
+ * template. each database file ("shard") gets its own read-only and read-write
+ * connection pools, and the shards that were least recently used are closed once
+ * more than max_open_dbfiles of them are open for a cache.
+ */
+struct sqlite_shard {
+  char *key;
+  char *dbfile;
+  mapcache_cache_sqlite *cache;
+  apr_pool_t *pool; /* holds the shard and its connection pools */
+  apr_reslist_t *ro_pool;
+  apr_reslist_t *rw_pool;
+  int nconns; /* connections currently acquired from the shard */
+  struct sqlite_shard *prev, *next; /* most recently used first */
+};
+
+struct sqlite_shards {
+  apr_pool_t *pool;
+  apr_hash_t *table;
+  struct sqlite_shard *head, *tail;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+};
+
+static struct sqlite_shards *shards = NULL;
 
 struct sqlite_conn {
   sqlite3 *handle;
@@ -55,6 +86,8 @@ struct sqlite_conn {
   int nstatements;
   sqlite3_stmt **prepared_statements;
   char *errmsg;
+  struct sqlite_shard *shard;
+  int wal; /* the database is in wal journal mode, so readers do not block writers */
 };
 
 #define HAS_TILE_STMT_IDX 0
@@ -70,12 +103,38 @@ struct sqlite_conn {
 #define MBTILES_DEL_TILE_STMT2_IDX 8
 
 
+/* sqlite3_exec callback storing whether the journal mode reported by a statement is wal */
+static int _sqlite_journal_mode_cb(void *data, int ncols, char **values, char **names)
+{
+  *(int*)data = (ncols > 0 && values[0] && !strcmp(values[0], "wal"));
+  return 0;
+}
+
 static int _sqlite_set_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, struct sqlite_conn *conn)
 {
+  conn->wal = 0;
+  if (cache->read_heavy) {
+    /*
+     * the journal mode is persistent. read-only connections of read_heavy caches open the
+     * database for writing too, so a database created before read_heavy was enabled is
+     * switched by whichever connection comes first. explicit <pragma> entries are executed
+     * afterwards, and override these
+     */
+    int ret;
+    do {
+      ret = sqlite3_exec(conn->handle, "PRAGMA journal_mode=WAL", _sqlite_journal_mode_cb, &conn->wal, NULL);
+    } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
+    if (!conn->readonly && ret != SQLITE_OK) {
+      conn->errmsg = apr_psprintf(pool,"failed to switch %s to wal journal mode: %s",conn->shard->dbfile,sqlite3_errmsg(conn->handle));
+      return MAPCACHE_FAILURE;
+    }
+    sqlite3_exec(conn->handle, apr_psprintf(pool,"PRAGMA mmap_size=%ld",(long)MAPCACHE_SQLITE_MMAP_SIZE), 0, 0, NULL);
+  }
   if (cache->pragmas && !apr_is_empty_table(cache->pragmas)) {
     const apr_array_header_t *elts = apr_table_elts(cache->pragmas);
+    int ret;
     /* FIXME dynamically allocate this string */
-    int i,ret;
+    int i;
     char *pragma_stmt;
     for (i = 0; i < elts->nelts; i++) {
       apr_table_entry_t entry = APR_ARRAY_IDX(elts, i, apr_table_entry_t);
@@ -91,6 +150,10 @@ static int _sqlite_set_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, s
         return MAPCACHE_FAILURE;
       }
     }
+    if (cache->read_heavy) {
+      /* a <pragma> may have changed the journal mode */
+      sqlite3_exec(conn->handle, "PRAGMA journal_mode", _sqlite_journal_mode_cb, &conn->wal, NULL);
+    }
   }
   return MAPCACHE_SUCCESS;
 }
@@ -98,14 +161,16 @@ static int _sqlite_set_pragmas(apr_pool_t *pool, mapcache_cache_sqlite* cache, s
 static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params, apr_pool_t *pool)
 {
   int ret;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_shard *shard = (struct sqlite_shard*) params;
+  mapcache_cache_sqlite *cache = shard->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->shard = shard;
   int flags;
   flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX | SQLITE_OPEN_CREATE;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
     return APR_EGENERAL;
   }
   sqlite3_busy_timeout(conn->handle, 300000);
@@ -116,7 +181,7 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret != SQLITE_OK) {
-    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+    conn->errmsg = apr_psprintf(pool, "sqlite backend failed to create db schema on %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
     sqlite3_close(conn->handle);
     return APR_EGENERAL;
   }
@@ -135,17 +200,24 @@ static apr_status_t _sqlite_reslist_get_rw_connection(void **conn_, void *params
 static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params, apr_pool_t *pool)
 {
   int ret;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) params;
+  struct sqlite_shard *shard = (struct sqlite_shard*) params;
+  mapcache_cache_sqlite *cache = shard->cache;
   struct sqlite_conn *conn = apr_pcalloc(pool, sizeof (struct sqlite_conn));
   *conn_ = conn;
+  conn->shard = shard;
   int flags;
-  flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
-  ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+  if(cache->read_heavy) {
+    /* readers of a wal database need write access to its shared memory index */
+    flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_NOMUTEX;
+  } else {
+    flags = SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX;
+  }
+  ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
   if (ret != SQLITE_OK) {
     /* maybe the database file doesn't exist yet. so we create it and setup the schema */
-    ret = sqlite3_open_v2(cache->dbfile, &conn->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
+    ret = sqlite3_open_v2(shard->dbfile, &conn->handle, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to open db %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
@@ -157,15 +229,15 @@ static apr_status_t _sqlite_reslist_get_ro_connection(void **conn_, void *params
       }
     } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to create db schema on %s: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool,"sqlite backend failed to create db schema on %s: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
 
     sqlite3_close(conn->handle);
-    ret = sqlite3_open_v2(cache->dbfile, &conn->handle, flags, NULL);
+    ret = sqlite3_open_v2(shard->dbfile, &conn->handle, flags, NULL);
     if (ret != SQLITE_OK) {
-      conn->errmsg = apr_psprintf(pool, "sqlite backend failed to re-open freshly created db %s readonly: %s", cache->dbfile, sqlite3_errmsg(conn->handle));
+      conn->errmsg = apr_psprintf(pool, "sqlite backend failed to re-open freshly created db %s readonly: %s", shard->dbfile, sqlite3_errmsg(conn->handle));
       sqlite3_close(conn->handle);
       return APR_EGENERAL;
     }
@@ -197,100 +269,278 @@ static apr_status_t _sqlite_reslist_free_connection(void *conn_, void *params, a
   return APR_SUCCESS;
 }
 
-static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
-  apr_status_t rv;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn;
-  apr_reslist_t *pool = NULL;
-  apr_hash_t *pool_container;
-  if (readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
+/* replaces the {x/N} or {y/N} entries of a dbfile template */
+static char* _sqlite_replace_div(mapcache_context *ctx, char *path, const char *prefix, int value)
+{
+  char *start;
+  while((start = strstr(path, prefix)) != NULL) {
+    char *end;
+    long div = strtol(start + strlen(prefix), &end, 10);
+    if(*end != '}' || div <= 0) {
+      ctx->set_error(ctx, 500, "invalid %sN} entry in sqlite dbfile template %s, expecting a positive integer N", prefix, path);
+      return NULL;
+    }
+    path = apr_psprintf(ctx->pool, "%.*s%d%s", (int)(start - path), path, value / (int)div, end + 1);
   }
-  if(!pool_container || NULL == (pool = apr_hash_get(pool_container,cache->cache.name, APR_HASH_KEY_STRING)) ) {
+  return path;
+}
+
+/**
+ * \brief the database file the given tile is stored in
+ *
+ * applies the tile's {tileset}, {grid}, {dim}, {z}, {x}, {y}, {x/N} and {y/N}
+ * substitutions to the dbfile template.
+ * \private \memberof mapcache_cache_sqlite
+ */
+static char* _sqlite_dbfile(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile *tile)
+{
+  char *path = cache->dbfile;
+  if(!strchr(path, '{'))
+    return path;
+
+  if(strstr(path,"{tileset}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{tileset}", tile->tileset->name);
+  if(strstr(path,"{grid}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{grid}", tile->grid_link->grid->name);
+  if(strstr(path,"{dim}")) {
+    char *dimstring="";
+    if(tile->dimensions) {
+      const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
+      int i = elts->nelts;
+      while(i--) {
+        apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
+        const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
+        dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
+      }
+    }
+    path = mapcache_util_str_replace(ctx->pool, path, "{dim}", dimstring);
+  }
+  while(strstr(path,"{z}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{z}", apr_psprintf(ctx->pool,"%d",tile->z));
+  while(strstr(path,"{x}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{x}", apr_psprintf(ctx->pool,"%d",tile->x));
+  while(strstr(path,"{y}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{y}", apr_psprintf(ctx->pool,"%d",tile->y));
+  path = _sqlite_replace_div(ctx, path, "{x/", tile->x);
+  if(path)
+    path = _sqlite_replace_div(ctx, path, "{y/", tile->y);
+  return path;
+}
+
+static apr_status_t _sqlite_shards_cleanup(void *data)
+{
+  struct sqlite_shards *s = (struct sqlite_shards*)data;
+  while(s->head) {
+    struct sqlite_shard *shard = s->head;
+    s->head = shard->next;
+    apr_pool_destroy(shard->pool);
+  }
+  apr_pool_destroy(s->pool);
+  if(shards == s)
+    shards = NULL;
+  return APR_SUCCESS;
+}
+
+static struct sqlite_shards* _sqlite_get_shards(mapcache_context *ctx)
+{
+  if(shards)
+    return shards;
 #ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
 #endif
-    if(!ro_connection_pools) {
-      ro_connection_pools = apr_hash_make(ctx->process_pool);
-      rw_connection_pools = apr_hash_make(ctx->process_pool);
-    }
-
-    /* probably doesn't exist, unless the previous mutex locked us, so we check */
-    pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    if(!pool) {
-      /* there where no existing connection pools, create them*/
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              10 /* soft max */,
-                              200 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_ro_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb ro connection pool");
+  if(!shards) {
+    /*
+     * the shards are opened and closed while serving requests, so they are not
+     * allocated from the process pool which is not safe to use concurrently
+     */
+    struct sqlite_shards *s = apr_pcalloc(ctx->process_pool, sizeof(struct sqlite_shards));
+    apr_pool_create(&s->pool, NULL);
+    s->table = apr_hash_make(s->pool);
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+    apr_thread_mutex_create(&s->mutex, APR_THREAD_MUTEX_DEFAULT, s->pool);
 #endif
-        return NULL;
-      }
-      apr_hash_set(ro_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
-      rv = apr_reslist_create(&pool,
-                              0 /* min */,
-                              1 /* soft max */,
-                              1 /* hard max */,
-                              60*1000000 /*60 seconds, ttl*/,
-                              _sqlite_reslist_get_rw_connection, /* resource constructor */
-                              _sqlite_reslist_free_connection, /* resource destructor */
-                              cache, ctx->process_pool);
-      if(rv != APR_SUCCESS) {
-        ctx->set_error(ctx,500,"failed to create bdb rw connection pool");
+    apr_pool_cleanup_register(ctx->process_pool, s, _sqlite_shards_cleanup, apr_pool_cleanup_null);
+    shards = s;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return shards;
+}
+
+static void _sqlite_shards_lock(struct sqlite_shards *s)
+{
 #ifdef APR_HAS_THREADS
-        if(ctx->threadlock)
-          apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  apr_thread_mutex_lock(s->mutex);
 #endif
+}
+
+static void _sqlite_shards_unlock(struct sqlite_shards *s)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(s->mutex);
+#endif
+}
+
+static void _sqlite_shard_unlink(struct sqlite_shards *s, struct sqlite_shard *shard)
+{
+  if(shard->prev) shard->prev->next = shard->next;
+  else s->head = shard->next;
+  if(shard->next) shard->next->prev = shard->prev;
+  else s->tail = shard->prev;
+  shard->prev = shard->next = NULL;
+}
+
+/* must be called with the shards locked */
+static struct sqlite_shard* _sqlite_shard_open(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile, const char *key)
+{
+  apr_status_t rv;
+  apr_pool_t *pool;
+  struct sqlite_shard *shard;
+  apr_pool_create(&pool, NULL);
+  shard = apr_pcalloc(pool, sizeof(struct sqlite_shard));
+  shard->pool = pool;
+  shard->cache = cache;
+  shard->key = apr_pstrdup(pool, key);
+  shard->dbfile = apr_pstrdup(pool, dbfile);
+
+  if(dbfile != cache->dbfile) {
+    /* templated database files may be stored in directories that don't exist yet */
+    char *dir = apr_pstrdup(ctx->pool, dbfile), *slash = strrchr(dir, '/');
+    if(slash && slash != dir) {
+      *slash = '\0';
+      rv = apr_dir_make_recursive(dir, APR_OS_DEFAULT, ctx->pool);
+      if(rv != APR_SUCCESS && !APR_STATUS_IS_EEXIST(rv)) {
+        char errmsg[120];
+        ctx->set_error(ctx, 500, "failed to create directory %s: %s", dir, apr_strerror(rv,errmsg,120));
+        apr_pool_destroy(pool);
         return NULL;
       }
-      apr_hash_set(rw_connection_pools,cache->cache.name,APR_HASH_KEY_STRING,pool);
     }
-#ifdef APR_HAS_THREADS
-    if(ctx->threadlock)
-      apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
-#endif
-    if(readonly)
-      pool = apr_hash_get(ro_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    else
-      pool = apr_hash_get(rw_connection_pools,cache->cache.name, APR_HASH_KEY_STRING);
-    assert(pool);
   }
-  rv = apr_reslist_acquire(pool, (void **) &conn);
+
+  rv = apr_reslist_create(&shard->ro_pool,
+                          0 /* min */,
+                          cache->ro_soft_max /* soft max */,
+                          cache->ro_hard_max /* hard max */,
+                          60*1000000 /*60 seconds, ttl*/,
+                          _sqlite_reslist_get_ro_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          shard, pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create sqlite ro connection pool for %s", dbfile);
+    apr_pool_destroy(pool);
+    return NULL;
+  }
+  /* sqlite only allows a single writer per database file */
+  rv = apr_reslist_create(&shard->rw_pool,
+                          0 /* min */,
+                          1 /* soft max */,
+                          1 /* hard max */,
+                          60*1000000 /*60 seconds, ttl*/,
+                          _sqlite_reslist_get_rw_connection, /* resource constructor */
+                          _sqlite_reslist_free_connection, /* resource destructor */
+                          shard, pool);
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx,500,"failed to create sqlite rw connection pool for %s", dbfile);
+    apr_pool_destroy(pool);
+    return NULL;
+  }
+  return shard;
+}
+
+/* closes the least recently used idle shards of a cache that has too many of them open */
+static void _sqlite_shards_evict(mapcache_context *ctx, struct sqlite_shards *s, mapcache_cache_sqlite *cache)
+{
+  struct sqlite_shard *shard, *prev;
+  int nopen = 0;
+  for(shard = s->head; shard; shard = shard->next) {
+    if(shard->cache == cache) nopen++;
+  }
+  for(shard = s->tail; shard && nopen > cache->max_open_dbfiles; shard = prev) {
+    prev = shard->prev;
+    if(shard->cache != cache || shard->nconns) continue;
+    ctx->log(ctx, MAPCACHE_DEBUG, "sqlite cache %s: closing idle database %s", cache->cache.name, shard->dbfile);
+    _sqlite_shard_unlink(s, shard);
+    apr_hash_set(s->table, shard->key, APR_HASH_KEY_STRING, NULL);
+    apr_pool_destroy(shard->pool);
+    nopen--;
+  }
+}
+
+static struct sqlite_shard* _sqlite_shard_acquire(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile)
+{
+  struct sqlite_shards *s = _sqlite_get_shards(ctx);
+  struct sqlite_shard *shard;
+  char *key = apr_pstrcat(ctx->pool, cache->cache.name, "|", dbfile, NULL);
+  _sqlite_shards_lock(s);
+  shard = apr_hash_get(s->table, key, APR_HASH_KEY_STRING);
+  if(shard) {
+    _sqlite_shard_unlink(s, shard);
+  } else {
+    shard = _sqlite_shard_open(ctx, cache, dbfile, key);
+    if(!shard) {
+      _sqlite_shards_unlock(s);
+      return NULL;
+    }
+    apr_hash_set(s->table, shard->key, APR_HASH_KEY_STRING, shard);
+  }
+  shard->next = s->head;
+  if(s->head) s->head->prev = shard;
+  s->head = shard;
+  if(!s->tail) s->tail = shard;
+  shard->nconns++;
+  if(shard->next)
+    _sqlite_shards_evict(ctx, s, cache);
+  _sqlite_shards_unlock(s);
+  return shard;
+}
+
+static void _sqlite_shard_release(struct sqlite_shard *shard)
+{
+  struct sqlite_shards *s = shards;
+  _sqlite_shards_lock(s);
+  shard->nconns--;
+  _sqlite_shards_unlock(s);
+}
+
+static struct sqlite_conn* _sqlite_get_dbfile_conn(mapcache_context *ctx, mapcache_cache_sqlite *cache, const char *dbfile, int readonly) {
+  apr_status_t rv;
+  struct sqlite_conn *conn = NULL;
+  struct sqlite_shard *shard = _sqlite_shard_acquire(ctx, cache, dbfile);
+  if(!shard)
+    return NULL;
+  rv = apr_reslist_acquire(readonly?shard->ro_pool:shard->rw_pool, (void **) &conn);
   if (rv != APR_SUCCESS) {
     ctx->set_error(ctx, 500, "failed to aquire connection to sqlite backend: %s", (conn && conn->errmsg)?conn->errmsg:"unknown error");
+    _sqlite_shard_release(shard);
     return NULL;
   }
+  conn->shard = shard;
   return conn;
 }
 
-static void _sqlite_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static struct sqlite_conn* _sqlite_get_conn(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile* tile, int readonly) {
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  char *dbfile = _sqlite_dbfile(ctx, cache, tile);
+  if(GC_HAS_ERROR(ctx))
+    return NULL;
+  return _sqlite_get_dbfile_conn(ctx, cache, dbfile, readonly);
+}
+
+static void _sqlite_release_conn(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  apr_reslist_t *pool;
-  apr_hash_t *pool_container;
-  if(conn->readonly) {
-    pool_container = ro_connection_pools;
-  } else {
-    pool_container = rw_connection_pools;
-  }
-  pool = apr_hash_get(pool_container,tile->tileset->cache->name, APR_HASH_KEY_STRING);
+  struct sqlite_shard *shard = conn->shard;
+  apr_reslist_t *pool = conn->readonly?shard->ro_pool:shard->rw_pool;
 
   if (GC_HAS_ERROR(ctx)) {
     apr_reslist_invalidate(pool, (void*) conn);
   } else {
     apr_reslist_release(pool, (void*) conn);
   }
+  _sqlite_shard_release(shard);
 }
 
 
@@ -394,14 +644,14 @@ static void _bind_mbtiles_params(mapcache_context *ctx, void *vstmt, mapcache_ti
   }
 }
 
-static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 1);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, pcache, tile, 1);
   sqlite3_stmt *stmt;
   int ret;
   if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, pcache, tile, conn);
     return MAPCACHE_FALSE;
   }
   stmt = conn->prepared_statements[HAS_TILE_STMT_IDX];
@@ -420,18 +670,18 @@ static int _mapcache_cache_sqlite_has_tile(mapcache_context *ctx, mapcache_tile
     ret = MAPCACHE_TRUE;
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, pcache, tile, conn);
   return ret;
 }
 
-static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, pcache, tile, 0);
   sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_DEL_TILE_STMT_IDX];
   int ret;
   if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, pcache, tile, conn);
     return;
   }
   if(!stmt) {
@@ -444,20 +694,20 @@ static void _mapcache_cache_sqlite_delete(mapcache_context *ctx, mapcache_tile *
     ctx->set_error(ctx, 500, "sqlite backend failed on delete: %s", sqlite3_errmsg(conn->handle));
   }
   sqlite3_reset(stmt);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, pcache, tile, conn);
 }
 
 
-static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, pcache, tile, 0);
   sqlite3_stmt *stmt1,*stmt2,*stmt3;
   int ret;
   const char *tile_id;
   size_t tile_id_size;
   if (GC_HAS_ERROR(ctx)) {
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, pcache, tile, conn);
     return;
   }
   stmt1 = conn->prepared_statements[MBTILES_DEL_TILE_SELECT_STMT_IDX];
@@ -481,13 +731,13 @@ static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
       ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 1: %s", sqlite3_errmsg(conn->handle));
       sqlite3_reset(stmt1);
-      _sqlite_release_conn(ctx, tile, conn);
+      _sqlite_release_conn(ctx, pcache, tile, conn);
       return;
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret == SQLITE_DONE) { /* tile does not exist, ignore */
     sqlite3_reset(stmt1);
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, pcache, tile, conn);
     return;
   } else {
     tile_id = (const char*) sqlite3_column_text(stmt1, 0);
@@ -502,7 +752,7 @@ static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile
     ctx->set_error(ctx, 500, "sqlite backend failed on mbtile del 2: %s", sqlite3_errmsg(conn->handle));
     sqlite3_reset(stmt1);
     sqlite3_reset(stmt2);
-    _sqlite_release_conn(ctx, tile, conn);
+    _sqlite_release_conn(ctx, pcache, tile, conn);
     return;
   }
 
@@ -518,7 +768,7 @@ static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile
       sqlite3_reset(stmt1);
       sqlite3_reset(stmt2);
       sqlite3_reset(stmt3);
-      _sqlite_release_conn(ctx, tile, conn);
+      _sqlite_release_conn(ctx, pcache, tile, conn);
       return;
     }
   }
@@ -526,15 +776,15 @@ static void _mapcache_cache_mbtiles_delete(mapcache_context *ctx, mapcache_tile
   sqlite3_reset(stmt1);
   sqlite3_reset(stmt2);
   sqlite3_reset(stmt3);
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, pcache, tile, conn);
 }
 
 
 
-static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+static void _single_mbtile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
   sqlite3_stmt *stmt1,*stmt2;
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)tile->tileset->cache;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
   int ret;
   if(!tile->raw_image) {
     tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
@@ -597,17 +847,17 @@ static void _single_mbtile_set(mapcache_context *ctx, mapcache_tile *tile, struc
   sqlite3_reset(stmt2);
 }
 
-static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile)
+/*
+ * look up a single tile using the given connection. if pin is set, the tile data is not
+ * copied: the tile's buffer points into sqlite's page cache (or its memory mapping of the
+ * database), and the statement is left un-reset. the caller must then keep the connection
+ * until it is done with the tile, see _sqlite_unpin_conn()
+ */
+static int _single_sqlitetile_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct sqlite_conn *conn, int pin)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
-  struct sqlite_conn *conn;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
   sqlite3_stmt *stmt;
   int ret;
-  conn = _sqlite_get_conn(ctx, tile, 1);
-  if (GC_HAS_ERROR(ctx)) {
-    if(conn) _sqlite_release_conn(ctx, tile, conn);
-    return MAPCACHE_FAILURE;
-  }
   stmt = conn->prepared_statements[GET_TILE_STMT_IDX];
   if(!stmt) {
     sqlite3_prepare(conn->handle, cache->get_stmt.sql, -1, &conn->prepared_statements[GET_TILE_STMT_IDX], NULL);
@@ -619,33 +869,126 @@ static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_tile *tile
     if (ret != SQLITE_DONE && ret != SQLITE_ROW && ret != SQLITE_BUSY && ret != SQLITE_LOCKED) {
       ctx->set_error(ctx, 500, "sqlite backend failed on get: %s", sqlite3_errmsg(conn->handle));
       sqlite3_reset(stmt);
-      _sqlite_release_conn(ctx, tile, conn);
       return MAPCACHE_FAILURE;
     }
   } while (ret == SQLITE_BUSY || ret == SQLITE_LOCKED);
   if (ret == SQLITE_DONE) {
     sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
     return MAPCACHE_CACHE_MISS;
   } else {
     const void *blob = sqlite3_column_blob(stmt, 0);
     int size = sqlite3_column_bytes(stmt, 0);
-    tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
-    memcpy(tile->encoded_data->buf, blob, size);
-    tile->encoded_data->size = size;
+    if(pin) {
+      tile->encoded_data = mapcache_buffer_create(0, ctx->pool);
+      tile->encoded_data->buf = (void*)blob;
+      tile->encoded_data->size = tile->encoded_data->avail = size;
+    } else {
+      tile->encoded_data = mapcache_buffer_create(size, ctx->pool);
+      memcpy(tile->encoded_data->buf, blob, size);
+      tile->encoded_data->size = size;
+    }
     if (sqlite3_column_count(stmt) > 1) {
       time_t mtime = sqlite3_column_int64(stmt, 1);
       apr_time_ansi_put(&(tile->mtime), mtime);
     }
-    sqlite3_reset(stmt);
-    _sqlite_release_conn(ctx, tile, conn);
+    if(!pin)
+      sqlite3_reset(stmt);
     return MAPCACHE_SUCCESS;
   }
 }
 
-static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, struct sqlite_conn *conn)
+/* releases a connection whose get statement was left pinned, once the request is done with the tile */
+static apr_status_t _sqlite_unpin_conn(void *data)
+{
+  struct sqlite_conn *conn = (struct sqlite_conn*)data;
+  struct sqlite_shard *shard = conn->shard;
+  sqlite3_reset(conn->prepared_statements[GET_TILE_STMT_IDX]);
+  apr_reslist_release(shard->ro_pool, (void*) conn);
+  _sqlite_shard_release(shard);
+  return APR_SUCCESS;
+}
+
+static int _mapcache_cache_sqlite_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn;
+  void *pinned = NULL;
+  int ret;
+  conn = _sqlite_get_conn(ctx, pcache, tile, 1);
+  if (GC_HAS_ERROR(ctx)) {
+    if(conn) _sqlite_release_conn(ctx, pcache, tile, conn);
+    return MAPCACHE_FAILURE;
+  }
+  /*
+   * in wal mode an open read statement does not block writers, so the tile can be served
+   * straight from sqlite's memory. a request pins at most one connection, so that it can
+   * never exhaust the connection pool by itself.
+   */
+  if(cache->read_heavy && conn->wal) {
+    apr_pool_userdata_get(&pinned, "mapcache_sqlite_pinned", ctx->pool);
+  } else {
+    /* with a rollback journal, a pinned read would hold a shared lock that blocks writers */
+    pinned = conn;
+  }
+  ret = _single_sqlitetile_get(ctx, pcache, tile, conn, !pinned);
+  if(ret == MAPCACHE_SUCCESS && !pinned) {
+    apr_pool_userdata_setn(conn, "mapcache_sqlite_pinned", NULL, ctx->pool);
+    apr_pool_cleanup_register(ctx->pool, conn, _sqlite_unpin_conn, apr_pool_cleanup_null);
+    return ret;
+  }
+  _sqlite_release_conn(ctx, pcache, tile, conn);
+  return ret;
+}
+
+/*
+ * computes the database file of each tile, so that the tiles of a batch can be
+ * handled one database file at a time. a batch only spans multiple database files
+ * when it crosses a boundary of the dbfile template.
+ */
+static char** _sqlite_batch_dbfiles(mapcache_context *ctx, mapcache_cache_sqlite *cache, mapcache_tile **tiles, mapcache_tile *tilearray, int ntiles)
+{
+  char **dbfiles = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+  int i;
+  for (i = 0; i < ntiles; i++) {
+    dbfiles[i] = _sqlite_dbfile(ctx, cache, tiles?tiles[i]:&tilearray[i]);
+    if(GC_HAS_ERROR(ctx)) return NULL;
+  }
+  return dbfiles;
+}
+
+/*
+ * the get statement is user configurable and addresses a single tile, so instead of
+ * rewriting it into a range query, it is prepared once and re-bound for every tile on
+ * a single pooled connection, inside a single read transaction
+ */
+static void _mapcache_cache_sqlite_multi_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile **tiles, int ntiles, int *rets)
+{
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn;
+  char **dbfiles = _sqlite_batch_dbfiles(ctx, cache, tiles, NULL, ntiles), *dbfile;
+  int first,i;
+  GC_CHECK_ERROR(ctx);
+  for (first = 0; first < ntiles; first++) {
+    if(!dbfiles[first]) continue; /* already looked up */
+    dbfile = dbfiles[first];
+    conn = _sqlite_get_dbfile_conn(ctx, cache, dbfile, 1);
+    GC_CHECK_ERROR(ctx);
+    sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+    for (i = first; i < ntiles; i++) {
+      if(!dbfiles[i] || strcmp(dbfiles[i], dbfile)) continue;
+      rets[i] = _single_sqlitetile_get(ctx, pcache, tiles[i], conn, 0);
+      dbfiles[i] = NULL;
+      if(GC_HAS_ERROR(ctx)) break;
+    }
+    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+    _sqlite_release_conn(ctx, pcache, tiles[first], conn);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile, struct sqlite_conn *conn)
 {
-  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*) tile->tileset->cache;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
   sqlite3_stmt *stmt = conn->prepared_statements[SQLITE_SET_TILE_STMT_IDX];
   int ret;
 
@@ -667,64 +1010,75 @@ static void _single_sqlitetile_set(mapcache_context *ctx, mapcache_tile *tile, s
   sqlite3_reset(stmt);
 }
 
-static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_sqlite_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, pcache, tile, 0);
   GC_CHECK_ERROR(ctx);
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_sqlitetile_set(ctx,tile,conn);
+  _single_sqlitetile_set(ctx, pcache, tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, pcache, tile, conn);
 }
 
-static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+static void _mapcache_cache_sqlite_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, &tiles[0], 0);
-  int i;
+  mapcache_cache_sqlite *cache = (mapcache_cache_sqlite*)pcache;
+  struct sqlite_conn *conn;
+  char **dbfiles = _sqlite_batch_dbfiles(ctx, cache, NULL, tiles, ntiles), *dbfile;
+  int first,i;
   GC_CHECK_ERROR(ctx);
-  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_sqlitetile_set(ctx,tile,conn);
-    if(GC_HAS_ERROR(ctx)) break;
-  }
-  if (GC_HAS_ERROR(ctx)) {
-    sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-  } else {
-    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+  for (first = 0; first < ntiles; first++) {
+    if(!dbfiles[first]) continue; /* already stored */
+    dbfile = dbfiles[first];
+    conn = _sqlite_get_dbfile_conn(ctx, cache, dbfile, 0);
+    GC_CHECK_ERROR(ctx);
+    sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+    for (i = first; i < ntiles; i++) {
+      if(!dbfiles[i] || strcmp(dbfiles[i], dbfile)) continue;
+      _single_sqlitetile_set(ctx, pcache, &tiles[i],conn);
+      dbfiles[i] = NULL;
+      if(GC_HAS_ERROR(ctx)) break;
+    }
+    if (GC_HAS_ERROR(ctx)) {
+      sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+    } else {
+      sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+    }
+    _sqlite_release_conn(ctx, pcache, &tiles[first], conn);
+    GC_CHECK_ERROR(ctx);
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
 }
 
-static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_mbtiles_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
-  struct sqlite_conn *conn = _sqlite_get_conn(ctx, tile, 0);
+  struct sqlite_conn *conn = _sqlite_get_conn(ctx, pcache, tile, 0);
   GC_CHECK_ERROR(ctx);
   if(!tile->raw_image) {
     tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
     if(GC_HAS_ERROR(ctx)) {
-      _sqlite_release_conn(ctx, tile, conn);
+      _sqlite_release_conn(ctx, pcache, tile, conn);
       return;
     }
   }
   sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  _single_mbtile_set(ctx,tile,conn);
+  _single_mbtile_set(ctx, pcache, tile,conn);
   if (GC_HAS_ERROR(ctx)) {
     sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
   } else {
     sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
   }
-  _sqlite_release_conn(ctx, tile, conn);
+  _sqlite_release_conn(ctx, pcache, tile, conn);
 }
 
-static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_tile *tiles, int ntiles)
+static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
 {
   struct sqlite_conn *conn = NULL;
-  int i;
+  char **dbfiles, *dbfile;
+  int first,i;
 
   /* decode/encode image data before going into the sqlite write lock */
   for (i = 0; i < ntiles; i++) {
@@ -739,20 +1093,29 @@ static void _mapcache_cache_mbtiles_multi_set(mapcache_context *ctx, mapcache_ti
       GC_CHECK_ERROR(ctx);
     }
   }
-  conn = _sqlite_get_conn(ctx, &tiles[0], 0);
+  dbfiles = _sqlite_batch_dbfiles(ctx, (mapcache_cache_sqlite*)pcache, NULL, tiles, ntiles);
+  GC_CHECK_ERROR(ctx);
 
-  sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
-  for (i = 0; i < ntiles; i++) {
-    mapcache_tile *tile = &tiles[i];
-    _single_mbtile_set(ctx,tile,conn);
-    if(GC_HAS_ERROR(ctx)) break;
-  }
-  if (GC_HAS_ERROR(ctx)) {
-    sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
-  } else {
-    sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+  for (first = 0; first < ntiles; first++) {
+    if(!dbfiles[first]) continue; /* already stored */
+    dbfile = dbfiles[first];
+    conn = _sqlite_get_dbfile_conn(ctx, (mapcache_cache_sqlite*)pcache, dbfile, 0);
+    GC_CHECK_ERROR(ctx);
+    sqlite3_exec(conn->handle, "BEGIN TRANSACTION", 0, 0, 0);
+    for (i = first; i < ntiles; i++) {
+      if(!dbfiles[i] || strcmp(dbfiles[i], dbfile)) continue;
+      _single_mbtile_set(ctx, pcache, &tiles[i],conn);
+      dbfiles[i] = NULL;
+      if(GC_HAS_ERROR(ctx)) break;
+    }
+    if (GC_HAS_ERROR(ctx)) {
+      sqlite3_exec(conn->handle, "ROLLBACK TRANSACTION", 0, 0, 0);
+    } else {
+      sqlite3_exec(conn->handle, "END TRANSACTION", 0, 0, 0);
+    }
+    _sqlite_release_conn(ctx, pcache, &tiles[first], conn);
+    GC_CHECK_ERROR(ctx);
   }
-  _sqlite_release_conn(ctx, &tiles[0], conn);
 }
 
 static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx, ezxml_t node, mapcache_cache *cache, mapcache_cfg *config)
@@ -790,6 +1153,46 @@ static void _mapcache_cache_sqlite_configuration_parse_xml(mapcache_context *ctx
       cur_node = cur_node->next;
     }
   }
+  if ((cur_node = ezxml_child(node, "read_heavy")) != NULL) {
+    if (!strcasecmp(cur_node->txt, "true")) {
+      dcache->read_heavy = 1;
+    } else if (strcasecmp(cur_node->txt, "false")) {
+      ctx->set_error(ctx, 400, "failed to parse read_heavy \"%s\" for sqlite cache \"%s\". Expecting true or false",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "pool_soft_max")) != NULL) {
+    char *endptr;
+    dcache->ro_soft_max = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->ro_soft_max < 0) {
+      ctx->set_error(ctx, 400, "failed to parse pool_soft_max \"%s\" for sqlite cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node, "pool_hard_max")) != NULL) {
+    char *endptr;
+    dcache->ro_hard_max = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->ro_hard_max <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse pool_hard_max \"%s\" for sqlite cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
+  if(dcache->ro_soft_max > dcache->ro_hard_max) {
+    ctx->set_error(ctx, 400, "sqlite cache \"%s\" has a pool_soft_max larger than its pool_hard_max", cache->name);
+    return;
+  }
+  if ((cur_node = ezxml_child(node, "max_open_dbfiles")) != NULL) {
+    char *endptr;
+    dcache->max_open_dbfiles = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || dcache->max_open_dbfiles <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse max_open_dbfiles \"%s\" for sqlite cache \"%s\". Expecting a positive integer",
+                     cur_node->txt, cache->name);
+      return;
+    }
+  }
   if (!dcache->dbfile) {
     ctx->set_error(ctx, 500, "sqlite cache \"%s\" is missing <dbfile> entry", cache->name);
     return;
@@ -849,6 +1252,7 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
   cache->cache.type = MAPCACHE_CACHE_SQLITE;
   cache->cache.tile_delete = _mapcache_cache_sqlite_delete;
   cache->cache.tile_get = _mapcache_cache_sqlite_get;
+  cache->cache.tile_multi_get = _mapcache_cache_sqlite_multi_get;
   cache->cache.tile_exists = _mapcache_cache_sqlite_has_tile;
   cache->cache.tile_set = _mapcache_cache_sqlite_set;
   cache->cache.tile_multi_set = _mapcache_cache_sqlite_multi_set;
@@ -866,6 +1270,9 @@ mapcache_cache* mapcache_cache_sqlite_create(mapcache_context *ctx)
                                        "delete from tiles where x=:x and y=:y and z=:z and dim=:dim and tileset=:tileset and grid=:grid");
   cache->n_prepared_statements = 4;
   cache->bind_stmt = _bind_sqlite_params;
+  cache->ro_soft_max = 10;
+  cache->ro_hard_max = 200;
+  cache->max_open_dbfiles = 64;
   return (mapcache_cache*) cache;
 }
 
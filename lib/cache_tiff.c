@@ -33,6 +33,10 @@
 #include <apr_file_info.h>
 #include <apr_strings.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
 #include <string.h>
 #include <errno.h>
 #include <stdlib.h>
@@ -52,6 +56,11 @@
 #define MyTIFFClose TIFFClose
 #endif
 
+#ifndef MAPCACHE_TIFF_INDEX_MAX_ENTRIES
+/* number of tiff files whose index each process keeps in memory */
+#define MAPCACHE_TIFF_INDEX_MAX_ENTRIES 1024
+#endif
+
 
 /**
  * \brief return filename for given tile
@@ -61,79 +70,33 @@
  * \param r
  * \private \memberof mapcache_cache_tiff
  */
-static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_tile *tile, char **path)
+static void _mapcache_cache_tiff_tile_key(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, char **path)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  *path = dcache->filename_template;
-
-  /*
-   * generic template substitutions
-   */
-  if(strstr(*path,"{tileset}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{tileset}",
-                                      tile->tileset->name);
-  if(strstr(*path,"{grid}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{grid}",
-                                      tile->grid_link->grid->name);
-  if(tile->dimensions && strstr(*path,"{dim}")) {
-    char *dimstring="";
+  char *dimstring = NULL;
+  if(tile->dimensions && dcache->template->has_dim) {
     const apr_array_header_t *elts = apr_table_elts(tile->dimensions);
     int i = elts->nelts;
+    dimstring = "";
     while(i--) {
       apr_table_entry_t *entry = &(APR_ARRAY_IDX(elts,i,apr_table_entry_t));
       const char *dimval = mapcache_util_str_sanitize(ctx->pool,entry->val,"/.",'#');
       dimstring = apr_pstrcat(ctx->pool,dimstring,"#",dimval,NULL);
     }
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{dim}", dimstring);
   }
-
-
-  while(strstr(*path,"{z}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{z}",
-                                      apr_psprintf(ctx->pool,dcache->z_fmt,tile->z));
-  /*
-   * x and y replacing, when the tiff files are numbered with an increasing
-   * x,y scheme (adjacent tiffs have x-x'=1 or y-y'=1
-   */
-  while(strstr(*path,"{div_x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{div_x}",
-                                      apr_psprintf(ctx->pool,dcache->div_x_fmt,tile->x/dcache->count_x));
-  while(strstr(*path,"{div_y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{div_y}",
-                                      apr_psprintf(ctx->pool,dcache->div_y_fmt,tile->y/dcache->count_y));
-  while(strstr(*path,"{inv_div_y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_y}",
-                                      apr_psprintf(ctx->pool,dcache->inv_div_y_fmt,(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y));
-  while(strstr(*path,"{inv_div_x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_div_x}",
-                                      apr_psprintf(ctx->pool,dcache->inv_div_x_fmt,(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x));
-
   /*
-   * x and y replacing, when the tiff files are numbered with the index
-   * of their bottom-left tile
-   * adjacent tiffs have x-x'=count_x or y-y'=count_y
+   * {x},{y},{inv_x},{inv_y} are the index of the bottom-left tile of the tiff file, i.e.
+   * adjacent tiffs have x-x'=count_x or y-y'=count_y. {div_x},{div_y},{inv_div_x},{inv_div_y}
+   * number the tiff files with an increasing x,y scheme, i.e. adjacent tiffs have x-x'=1 or y-y'=1
    */
-  while(strstr(*path,"{x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{x}",
-                                      apr_psprintf(ctx->pool,dcache->x_fmt,tile->x/dcache->count_x*dcache->count_x));
-  while(strstr(*path,"{y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{y}",
-                                      apr_psprintf(ctx->pool,dcache->y_fmt,tile->y/dcache->count_y*dcache->count_y));
-  while(strstr(*path,"{inv_y}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_y}",
-                                      apr_psprintf(ctx->pool,dcache->inv_y_fmt,(tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1)/dcache->count_y*dcache->count_y));
-  while(strstr(*path,"{inv_x}"))
-    *path = mapcache_util_str_replace(ctx->pool,*path, "{inv_x}",
-                                      apr_psprintf(ctx->pool,dcache->inv_x_fmt,(tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1)/dcache->count_x*dcache->count_y));
+  *path = mapcache_key_template_render(ctx, dcache->template, tile, dimstring);
   if(!*path) {
     ctx->set_error(ctx,500, "failed to allocate tile key");
   }
 }
 
 #ifdef DEBUG
-static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
+static void check_tiff_format(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile, TIFF *hTIFF, const char *filename)
 {
-  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   uint32 imwidth,imheight,tilewidth,tileheight;
   int16 planarconfig,orientation;
   uint16 compression;
@@ -212,80 +175,355 @@ static void check_tiff_format(mapcache_context *ctx, mapcache_tile *tile, TIFF *
 }
 #endif
 
-static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_tile *tile)
-{
+/*
+ * per-process index of the tiff files that were read from: the tile offsets, sizes and
+ * jpeg tables of the file's main directory. an entry is only used while the file's
+ * modification time and size are unchanged, so that tiles served from a hot file only
+ * require a stat and a single read of the jpeg data.
+ */
+typedef struct _tiff_index _tiff_index;
+struct _tiff_index {
   char *filename;
-  TIFF *hTIFF;
-  mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
-  if(GC_HAS_ERROR(ctx)) {
-    return MAPCACHE_FALSE;
+  apr_time_t mtime;
+  apr_off_t fsize;
+  int ntiles;
+  toff_t *offsets;
+  toff_t *sizes;
+  uint32 jpegtable_size;
+  unsigned char *jpegtable;
+  _tiff_index *prev, *next; /* most recently used first */
+};
+
+typedef struct {
+  apr_pool_t *pool;
+  apr_hash_t *table;
+  _tiff_index *head, *tail;
+  int count;
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+} _tiff_indexes;
+
+static _tiff_indexes *tiff_indexes = NULL;
+
+static void _tiff_index_unlink(_tiff_indexes *indexes, _tiff_index *index)
+{
+  if(index->prev) index->prev->next = index->next;
+  else indexes->head = index->next;
+  if(index->next) index->next->prev = index->prev;
+  else indexes->tail = index->prev;
+  index->prev = index->next = NULL;
+}
+
+static void _tiff_index_remove(_tiff_indexes *indexes, _tiff_index *index)
+{
+  _tiff_index_unlink(indexes, index);
+  apr_hash_set(indexes->table, index->filename, APR_HASH_KEY_STRING, NULL);
+  indexes->count--;
+  free(index);
+}
+
+static apr_status_t _tiff_indexes_cleanup(void *data)
+{
+  _tiff_indexes *indexes = (_tiff_indexes*)data;
+  while(indexes->head) {
+    _tiff_index *index = indexes->head;
+    indexes->head = index->next;
+    free(index);
   }
-  hTIFF = MyTIFFOpen(filename,"r");
+  apr_pool_destroy(indexes->pool);
+  if(tiff_indexes == indexes)
+    tiff_indexes = NULL;
+  return APR_SUCCESS;
+}
 
-  if(hTIFF) {
-    do {
-      uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+static _tiff_indexes* _tiff_get_indexes(mapcache_context *ctx)
+{
+  if(tiff_indexes)
+    return tiff_indexes;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!tiff_indexes) {
+    /* the index table grows while serving requests, so it does not use the process pool */
+    _tiff_indexes *indexes = apr_pcalloc(ctx->process_pool, sizeof(_tiff_indexes));
+    apr_pool_create(&indexes->pool, NULL);
+    indexes->table = apr_hash_make(indexes->pool);
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_create(&indexes->mutex, APR_THREAD_MUTEX_DEFAULT, indexes->pool);
+#endif
+    apr_pool_cleanup_register(ctx->process_pool, indexes, _tiff_indexes_cleanup, apr_pool_cleanup_null);
+    tiff_indexes = indexes;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return tiff_indexes;
+}
 
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
+static void _tiff_indexes_lock(_tiff_indexes *indexes)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_lock(indexes->mutex);
+#endif
+}
 
-      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-        nSubType = 0;
+static void _tiff_indexes_unlock(_tiff_indexes *indexes)
+{
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_unlock(indexes->mutex);
+#endif
+}
 
-      /* skip overviews and masks */
-      if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
-          (nSubType & FILETYPE_MASK) )
-        continue;
+/* forgets the index of a tiff file that was written to by this process */
+static void _tiff_index_invalidate(const char *filename)
+{
+  _tiff_indexes *indexes = tiff_indexes;
+  _tiff_index *index;
+  if(!indexes)
+    return;
+  _tiff_indexes_lock(indexes);
+  index = apr_hash_get(indexes->table, filename, APR_HASH_KEY_STRING);
+  if(index)
+    _tiff_index_remove(indexes, index);
+  _tiff_indexes_unlock(indexes);
+}
 
+/* the index of the tile inside the list of tiles of its tiff file */
+static int _tiff_tile_offset(mapcache_cache_tiff *dcache, mapcache_tile *tile)
+{
+  /*
+   * compute the width and height of the full tiff file. This
+   * is not simply the tile size times the number of tiles per
+   * file for lower zoom levels
+   */
+  mapcache_grid_level *level = tile->grid_link->grid->levels[tile->z];
+  int ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
+  int ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
+
+  /* x offset of the tile along a row */
+  int tiff_offx = tile->x % ntilesx;
+
+  /*
+   * y offset of the requested row. we inverse it as the rows are ordered
+   * from top to bottom, whereas the tile y is bottom to top
+   */
+  int tiff_offy = ntilesy - (tile->y % ntilesy) -1;
+  return tiff_offy * ntilesx + tiff_offx;
+}
+
+/*
+ * reads the tile offsets, sizes and jpeg tables of a tiff file. returns NULL if the file
+ * could not be opened or only contains overviews, or on error
+ */
+static _tiff_index* _tiff_index_load(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                                     const char *filename, apr_finfo_t *finfo)
+{
+  TIFF *hTIFF = MyTIFFOpen(filename,"r");
+
+  /*
+   * we currrently have no way of knowing if the opening failed because the tif
+   * file does not exist (which is not an error condition, as it only signals
+   * that the requested tile does not exist in the cache), or if an other error
+   * that should be signaled occured (access denied, not a tiff file, etc...)
+   *
+   * we ignore this case here and hope that further parts of the code will be
+   * able to detect what's happening more precisely
+   */
+  if(!hTIFF)
+    return NULL;
+
+  do {
+    uint32 nSubType = 0;
+    toff_t *offsets=NULL, *sizes=NULL;
+    uint32 jpegtable_size = 0;
+    unsigned char* jpegtable_ptr = NULL;
+    int ntiles, filenamelen;
+    _tiff_index *index;
+
+    if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
+      nSubType = 0;
+
+    /* skip overviews and masks */
+    if( (nSubType & FILETYPE_REDUCEDIMAGE) ||
+        (nSubType & FILETYPE_MASK) )
+      continue;
 
 #ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
+    check_tiff_format(ctx,dcache,tile,hTIFF,filename);
+    if(GC_HAS_ERROR(ctx)) {
+      MyTIFFClose(hTIFF);
+      return NULL;
+    }
 #endif
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
-
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
-      if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes )) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FALSE;
-      }
+
+    /* get the offset of the jpeg data from the start of the file for each tile */
+    if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets )) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
+                     filename);
       MyTIFFClose(hTIFF);
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        return MAPCACHE_TRUE;
-      } else {
-        return MAPCACHE_FALSE;
-      }
-    } while( TIFFReadDirectory( hTIFF ) );
-    return MAPCACHE_FALSE; /* TIFF only contains overviews ? */
-  } else
+      return NULL;
+    }
+
+    /* get the size of the jpeg data for each tile */
+    if(1 != TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes )) {
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
+                     filename);
+      MyTIFFClose(hTIFF);
+      return NULL;
+    }
+
+    /* the jpeg header common to all tiles. a file without any tile may not have one yet */
+    if(1 != TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr ) || !jpegtable_ptr) {
+      jpegtable_size = 0;
+    }
+
+    ntiles = TIFFNumberOfTiles(hTIFF);
+    filenamelen = strlen(filename) + 1;
+    index = malloc(sizeof(_tiff_index) + 2 * ntiles * sizeof(toff_t) + jpegtable_size + filenamelen);
+    if(!index) {
+      ctx->set_error(ctx,500,"failed to allocate index of TIFF file \"%s\"", filename);
+      MyTIFFClose(hTIFF);
+      return NULL;
+    }
+    index->offsets = (toff_t*)(index + 1);
+    index->sizes = index->offsets + ntiles;
+    index->jpegtable = (unsigned char*)(index->sizes + ntiles);
+    index->filename = (char*)index->jpegtable + jpegtable_size;
+    index->ntiles = ntiles;
+    index->jpegtable_size = jpegtable_size;
+    index->mtime = finfo->mtime;
+    index->fsize = finfo->size;
+    index->prev = index->next = NULL;
+    memcpy(index->offsets, offsets, ntiles * sizeof(toff_t));
+    memcpy(index->sizes, sizes, ntiles * sizeof(toff_t));
+    if(jpegtable_size)
+      memcpy(index->jpegtable, jpegtable_ptr, jpegtable_size);
+    memcpy(index->filename, filename, filenamelen);
+    MyTIFFClose(hTIFF);
+    return index;
+  } /* loop through the tiff directories if there are multiple ones */
+  while( TIFFReadDirectory( hTIFF ) );
+
+  /*
+   * should not happen?
+   * finished looping through directories and didn't find anything suitable.
+   * does the file only contain overviews?
+   */
+  MyTIFFClose(hTIFF);
+  return NULL;
+}
+
+/**
+ * \brief locate a tile inside its tiff file
+ *
+ * sets the offset and size of the tile's jpeg data inside the file, using the index of
+ * the file if it is up to date. if data is not NULL, it is set to a buffer containing
+ * the jpeg header of the file, with room for the tile's jpeg body.
+ * \returns MAPCACHE_CACHE_MISS if the file does not exist or does not contain the tile
+ * \private \memberof mapcache_cache_tiff
+ */
+static int _tiff_locate_tile(mapcache_context *ctx, mapcache_cache_tiff *dcache, mapcache_tile *tile,
+                             const char *filename, toff_t *offset, toff_t *size, mapcache_buffer **data)
+{
+  apr_finfo_t finfo;
+  _tiff_indexes *indexes;
+  _tiff_index *index;
+  int tiff_off = _tiff_tile_offset(dcache, tile);
+
+  if(apr_stat(&finfo, filename, APR_FINFO_MTIME|APR_FINFO_SIZE, ctx->pool) != APR_SUCCESS) {
+    return MAPCACHE_CACHE_MISS;
+  }
+  /*
+   * extract the file modification time. this isn't guaranteed to be the
+   * modification time of the actual tile, but it's the best we can do
+   */
+  tile->mtime = finfo.mtime;
+
+  indexes = _tiff_get_indexes(ctx);
+  _tiff_indexes_lock(indexes);
+  index = apr_hash_get(indexes->table, filename, APR_HASH_KEY_STRING);
+  if(index && (index->mtime != finfo.mtime || index->fsize != finfo.size)) {
+    _tiff_index_remove(indexes, index);
+    index = NULL;
+  }
+  if(!index) {
+    _tiff_index *existing;
+    /* don't hold the lock while parsing the file */
+    _tiff_indexes_unlock(indexes);
+    index = _tiff_index_load(ctx, dcache, tile, filename, &finfo);
+    if(!index) {
+      return GC_HAS_ERROR(ctx)?MAPCACHE_FAILURE:MAPCACHE_CACHE_MISS;
+    }
+    _tiff_indexes_lock(indexes);
+    existing = apr_hash_get(indexes->table, filename, APR_HASH_KEY_STRING);
+    if(existing)
+      _tiff_index_remove(indexes, existing);
+    apr_hash_set(indexes->table, index->filename, APR_HASH_KEY_STRING, index);
+    indexes->count++;
+    while(indexes->count > MAPCACHE_TIFF_INDEX_MAX_ENTRIES) {
+      _tiff_index_remove(indexes, indexes->tail);
+    }
+  } else {
+    _tiff_index_unlink(indexes, index);
+  }
+  index->next = indexes->head;
+  if(indexes->head) indexes->head->prev = index;
+  indexes->head = index;
+  if(!indexes->tail) indexes->tail = index;
+
+  /*
+   * the tile data exists for the given tiff_off if both offsets and size
+   * are not zero for that index.
+   * if not, the tiff file is sparse and is missing the requested tile
+   */
+  if(tiff_off >= index->ntiles || !index->offsets[tiff_off] || !index->sizes[tiff_off]) {
+    _tiff_indexes_unlock(indexes);
+    return MAPCACHE_CACHE_MISS;
+  }
+  *offset = index->offsets[tiff_off];
+  *size = index->sizes[tiff_off];
+  if(data) {
+    if(!index->jpegtable_size) {
+      /* there is no common jpeg header in the tiff tags */
+      _tiff_indexes_unlock(indexes);
+      ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
+                     filename);
+      return MAPCACHE_FAILURE;
+    }
+    /* create a memory buffer to contain the jpeg data */
+    *data = mapcache_buffer_create((index->jpegtable_size+*size-4),ctx->pool);
+
+    /*
+     * copy the jpeg header to the beginning of the memory buffer,
+     * omitting the last 2 bytes
+     */
+    memcpy((*data)->buf,index->jpegtable,(index->jpegtable_size-2));
+    (*data)->size = index->jpegtable_size-2;
+  }
+  _tiff_indexes_unlock(indexes);
+  return MAPCACHE_SUCCESS;
+}
+
+static int _mapcache_cache_tiff_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  toff_t offset, size;
+  mapcache_cache_tiff *dcache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
+  if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
+  }
+  if(_tiff_locate_tile(ctx, dcache, tile, filename, &offset, &size, NULL) == MAPCACHE_SUCCESS) {
+    return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
 }
 
-static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   ctx->set_error(ctx,500,"TIFF cache tile deleting not implemented");
 }
@@ -298,14 +536,18 @@ static void _mapcache_cache_tiff_delete(mapcache_context *ctx, mapcache_tile *ti
  * \private \memberof mapcache_cache_tiff
  * \sa mapcache_cache::tile_get()
  */
-static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   char *filename;
-  TIFF *hTIFF = NULL;
   int rv;
+  toff_t offset, size;
+  apr_file_t *f;
+  apr_status_t ret;
+  apr_off_t off;
+  apr_size_t bytes;
   mapcache_cache_tiff *dcache;
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
+  dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
   if(GC_HAS_ERROR(ctx)) {
     return MAPCACHE_FALSE;
   }
@@ -314,227 +556,72 @@ static int _mapcache_cache_tiff_get(mapcache_context *ctx, mapcache_tile *tile)
            tile->x,tile->y,tile->z,filename);
 #endif
 
-  hTIFF = MyTIFFOpen(filename,"r");
+  rv = _tiff_locate_tile(ctx, dcache, tile, filename, &offset, &size, &tile->encoded_data);
+  if(rv != MAPCACHE_SUCCESS) {
+    return rv;
+  }
 
   /*
-   * we currrently have no way of knowing if the opening failed because the tif
-   * file does not exist (which is not an error condition, as it only signals
-   * that the requested tile does not exist in the cache), or if an other error
-   * that should be signaled occured (access denied, not a tiff file, etc...)
-   *
-   * we ignore this case here and hope that further parts of the code will be
-   * able to detect what's happening more precisely
+   * open the tiff file directly to access the jpeg image data with the given
+   * offset. the data is read in a single call, so the file isn't buffered
    */
+  if((ret=apr_file_open(&f, filename, APR_FOPEN_READ|APR_FOPEN_BINARY,APR_OS_DEFAULT,
+                        ctx->pool)) != APR_SUCCESS) {
+    /* the file was removed since it was indexed */
+    return MAPCACHE_CACHE_MISS;
+  }
 
-  if(hTIFF) {
-    do {
-      uint32 nSubType = 0;
-      int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-      int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
-
-      mapcache_grid_level *level;
-      int ntilesx;
-      int ntilesy;
-      toff_t  *offsets=NULL, *sizes=NULL;
-
-      if( !TIFFGetField(hTIFF, TIFFTAG_SUBFILETYPE, &nSubType) )
-        nSubType = 0;
-
-      /* skip overviews */
-      if( nSubType & FILETYPE_REDUCEDIMAGE )
-        continue;
-
-
-#ifdef DEBUG
-      check_tiff_format(ctx,tile,hTIFF,filename);
-      if(GC_HAS_ERROR(ctx)) {
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
-#endif
-      /*
-       * compute the width and height of the full tiff file. This
-       * is not simply the tile size times the number of tiles per
-       * file for lower zoom levels
-       */
-      level = tile->grid_link->grid->levels[tile->z];
-      ntilesx = MAPCACHE_MIN(dcache->count_x, level->maxx);
-      ntilesy = MAPCACHE_MIN(dcache->count_y, level->maxy);
-
-      /* x offset of the tile along a row */
-      tiff_offx = tile->x % ntilesx;
-
-      /*
-       * y offset of the requested row. we inverse it as the rows are ordered
-       * from top to bottom, whereas the tile y is bottom to top
-       */
-      tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-      tiff_off = tiff_offy * ntilesx + tiff_offx;
-
-      /* get the offset of the jpeg data from the start of the file for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEOFFSETS, &offsets );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile offsets",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
-
-      /* get the size of the jpeg data for each tile */
-      rv = TIFFGetField( hTIFF, TIFFTAG_TILEBYTECOUNTS, &sizes );
-      if( rv != 1 ) {
-        ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" tile sizes",
-                       filename);
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_FAILURE;
-      }
-
-      /*
-       * the tile data exists for the given tiff_off if both offsets and size
-       * are not zero for that index.
-       * if not, the tiff file is sparse and is missing the requested tile
-       */
-      if( offsets[tiff_off] > 0 && sizes[tiff_off] > 0 ) {
-        apr_file_t *f;
-        apr_finfo_t finfo;
-        apr_status_t ret;
-
-        /* read the jpeg header (common to all tiles) */
-        uint32 jpegtable_size = 0;
-        unsigned char* jpegtable_ptr;
-        rv = TIFFGetField( hTIFF, TIFFTAG_JPEGTABLES, &jpegtable_size, &jpegtable_ptr );
-        if( rv != 1 || !jpegtable_ptr || !jpegtable_size) {
-          /* there is no common jpeg header in the tiff tags */
-          ctx->set_error(ctx,500,"Failed to read TIFF file \"%s\" jpeg table",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-
-        /*
-         * open the tiff file directly to access the jpeg image data with the given
-         * offset
-         */
-        if((ret=apr_file_open(&f, filename,
-                              APR_FOPEN_READ|APR_FOPEN_BUFFERED|APR_FOPEN_BINARY,APR_OS_DEFAULT,
-                              ctx->pool)) == APR_SUCCESS) {
-          char *bufptr;
-          apr_off_t off;
-          apr_size_t bytes;
-          ret = apr_file_info_get(&finfo, APR_FINFO_MTIME, f);
-          if(ret == APR_SUCCESS) {
-            /*
-             * extract the file modification time. this isn't guaranteed to be the
-             * modification time of the actual tile, but it's the best we can do
-             */
-            tile->mtime = finfo.mtime;
-          }
-
-          /* create a memory buffer to contain the jpeg data */
-          tile->encoded_data = mapcache_buffer_create((jpegtable_size+sizes[tiff_off]-4),ctx->pool);
-
-          /*
-           * copy the jpeg header to the beginning of the memory buffer,
-           * omitting the last 2 bytes
-           */
-          memcpy(tile->encoded_data->buf,jpegtable_ptr,(jpegtable_size-2));
-
-          /* advance the data pointer to after the header data */
-          bufptr = tile->encoded_data->buf + (jpegtable_size-2);
-
-
-          /* go to the specified offset in the tiff file, plus 2 bytes */
-          off = offsets[tiff_off]+2;
-          apr_file_seek(f,APR_SET,&off);
-
-          /*
-           * copy the jpeg body at the end of the memory buffer, accounting
-           * for the two bytes we omitted in the previous step
-           */
-          bytes = sizes[tiff_off]-2;
-          apr_file_read(f,bufptr,&bytes);
-
-          /* check we have correctly read the requested number of bytes */
-          if(bytes !=  sizes[tiff_off]-2) {
-            ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
-                        (read %d of %d bytes)", filename,bytes,sizes[tiff_off]-2);
-            MyTIFFClose(hTIFF);
-            return MAPCACHE_FAILURE;
-          }
-
-          tile->encoded_data->size = (jpegtable_size+sizes[tiff_off]-4);
-
-          /* finalize and cleanup */
-          apr_file_close(f);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_SUCCESS;
-        } else {
-          /* shouldn't usually happen. we managed to open the file with TIFFOpen,
-           * but apr_file_open failed to do so.
-           * nothing much to do except bail out.
-           */
-          ctx->set_error(ctx,500,"apr_file_open failed on already open tiff file \"%s\", giving up .... ",
-                         filename);
-          MyTIFFClose(hTIFF);
-          return MAPCACHE_FAILURE;
-        }
-      } else {
-        /* sparse tiff file without the requested tile */
-        MyTIFFClose(hTIFF);
-        return MAPCACHE_CACHE_MISS;
-      }
-    } /* loop through the tiff directories if there are multiple ones */
-    while( TIFFReadDirectory( hTIFF ) );
+  /* go to the specified offset in the tiff file, plus 2 bytes */
+  off = offset+2;
+  apr_file_seek(f,APR_SET,&off);
 
-    /*
-     * should not happen?
-     * finished looping through directories and didn't find anything suitable.
-     * does the file only contain overviews?
-     */
-    MyTIFFClose(hTIFF);
-    return MAPCACHE_CACHE_MISS;
+  /*
+   * copy the jpeg body after the header, accounting for the two bytes we
+   * omitted from the header
+   */
+  bytes = size-2;
+  apr_file_read_full(f,tile->encoded_data->buf + tile->encoded_data->size,bytes,&bytes);
+  apr_file_close(f);
+
+  /* check we have correctly read the requested number of bytes */
+  if(bytes != size-2) {
+    ctx->set_error(ctx,500,"failed to read jpeg body in \"%s\".\
+                    (read %d of %d bytes)", filename,(int)bytes,(int)size-2);
+    return MAPCACHE_FAILURE;
   }
-  /* failed to open tiff file */
-  return MAPCACHE_CACHE_MISS;
+
+  tile->encoded_data->size += bytes;
+  return MAPCACHE_SUCCESS;
 }
 
 /**
- * \brief write tile data to tiff
+ * \brief write tiles to a tiff file
  *
- * writes the content of mapcache_tile::data to tiff.
- * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
- * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * writes the given tiles, which must all be stored in the given file, with a
+ * single lock, open and close of the file.
  * \private \memberof mapcache_cache_tiff
- * \sa mapcache_cache::tile_set()
  */
-static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tiff_write(mapcache_context *ctx, mapcache_cache_tiff *dcache, char *filename,
+                                       mapcache_tile **tiles, int ntiles)
 {
 #ifdef USE_TIFF_WRITE
-  char *filename;
   TIFF *hTIFF = NULL;
   int rv;
   int create;
   char errmsg[120];
-  mapcache_cache_tiff *dcache;
   mapcache_image_format_jpeg *format;
   char *hackptr1,*hackptr2;
   int tilew;
   int tileh;
   unsigned char *rgb;
-  int r,c;
+  int r,c,i;
   apr_finfo_t finfo;
   mapcache_grid_level *level;
   int ntilesx;
   int ntilesy;
-  int tiff_offx, tiff_offy; /* the x and y offset of the tile inside the tiff image */
-  int tiff_off; /* the index of the tile inside the list of tiles of the tiff image */
+  mapcache_tile *tile = tiles[0];
 
-  _mapcache_cache_tiff_tile_key(ctx, tile, &filename);
-  dcache = (mapcache_cache_tiff*)tile->tileset->cache;
   format = (mapcache_image_format_jpeg*) dcache->format;
-  if(GC_HAS_ERROR(ctx)) {
-    return;
-  }
 #ifdef DEBUG
   ctx->log(ctx,MAPCACHE_DEBUG,"tile write (%d,%d,%d) => filename %s)",
            tile->x,tile->y,tile->z,filename);
@@ -568,22 +655,11 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
   tilew = tile->grid_link->grid->tile_sx;
   tileh = tile->grid_link->grid->tile_sy;
 
-  if(!tile->raw_image) {
-    tile->raw_image = mapcache_imageio_decode(ctx, tile->encoded_data);
-    GC_CHECK_ERROR(ctx);
-  }
-
-  /* remap xrgb to rgb */
-  rgb = (unsigned char*)malloc(tilew*tileh*3);
-  for(r=0; r<tile->raw_image->h; r++) {
-    unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
-    unsigned char *rgbptr = rgb + r * tilew * 3;
-    for(c=0; c<tile->raw_image->w; c++) {
-      rgbptr[0] = imptr[2];
-      rgbptr[1] = imptr[1];
-      rgbptr[2] = imptr[0];
-      rgbptr += 3;
-      imptr += 4;
+  /* decode the tiles before going into the file lock */
+  for(i=0; i<ntiles; i++) {
+    if(!tiles[i]->raw_image) {
+      tiles[i]->raw_image = mapcache_imageio_decode(ctx, tiles[i]->encoded_data);
+      GC_CHECK_ERROR(ctx);
     }
   }
 
@@ -591,7 +667,8 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
    * aquire a lock on the tiff file.
    */
 
-  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE);
+  while(mapcache_lock_or_wait_for_resource(ctx,filename) == MAPCACHE_FALSE && !GC_HAS_ERROR(ctx));
+  GC_CHECK_ERROR(ctx);
 
   /* check if the tiff file exists already */
   rv = apr_stat(&finfo,filename,0,ctx->pool);
@@ -702,21 +779,31 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
   }
   TIFFSetField( hTIFF, TIFFTAG_JPEGCOLORMODE, JPEGCOLORMODE_RGB );
 
-  /* x offset of the tile along a row */
-  tiff_offx = tile->x % ntilesx;
-
-  /*
-   * y offset of the requested row. we inverse it as the rows are ordered
-   * from top to bottom, whereas the tile y is bottom to top
-   */
-  tiff_offy = ntilesy - (tile->y % ntilesy) -1;
-  tiff_off = tiff_offy * ntilesx + tiff_offx;
-
+  rgb = (unsigned char*)malloc(tilew*tileh*3);
+  for(i=0; i<ntiles; i++) {
+    tile = tiles[i];
+
+    /* remap xrgb to rgb */
+    for(r=0; r<tile->raw_image->h; r++) {
+      unsigned char *imptr = tile->raw_image->data + r * tile->raw_image->stride;
+      unsigned char *rgbptr = rgb + r * tilew * 3;
+      for(c=0; c<tile->raw_image->w; c++) {
+        rgbptr[0] = imptr[2];
+        rgbptr[1] = imptr[1];
+        rgbptr[2] = imptr[0];
+        rgbptr += 3;
+        imptr += 4;
+      }
+    }
 
-  rv = TIFFWriteEncodedTile(hTIFF, tiff_off, rgb, tilew*tileh*3);
+    rv = TIFFWriteEncodedTile(hTIFF, _tiff_tile_offset(dcache, tile), rgb, tilew*tileh*3);
+    if(!rv) {
+      ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
+      break;
+    }
+  }
   free(rgb);
-  if(!rv) {
-    ctx->set_error(ctx,500,"failed TIFFWriteEncodedTile to %s",filename);
+  if(GC_HAS_ERROR(ctx)) {
     goto close_tiff;
   }
   rv = TIFFWriteCheck( hTIFF, 1, "cache_set()");
@@ -736,11 +823,62 @@ static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_tile *tile)
 close_tiff:
   if(hTIFF)
     MyTIFFClose(hTIFF);
+  _tiff_index_invalidate(filename);
   mapcache_unlock_resource(ctx,filename);
 #else
   ctx->set_error(ctx,500,"tiff write support disabled by default");
 #endif
+}
 
+/**
+ * \brief write tile data to tiff
+ *
+ * writes the content of mapcache_tile::data to tiff.
+ * \returns MAPCACHE_FAILURE if there is no data to write, or if the tile isn't locked
+ * \returns MAPCACHE_SUCCESS if the tile has been successfully written to tiff
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_set()
+ */
+static void _mapcache_cache_tiff_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
+{
+  char *filename;
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)pcache;
+  _mapcache_cache_tiff_tile_key(ctx, dcache, tile, &filename);
+  GC_CHECK_ERROR(ctx);
+  _mapcache_cache_tiff_write(ctx, dcache, filename, &tile, 1);
+}
+
+/**
+ * \brief write the tiles of a metatile to tiff
+ *
+ * the tiles stored in the same tiff file are written with a single lock, open and
+ * close of the file.
+ * \private \memberof mapcache_cache_tiff
+ * \sa mapcache_cache::tile_multi_set()
+ */
+static void _mapcache_cache_tiff_multi_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tiles, int ntiles)
+{
+  mapcache_cache_tiff *dcache = (mapcache_cache_tiff*)pcache;
+  char **filenames = apr_palloc(ctx->pool, ntiles * sizeof(char*));
+  mapcache_tile **filetiles = apr_palloc(ctx->pool, ntiles * sizeof(mapcache_tile*));
+  int first, i, nfiletiles;
+  for(i=0; i<ntiles; i++) {
+    _mapcache_cache_tiff_tile_key(ctx, dcache, &tiles[i], &filenames[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+  for(first=0; first<ntiles; first++) {
+    char *filename = filenames[first];
+    if(!filename) continue; /* already written */
+    nfiletiles = 0;
+    for(i=first; i<ntiles; i++) {
+      if(filenames[i] && !strcmp(filenames[i], filename)) {
+        filetiles[nfiletiles++] = &tiles[i];
+        filenames[i] = NULL;
+      }
+    }
+    _mapcache_cache_tiff_write(ctx, dcache, filename, filetiles, nfiletiles);
+    GC_CHECK_ERROR(ctx);
+  }
 }
 
 /**
@@ -834,6 +972,13 @@ static void _mapcache_cache_tiff_configuration_parse_xml(mapcache_context *ctx,
   dcache->format = (mapcache_image_format_jpeg*)pformat;
 }
 
+/* keep the fast path for the placeholders using the default format */
+static void _tiff_template_format(mapcache_cache_tiff *dcache, mapcache_key_token_type type, const char *fmt)
+{
+  if(strcmp(fmt,"%d"))
+    mapcache_key_template_set_format(dcache->template, type, fmt);
+}
+
 /**
  * \private \memberof mapcache_cache_tiff
  */
@@ -850,6 +995,18 @@ static void _mapcache_cache_tiff_configuration_post_config(mapcache_context *ctx
     ctx->set_error(ctx, 400, "tiff cache %s has invalid count (%d,%d)",dcache->count_x,dcache->count_y);
     return;
   }
+  dcache->template = mapcache_key_template_compile(ctx->pool, dcache->filename_template);
+  dcache->template->block_x = dcache->count_x;
+  dcache->template->block_y = dcache->count_y;
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_X, dcache->x_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_Y, dcache->y_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_Z, dcache->z_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_INV_X, dcache->inv_x_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_INV_Y, dcache->inv_y_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_DIV_X, dcache->div_x_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_DIV_Y, dcache->div_y_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_INV_DIV_X, dcache->inv_div_x_fmt);
+  _tiff_template_format(dcache, MAPCACHE_KEY_TOKEN_INV_DIV_Y, dcache->inv_div_y_fmt);
 }
 
 /**
@@ -868,6 +1025,7 @@ mapcache_cache* mapcache_cache_tiff_create(mapcache_context *ctx)
   cache->cache.tile_get = _mapcache_cache_tiff_get;
   cache->cache.tile_exists = _mapcache_cache_tiff_has_tile;
   cache->cache.tile_set = _mapcache_cache_tiff_set;
+  cache->cache.tile_multi_set = _mapcache_cache_tiff_multi_set;
   cache->cache.configuration_post_config = _mapcache_cache_tiff_configuration_post_config;
   cache->cache.configuration_parse_xml = _mapcache_cache_tiff_configuration_parse_xml;
   cache->count_x = 10;
@@ -48,11 +48,11 @@ struct tc_conn {
   TCBDB *bdb;
   int readonly;
 };
-static struct tc_conn _tc_get_conn(mapcache_context *ctx, mapcache_tile* tile, int readonly) {
+static struct tc_conn _tc_get_conn(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile* tile, int readonly) {
   struct tc_conn conn;
   /* create the object */
   conn.bdb = tcbdbnew();
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
 
   /* open the database */
   if(!readonly) {
@@ -86,14 +86,14 @@ static void _tc_release_conn(mapcache_context *ctx, mapcache_tile *tile, struct
   tcbdbdel(conn.bdb);
 }
 
-static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   int ret;
   struct tc_conn conn;
   int nrecords = 0;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,1);
+  conn = _tc_get_conn(ctx,pcache,tile,1);
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FALSE;
   nrecords = tcbdbvnum2(conn.bdb, skey);
   if(nrecords == 0)
@@ -104,25 +104,25 @@ static int _mapcache_cache_tc_has_tile(mapcache_context *ctx, mapcache_tile *til
   return ret;
 }
 
-static void _mapcache_cache_tc_delete(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tc_delete(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,0);
+  conn = _tc_get_conn(ctx,pcache,tile,0);
   GC_CHECK_ERROR(ctx);
   tcbdbout2(conn.bdb, skey);
   _tc_release_conn(ctx,tile,conn);
 }
 
 
-static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile)
+static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   int ret;
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
-  conn = _tc_get_conn(ctx,tile,1);
+  conn = _tc_get_conn(ctx,pcache,tile,1);
   int size;
   if(GC_HAS_ERROR(ctx)) return MAPCACHE_FAILURE;
   tile->encoded_data = mapcache_buffer_create(0,ctx->pool);
@@ -140,13 +140,13 @@ static int _mapcache_cache_tc_get(mapcache_context *ctx, mapcache_tile *tile)
   return ret;
 }
 
-static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_tile *tile)
+static void _mapcache_cache_tc_set(mapcache_context *ctx, mapcache_cache *pcache, mapcache_tile *tile)
 {
   struct tc_conn conn;
-  mapcache_cache_tc *cache = (mapcache_cache_tc*)tile->tileset->cache;
+  mapcache_cache_tc *cache = (mapcache_cache_tc*)pcache;
   char *skey = mapcache_util_get_tile_key(ctx,tile,cache->key_template,NULL,NULL);
   apr_time_t now = apr_time_now();
-  conn = _tc_get_conn(ctx,tile,0);
+  conn = _tc_get_conn(ctx,pcache,tile,0);
   GC_CHECK_ERROR(ctx);
 
   if(!tile->encoded_data) {
@@ -170,9 +170,9 @@ static void _mapcache_cache_tc_configuration_parse_xml(mapcache_context *ctx, ez
     dcache->basedir = apr_pstrdup(ctx->pool,cur_node->txt);
   }
   if ((cur_node = ezxml_child(node,"key_template")) != NULL) {
-    dcache->key_template = apr_pstrdup(ctx->pool,cur_node->txt);
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,cur_node->txt);
   } else {
-    dcache->key_template = apr_pstrdup(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
+    dcache->key_template = mapcache_key_template_compile(ctx->pool,"{tileset}-{grid}-{dim}-{z}-{y}-{x}.{ext}");
   }
   if(!dcache->basedir) {
     ctx->set_error(ctx,500,"tokyocabinet cache \"%s\" is missing <base> entry",cache->name);
@@ -48,33 +48,36 @@ void mapcache_configuration_parse(mapcache_context *ctx, const char *filename, m
   if(!config->lockdir || !strlen(config->lockdir)) {
     config->lockdir = apr_pstrdup(ctx->pool, "/tmp");
   }
-  rv = apr_dir_open(&lockdir,config->lockdir,ctx->pool);
-  if(rv != APR_SUCCESS) {
-    ctx->set_error(ctx,500, "failed to open lock directory %s: %s"
-                   ,config->lockdir,apr_strerror(rv,errmsg,120));
-    return;
-  }
+  /* lockfiles are only used by the disk locker */
+  if(config->locker->type == MAPCACHE_LOCKER_DISK) {
+    rv = apr_dir_open(&lockdir,config->lockdir,ctx->pool);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500, "failed to open lock directory %s: %s"
+                     ,config->lockdir,apr_strerror(rv,errmsg,120));
+      return;
+    }
+
+    /* only remove lockfiles if we're not in cgi mode */
+    if(!cgi) {
+      apr_finfo_t finfo;
+      while ((apr_dir_read(&finfo, APR_FINFO_DIRENT|APR_FINFO_TYPE|APR_FINFO_NAME, lockdir)) == APR_SUCCESS) {
+        if(finfo.filetype == APR_REG) {
+          if(!strncmp(finfo.name, MAPCACHE_LOCKFILE_PREFIX, strlen(MAPCACHE_LOCKFILE_PREFIX))) {
+            ctx->log(ctx,MAPCACHE_WARN,"found old lockfile %s/%s, deleting it",config->lockdir,
+                     finfo.name);
+            rv = apr_file_remove(apr_psprintf(ctx->pool,"%s/%s",config->lockdir, finfo.name),ctx->pool);
+            if(rv != APR_SUCCESS) {
+              ctx->set_error(ctx,500, "failed to remove lockfile %s: %s",finfo.name,apr_strerror(rv,errmsg,120));
+              return;
+            }
 
-  /* only remove lockfiles if we're not in cgi mode */
-  if(!cgi) {
-    apr_finfo_t finfo;
-    while ((apr_dir_read(&finfo, APR_FINFO_DIRENT|APR_FINFO_TYPE|APR_FINFO_NAME, lockdir)) == APR_SUCCESS) {
-      if(finfo.filetype == APR_REG) {
-        if(!strncmp(finfo.name, MAPCACHE_LOCKFILE_PREFIX, strlen(MAPCACHE_LOCKFILE_PREFIX))) {
-          ctx->log(ctx,MAPCACHE_WARN,"found old lockfile %s/%s, deleting it",config->lockdir,
-                   finfo.name);
-          rv = apr_file_remove(apr_psprintf(ctx->pool,"%s/%s",config->lockdir, finfo.name),ctx->pool);
-          if(rv != APR_SUCCESS) {
-            ctx->set_error(ctx,500, "failed to remove lockfile %s: %s",finfo.name,apr_strerror(rv,errmsg,120));
-            return;
           }
 
         }
-
       }
     }
+    apr_dir_close(lockdir);
   }
-  apr_dir_close(lockdir);
 
   /* if we were suppplied with an onlineresource, make sure it ends with a / */
   if(NULL != (url = (char*)apr_table_get(config->metadata,"url"))) {
@@ -89,6 +92,8 @@ void mapcache_configuration_parse(mapcache_context *ctx, const char *filename, m
 void mapcache_configuration_post_config(mapcache_context *ctx, mapcache_cfg *config)
 {
   apr_hash_index_t *cachei = apr_hash_first(ctx->pool,config->caches);
+  config->locker->post_config(ctx,config->locker,config);
+  GC_CHECK_ERROR(ctx);
   while(cachei) {
     mapcache_cache *cache;
     const void *key;
@@ -255,6 +260,8 @@ mapcache_cfg* mapcache_configuration_create(apr_pool_t *pool)
   cfg->loglevel = MAPCACHE_WARN;
   cfg->autoreload = 0;
 
+  cfg->download_threads = 8;
+
   return cfg;
 }
 
@@ -455,6 +455,12 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
   }
   if(!strcmp(type,"disk")) {
     cache = mapcache_cache_disk_create(ctx);
+  } else if(!strcmp(type,"shm")) {
+    cache = mapcache_cache_shm_create(ctx);
+  } else if(!strcmp(type,"bundle")) {
+    cache = mapcache_cache_bundle_create(ctx);
+  } else if(!strcmp(type,"composite")) {
+    cache = mapcache_cache_composite_create(ctx);
   } else if(!strcmp(type,"bdb")) {
 #ifdef USE_BDB
     cache = mapcache_cache_bdb_create(ctx);
@@ -468,6 +474,13 @@ void parseCache(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
 #else
     ctx->set_error(ctx,400, "failed to add cache \"%s\": Tokyo Cabinet support is not available on this build",name);
     return;
+#endif
+  } else if(!strcmp(type,"lmdb")) {
+#ifdef USE_LMDB
+    cache = mapcache_cache_lmdb_create(ctx);
+#else
+    ctx->set_error(ctx,400, "failed to add cache \"%s\": LMDB support is not available on this build",name);
+    return;
 #endif
   } else if(!strcmp(type,"sqlite3")) {
 #ifdef USE_SQLITE
@@ -729,6 +742,7 @@ void parseTileset(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
   }
   if ((cur_node = ezxml_child(node,"auto_expire")) != NULL) {
     char *endptr;
+    const char *attr;
     tileset->auto_expire = (int)strtol(cur_node->txt,&endptr,10);
     if(*endptr != 0) {
       ctx->set_error(ctx, 400, "failed to parse auto_expire %s."
@@ -737,6 +751,16 @@ void parseTileset(mapcache_context *ctx, ezxml_t node, mapcache_cfg *config)
                      cur_node->txt);
       return;
     }
+    if((attr = ezxml_attr(cur_node,"stale_while_revalidate")) != NULL) {
+      tileset->stale_while_revalidate = (int)strtol(attr,&endptr,10);
+      if(*endptr != 0 || tileset->stale_while_revalidate < 0) {
+        ctx->set_error(ctx, 400, "failed to parse auto_expire stale_while_revalidate \"%s\"."
+                       "(expecting a positive integer, "
+                       "eg <auto_expire stale_while_revalidate=\"600\">3600</auto_expire>",
+                       attr);
+        return;
+      }
+    }
   }
 
   if ((cur_node = ezxml_child(node,"metabuffer")) != NULL) {
@@ -1001,13 +1025,40 @@ void mapcache_configuration_parse_xml(mapcache_context *ctx, const char *filenam
     }
   }
 
+  if((node = ezxml_child(doc,"locker")) != NULL) {
+    const char *type = ezxml_attr(node,"type");
+    if(!type || !strcmp(type,"disk")) {
+      config->locker = mapcache_locker_disk_create(ctx);
+    } else if(!strcmp(type,"shm")) {
+      config->locker = mapcache_locker_shm_create(ctx);
+    } else {
+      ctx->set_error(ctx, 400, "unknown locker type \"%s\" (allowed are disk, shm)", type);
+      goto cleanup;
+    }
+    if(GC_HAS_ERROR(ctx)) goto cleanup;
+    config->locker->parse_xml(ctx, config->locker, node);
+    if(GC_HAS_ERROR(ctx)) goto cleanup;
+  } else {
+    config->locker = mapcache_locker_disk_create(ctx);
+  }
+
   if((node = ezxml_child(doc,"threaded_fetching")) != NULL) {
+    const char *max_threads;
     if(!strcasecmp(node->txt,"true")) {
       config->threaded_fetching = 1;
     } else if(strcasecmp(node->txt,"false")) {
       ctx->set_error(ctx, 400, "failed to parse threaded_fetching \"%s\". Expecting true or false",node->txt);
       return;
     }
+    if((max_threads = ezxml_attr(node,"max_threads")) != NULL) {
+      char *endptr;
+      config->download_threads = (int)strtol(max_threads,&endptr,10);
+      if(*endptr != 0 || config->download_threads < 1) {
+        ctx->set_error(ctx, 400, "failed to parse threaded_fetching max_threads \"%s\". Expecting a positive integer",
+                       max_threads);
+        return;
+      }
+    }
   }
 
   if((node = ezxml_child(doc,"log_level")) != NULL) {
@@ -29,6 +29,8 @@
  *****************************************************************************/
 
 #include <apr_strings.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include "mapcache.h"
 #if APR_HAS_THREADS
 #include "apu_version.h"
@@ -44,26 +46,449 @@
 #include <apr_thread_proc.h>
 #else
 #include <apr_thread_pool.h>
+#include <apr_thread_mutex.h>
+#include <apr_thread_cond.h>
+#endif
+
+#if USE_THREADPOOL
+/**
+ * \brief completion tracking for the tiles of a single request pushed to the worker pool
+ */
+typedef struct {
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+  int pending; /* number of pushed tasks that have not completed yet */
+} _thread_batch;
 #endif
 
 typedef struct {
   mapcache_tile *tile;
   mapcache_context *ctx;
   int launch;
+  int ret; /* result of the cache lookup already done for the tile, or -1 */
+#if USE_THREADPOOL
+  _thread_batch *batch;
+#endif
 } _thread_tile;
 
+/* get a tile, without looking it up in the cache again if ret is a known lookup result */
+static void _mapcache_core_tile_get(mapcache_context *ctx, mapcache_tile *tile, int ret)
+{
+  if(ret == -1)
+    mapcache_tileset_tile_get(ctx, tile);
+  else
+    mapcache_tileset_tile_get_after_lookup(ctx, tile, ret);
+}
+
 static void* APR_THREAD_FUNC _thread_get_tile(apr_thread_t *thread, void *data)
 {
   _thread_tile* t = (_thread_tile*)data;
-  mapcache_tileset_tile_get(t->ctx, t->tile);
+  _mapcache_core_tile_get(t->ctx, t->tile, t->ret);
 #if !USE_THREADPOOL
   apr_thread_exit(thread, APR_SUCCESS);
+#else
+  apr_thread_mutex_lock(t->batch->mutex);
+  if(--t->batch->pending == 0) {
+    apr_thread_cond_signal(t->batch->cond);
+  }
+  apr_thread_mutex_unlock(t->batch->mutex);
 #endif
   return NULL;
 }
 
+#if USE_THREADPOOL
+/*
+ * worker pool shared by all the requests handled by this process. It is allocated
+ * from the process pool, and is therefore destroyed along with it (i.e. on apache
+ * child exit, nginx worker exit, or fastcgi configuration reload)
+ */
+static apr_thread_pool_t *prefetch_thread_pool = NULL;
+
+static apr_status_t _prefetch_thread_pool_cleanup(void *data)
+{
+  prefetch_thread_pool = NULL;
+  return APR_SUCCESS;
+}
+
+static apr_thread_pool_t* _get_prefetch_thread_pool(mapcache_context *ctx)
+{
+  apr_status_t rv;
+  if(prefetch_thread_pool)
+    return prefetch_thread_pool;
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+  /* the pool may have been created by another thread while we were waiting for the lock */
+  if(!prefetch_thread_pool) {
+    apr_thread_pool_t *thread_pool;
+    rv = apr_thread_pool_create(&thread_pool, 0, ctx->config->download_threads, ctx->process_pool);
+    if(rv != APR_SUCCESS) {
+      char errmsg[120];
+      ctx->set_error(ctx,500, "failed to create tile fetching thread pool: %s", apr_strerror(rv,errmsg,120));
+    } else {
+      /* keep the started threads alive between requests */
+      apr_thread_pool_idle_max_set(thread_pool, ctx->config->download_threads);
+      apr_pool_cleanup_register(ctx->process_pool, NULL, _prefetch_thread_pool_cleanup, apr_pool_cleanup_null);
+      prefetch_thread_pool = thread_pool;
+    }
+  }
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+  return prefetch_thread_pool;
+}
+#endif
+
 #endif
 
+/* query the source of a map, and decode the returned image so it can be merged */
+static void _mapcache_core_render_map(mapcache_context *ctx, mapcache_map *map)
+{
+  map->tileset->source->render_map(ctx, map);
+  GC_CHECK_ERROR(ctx);
+  if(!map->raw_image) {
+    map->raw_image = mapcache_imageio_decode(ctx,map->encoded_data);
+  }
+}
+
+static void _mapcache_core_merge_map(mapcache_context *ctx, mapcache_map *basemap, mapcache_map *overlaymap)
+{
+  mapcache_image_merge(ctx,basemap->raw_image,overlaymap->raw_image);
+  GC_CHECK_ERROR(ctx);
+  if(!basemap->expires || overlaymap->expires<basemap->expires) basemap->expires = overlaymap->expires;
+}
+
+#if APR_HAS_THREADS && USE_THREADPOOL
+typedef struct {
+  mapcache_map *map;
+  mapcache_context *ctx;
+  int done;
+  _thread_batch *batch;
+} _thread_map;
+
+static void* APR_THREAD_FUNC _thread_render_map(apr_thread_t *thread, void *data)
+{
+  _thread_map* t = (_thread_map*)data;
+  _mapcache_core_render_map(t->ctx, t->map);
+  apr_thread_mutex_lock(t->batch->mutex);
+  t->done = 1;
+  t->batch->pending--;
+  /* wake up the requesting thread for every map, so it can merge them as they arrive */
+  apr_thread_cond_signal(t->batch->cond);
+  apr_thread_mutex_unlock(t->batch->mutex);
+  return NULL;
+}
+
+/**
+ * \brief render the maps concurrently and merge them onto the first one
+ *
+ * the first map is rendered by the calling thread, the other ones by the worker pool.
+ * maps are merged in order as soon as they are available, so the total latency is
+ * that of the slowest source instead of the sum of all of them.
+ */
+static void _mapcache_core_forward_maps_threaded(mapcache_context *ctx, mapcache_map **maps, int nmaps)
+{
+  apr_thread_pool_t *thread_pool;
+  _thread_batch batch;
+  _thread_map *thread_maps;
+  apr_status_t rv;
+  int i;
+
+  thread_pool = _get_prefetch_thread_pool(ctx);
+  GC_CHECK_ERROR(ctx);
+  batch.pending = 0;
+  if(apr_thread_mutex_create(&batch.mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&batch.cond, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx,500, "failed to create thread pool synchronization primitives");
+    return;
+  }
+  thread_maps = (_thread_map*)apr_pcalloc(ctx->pool,nmaps*sizeof(_thread_map));
+  for(i=1; i<nmaps; i++) {
+    thread_maps[i].map = maps[i];
+    thread_maps[i].ctx = ctx->clone(ctx);
+    thread_maps[i].batch = &batch;
+    apr_thread_mutex_lock(batch.mutex);
+    batch.pending++;
+    apr_thread_mutex_unlock(batch.mutex);
+    rv = apr_thread_pool_push(thread_pool, _thread_render_map, (void*)&(thread_maps[i]), APR_THREAD_TASK_PRIORITY_NORMAL, ctx);
+    if(rv != APR_SUCCESS) {
+      /* render it ourselves */
+      apr_thread_mutex_lock(batch.mutex);
+      batch.pending--;
+      apr_thread_mutex_unlock(batch.mutex);
+      _mapcache_core_render_map(thread_maps[i].ctx, maps[i]);
+      thread_maps[i].done = 1;
+    }
+  }
+
+  _mapcache_core_render_map(ctx, maps[0]);
+  for(i=1; i<nmaps && !GC_HAS_ERROR(ctx); i++) {
+    apr_thread_mutex_lock(batch.mutex);
+    while(!thread_maps[i].done) {
+      apr_thread_cond_wait(batch.cond, batch.mutex);
+    }
+    apr_thread_mutex_unlock(batch.mutex);
+    if(GC_HAS_ERROR(thread_maps[i].ctx)) {
+      /* transfer error message from child thread to main context */
+      ctx->set_error(ctx,thread_maps[i].ctx->get_error(thread_maps[i].ctx),
+                     thread_maps[i].ctx->get_error_message(thread_maps[i].ctx));
+      ctx->_blocking = thread_maps[i].ctx->_blocking;
+      break;
+    }
+    _mapcache_core_merge_map(ctx, maps[0], maps[i]);
+  }
+
+  /* tasks still running after an error reference memory from this request: wait for them */
+  apr_thread_mutex_lock(batch.mutex);
+  while(batch.pending > 0) {
+    apr_thread_cond_wait(batch.cond, batch.mutex);
+  }
+  apr_thread_mutex_unlock(batch.mutex);
+  apr_thread_cond_destroy(batch.cond);
+  apr_thread_mutex_destroy(batch.mutex);
+}
+#endif
+
+/**
+ * \brief render the maps from their sources, and merge them onto the first one
+ */
+static void _mapcache_core_forward_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps)
+{
+  int i;
+#if APR_HAS_THREADS && USE_THREADPOOL
+  if(ctx->config->threaded_fetching) {
+    _mapcache_core_forward_maps_threaded(ctx, maps, nmaps);
+    return;
+  }
+#endif
+  _mapcache_core_render_map(ctx, maps[0]);
+  GC_CHECK_ERROR(ctx);
+  for(i=1; i<nmaps; i++) {
+    _mapcache_core_render_map(ctx, maps[i]);
+    GC_CHECK_ERROR(ctx);
+    _mapcache_core_merge_map(ctx, maps[0], maps[i]);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+#if APR_HAS_THREADS && USE_THREADPOOL
+typedef struct {
+  mapcache_task_func task;
+  void *data;
+  int ntasks;
+  int next; /* index of the next task to run */
+  int failed; /* set as soon as a task failed, to stop handing out the remaining ones */
+  int closed; /* set once all the tasks have been claimed, workers starting later exit straight away */
+  int running; /* number of workers currently running tasks */
+  int queued; /* number of workers pushed to the thread pool that have not exited yet */
+  mapcache_context *source; /* the context worker contexts are cloned from, only used under the mutex */
+  apr_thread_mutex_t *mutex;
+  apr_thread_cond_t *cond;
+} _task_group;
+
+typedef struct {
+  _task_group *group;
+  mapcache_context *ctx; /* cloned when the worker first runs a task */
+} _task_worker;
+
+/* run the tasks of the group that have not been claimed yet by another thread */
+static void _mapcache_core_run_task_group(mapcache_context *ctx, _task_group *group)
+{
+  while(1) {
+    int i;
+    apr_thread_mutex_lock(group->mutex);
+    if(GC_HAS_ERROR(ctx)) {
+      group->failed = 1;
+    }
+    i = group->failed ? group->ntasks : group->next++;
+    apr_thread_mutex_unlock(group->mutex);
+    if(i >= group->ntasks)
+      return;
+    group->task(ctx, group->data, i);
+  }
+}
+
+static void* APR_THREAD_FUNC _thread_run_tasks(apr_thread_t *thread, void *data)
+{
+  _task_worker *w = (_task_worker*)data;
+  _task_group *group = w->group;
+  int run = 0;
+  apr_thread_mutex_lock(group->mutex);
+  if(!group->closed && !group->failed && group->next < group->ntasks) {
+    /* the source context's pool is not used by any other thread while we hold the mutex */
+    w->ctx = group->source->clone(group->source);
+    group->running++;
+    run = 1;
+  }
+  apr_thread_mutex_unlock(group->mutex);
+  if(run) {
+    _mapcache_core_run_task_group(w->ctx, group);
+  }
+  apr_thread_mutex_lock(group->mutex);
+  group->running -= run;
+  group->queued--;
+  apr_thread_cond_signal(group->cond);
+  apr_thread_mutex_unlock(group->mutex);
+  return NULL;
+}
+#endif
+
+void mapcache_core_run_tasks(mapcache_context *ctx, mapcache_task_func task, void *data, int ntasks)
+{
+  int i;
+#if APR_HAS_THREADS && USE_THREADPOOL
+  /* contexts that cannot be cloned (e.g. the seeder's, which has its own threads) run the tasks serially */
+  if(ctx->config->threaded_fetching && ntasks > 1 && ctx->clone) {
+    apr_thread_pool_t *thread_pool;
+    _task_group group;
+    _task_worker *workers;
+    int nworkers = ntasks - 1, npushed;
+
+    thread_pool = _get_prefetch_thread_pool(ctx);
+    GC_CHECK_ERROR(ctx);
+    if(nworkers > ctx->config->download_threads)
+      nworkers = ctx->config->download_threads;
+    memset(&group, 0, sizeof(_task_group));
+    group.task = task;
+    group.data = data;
+    group.ntasks = ntasks;
+    if(apr_thread_mutex_create(&group.mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+        apr_thread_cond_create(&group.cond, ctx->pool) != APR_SUCCESS) {
+      ctx->set_error(ctx,500, "failed to create thread pool synchronization primitives");
+      return;
+    }
+    /*
+     * a single clone is made here, the workers clone their own context from it once they
+     * actually start, so that workers which find no task left cost nothing
+     */
+    group.source = ctx->clone(ctx);
+    workers = (_task_worker*)apr_pcalloc(ctx->pool, nworkers*sizeof(_task_worker));
+    for(npushed=0; npushed<nworkers; npushed++) {
+      workers[npushed].group = &group;
+      apr_thread_mutex_lock(group.mutex);
+      group.queued++;
+      apr_thread_mutex_unlock(group.mutex);
+      if(apr_thread_pool_push(thread_pool, _thread_run_tasks, (void*)&(workers[npushed]),
+                              APR_THREAD_TASK_PRIORITY_NORMAL, &group) != APR_SUCCESS) {
+        /* the tasks not picked up by the workers are run by this thread */
+        apr_thread_mutex_lock(group.mutex);
+        group.queued--;
+        apr_thread_mutex_unlock(group.mutex);
+        break;
+      }
+    }
+
+    /* participate until all the tasks have been claimed */
+    _mapcache_core_run_task_group(ctx, &group);
+
+    /* wait for the workers still running their last task */
+    apr_thread_mutex_lock(group.mutex);
+    group.closed = 1;
+    while(group.running > 0) {
+      apr_thread_cond_wait(group.cond, group.mutex);
+    }
+    i = group.queued;
+    apr_thread_mutex_unlock(group.mutex);
+    if(i > 0) {
+      /*
+       * workers that have not started yet, e.g. because all the threads of the pool are
+       * busy, possibly with the caller of this function, are removed from the queue instead
+       * of being waited for. a worker starting meanwhile exits straight away
+       */
+      apr_thread_pool_tasks_cancel(thread_pool, &group);
+    }
+    apr_thread_cond_destroy(group.cond);
+    apr_thread_mutex_destroy(group.mutex);
+
+    for(i=0; i<npushed && !GC_HAS_ERROR(ctx); i++) {
+      if(workers[i].ctx && GC_HAS_ERROR(workers[i].ctx)) {
+        /* transfer error message from child thread to main context */
+        ctx->set_error(ctx,workers[i].ctx->get_error(workers[i].ctx),
+                       workers[i].ctx->get_error_message(workers[i].ctx));
+        ctx->_blocking = workers[i].ctx->_blocking;
+      }
+    }
+    return;
+  }
+#endif
+  for(i=0; i<ntasks; i++) {
+    task(ctx, data, i);
+    GC_CHECK_ERROR(ctx);
+  }
+}
+
+/*
+ * the logger of the server module context references its request, which is gone by the
+ * time a detached task runs. messages are written to stderr instead, which the servers
+ * redirect to their error log
+ */
+static void _mapcache_detached_context_log(mapcache_context *c, mapcache_log_level level, char *message, ...)
+{
+  va_list args;
+  if(!c->config || level >= c->config->loglevel) {
+    va_start(args,message);
+    fprintf(stderr,"mapcache: %s\n",apr_pvsprintf(c->pool,message,args));
+    va_end(args);
+  }
+}
+
+mapcache_context* mapcache_core_detached_context(mapcache_context *ctx)
+{
+  apr_pool_t *pool;
+  mapcache_context *dctx;
+  if(apr_pool_create(&pool, NULL) != APR_SUCCESS)
+    return NULL;
+  dctx = (mapcache_context*)apr_pcalloc(pool, sizeof(mapcache_context));
+  mapcache_context_init(dctx);
+  dctx->pool = pool;
+  dctx->process_pool = ctx->process_pool;
+  dctx->threadlock = ctx->threadlock;
+  dctx->config = ctx->config;
+  dctx->log = _mapcache_detached_context_log;
+  /* no clone: the tasks run by a detached context don't fan out to the worker pool themselves */
+  dctx->clone = NULL;
+  return dctx;
+}
+
+#if APR_HAS_THREADS && USE_THREADPOOL
+typedef struct {
+  mapcache_context *ctx;
+  mapcache_detached_func func;
+  void *data;
+} _detached_task;
+
+static void* APR_THREAD_FUNC _thread_run_detached(apr_thread_t *thread, void *data)
+{
+  _detached_task *t = (_detached_task*)data;
+  t->func(t->ctx, t->data);
+  if(GC_HAS_ERROR(t->ctx)) {
+    t->ctx->log(t->ctx, MAPCACHE_WARN, "background task failed: %s", t->ctx->get_error_message(t->ctx));
+  }
+  apr_pool_destroy(t->ctx->pool);
+  return NULL;
+}
+#endif
+
+int mapcache_core_run_detached(mapcache_context *ctx, mapcache_context *dctx, mapcache_detached_func func, void *data)
+{
+#if APR_HAS_THREADS && USE_THREADPOOL
+  if(ctx->config->threaded_fetching) {
+    apr_thread_pool_t *thread_pool = _get_prefetch_thread_pool(ctx);
+    if(thread_pool) {
+      _detached_task *t = (_detached_task*)apr_palloc(dctx->pool, sizeof(_detached_task));
+      t->ctx = dctx;
+      t->func = func;
+      t->data = data;
+      /* low priority, so the tasks of the requests being served are run first */
+      if(apr_thread_pool_push(thread_pool, _thread_run_detached, t, APR_THREAD_TASK_PRIORITY_LOW, NULL) == APR_SUCCESS)
+        return MAPCACHE_SUCCESS;
+    } else {
+      ctx->clear_errors(ctx);
+    }
+  }
+#endif
+  apr_pool_destroy(dctx->pool);
+  return MAPCACHE_FAILURE;
+}
+
 
 mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
 {
@@ -75,42 +500,117 @@ mapcache_http_response *mapcache_http_response_create(apr_pool_t *pool)
   return response;
 }
 
-void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+/*
+ * look up in a single operation the tiles stored in caches that support batched reads,
+ * and finish getting the ones that were found. returns the tiles that still have to be
+ * fetched one by one, i.e. the cache misses and the tiles of the other caches, along with
+ * the result of their lookup in *remaining_rets (-1 for the tiles not looked up yet)
+ */
+static mapcache_tile** _mapcache_core_multi_get_tiles(mapcache_context *ctx, mapcache_tile **tiles, int *ntiles,
+    int **remaining_rets)
 {
+  int i,j,nbatch,nremaining = 0;
+  int *rets = (int*)apr_palloc(ctx->pool, *ntiles * sizeof(int));
+  int *batchrets = (int*)apr_palloc(ctx->pool, *ntiles * sizeof(int));
+  int *batchidx = (int*)apr_palloc(ctx->pool, *ntiles * sizeof(int));
+  mapcache_tile **batch = (mapcache_tile**)apr_palloc(ctx->pool, *ntiles * sizeof(mapcache_tile*));
+  mapcache_tile **remaining = (mapcache_tile**)apr_palloc(ctx->pool, *ntiles * sizeof(mapcache_tile*));
 
-  apr_thread_t **threads;
-  apr_threadattr_t *thread_attrs;
-  int nthreads;
-#if !APR_HAS_THREADS
-  int i;
+  for(i=0; i<*ntiles; i++) {
+    rets[i] = -1; /* not looked up */
+  }
+  for(i=0; i<*ntiles; i++) {
+    mapcache_cache *cache = tiles[i]->tileset->cache;
+    if(rets[i] != -1 || !cache->tile_multi_get) continue;
+    nbatch = 0;
+    for(j=i; j<*ntiles; j++) {
+      if(rets[j] == -1 && tiles[j]->tileset->cache == cache) {
+        batchidx[nbatch] = j;
+        batchrets[nbatch] = MAPCACHE_CACHE_MISS;
+        batch[nbatch++] = tiles[j];
+      }
+    }
+    if(nbatch < 2) continue;
+    cache->tile_multi_get(ctx, cache, batch, nbatch, batchrets);
+    if(GC_HAS_ERROR(ctx)) return NULL;
+    for(j=0; j<nbatch; j++) {
+      rets[batchidx[j]] = batchrets[j];
+    }
+  }
+
+  for(i=0; i<*ntiles; i++) {
+    if(rets[i] == MAPCACHE_SUCCESS) {
+      /* checks for expiration, which only re-renders the tile in rare cases */
+      mapcache_tileset_tile_get_after_lookup(ctx, tiles[i], rets[i]);
+      if(GC_HAS_ERROR(ctx)) return NULL;
+    } else {
+      /* the lookup results are compacted in place, rets[nremaining] has been read already */
+      rets[nremaining] = rets[i];
+      remaining[nremaining++] = tiles[i];
+    }
+  }
+  *ntiles = nremaining;
+  *remaining_rets = rets;
+  return remaining;
+}
+
+static int _mapcache_core_same_metatile(mapcache_tile *a, mapcache_tile *b)
+{
+  return a->tileset == b->tileset &&
+         a->x / a->tileset->metasize_x == b->x / b->tileset->metasize_x &&
+         a->y / a->tileset->metasize_y == b->y / b->tileset->metasize_y;
+}
+
+/*
+ * get the tiles one at a time. the known lookup result of a tile is only used if no tile
+ * of its metatile came before it, as the metatile may have been rendered since
+ */
+static void _mapcache_core_fetch_tiles_serial(mapcache_context *ctx, mapcache_tile **tiles, int *rets, int ntiles)
+{
+  int i,j;
   for(i=0; i<ntiles; i++) {
-    mapcache_tileset_tile_get(ctx, tiles[i], readonly);
+    int ret = rets ? rets[i] : -1;
+    for(j=0; j<i && ret != -1; j++) {
+      if(_mapcache_core_same_metatile(tiles[i], tiles[j]))
+        ret = -1;
+    }
+    _mapcache_core_tile_get(ctx, tiles[i], ret);
     GC_CHECK_ERROR(ctx);
   }
+}
+
+/*
+ * \param rets the results of the cache lookups already done for the tiles, -1 for the tiles
+ * that were not looked up. NULL if none was
+ */
+static void _mapcache_core_fetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int *rets, int ntiles)
+{
+#if !APR_HAS_THREADS
+  _mapcache_core_fetch_tiles_serial(ctx, tiles, rets, ntiles);
 #else
   int i,rv;
   _thread_tile* thread_tiles;
+#if !USE_THREADPOOL
+  apr_thread_t **threads;
+  apr_threadattr_t *thread_attrs;
+#else
+  apr_thread_pool_t *thread_pool;
+  _thread_batch batch;
+#endif
   if(ntiles==1 || ctx->config->threaded_fetching == 0) {
     /* if threads disabled, or only fetching a single tile, don't launch a thread for the operation */
-    for(i=0; i<ntiles; i++) {
-      mapcache_tileset_tile_get(ctx, tiles[i]);
-      GC_CHECK_ERROR(ctx);
-    }
+    _mapcache_core_fetch_tiles_serial(ctx, tiles, rets, ntiles);
     return;
   }
 
 
   /* allocate a thread struct for each tile. Not all will be used */
   thread_tiles = (_thread_tile*)apr_pcalloc(ctx->pool,ntiles*sizeof(_thread_tile));
-#if 1 || !USE_THREADPOOL
-  /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
-  apr_threadattr_create(&thread_attrs, ctx->pool);
-  threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
-  nthreads = 0;
   for(i=0; i<ntiles; i++) {
     int j;
     thread_tiles[i].tile = tiles[i];
     thread_tiles[i].launch = 1;
+    thread_tiles[i].ret = rets ? rets[i] : -1;
     j=i-1;
     /*
      * we only launch one thread per metatile as in the unseeded case the threads
@@ -119,12 +619,7 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
      */
     while(j>=0) {
       /* check that the given metatile hasn't been rendered yet */
-      if(thread_tiles[j].launch &&
-          (thread_tiles[i].tile->tileset == thread_tiles[j].tile->tileset) &&
-          (thread_tiles[i].tile->x / thread_tiles[i].tile->tileset->metasize_x  ==
-           thread_tiles[j].tile->x / thread_tiles[j].tile->tileset->metasize_x)&&
-          (thread_tiles[i].tile->y / thread_tiles[i].tile->tileset->metasize_y  ==
-           thread_tiles[j].tile->y / thread_tiles[j].tile->tileset->metasize_y)) {
+      if(thread_tiles[j].launch && _mapcache_core_same_metatile(thread_tiles[i].tile, thread_tiles[j].tile)) {
         thread_tiles[i].launch = 0; /* this tile will not have a thread spawned for it */
         break;
       }
@@ -133,6 +628,11 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
     if(thread_tiles[i].launch)
       thread_tiles[i].ctx = ctx->clone(ctx);
   }
+
+#if !USE_THREADPOOL
+  /* use multiple threads, to fetch from multiple metatiles and/or multiple tilesets */
+  apr_threadattr_create(&thread_attrs, ctx->pool);
+  threads = (apr_thread_t**)apr_pcalloc(ctx->pool, ntiles*sizeof(apr_thread_t*));
   for(i=0; i<ntiles; i++) {
     if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
     rv = apr_thread_create(&threads[i], thread_attrs, _thread_get_tile, (void*)&(thread_tiles[i]), thread_tiles[i].ctx->pool);
@@ -140,63 +640,104 @@ void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int n
       ctx->set_error(ctx,500, "failed to create thread %d of %d\n",i,ntiles);
       break;
     }
-    nthreads++;
   }
 
   /* wait for launched threads to finish */
   for(i=0; i<ntiles; i++) {
-    if(!thread_tiles[i].launch) continue;
+    if(!thread_tiles[i].launch || !threads[i]) continue;
     apr_thread_join(&rv, threads[i]);
     if(rv != APR_SUCCESS) {
       ctx->set_error(ctx,500, "thread %d of %d failed on exit\n",i,ntiles);
     }
-    if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
-      /* transfer error message from child thread to main context */
-      ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
-                     thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
-    }
-  }
-  for(i=0; i<ntiles; i++) {
-    /* fetch the tiles that did not get a thread launched for them */
-    if(thread_tiles[i].launch) continue;
-    mapcache_tileset_tile_get(ctx, tiles[i]);
-    GC_CHECK_ERROR(ctx);
   }
 #else
-  /* experimental version using a threadpool, disabled for stability reasons */
-  apr_thread_pool_t *thread_pool;
-  apr_thread_pool_create(&thread_pool,2,ctx->config->download_threads,ctx->pool);
+  /* push one task per metatile to the process-wide worker pool */
+  thread_pool = _get_prefetch_thread_pool(ctx);
+  GC_CHECK_ERROR(ctx);
+  batch.pending = 0;
+  if(apr_thread_mutex_create(&batch.mutex, APR_THREAD_MUTEX_DEFAULT, ctx->pool) != APR_SUCCESS ||
+      apr_thread_cond_create(&batch.cond, ctx->pool) != APR_SUCCESS) {
+    ctx->set_error(ctx,500, "failed to create thread pool synchronization primitives");
+    return;
+  }
   for(i=0; i<ntiles; i++) {
-    ctx->log(ctx,MAPCACHE_DEBUG,"starting thread for tile %s",tiles[i]->tileset->name);
-    thread_tiles[i].tile = tiles[i];
-    thread_tiles[i].ctx = ctx->clone(ctx);
-    rv = apr_thread_pool_push(thread_pool,_thread_get_tile,(void*)&(thread_tiles[i]), 0,NULL);
+    if(!thread_tiles[i].launch) continue; /* skip tiles that have been marked */
+    thread_tiles[i].batch = &batch;
+    apr_thread_mutex_lock(batch.mutex);
+    batch.pending++;
+    apr_thread_mutex_unlock(batch.mutex);
+    rv = apr_thread_pool_push(thread_pool, _thread_get_tile, (void*)&(thread_tiles[i]), APR_THREAD_TASK_PRIORITY_NORMAL, ctx);
     if(rv != APR_SUCCESS) {
-      ctx->set_error(ctx,500, "failed to push thread %d of %d in thread pool\n",i,ntiles);
+      apr_thread_mutex_lock(batch.mutex);
+      batch.pending--;
+      apr_thread_mutex_unlock(batch.mutex);
+      thread_tiles[i].launch = 0;
+      ctx->set_error(ctx,500, "failed to push tile %d of %d to thread pool\n",i,ntiles);
       break;
     }
   }
-  GC_CHECK_ERROR(ctx);
-  while(apr_thread_pool_tasks_run_count(thread_pool) != ntiles || apr_thread_pool_busy_count(thread_pool)>0)
-    apr_sleep(10000);
-  apr_thread_pool_destroy(thread_pool);
+
+  /* wait for the pushed tasks to finish. tasks that could not be pushed are never waited on */
+  apr_thread_mutex_lock(batch.mutex);
+  while(batch.pending > 0) {
+    apr_thread_cond_wait(batch.cond, batch.mutex);
+  }
+  apr_thread_mutex_unlock(batch.mutex);
+  apr_thread_cond_destroy(batch.cond);
+  apr_thread_mutex_destroy(batch.mutex);
+#endif
+
   for(i=0; i<ntiles; i++) {
+    if(!thread_tiles[i].launch) continue;
     if(GC_HAS_ERROR(thread_tiles[i].ctx)) {
+      /* transfer error message from child thread to main context */
       ctx->set_error(ctx,thread_tiles[i].ctx->get_error(thread_tiles[i].ctx),
                      thread_tiles[i].ctx->get_error_message(thread_tiles[i].ctx));
+      ctx->_blocking = thread_tiles[i].ctx->_blocking;
     }
   }
+  GC_CHECK_ERROR(ctx);
+  for(i=0; i<ntiles; i++) {
+    /* fetch the tiles that did not get a thread launched for them, their metatile has been rendered since the lookup */
+    if(thread_tiles[i].launch) continue;
+    mapcache_tileset_tile_get(ctx, tiles[i]);
+    GC_CHECK_ERROR(ctx);
+  }
 #endif
 
-#endif
+}
+
+void mapcache_prefetch_tiles(mapcache_context *ctx, mapcache_tile **tiles, int ntiles)
+{
+  int *rets = NULL;
+  if(ntiles > 1) {
+    tiles = _mapcache_core_multi_get_tiles(ctx, tiles, &ntiles, &rets);
+    GC_CHECK_ERROR(ctx);
+    if(!ntiles) return;
+  }
+  _mapcache_core_fetch_tiles(ctx, tiles, rets, ntiles);
+}
 
+/*
+ * check, without decoding it, if a tile is known to be fully opaque
+ */
+static int _mapcache_core_tile_is_opaque(mapcache_context *ctx, mapcache_tile *tile)
+{
+  if(tile->raw_image) {
+    return tile->raw_image->has_alpha == MC_ALPHA_NO;
+  }
+  if(tile->encoded_data) {
+    /* jpeg has no transparency */
+    return mapcache_imageio_header_sniff(ctx,tile->encoded_data) == GC_JPEG;
+  }
+  return MAPCACHE_FALSE;
 }
 
 mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_request_get_tile *req_tile)
 {
   int expires = 0;
   mapcache_http_response *response;
-  int i,first = -1;
+  int i,first = -1,start = 0;
   int ntiles_with_data = 0;
   char *timestr;
   mapcache_image *base=NULL,*overlay;
@@ -226,9 +767,27 @@ mapcache_http_response *mapcache_core_get_tile(mapcache_context *ctx, mapcache_r
                    "no tiles containing image data could be retrieved (not in cache, and/or no source configured)");
     return NULL;
   }
+
+  /*
+   * tiles lying under an opaque one are completely hidden, there's no need to decode
+   * and merge them. If only a single tile remains, its encoded data is returned as-is
+   */
+  if(ntiles_with_data > 1) {
+    for(start=req_tile->ntiles-1; start>0; start--) {
+      if(!req_tile->tiles[start]->nodata && _mapcache_core_tile_is_opaque(ctx,req_tile->tiles[start]))
+        break;
+    }
+    if(start > 0) {
+      ntiles_with_data = 0;
+      for(i=start; i<req_tile->ntiles; i++) {
+        ntiles_with_data -= req_tile->tiles[i]->nodata - 1;
+      }
+    }
+  }
+
   /* this loop retrieves the tiles from the caches, and eventually decodes and merges them together
    * if multiple tiles were asked for */
-  for(i=0; i<req_tile->ntiles; i++) {
+  for(i=start; i<req_tile->ntiles; i++) {
     mapcache_tile *tile = req_tile->tiles[i];
     if(tile->nodata) continue;
     if(first == -1) {
@@ -359,12 +918,53 @@ void mapcache_fetch_maps(mapcache_context *ctx, mapcache_map **maps, int nmaps,
                            &maps[i]->extent, maps[i]->width, maps[i]->height,
                            nmaptiles[i], maptiles[i],
                            mode);
+      GC_CHECK_ERROR(ctx);
     } else {
       maps[i]->nodata = 1;
     }
   }
 }
 
+/*
+ * if all the maps of a request exactly cover a single tile of their grid, and are
+ * to be returned in the format the tiles are stored in, return the equivalent tile
+ * request so the cached encoded data can be sent as-is. Returns NULL otherwise
+ */
+static mapcache_request_get_tile* _mapcache_core_get_map_as_tiles(mapcache_context *ctx, mapcache_request_get_map *req_map)
+{
+  mapcache_request_get_tile *req_tile;
+  int i,x,y,z;
+  req_tile = apr_pcalloc(ctx->pool, sizeof(mapcache_request_get_tile));
+  req_tile->request.type = MAPCACHE_REQUEST_GET_TILE;
+  req_tile->format = req_map->getmap_format;
+  req_tile->tiles = apr_pcalloc(ctx->pool, req_map->nmaps*sizeof(mapcache_tile*));
+  for(i=0; i<req_map->nmaps; i++) {
+    mapcache_map *map = req_map->maps[i];
+    mapcache_grid *grid = map->grid_link->grid;
+    mapcache_tile *tile;
+    if(map->tileset->format != req_map->getmap_format ||
+        map->width != grid->tile_sx || map->height != grid->tile_sy ||
+        mapcache_grid_get_cell(ctx, grid, &map->extent, &x, &y, &z) != MAPCACHE_SUCCESS) {
+      return NULL;
+    }
+    tile = mapcache_tileset_tile_create(ctx->pool, map->tileset, map->grid_link);
+    tile->x = x;
+    tile->y = y;
+    tile->z = z;
+    if(map->dimensions) {
+      tile->dimensions = apr_table_clone(ctx->pool, map->dimensions);
+    }
+    mapcache_tileset_tile_validate(ctx,tile);
+    if(GC_HAS_ERROR(ctx)) {
+      /* e.g. outside of the restricted extent, let the generic code handle it */
+      ctx->clear_errors(ctx);
+      return NULL;
+    }
+    req_tile->tiles[req_tile->ntiles++] = tile;
+  }
+  return req_tile;
+}
+
 mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_request_get_map *req_map)
 {
   mapcache_image_format *format = NULL;
@@ -385,6 +985,13 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
     return NULL;
   }
 
+  if(req_map->getmap_strategy == MAPCACHE_GETMAP_ASSEMBLE) {
+    mapcache_request_get_tile *req_tile = _mapcache_core_get_map_as_tiles(ctx, req_map);
+    if(req_tile) {
+      return mapcache_core_get_tile(ctx, req_tile);
+    }
+  }
+
   format = NULL;
   response = mapcache_http_response_create(ctx->pool);
 
@@ -421,27 +1028,16 @@ mapcache_http_response *mapcache_core_get_map(mapcache_context *ctx, mapcache_re
         return NULL;
       }
     }
-    basemap->tileset->source->render_map(ctx, basemap);
-    if(GC_HAS_ERROR(ctx)) return NULL;
     if(req_map->nmaps>1) {
-      if(!basemap->raw_image) {
-        basemap->raw_image = mapcache_imageio_decode(ctx,basemap->encoded_data);
-        if(GC_HAS_ERROR(ctx)) return NULL;
-      }
-      for(i=1; i<req_map->nmaps; i++) {
-        mapcache_map *overlaymap = req_map->maps[i];
-        overlaymap->tileset->source->render_map(ctx, overlaymap);
-        if(GC_HAS_ERROR(ctx)) return NULL;
-        if(!overlaymap->raw_image) {
-          overlaymap->raw_image = mapcache_imageio_decode(ctx,overlaymap->encoded_data);
-          if(GC_HAS_ERROR(ctx)) return NULL;
-        }
-        if(GC_HAS_ERROR(ctx)) return NULL;
-        mapcache_image_merge(ctx,basemap->raw_image,overlaymap->raw_image);
-        if(GC_HAS_ERROR(ctx)) return NULL;
-        if(!basemap->expires || overlaymap->expires<basemap->expires) basemap->expires = overlaymap->expires;
-      }
+      _mapcache_core_forward_maps(ctx, req_map->maps, req_map->nmaps);
+    } else {
+      basemap->tileset->source->render_map(ctx, basemap);
     }
+    if(GC_HAS_ERROR(ctx)) return NULL;
+  } else if(ctx->config->non_blocking && req_map->getmap_strategy == MAPCACHE_GETMAP_FORWARD) {
+    ctx->set_error(ctx,400,"failed getmap, readonly mode");
+    ctx->_blocking = 1;
+    return NULL;
   } else {
     ctx->set_error(ctx,400,"failed getmap, readonly mode");
     return NULL;
@@ -31,10 +31,125 @@
 #include <curl/curl.h>
 #include <apr_hash.h>
 #include <apr_strings.h>
+#include <apr_reslist.h>
 #include <ctype.h>
 
 #define MAX_STRING_LEN 10000
 
+/*
+ * curl handles are kept in a per process pool for each upstream host, so that
+ * connections are kept alive between requests. all the handles share their dns
+ * cache, ssl sessions and (if supported by libcurl) connection cache.
+ */
+static apr_hash_t *curl_handle_pools = NULL;
+static CURLSH *curl_share = NULL;
+#if APR_HAS_THREADS
+static apr_thread_mutex_t *curl_share_locks[CURL_LOCK_DATA_LAST];
+
+static void _mapcache_curl_share_lock(CURL *handle, curl_lock_data data, curl_lock_access access, void *userptr)
+{
+  apr_thread_mutex_lock(curl_share_locks[data]);
+}
+
+static void _mapcache_curl_share_unlock(CURL *handle, curl_lock_data data, void *userptr)
+{
+  apr_thread_mutex_unlock(curl_share_locks[data]);
+}
+#endif
+
+static apr_status_t _mapcache_curl_share_cleanup(void *dummy)
+{
+  curl_share_cleanup(curl_share);
+  curl_share = NULL;
+  curl_handle_pools = NULL;
+  return APR_SUCCESS;
+}
+
+static apr_status_t _mapcache_curl_reslist_get_handle(void **handle, void *params, apr_pool_t *pool)
+{
+  *handle = curl_easy_init();
+  if(!*handle) {
+    return APR_EGENERAL;
+  }
+  return APR_SUCCESS;
+}
+
+static apr_status_t _mapcache_curl_reslist_free_handle(void *handle, void *params, apr_pool_t *pool)
+{
+  curl_easy_cleanup((CURL*)handle);
+  return APR_SUCCESS;
+}
+
+/*
+ * the part of the url that identifies the host, i.e. scheme://host:port, along with the
+ * settings of the handle pool
+ */
+static char* _mapcache_http_host_key(mapcache_context *ctx, mapcache_http *req)
+{
+  const char *host = strstr(req->url,"://");
+  const char *end;
+  host = host ? host+3 : req->url;
+  end = host + strcspn(host,"/?#");
+  return apr_psprintf(ctx->pool,"%d#%d#%.*s",req->max_connections,req->connection_timeout,(int)(end-req->url),req->url);
+}
+
+static apr_reslist_t* _mapcache_http_get_handle_pool(mapcache_context *ctx, mapcache_http *req)
+{
+  apr_reslist_t *pool = NULL;
+  char *key = _mapcache_http_host_key(ctx,req);
+  apr_status_t rv;
+  /* the hash may be resized by another thread adding a host, so it is only read under the lock */
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  if(!curl_handle_pools) {
+    curl_share = curl_share_init();
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+    curl_share_setopt(curl_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+#if APR_HAS_THREADS
+    {
+      int i;
+      for(i=0; i<CURL_LOCK_DATA_LAST; i++) {
+        apr_thread_mutex_create(&curl_share_locks[i],APR_THREAD_MUTEX_DEFAULT,ctx->process_pool);
+      }
+      curl_share_setopt(curl_share, CURLSHOPT_LOCKFUNC, _mapcache_curl_share_lock);
+      curl_share_setopt(curl_share, CURLSHOPT_UNLOCKFUNC, _mapcache_curl_share_unlock);
+    }
+#endif
+    apr_pool_cleanup_register(ctx->process_pool, NULL, _mapcache_curl_share_cleanup, apr_pool_cleanup_null);
+    curl_handle_pools = apr_hash_make(ctx->process_pool);
+  }
+
+  pool = apr_hash_get(curl_handle_pools,key,APR_HASH_KEY_STRING);
+  if(!pool) {
+    rv = apr_reslist_create(&pool,
+                            0 /* min */,
+                            req->max_connections /* soft max */,
+                            req->max_connections /* hard max */,
+                            60*1000000 /*60 seconds, ttl*/,
+                            _mapcache_curl_reslist_get_handle, /* resource constructor */
+                            _mapcache_curl_reslist_free_handle, /* resource destructor */
+                            NULL, ctx->process_pool);
+    if(rv != APR_SUCCESS) {
+      ctx->set_error(ctx,500,"failed to create curl handle pool");
+      pool = NULL;
+    } else {
+      /* requests wait for a handle at most as long as they would wait for a connection */
+      apr_reslist_timeout(pool, apr_time_from_sec(req->connection_timeout));
+      apr_hash_set(curl_handle_pools,apr_pstrdup(ctx->process_pool,key),APR_HASH_KEY_STRING,pool);
+    }
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return pool;
+}
+
 struct _header_struct {
   apr_table_t *headers;
   mapcache_context *ctx;
@@ -79,8 +194,24 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
   char error_msg[CURL_ERROR_SIZE];
   int ret;
   struct curl_slist *curl_headers=NULL;
-  curl_handle = curl_easy_init();
-
+  struct _header_struct h;
+  apr_reslist_t *handle_pool;
+  apr_status_t rv;
+
+  handle_pool = _mapcache_http_get_handle_pool(ctx,req);
+  GC_CHECK_ERROR(ctx);
+  rv = apr_reslist_acquire(handle_pool, (void**)&curl_handle);
+  if(APR_STATUS_IS_TIMEUP(rv)) {
+    ctx->set_error(ctx, 503, "all the %d connections to the host of url %s have been busy for %d seconds, "
+                   "consider increasing its <max_connections>", req->max_connections, req->url, req->connection_timeout);
+    return;
+  } else if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to aquire a curl handle to request url %s", req->url);
+    return;
+  }
+  /* drop the options of the previous request, but keep the open connections */
+  curl_easy_reset(curl_handle);
+  curl_easy_setopt(curl_handle, CURLOPT_SHARE, curl_share);
 
   /* specify URL to get */
   curl_easy_setopt(curl_handle, CURLOPT_URL, req->url);
@@ -95,7 +226,6 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
 
   if(headers != NULL) {
     /* intercept headers */
-    struct _header_struct h;
     h.headers = headers;
     h.ctx=ctx;
     curl_easy_setopt(curl_handle, CURLOPT_HEADERFUNCTION, _mapcache_curl_header_callback);
@@ -128,11 +258,15 @@ void mapcache_http_do_request(mapcache_context *ctx, mapcache_http *req, mapcach
   else
     curl_easy_setopt(curl_handle, CURLOPT_FAILONERROR, 1);
 
+  curl_slist_free_all(curl_headers);
+
   if(ret != CURLE_OK) {
     ctx->set_error(ctx, 502, "curl failed to request url %s : %s", req->url, error_msg);
+    /* don't reuse a handle whose connection may be in an unknown state */
+    apr_reslist_invalidate(handle_pool, (void*)curl_handle);
+  } else {
+    apr_reslist_release(handle_pool, (void*)curl_handle);
   }
-  /* cleanup curl stuff */
-  curl_easy_cleanup(curl_handle);
 }
 
 void mapcache_http_do_request_with_params(mapcache_context *ctx, mapcache_http *req, apr_table_t *params,
@@ -344,6 +478,18 @@ mapcache_http* mapcache_http_configuration_parse_xml(mapcache_context *ctx, ezxm
     req->connection_timeout = 30;
   }
 
+  if ((http_node = ezxml_child(node,"max_connections")) != NULL) {
+    char *endptr;
+    req->max_connections = (int)strtol(http_node->txt,&endptr,10);
+    if(*endptr != 0 || req->max_connections<1) {
+      ctx->set_error(ctx,400,"invalid <http> <max_connections> \"%s\" (positive integer expected)",
+                     http_node->txt);
+      return NULL;
+    }
+  } else {
+    req->max_connections = 10;
+  }
+
   req->headers = apr_table_make(ctx->pool,1);
   if((http_node = ezxml_child(node,"headers")) != NULL) {
     ezxml_t header_node;
@@ -362,6 +508,7 @@ mapcache_http* mapcache_http_clone(mapcache_context *ctx, mapcache_http *orig)
   ret->headers = apr_table_clone(ctx->pool,orig->headers);
   ret->url = apr_pstrdup(ctx->pool, orig->url);
   ret->connection_timeout = orig->connection_timeout;
+  ret->max_connections = orig->max_connections;
   return ret;
 }
 
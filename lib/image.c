@@ -32,7 +32,48 @@
 #include <pixman.h>
 #else
 #include <math.h>
+
+/*
+ * SSE2 is part of the x86_64 baseline, and is used whenever the compiler targets it.
+ * AVX2 kernels are compiled with a function level target attribute and are only used
+ * if the cpu supports them at runtime.
+ */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+#if defined(USE_SSE2) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) || __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
+typedef void (*_merge_row_func)(unsigned char *bptr, const unsigned char *optr, size_t npixels);
+static _merge_row_func _merge_row = NULL;
+#endif
+
+static mapcache_simd_level _simd_max_level = MAPCACHE_SIMD_AVX2;
+
+mapcache_simd_level mapcache_image_simd_level()
+{
+#ifdef USE_AVX2
+  if(_simd_max_level >= MAPCACHE_SIMD_AVX2 && __builtin_cpu_supports("avx2"))
+    return MAPCACHE_SIMD_AVX2;
+#endif
+#ifdef USE_SSE2
+  if(_simd_max_level >= MAPCACHE_SIMD_SSE2)
+    return MAPCACHE_SIMD_SSE2;
+#endif
+  return MAPCACHE_SIMD_NONE;
+}
+
+void mapcache_image_simd_limit(mapcache_simd_level level)
+{
+  _simd_max_level = level;
+#ifndef USE_PIXMAN
+  _merge_row = NULL;
 #endif
+}
 
 mapcache_image* mapcache_image_create(mapcache_context *ctx)
 {
@@ -70,12 +111,184 @@ int mapcache_image_has_alpha(mapcache_image *img)
   }
 }
 
+#ifndef USE_PIXMAN
+/*
+ * premultiplied OVER compositing of a row of pixels:
+ *   dst = overlay + dst * (255 - overlay_alpha) / 256
+ * fully transparent overlay pixels leave the destination untouched. The SIMD
+ * versions produce exactly the same output as the scalar one.
+ */
+static void _merge_row_scalar(unsigned char *bptr, const unsigned char *optr, size_t npixels)
+{
+  size_t j;
+  for(j=0; j<npixels; j++) {
+    if(optr[3]) { /* if overlay is not completely transparent */
+      if(optr[3] == 255) {
+        bptr[0]=optr[0];
+        bptr[1]=optr[1];
+        bptr[2]=optr[2];
+        bptr[3]=optr[3];
+      } else {
+        unsigned int ia = 255 - optr[3];
+        bptr[0] = (unsigned char)(optr[0] + ((ia*bptr[0])>>8));
+        bptr[1] = (unsigned char)(optr[1] + ((ia*bptr[1])>>8));
+        bptr[2] = (unsigned char)(optr[2] + ((ia*bptr[2])>>8));
+        bptr[3] = (unsigned char)(optr[3] + ((ia*bptr[3])>>8));
+      }
+    }
+    bptr+=4;
+    optr+=4;
+  }
+}
+
+#ifdef USE_SSE2
+/* dst * (255 - alpha) >> 8, for two pixels unpacked to 16 bits */
+static __inline __m128i _merge_scale_sse2(__m128i b16, __m128i o16)
+{
+  __m128i ia = _mm_shufflehi_epi16(_mm_shufflelo_epi16(o16, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+  ia = _mm_sub_epi16(_mm_set1_epi16(255), ia);
+  return _mm_srli_epi16(_mm_mullo_epi16(b16, ia), 8);
+}
+
+static void _merge_row_sse2(unsigned char *bptr, const unsigned char *optr, size_t npixels)
+{
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i amask = _mm_set1_epi32(0xff000000);
+  size_t j = 0;
+  for(; j+4<=npixels; j+=4, bptr+=16, optr+=16) {
+    __m128i o = _mm_loadu_si128((const __m128i*)optr);
+    __m128i oa = _mm_and_si128(o, amask);
+    __m128i b, res, transparent;
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(oa, zero)) == 0xffff) {
+      /* run of fully transparent pixels */
+      continue;
+    }
+    if(_mm_movemask_epi8(_mm_cmpeq_epi8(oa, amask)) == 0xffff) {
+      /* run of fully opaque pixels */
+      _mm_storeu_si128((__m128i*)bptr, o);
+      continue;
+    }
+    b = _mm_loadu_si128((const __m128i*)bptr);
+    res = _mm_packus_epi16(_merge_scale_sse2(_mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(o, zero)),
+                           _merge_scale_sse2(_mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(o, zero)));
+    res = _mm_add_epi8(res, o);
+    /* keep the base pixel where the overlay is fully transparent */
+    transparent = _mm_cmpeq_epi32(oa, zero);
+    res = _mm_or_si128(_mm_and_si128(transparent, b), _mm_andnot_si128(transparent, res));
+    _mm_storeu_si128((__m128i*)bptr, res);
+  }
+  _merge_row_scalar(bptr, optr, npixels - j);
+}
+#endif
+
+#ifdef USE_AVX2
+__attribute__((target("avx2")))
+static __inline __m256i _merge_scale_avx2(__m256i b16, __m256i o16)
+{
+  __m256i ia = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(o16, _MM_SHUFFLE(3,3,3,3)), _MM_SHUFFLE(3,3,3,3));
+  ia = _mm256_sub_epi16(_mm256_set1_epi16(255), ia);
+  return _mm256_srli_epi16(_mm256_mullo_epi16(b16, ia), 8);
+}
+
+__attribute__((target("avx2")))
+static void _merge_row_avx2(unsigned char *bptr, const unsigned char *optr, size_t npixels)
+{
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i amask = _mm256_set1_epi32(0xff000000);
+  size_t j = 0;
+  for(; j+8<=npixels; j+=8, bptr+=32, optr+=32) {
+    __m256i o = _mm256_loadu_si256((const __m256i*)optr);
+    __m256i oa = _mm256_and_si256(o, amask);
+    __m256i b, res;
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(oa, zero)) == -1) {
+      continue;
+    }
+    if(_mm256_movemask_epi8(_mm256_cmpeq_epi8(oa, amask)) == -1) {
+      _mm256_storeu_si256((__m256i*)bptr, o);
+      continue;
+    }
+    b = _mm256_loadu_si256((const __m256i*)bptr);
+    /* unpack and pack both work within 128 bit lanes, so the pixel order is preserved */
+    res = _mm256_packus_epi16(_merge_scale_avx2(_mm256_unpacklo_epi8(b, zero), _mm256_unpacklo_epi8(o, zero)),
+                              _merge_scale_avx2(_mm256_unpackhi_epi8(b, zero), _mm256_unpackhi_epi8(o, zero)));
+    res = _mm256_add_epi8(res, o);
+    res = _mm256_blendv_epi8(res, b, _mm256_cmpeq_epi32(oa, zero));
+    _mm256_storeu_si256((__m256i*)bptr, res);
+  }
+  _merge_row_sse2(bptr, optr, npixels - j);
+}
+#endif
+
+static _merge_row_func _get_merge_row()
+{
+  if(!_merge_row) {
+    switch(mapcache_image_simd_level()) {
+#ifdef USE_AVX2
+      case MAPCACHE_SIMD_AVX2:
+        _merge_row = _merge_row_avx2;
+        break;
+#endif
+#ifdef USE_SSE2
+      case MAPCACHE_SIMD_SSE2:
+        _merge_row = _merge_row_sse2;
+        break;
+#endif
+      default:
+        _merge_row = _merge_row_scalar;
+    }
+  }
+  return _merge_row;
+}
+
+/*
+ * bilinear interpolation of a pixel, with 8 bit fixed point weights.
+ * p1 p2 are the top left/right pixels, p3 p4 the bottom ones
+ */
+#ifndef _WIN32
+static inline void bilinear_pixel_scalar(const unsigned char *p1, const unsigned char *p2,
+    const unsigned char *p3, const unsigned char *p4, int wx, int wy, unsigned char *dst)
+{
+#else
+static __inline void bilinear_pixel_scalar(const unsigned char *p1, const unsigned char *p2,
+    const unsigned char *p3, const unsigned char *p4, int wx, int wy, unsigned char *dst)
+{
+#endif
+  int c;
+  for(c=0; c<4; c++) {
+    unsigned int left = (p1[c] * (256-wy) + p3[c] * wy) >> 8;
+    unsigned int right = (p2[c] * (256-wy) + p4[c] * wy) >> 8;
+    dst[c] = (left * (256-wx) + right * wx) >> 8;
+  }
+}
+
+#ifdef USE_SSE2
+static __inline void bilinear_pixel_sse2(const unsigned char *p1, const unsigned char *p2,
+    const unsigned char *p3, const unsigned char *p4, int wx, int wy, unsigned char *dst)
+{
+  const __m128i zero = _mm_setzero_si128();
+  /* [p1 p2] and [p3 p4], unpacked to 16 bits */
+  __m128i top = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)p1),
+                                  _mm_cvtsi32_si128(*(const int*)p2)), zero);
+  __m128i bottom = _mm_unpacklo_epi8(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)p3),
+                                     _mm_cvtsi32_si128(*(const int*)p4)), zero);
+  /* vertical pass, gives [left right] */
+  __m128i v = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, _mm_set1_epi16(256-wy)),
+                             _mm_mullo_epi16(bottom, _mm_set1_epi16(wy))), 8);
+  /* horizontal pass */
+  v = _mm_mullo_epi16(v, _mm_set_epi16(wx,wx,wx,wx,256-wx,256-wx,256-wx,256-wx));
+  v = _mm_srli_epi16(_mm_add_epi16(v, _mm_srli_si128(v, 8)), 8);
+  *(int*)dst = _mm_cvtsi128_si32(_mm_packus_epi16(v, zero));
+}
+#endif
+#endif
+
 void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_image *overlay)
 {
   int starti,startj;
 #ifndef USE_PIXMAN
-  int i,j;
-  unsigned char *browptr, *orowptr, *bptr, *optr;
+  int i;
+  unsigned char *browptr, *orowptr;
+  _merge_row_func merge_row;
 #endif
 
   if(base->w < overlay->w || base->h < overlay->h) {
@@ -100,89 +313,26 @@ void mapcache_image_merge(mapcache_context *ctx, mapcache_image *base, mapcache_
   pixman_image_unref(si);
   pixman_image_unref(bi);
 #else
-
-
   browptr = base->data + starti * base->stride + startj*4;
   orowptr = overlay->data;
-  for(i=0; i<overlay->h; i++) {
-    bptr = browptr;
-    optr = orowptr;
-    for(j=0; j<overlay->w; j++) {
-      if(optr[3]) { /* if overlay is not completely transparent */
-        if(optr[3] == 255) {
-          bptr[0]=optr[0];
-          bptr[1]=optr[1];
-          bptr[2]=optr[2];
-          bptr[3]=optr[3];
-        } else if(optr[3] != 0) {
-          unsigned int br = bptr[0];
-          unsigned int bg = bptr[1];
-          unsigned int bb = bptr[2];
-          unsigned int ba = bptr[3];
-          unsigned int or = optr[0];
-          unsigned int og = optr[1];
-          unsigned int ob = optr[2];
-          unsigned int oa = optr[3];
-          bptr[0] = (unsigned char)(or + (((255-oa)*br)>>8));
-          bptr[1] = (unsigned char)(og + (((255-oa)*bg)>>8));
-          bptr[2] = (unsigned char)(ob + (((255-oa)*bb)>>8));
-
-          bptr[3] = oa+((ba*(255-oa))>>8);
-        }
-      }
-      bptr+=4;
-      optr+=4;
+  if(overlay->has_alpha == MC_ALPHA_NO) {
+    /* the overlay is known to be fully opaque, it simply replaces the base pixels */
+    for(i=0; i<overlay->h; i++) {
+      memcpy(browptr, orowptr, overlay->w*4);
+      browptr += base->stride;
+      orowptr += overlay->stride;
     }
+    return;
+  }
+  merge_row = _get_merge_row();
+  for(i=0; i<overlay->h; i++) {
+    merge_row(browptr, orowptr, overlay->w);
     browptr += base->stride;
     orowptr += overlay->stride;
   }
 #endif
 }
 
-#ifndef USE_PIXMAN
-#ifndef _WIN32
-static inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
-{
-#else
-static __inline void bilinear_pixel(mapcache_image *img, double x, double y, unsigned char *dst)
-{
-#endif
-
-  int px,py;
-  int px1, py1;
-  unsigned char *p1, *p2, *p3, *p4;
-  float fx, fy, fx1, fy1;
-  int w1, w2, w3, w4;
-  px = (int)x;
-  py = (int)y;
-
-  px1 = (px==(img->w-1))?(px):(px+1);
-  py1 = (py==(img->h-1))?(py):(py+1);
-
-  p1 = &img->data[py*img->stride+px*4];
-  p2 = &img->data[py*img->stride+px1*4];
-  p3 = &img->data[py1*img->stride+px*4];
-  p4 = &img->data[py1*img->stride+px1*4];
-
-  // Calculate the weights for each pixel
-  fx = x - px;
-  fy = y - py;
-  fx1 = 1.0f - fx;
-  fy1 = 1.0f - fy;
-
-  w1 = fx1 * fy1 * 256.0f;
-  w2 = fx  * fy1 * 256.0f;
-  w3 = fx1 * fy  * 256.0f;
-  w4 = fx  * fy  * 256.0f;
-
-  // Calculate the weighted sum of pixels (for each color channel)
-  dst[0] = (p1[0] * w1 + p2[0] * w2 + p3[0] * w3 + p4[0] * w4) >> 8;
-  dst[1] = (p1[1] * w1 + p2[1] * w2 + p3[1] * w3 + p4[1] * w4) >> 8;
-  dst[2] = (p1[2] * w1 + p2[2] * w2 + p3[2] * w3 + p4[2] * w4) >> 8;
-  dst[3] = (p1[3] * w1 + p2[3] * w2 + p3[3] * w3 + p4[3] * w4) >> 8;
-}
-#endif
-
 void mapcache_image_copy_resampled_nearest(mapcache_context *ctx, mapcache_image *src, mapcache_image *dst,
     double off_x, double off_y, double scale_x, double scale_y)
 {
@@ -202,18 +352,35 @@ void mapcache_image_copy_resampled_nearest(mapcache_context *ctx, mapcache_image
   pixman_image_unref(bi);
 #else
   int dstx,dsty;
-  unsigned char *dstrowptr = dst->data;
+  int startx = dst->w, endx = 0, prev_srcy = -1;
+  unsigned char *dstrowptr = dst->data, *prev_dstrowptr = NULL;
+  /*
+   * the source column of each destination column does not depend on the row. As the
+   * mapping is monotonic, the columns inside the source form the range [startx,endx[
+   */
+  int *srcxs = (int*)apr_palloc(ctx->pool, dst->w * sizeof(int));
+  for(dstx=0; dstx<dst->w; dstx++) {
+    srcxs[dstx] = (int)(((dstx-off_x)/scale_x)+0.5);
+    if(srcxs[dstx] >= 0 && srcxs[dstx] < src->w) {
+      if(dstx < startx) startx = dstx;
+      endx = dstx + 1;
+    }
+  }
   for(dsty=0; dsty<dst->h; dsty++) {
-    int *dstptr = (int*)dstrowptr;
     int srcy = (int)(((dsty-off_y)/scale_y)+0.5);
-    if(srcy >= 0 && srcy < src->h) {
-      for(dstx=0; dstx<dst->w; dstx++) {
-        int srcx = (int)(((dstx-off_x)/scale_x)+0.5);
-        if(srcx >= 0 && srcx < src->w) {
-          *dstptr = *((int*)&(src->data[srcy*src->stride+srcx*4]));
+    if(startx < endx && srcy >= 0 && srcy < src->h) {
+      if(srcy == prev_srcy) {
+        /* upsampling: same source row as the previous destination row */
+        memcpy(dstrowptr + startx*4, prev_dstrowptr + startx*4, (endx-startx)*4);
+      } else {
+        apr_uint32_t *dstptr = (apr_uint32_t*)dstrowptr;
+        const apr_uint32_t *srcrow = (const apr_uint32_t*)(src->data + srcy*src->stride);
+        for(dstx=startx; dstx<endx; dstx++) {
+          dstptr[dstx] = srcrow[srcxs[dstx]];
         }
-        dstptr ++;
       }
+      prev_srcy = srcy;
+      prev_dstrowptr = dstrowptr;
     }
     dstrowptr += dst->stride;
   }
@@ -241,14 +408,45 @@ void mapcache_image_copy_resampled_bilinear(mapcache_context *ctx, mapcache_imag
 #else
   int dstx,dsty;
   unsigned char *dstrowptr = dst->data;
+#ifdef USE_SSE2
+  int use_sse2 = (mapcache_image_simd_level() >= MAPCACHE_SIMD_SSE2);
+#endif
+  /*
+   * precompute the source columns and the 8 bit fixed point horizontal weights, as
+   * they do not depend on the row. px is -1 for columns falling outside the source
+   */
+  int *px = (int*)apr_palloc(ctx->pool, dst->w * 3 * sizeof(int));
+  int *px1 = px + dst->w;
+  int *wx = px1 + dst->w;
+  for(dstx=0; dstx<dst->w; dstx++) {
+    double srcx = (dstx-off_x)/scale_x;
+    if(srcx >= 0 && srcx < src->w) {
+      px[dstx] = (int)srcx;
+      px1[dstx] = (px[dstx]==(src->w-1))?(px[dstx]):(px[dstx]+1);
+      wx[dstx] = (int)((srcx - px[dstx]) * 256);
+    } else {
+      px[dstx] = -1;
+    }
+  }
   for(dsty=0; dsty<dst->h; dsty++) {
     unsigned char *dstptr = dstrowptr;
     double srcy = (dsty-off_y)/scale_y;
     if(srcy >= 0 && srcy < src->h) {
+      int py = (int)srcy;
+      int py1 = (py==(src->h-1))?(py):(py+1);
+      int wy = (int)((srcy - py) * 256);
+      const unsigned char *row = src->data + py*src->stride;
+      const unsigned char *row1 = src->data + py1*src->stride;
       for(dstx=0; dstx<dst->w; dstx++) {
-        double srcx = (dstx-off_x)/scale_x;
-        if(srcx >= 0 && srcx < src->w) {
-          bilinear_pixel(src,srcx,srcy,dstptr);
+        if(px[dstx] >= 0) {
+#ifdef USE_SSE2
+          if(use_sse2)
+            bilinear_pixel_sse2(row + px[dstx]*4, row + px1[dstx]*4, row1 + px[dstx]*4, row1 + px1[dstx]*4,
+                                wx[dstx], wy, dstptr);
+          else
+#endif
+            bilinear_pixel_scalar(row + px[dstx]*4, row + px1[dstx]*4, row1 + px[dstx]*4, row1 + px1[dstx]*4,
+                                  wx[dstx], wy, dstptr);
         }
         dstptr += 4;
       }
@@ -258,6 +456,12 @@ void mapcache_image_copy_resampled_bilinear(mapcache_context *ctx, mapcache_imag
 #endif
 }
 
+static void _mapcache_image_watermark_task(mapcache_context *ctx, void *data, int i)
+{
+  mapcache_metatile *mt = (mapcache_metatile*)data;
+  mapcache_image_merge(ctx,mt->tiles[i].raw_image,mt->map.tileset->watermark);
+}
+
 void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
 {
   if(mt->map.tileset->format) {
@@ -300,14 +504,14 @@ void mapcache_image_metatile_split(mapcache_context *ctx, mapcache_metatile *mt)
             break;
         }
         tileimg->data = &(metatile->data[sy*metatile->stride + 4 * sx]);
-        if(mt->map.tileset->watermark) {
-          mapcache_image_merge(ctx,tileimg,mt->map.tileset->watermark);
-          GC_CHECK_ERROR(ctx);
-        }
         mt->tiles[i*mt->metasize_y+j].raw_image = tileimg;
-        GC_CHECK_ERROR(ctx);
       }
     }
+    if(mt->map.tileset->watermark) {
+      /* the tiles are disjoint regions of the metatile */
+      mapcache_core_run_tasks(ctx, _mapcache_image_watermark_task, mt, mt->ntiles);
+      GC_CHECK_ERROR(ctx);
+    }
   } else {
 #ifdef DEBUG
     if(mt->map.tileset->metasize_x != 1 ||
@@ -0,0 +1,245 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache tile caching: per-process recycling of pixel buffers
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * rgba buffers are rounded up to a size class. Classes are spaced by quarters of a power of
+ * two (4kB, 5kB, 6kB, 7kB, 8kB, 10kB, ...), so that at most a fifth of a buffer is unused,
+ * and the sizes of the usual square tiles fall exactly on a class. When the request pool they
+ * were handed out on is cleared they are put back on the free list of their class
+ * instead of being freed, so that the next request needing a buffer of the same class
+ * does not go through malloc (and the kernel page zeroing of large mmaped chunks).
+ */
+
+#include "mapcache.h"
+#include <stdlib.h>
+#include <string.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+
+#define BUFFER_MIN_SHIFT 12 /* 4kB, i.e. a 32x32 rgba tile */
+#define BUFFER_MAX_SHIFT 26 /* 64MB, larger buffers are not recycled */
+#define BUFFER_NCLASSES ((BUFFER_MAX_SHIFT - BUFFER_MIN_SHIFT) * 4 + 1)
+#define BUFFER_MAX_SIZE ((size_t)1<<BUFFER_MAX_SHIFT)
+
+/* size of class i: 1, 1.25, 1.5 or 1.75 times a power of two */
+#define BUFFER_CLASS_SIZE(i) ((((size_t)4 + (i)%4) << (BUFFER_MIN_SHIFT + (i)/4)) >> 2)
+
+/* the header is kept in front of the pixel data, padded so the data keeps the alignment of malloc */
+#define BUFFER_HEADER_SIZE 64
+
+typedef struct _image_buffer_pool _image_buffer_pool;
+
+typedef struct _image_buffer _image_buffer;
+struct _image_buffer {
+  _image_buffer *next;
+  _image_buffer_pool *pool; /* the pool the buffer was handed out from */
+  size_t size; /* usable size of the buffer */
+  int cls; /* size class, or -1 if the buffer is not recycled */
+};
+
+struct _image_buffer_pool {
+#ifdef APR_HAS_THREADS
+  apr_thread_mutex_t *mutex;
+#endif
+  _image_buffer *free[BUFFER_NCLASSES];
+  mapcache_image_buffer_stats stats;
+  size_t reported_hwm; /* last in_use high-water mark that was logged */
+};
+
+static _image_buffer_pool *buffer_pool = NULL;
+
+static void _buffer_lock(_image_buffer_pool *p)
+{
+#ifdef APR_HAS_THREADS
+  if(p->mutex)
+    apr_thread_mutex_lock(p->mutex);
+#endif
+}
+
+static void _buffer_unlock(_image_buffer_pool *p)
+{
+#ifdef APR_HAS_THREADS
+  if(p->mutex)
+    apr_thread_mutex_unlock(p->mutex);
+#endif
+}
+
+static apr_status_t _buffer_pool_cleanup(void *data)
+{
+  _image_buffer_pool *p = (_image_buffer_pool*)data;
+  int i;
+  for(i=0; i<BUFFER_NCLASSES; i++) {
+    while(p->free[i]) {
+      _image_buffer *b = p->free[i];
+      p->free[i] = b->next;
+      free(b);
+    }
+  }
+  if(buffer_pool == p)
+    buffer_pool = NULL;
+  return APR_SUCCESS;
+}
+
+static _image_buffer_pool* _get_buffer_pool(mapcache_context *ctx)
+{
+  if(buffer_pool)
+    return buffer_pool;
+  if(!ctx->process_pool)
+    return NULL;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* the pool may have been created by another thread while we were waiting for the lock */
+  if(!buffer_pool) {
+    _image_buffer_pool *p = apr_pcalloc(ctx->process_pool, sizeof(_image_buffer_pool));
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_create(&p->mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool);
+#endif
+    apr_pool_cleanup_register(ctx->process_pool, p, _buffer_pool_cleanup, apr_pool_cleanup_null);
+    buffer_pool = p;
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return buffer_pool;
+}
+
+static apr_status_t _buffer_release(void *data)
+{
+  _image_buffer *b = (_image_buffer*)data;
+  _image_buffer_pool *p = buffer_pool;
+  if(!p || b->pool != p) {
+    /* the buffer outlived the pool it was taken from */
+    free(b);
+    return APR_SUCCESS;
+  }
+  _buffer_lock(p);
+  p->stats.in_use -= b->size;
+  if(b->cls >= 0 && p->stats.retained + b->size <= MAPCACHE_IMAGE_BUFFER_MAX_RETAINED) {
+    b->next = p->free[b->cls];
+    p->free[b->cls] = b;
+    p->stats.retained += b->size;
+    if(p->stats.retained > p->stats.retained_hwm)
+      p->stats.retained_hwm = p->stats.retained;
+    b = NULL;
+  }
+  _buffer_unlock(p);
+  if(b)
+    free(b);
+  return APR_SUCCESS;
+}
+
+unsigned char* mapcache_image_buffer_alloc(mapcache_context *ctx, size_t size, int zero)
+{
+  _image_buffer_pool *p = _get_buffer_pool(ctx);
+  _image_buffer *b = NULL;
+  size_t bufsize = size;
+  int cls = 0;
+  size_t hwm = 0, retained = 0;
+
+  /* skip whole powers of two first */
+  while(cls + 4 < BUFFER_NCLASSES && BUFFER_CLASS_SIZE(cls + 4) < size)
+    cls += 4;
+  while(cls < BUFFER_NCLASSES && BUFFER_CLASS_SIZE(cls) < size)
+    cls++;
+  if(cls < BUFFER_NCLASSES) {
+    bufsize = BUFFER_CLASS_SIZE(cls);
+  } else {
+    cls = -1;
+  }
+
+  if(p) {
+    _buffer_lock(p);
+    if(cls >= 0 && p->free[cls]) {
+      b = p->free[cls];
+      p->free[cls] = b->next;
+      p->stats.retained -= b->size;
+      p->stats.hits++;
+    } else {
+      p->stats.misses++;
+    }
+    p->stats.in_use += bufsize;
+    if(p->stats.in_use > p->stats.in_use_hwm) {
+      p->stats.in_use_hwm = p->stats.in_use;
+      /* only report significant growth, the mark moves often while the process warms up */
+      if(p->stats.in_use_hwm >= p->reported_hwm + p->reported_hwm/4 + BUFFER_MAX_SIZE/4) {
+        p->reported_hwm = hwm = p->stats.in_use_hwm;
+        retained = p->stats.retained;
+      }
+    }
+    _buffer_unlock(p);
+  }
+
+  if(b) {
+    if(zero)
+      memset((unsigned char*)b + BUFFER_HEADER_SIZE, 0, size);
+  } else {
+    if(zero)
+      b = calloc(1, BUFFER_HEADER_SIZE + bufsize);
+    else
+      b = malloc(BUFFER_HEADER_SIZE + bufsize);
+    if(!b) {
+      if(p) {
+        _buffer_lock(p);
+        p->stats.in_use -= bufsize;
+        _buffer_unlock(p);
+      }
+      ctx->set_error(ctx, 500, "failed to allocate %lu bytes of image data", (unsigned long)size);
+      return NULL;
+    }
+    b->size = bufsize;
+    b->cls = cls;
+  }
+  b->next = NULL;
+  b->pool = p;
+  apr_pool_cleanup_register(ctx->pool, b, _buffer_release, apr_pool_cleanup_null);
+
+  if(hwm) {
+    ctx->log(ctx, MAPCACHE_DEBUG, "image buffer pool: new high-water mark of %lu kB in use (%lu kB retained)",
+             (unsigned long)(hwm/1024), (unsigned long)(retained/1024));
+  }
+  return (unsigned char*)b + BUFFER_HEADER_SIZE;
+}
+
+void mapcache_image_buffer_pool_stats(mapcache_image_buffer_stats *stats)
+{
+  _image_buffer_pool *p = buffer_pool;
+  memset(stats, 0, sizeof(mapcache_image_buffer_stats));
+  if(!p)
+    return;
+  _buffer_lock(p);
+  *stats = p->stats;
+  _buffer_unlock(p);
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -237,8 +237,12 @@ void _mapcache_imageio_jpeg_decode_to_image(mapcache_context *r, mapcache_buffer
   img->h = cinfo.output_height;
   s = cinfo.output_components;
   if(!img->data) {
-    img->data = calloc(1,img->w*img->h*4*sizeof(unsigned char));
-    apr_pool_cleanup_register(r->pool, img->data, (void*)free, apr_pool_cleanup_null) ;
+    /* every scanline is written below, no need to zero the buffer */
+    img->data = mapcache_image_buffer_alloc(r,img->w*img->h*4,MAPCACHE_FALSE);
+    if(!img->data) {
+      jpeg_destroy_decompress(&cinfo);
+      return;
+    }
     img->stride = img->w * 4;
   }
 
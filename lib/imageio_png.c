@@ -129,8 +129,12 @@ void _mapcache_imageio_png_decode_to_image(mapcache_context *ctx, mapcache_buffe
   img->w = width;
   img->h = height;
   if(!img->data) {
-    img->data = calloc(1,img->w*img->h*4*sizeof(unsigned char));
-    apr_pool_cleanup_register(ctx->pool, img->data, (void*)free, apr_pool_cleanup_null) ;
+    /* every row is written by png_read_image, no need to zero the buffer */
+    img->data = mapcache_image_buffer_alloc(ctx,img->w*img->h*4,MAPCACHE_FALSE);
+    if(!img->data) {
+      png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+      return;
+    }
     img->stride = img->w * 4;
   }
   row_pointers = malloc(img->h * sizeof(unsigned char*));
@@ -31,6 +31,31 @@
 #include <apr_file_io.h>
 #include <apr_strings.h>
 #include <apr_time.h>
+#include <apr_shm.h>
+
+#if APR_HAS_SHARED_MEMORY && APR_HAS_PROC_PTHREAD_SERIALIZE
+#define USE_SHM_LOCKER
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+/*
+ * PTHREAD_MUTEX_ROBUST is an enum value on glibc, it cannot be tested by the
+ * preprocessor. configure defines HAVE_PTHREAD_MUTEX_ROBUST where it finds
+ * pthread_mutexattr_setrobust(), glibc has it since 2.12
+ */
+#if defined(HAVE_PTHREAD_MUTEX_ROBUST) || \
+    (defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 12)))
+#define USE_ROBUST_MUTEX
+#endif
+#endif
+
+/* interval at which waiters check if the owner of a shm lock is still alive */
+#define SHM_LOCK_CHECK_INTERVAL apr_time_from_sec(1)
+
+/* marks a named lock table as initialized by the process that created it */
+#define SHM_LOCK_MAGIC 0x4d434c4bU
 
 char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
 {
@@ -46,41 +71,541 @@ char* lock_filename_for_resource(mapcache_context *ctx, const char *resource)
                       ctx->config->lockdir,saferes);
 }
 
-int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+static void _mapcache_locker_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node)
+{
+  ezxml_t cur_node;
+  if ((cur_node = ezxml_child(node,"timeout")) != NULL) {
+    char *endptr;
+    int timeout = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || timeout < 0) {
+      ctx->set_error(ctx, 400, "failed to parse locker timeout \"%s\". Expecting a positive number of seconds",
+                     cur_node->txt);
+      return;
+    }
+    self->timeout = apr_time_from_sec(timeout);
+  }
+}
+
+static int _mapcache_locker_disk_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, char *resource)
 {
   char *lockname = lock_filename_for_resource(ctx,resource);
   apr_file_t *lockfile;
   apr_status_t rv;
-  /* create the lockfile */
-  rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
-
-  /* if the file already exists, wait for it to disappear */
-  /* TODO: check the lock isn't stale (i.e. too old) */
-  if( rv != APR_SUCCESS ) {
-    apr_finfo_t info;
-    rv = apr_stat(&info,lockname,0,ctx->pool);
+  apr_finfo_t info;
+
+  for(;;) {
+    /* create the lockfile */
+    rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
+    if(rv == APR_SUCCESS) {
+      /* we acquired the lock */
+      apr_file_close(lockfile);
+      return MAPCACHE_TRUE;
+    }
+
+    /* the file already exists, wait for it to disappear */
+    rv = apr_stat(&info,lockname,APR_FINFO_MTIME,ctx->pool);
 #ifdef DEBUG
     if(!APR_STATUS_IS_ENOENT(rv)) {
       ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
     }
 #endif
     while(!APR_STATUS_IS_ENOENT(rv)) {
+      if(self->timeout && rv == APR_SUCCESS && apr_time_now() - info.mtime > self->timeout) {
+        break;
+      }
       /* sleep for the configured number of micro-seconds (default is 1/100th of a second) */
       apr_sleep(ctx->config->lock_retry_interval);
-      rv = apr_stat(&info,lockname,0,ctx->pool);
+      rv = apr_stat(&info,lockname,APR_FINFO_MTIME,ctx->pool);
+    }
+    if(APR_STATUS_IS_ENOENT(rv)) {
+      return MAPCACHE_FALSE;
+    }
+
+    /* the lock is stale, remove it and try to take it over */
+    ctx->log(ctx, MAPCACHE_WARN, "removing stale lockfile %s", lockname);
+    apr_file_remove(lockname,ctx->pool);
+  }
+}
+
+static int _mapcache_locker_disk_trylock(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  char *lockname = lock_filename_for_resource(ctx,resource);
+  apr_file_t *lockfile;
+  apr_status_t rv;
+  apr_finfo_t info;
+  char errmsg[120];
+  int i;
+
+  /* a second attempt is made after removing a stale lockfile */
+  for(i=0; i<2; i++) {
+    rv = apr_file_open(&lockfile,lockname,APR_WRITE|APR_CREATE|APR_EXCL|APR_XTHREAD,APR_OS_DEFAULT,ctx->pool);
+    if(rv == APR_SUCCESS) {
+      apr_file_close(lockfile);
+      return MAPCACHE_TRUE;
+    }
+    if(!APR_STATUS_IS_EEXIST(rv)) {
+      ctx->set_error(ctx, 500, "failed to create lockfile %s: %s", lockname, apr_strerror(rv,errmsg,120));
+      return MAPCACHE_FALSE;
+    }
+    rv = apr_stat(&info,lockname,APR_FINFO_MTIME,ctx->pool);
+    if(rv != APR_SUCCESS || !self->timeout || apr_time_now() - info.mtime <= self->timeout) {
+      break;
+    }
+    ctx->log(ctx, MAPCACHE_WARN, "removing stale lockfile %s", lockname);
+    apr_file_remove(lockname,ctx->pool);
+  }
+  return MAPCACHE_FALSE;
+}
+
+static void _mapcache_locker_disk_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  char *lockname = lock_filename_for_resource(ctx,resource);
+  apr_file_remove(lockname,ctx->pool);
+}
+
+static void _mapcache_locker_disk_post_config(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg)
+{
+}
+
+mapcache_locker* mapcache_locker_disk_create(mapcache_context *ctx)
+{
+  mapcache_locker_disk *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_disk));
+  locker->locker.type = MAPCACHE_LOCKER_DISK;
+  locker->locker.lock_or_wait = _mapcache_locker_disk_lock_or_wait;
+  locker->locker.trylock = _mapcache_locker_disk_trylock;
+  locker->locker.unlock = _mapcache_locker_disk_unlock;
+  locker->locker.parse_xml = _mapcache_locker_parse_xml;
+  locker->locker.post_config = _mapcache_locker_disk_post_config;
+  locker->locker.timeout = 0;
+  return (mapcache_locker*)locker;
+}
+
+#ifdef USE_SHM_LOCKER
+
+/*
+ * the shm locker keeps a fixed size table of the locks currently held. The table
+ * is protected by a single process-shared mutex, and each slot has a condition
+ * that is broadcast when its lock is released.
+ */
+typedef struct {
+  apr_uint64_t hash; /* hash of the locked resource */
+  pid_t owner; /* process holding the lock, or 0 if the slot is free */
+  apr_time_t since;
+  apr_uint32_t generation; /* incremented each time the lock is released */
+  apr_uint32_t token; /* identifies the current acquisition of the lock */
+  pthread_cond_t released;
+} _shm_lock_slot;
+
+typedef struct {
+  apr_uint32_t magic;
+  pthread_mutex_t mutex;
+  pthread_cond_t slot_freed;
+  apr_uint32_t next_token;
+  int nslots;
+  _shm_lock_slot slots[1];
+} _shm_lock_table;
+
+/* 64 bit FNV-1a hash, so that collisions between resources are practically impossible */
+static apr_uint64_t _shm_lock_hash(const char *resource)
+{
+  apr_uint64_t hash = APR_UINT64_C(14695981039346656037);
+  while(*resource) {
+    hash ^= (unsigned char)*resource++;
+    hash *= APR_UINT64_C(1099511628211);
+  }
+  return hash;
+}
+
+/*
+ * returns 0 once the table mutex is held, or the error that prevented taking it
+ */
+static int _shm_lock_recover(_shm_lock_table *table, int rv)
+{
+#ifdef USE_ROBUST_MUTEX
+  /* a process died while holding the table mutex. Slots are always left consistent */
+  if(rv == EOWNERDEAD) {
+    rv = pthread_mutex_consistent(&table->mutex);
+  }
+#endif
+  return rv;
+}
+
+static int _shm_lock_table(mapcache_context *ctx, _shm_lock_table *table)
+{
+  int rv = _shm_lock_recover(table, pthread_mutex_lock(&table->mutex));
+  if(rv) {
+    ctx->set_error(ctx, 500, "failed to lock the shared lock table: %s", strerror(rv));
+  }
+  return rv;
+}
+
+/* returns 0 if the table mutex is held again after the wait */
+static int _shm_lock_timedwait(mapcache_context *ctx, _shm_lock_table *table, pthread_cond_t *cond)
+{
+  struct timespec ts;
+  int rv;
+  apr_time_t deadline = apr_time_now() + SHM_LOCK_CHECK_INTERVAL;
+  ts.tv_sec = apr_time_sec(deadline);
+  ts.tv_nsec = apr_time_usec(deadline) * 1000;
+  rv = _shm_lock_recover(table, pthread_cond_timedwait(cond, &table->mutex, &ts));
+  if(rv == ETIMEDOUT)
+    rv = 0;
+  if(rv) {
+    ctx->set_error(ctx, 500, "failed to wait on the shared lock table: %s", strerror(rv));
+  }
+  return rv;
+}
+
+/*
+ * the token of the acquisition of a lock is kept with the request, so that a holder
+ * whose lock was taken over does not release the lock of the new holder
+ */
+static char* _shm_lock_token_key(mapcache_context *ctx, const char *resource)
+{
+  return apr_pstrcat(ctx->pool, "mapcache_shm_lock:", resource, NULL);
+}
+
+static void _shm_lock_acquired(mapcache_context *ctx, _shm_lock_table *table, _shm_lock_slot *slot,
+                               const char *resource)
+{
+  apr_uint32_t *token = apr_palloc(ctx->pool, sizeof(apr_uint32_t));
+  slot->owner = getpid();
+  slot->since = apr_time_now();
+  slot->token = *token = ++table->next_token;
+  apr_pool_userdata_set(token, _shm_lock_token_key(ctx, resource), NULL, ctx->pool);
+}
+
+static int _shm_lock_is_stale(mapcache_locker *self, _shm_lock_slot *slot)
+{
+  if(kill(slot->owner, 0) != 0 && errno == ESRCH) {
+    return MAPCACHE_TRUE;
+  }
+  if(self->timeout && apr_time_now() - slot->since > self->timeout) {
+    return MAPCACHE_TRUE;
+  }
+  return MAPCACHE_FALSE;
+}
+
+static int _mapcache_locker_shm_lock_or_wait(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  _shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+  apr_uint64_t hash = _shm_lock_hash(resource);
+  _shm_lock_slot *slot;
+  apr_uint32_t generation;
+  int i;
+
+  if(_shm_lock_table(ctx, table))
+    return MAPCACHE_FALSE;
+  for(;;) {
+    _shm_lock_slot *free_slot = NULL;
+    slot = NULL;
+    for(i=0; i<table->nslots; i++) {
+      if(!table->slots[i].owner) {
+        if(!free_slot) free_slot = &table->slots[i];
+      } else if(table->slots[i].hash == hash) {
+        slot = &table->slots[i];
+        break;
+      }
+    }
+    if(slot) {
+      break;
+    }
+    if(free_slot) {
+      /* nobody holds the lock, take it */
+      free_slot->hash = hash;
+      _shm_lock_acquired(ctx, table, free_slot, resource);
+      pthread_mutex_unlock(&table->mutex);
+      return MAPCACHE_TRUE;
+    }
+    /* all the slots are in use, wait for one to be released */
+    if(_shm_lock_timedwait(ctx, table, &table->slot_freed))
+      return MAPCACHE_FALSE;
+  }
+
+#ifdef DEBUG
+  ctx->log(ctx, MAPCACHE_DEBUG, "waiting on resource lock %s", resource);
+#endif
+  /* the lock is held by someone else, wait for it to be released */
+  generation = slot->generation;
+  while(slot->generation == generation) {
+    if(_shm_lock_is_stale(self, slot)) {
+      ctx->log(ctx, MAPCACHE_WARN, "taking over stale lock on %s held by process %d",
+               resource, (int)slot->owner);
+      _shm_lock_acquired(ctx, table, slot, resource);
+      pthread_mutex_unlock(&table->mutex);
+      return MAPCACHE_TRUE;
     }
+    if(_shm_lock_timedwait(ctx, table, &slot->released))
+      return MAPCACHE_FALSE;
+  }
+  pthread_mutex_unlock(&table->mutex);
+  return MAPCACHE_FALSE;
+}
+
+static int _mapcache_locker_shm_trylock(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  _shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+  apr_uint64_t hash = _shm_lock_hash(resource);
+  _shm_lock_slot *slot = NULL, *free_slot = NULL;
+  int i;
+
+  if(_shm_lock_table(ctx, table))
     return MAPCACHE_FALSE;
+  for(i=0; i<table->nslots; i++) {
+    if(!table->slots[i].owner) {
+      if(!free_slot) free_slot = &table->slots[i];
+    } else if(table->slots[i].hash == hash) {
+      slot = &table->slots[i];
+      break;
+    }
+  }
+  if(slot) {
+    if(!_shm_lock_is_stale(self, slot)) {
+      pthread_mutex_unlock(&table->mutex);
+      return MAPCACHE_FALSE;
+    }
+    ctx->log(ctx, MAPCACHE_WARN, "taking over stale lock on %s held by process %d",
+             resource, (int)slot->owner);
+  } else if(free_slot) {
+    slot = free_slot;
+    slot->hash = hash;
   } else {
-    /* we acquired the lock */
-    apr_file_close(lockfile);
-    return MAPCACHE_TRUE;
+    /* all the slots are in use */
+    pthread_mutex_unlock(&table->mutex);
+    return MAPCACHE_FALSE;
+  }
+  _shm_lock_acquired(ctx, table, slot, resource);
+  pthread_mutex_unlock(&table->mutex);
+  return MAPCACHE_TRUE;
+}
+
+static void _mapcache_locker_shm_unlock(mapcache_context *ctx, mapcache_locker *self, char *resource)
+{
+  _shm_lock_table *table = ((mapcache_locker_shm*)self)->table;
+  apr_uint64_t hash = _shm_lock_hash(resource);
+  char *key = _shm_lock_token_key(ctx, resource);
+  apr_uint32_t *token = NULL;
+  int i;
+  apr_pool_userdata_get((void**)&token, key, ctx->pool);
+  if(!token) {
+    /* not locked by this request */
+    return;
   }
+  apr_pool_userdata_set(NULL, key, NULL, ctx->pool);
+  if(_shm_lock_table(ctx, table))
+    return;
+  for(i=0; i<table->nslots; i++) {
+    _shm_lock_slot *slot = &table->slots[i];
+    if(slot->owner && slot->hash == hash) {
+      if(slot->token == *token) {
+        slot->owner = 0;
+        slot->generation++;
+        pthread_cond_broadcast(&slot->released);
+        pthread_cond_signal(&table->slot_freed);
+      } else {
+        ctx->log(ctx, MAPCACHE_WARN, "lock on %s was taken over by process %d, not releasing it",
+                 resource, (int)slot->owner);
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&table->mutex);
+}
+
+static void _mapcache_locker_shm_parse_xml(mapcache_context *ctx, mapcache_locker *self, ezxml_t node)
+{
+  ezxml_t cur_node;
+  mapcache_locker_shm *locker = (mapcache_locker_shm*)self;
+  _mapcache_locker_parse_xml(ctx, self, node);
+  GC_CHECK_ERROR(ctx);
+  if ((cur_node = ezxml_child(node,"slots")) != NULL) {
+    char *endptr;
+    locker->nslots = (int)strtol(cur_node->txt,&endptr,10);
+    if(*endptr != 0 || locker->nslots <= 0) {
+      ctx->set_error(ctx, 400, "failed to parse locker slots \"%s\". Expecting a positive integer",
+                     cur_node->txt);
+      return;
+    }
+  }
+  if ((cur_node = ezxml_child(node,"filename")) != NULL && cur_node->txt && *cur_node->txt) {
+    locker->filename = apr_pstrdup(ctx->pool, cur_node->txt);
+  }
+}
+
+/**
+ * \brief create the lock table
+ *
+ * this is done at configuration time, so that an anonymous table is shared with the
+ * server processes that are forked afterwards. a named table is attached to by every
+ * process that loads the same configuration, e.g. fastcgi processes or the seeder.
+ */
+static void _mapcache_locker_shm_post_config(mapcache_context *ctx, mapcache_locker *self, mapcache_cfg *cfg)
+{
+  mapcache_locker_shm *locker = (mapcache_locker_shm*)self;
+  _shm_lock_table *table;
+  pthread_condattr_t cattr;
+  apr_shm_t *shm;
+  apr_status_t rv;
+  apr_size_t size = sizeof(_shm_lock_table) + (locker->nslots - 1) * sizeof(_shm_lock_slot);
+  char errmsg[120];
+  int i, created = 1;
+
+  if(locker->filename) {
+    rv = apr_shm_attach(&shm, locker->filename, ctx->pool);
+    if(rv == APR_SUCCESS) {
+      created = 0;
+    } else {
+      rv = apr_shm_create(&shm, size, locker->filename, ctx->pool);
+      if(APR_STATUS_IS_EEXIST(rv)) {
+        /* another process created the table in the meantime */
+        rv = apr_shm_attach(&shm, locker->filename, ctx->pool);
+        created = 0;
+      }
+    }
+  } else {
+    rv = apr_shm_create(&shm, size, NULL, ctx->pool);
+  }
+  if(rv != APR_SUCCESS) {
+    ctx->set_error(ctx, 500, "failed to create shared memory for the lock table: %s",
+                   apr_strerror(rv,errmsg,120));
+    return;
+  }
+  table = apr_shm_baseaddr_get(shm);
+
+  if(!created) {
+    /* give the creating process some time to initialize the table */
+    for(i=0; i<100 && table->magic != SHM_LOCK_MAGIC; i++) {
+      apr_sleep(10000);
+    }
+    if(table->magic != SHM_LOCK_MAGIC || table->nslots != locker->nslots) {
+      ctx->set_error(ctx, 500, "existing lock table %s has an incompatible layout", locker->filename);
+      return;
+    }
+    locker->table = table;
+    return;
+  }
+
+  memset(table, 0, apr_shm_size_get(shm));
+  table->nslots = locker->nslots;
+
+  if(mapcache_shm_mutex_init(ctx, &table->mutex) != MAPCACHE_SUCCESS)
+    return;
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+  if(pthread_cond_init(&table->slot_freed, &cattr)) {
+    ctx->set_error(ctx, 500, "failed to initialize the shared lock table conditions");
+  }
+  for(i=0; i<table->nslots && !GC_HAS_ERROR(ctx); i++) {
+    if(pthread_cond_init(&table->slots[i].released, &cattr)) {
+      ctx->set_error(ctx, 500, "failed to initialize the shared lock table conditions");
+    }
+  }
+  pthread_condattr_destroy(&cattr);
+  if(!GC_HAS_ERROR(ctx)) {
+    table->magic = SHM_LOCK_MAGIC;
+  }
+  locker->table = table;
+}
+
+#endif /* USE_SHM_LOCKER */
+
+mapcache_locker* mapcache_locker_shm_create(mapcache_context *ctx)
+{
+#ifdef USE_SHM_LOCKER
+  mapcache_locker_shm *locker = apr_pcalloc(ctx->pool, sizeof(mapcache_locker_shm));
+  locker->locker.type = MAPCACHE_LOCKER_SHM;
+  locker->locker.lock_or_wait = _mapcache_locker_shm_lock_or_wait;
+  locker->locker.trylock = _mapcache_locker_shm_trylock;
+  locker->locker.unlock = _mapcache_locker_shm_unlock;
+  locker->locker.parse_xml = _mapcache_locker_shm_parse_xml;
+  locker->locker.post_config = _mapcache_locker_shm_post_config;
+  locker->locker.timeout = 0;
+  locker->nslots = 256;
+  return (mapcache_locker*)locker;
+#else
+  ctx->set_error(ctx, 400, "shm locker is not supported on this platform (requires process-shared pthread mutexes), use the disk locker");
+  return NULL;
+#endif
+}
+
+apr_size_t mapcache_shm_mutex_size(void)
+{
+#ifdef USE_SHM_LOCKER
+  return sizeof(pthread_mutex_t);
+#else
+  return 0;
+#endif
+}
+
+int mapcache_shm_mutex_init(mapcache_context *ctx, void *mutex)
+{
+#ifdef USE_SHM_LOCKER
+  pthread_mutexattr_t mattr;
+  int rv;
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+#ifdef USE_ROBUST_MUTEX
+  pthread_mutexattr_setrobust(&mattr, PTHREAD_MUTEX_ROBUST);
+#endif
+  rv = pthread_mutex_init((pthread_mutex_t*)mutex, &mattr);
+  pthread_mutexattr_destroy(&mattr);
+  if(rv) {
+    ctx->set_error(ctx, 500, "failed to initialize process-shared mutex: %s", strerror(rv));
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+#else
+  ctx->set_error(ctx, 500, "process-shared mutexes are not supported on this platform");
+  return MAPCACHE_FAILURE;
+#endif
+}
+
+int mapcache_shm_mutex_lock(mapcache_context *ctx, void *mutex, int *recovered)
+{
+#ifdef USE_SHM_LOCKER
+  int rv = pthread_mutex_lock((pthread_mutex_t*)mutex);
+  *recovered = 0;
+#ifdef USE_ROBUST_MUTEX
+  if(rv == EOWNERDEAD) {
+    /* the previous owner died while holding the mutex, the caller repairs the data */
+    *recovered = 1;
+    rv = pthread_mutex_consistent((pthread_mutex_t*)mutex);
+  }
+#endif
+  if(rv) {
+    ctx->set_error(ctx, 500, "failed to lock process-shared mutex: %s", strerror(rv));
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+#else
+  ctx->set_error(ctx, 500, "process-shared mutexes are not supported on this platform");
+  return MAPCACHE_FAILURE;
+#endif
+}
+
+void mapcache_shm_mutex_unlock(void *mutex)
+{
+#ifdef USE_SHM_LOCKER
+  pthread_mutex_unlock((pthread_mutex_t*)mutex);
+#endif
+}
+
+int mapcache_lock_or_wait_for_resource(mapcache_context *ctx, char *resource)
+{
+  mapcache_locker *locker = ctx->config->locker;
+  return locker->lock_or_wait(ctx, locker, resource);
+}
+
+int mapcache_lock_resource_try(mapcache_context *ctx, char *resource)
+{
+  mapcache_locker *locker = ctx->config->locker;
+  return locker->trylock(ctx, locker, resource);
 }
 
 void mapcache_unlock_resource(mapcache_context *ctx, char *resource)
 {
-  char *lockname = lock_filename_for_resource(ctx,resource);
-  apr_file_remove(lockname,ctx->pool);
+  mapcache_locker *locker = ctx->config->locker;
+  locker->unlock(ctx, locker, resource);
 }
 
 /* vim: ts=2 sts=2 et sw=2
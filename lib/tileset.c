@@ -31,23 +31,40 @@
 #include <apr_strings.h>
 #include <apr_file_info.h>
 #include <apr_file_io.h>
+#include <apr_hash.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
 
 #ifdef _WIN32
 #include <limits.h>
 #endif
 
+/* {z}-{y}-{x}-{tileset}{dim} and {z}-{y}-{x}-{tileset}{grid}{dim} */
+static mapcache_key_token _metatile_resource_tokens[] = {
+  {MAPCACHE_KEY_TOKEN_Z,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_Y,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_X,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_TILESET,NULL,0}, {MAPCACHE_KEY_TOKEN_DIM,NULL,0}
+};
+static mapcache_key_token _metatile_grid_resource_tokens[] = {
+  {MAPCACHE_KEY_TOKEN_Z,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_Y,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_X,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"-",1},
+  {MAPCACHE_KEY_TOKEN_TILESET,NULL,0}, {MAPCACHE_KEY_TOKEN_GRID,NULL,0},
+  {MAPCACHE_KEY_TOKEN_DIM,NULL,0}
+};
+/* tokens, ntokens, literal_len, nnumbers, has_dim, block_x, block_y */
+static mapcache_key_template _metatile_resource_key = {_metatile_resource_tokens, 8, 3, 3, 1, 1, 1};
+static mapcache_key_template _metatile_grid_resource_key = {_metatile_grid_resource_tokens, 9, 3, 3, 1, 1, 1};
+
 char* mapcache_tileset_metatile_resource_key(mapcache_context *ctx, mapcache_metatile *mt)
 {
-  char *lockname = apr_psprintf(ctx->pool,
-                                "%d-%d-%d-%s",
-                                mt->z,mt->y,mt->x,
-                                mt->map.tileset->name);
-
-  /* if the tileset has multiple grids, add the name of the current grid to the lock key*/
-  if(mt->map.tileset->grid_links->nelts > 1) {
-    lockname = apr_pstrcat(ctx->pool,lockname,mt->map.grid_link->grid->name,NULL);
-  }
+  mapcache_tile tile;
+  char *dimkey = "";
 
   if(mt->map.dimensions && !apr_is_empty_table(mt->map.dimensions)) {
     const apr_array_header_t *elts = apr_table_elts(mt->map.dimensions);
@@ -60,15 +77,50 @@ char* mapcache_tileset_metatile_resource_key(mapcache_context *ctx, mapcache_met
         if(*iter == '/') *iter='_';
         iter++;
       }
-      lockname = apr_pstrcat(ctx->pool,lockname,dimvalue,NULL);
+      dimkey = apr_pstrcat(ctx->pool,dimkey,dimvalue,NULL);
     }
+  }
+
+  /* the key is rendered from the metatile's coordinates */
+  memset(&tile, 0, sizeof(mapcache_tile));
+  tile.tileset = mt->map.tileset;
+  tile.grid_link = mt->map.grid_link;
+  tile.x = mt->x;
+  tile.y = mt->y;
+  tile.z = mt->z;
+
+  /* if the tileset has multiple grids, add the name of the current grid to the lock key*/
+  if(mt->map.tileset->grid_links->nelts > 1) {
+    return mapcache_key_template_render(ctx, &_metatile_grid_resource_key, &tile, dimkey);
+  }
+  return mapcache_key_template_render(ctx, &_metatile_resource_key, &tile, dimkey);
+}
 
+/*
+ * tiles of a disk cache with hardlink dedup share the modification time of all the tiles
+ * with the same content, they cannot expire individually
+ */
+static mapcache_cache* _mapcache_tileset_shared_mtime_cache(mapcache_cache *cache)
+{
+  if(cache->type == MAPCACHE_CACHE_DISK &&
+      ((mapcache_cache_disk*)cache)->dedup == MAPCACHE_DISK_DEDUP_HARDLINK) {
+    return cache;
   }
-  return lockname;
+  if(cache->type == MAPCACHE_CACHE_COMPOSITE) {
+    apr_array_header_t *caches = ((mapcache_cache_composite*)cache)->caches;
+    int i;
+    for(i=0; i<caches->nelts; i++) {
+      mapcache_cache *found = _mapcache_tileset_shared_mtime_cache(APR_ARRAY_IDX(caches,i,mapcache_cache*));
+      if(found)
+        return found;
+    }
+  }
+  return NULL;
 }
 
 void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tileset *tileset)
 {
+  mapcache_cache *shared;
 
   /* check we have all we want */
   if(tileset->cache == NULL) {
@@ -77,6 +129,13 @@ void mapcache_tileset_configuration_check(mapcache_context *ctx, mapcache_tilese
     return;
   }
 
+  if(tileset->auto_expire && (shared = _mapcache_tileset_shared_mtime_cache(tileset->cache)) != NULL) {
+    ctx->set_error(ctx, 400, "tileset \"%s\" uses auto_expire, but cache \"%s\" uses hardlink dedup,"
+                   " which gives the same modification time to all the tiles with the same content."
+                   " (hint: use symlink dedup)", tileset->name, shared->name);
+    return;
+  }
+
   if(apr_is_empty_array(tileset->grid_links)) {
     ctx->set_error(ctx, 400, "tileset \"%s\" has no grids configured", tileset->name);
     return;
@@ -214,6 +273,29 @@ void mapcache_tileset_get_map_tiles(mapcache_context *ctx, mapcache_tileset *til
   *ntiles = i;
 }
 
+/* a tile and the region of the mosaic it is copied into */
+typedef struct {
+  mapcache_tile *tile;
+  mapcache_image region;
+} _assemble_tile;
+
+static void _mapcache_tileset_assemble_tile_task(mapcache_context *ctx, void *data, int i)
+{
+  _assemble_tile *at = &(((_assemble_tile*)data)[i]);
+  if(!at->tile->raw_image) {
+    mapcache_imageio_decode_to_image(ctx,at->tile->encoded_data,&at->region);
+  } else {
+    int r;
+    unsigned char *srcptr = at->tile->raw_image->data;
+    unsigned char *dstptr = at->region.data;
+    for(r=0; r<at->tile->raw_image->h; r++) {
+      memcpy(dstptr,srcptr,at->tile->raw_image->w*4);
+      srcptr += at->tile->raw_image->stride;
+      dstptr += at->region.stride;
+    }
+  }
+}
+
 mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapcache_tileset *tileset,
     mapcache_grid_link *grid_link,
     mapcache_extent *bbox, int width, int height,
@@ -226,9 +308,10 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   mapcache_extent tilebbox;
   mapcache_tile *toplefttile=NULL;
   int mx=INT_MAX,my=INT_MAX,Mx=INT_MIN,My=INT_MIN;
-  int i;
+  int i, ndata = 0;
   mapcache_image *image = mapcache_image_create(ctx);
   mapcache_image *srcimage;
+  _assemble_tile *assemble_tiles;
   double tileresolution, dstminx, dstminy, hf, vf;
 #ifdef DEBUG
   /* we know at least one tile contains data */
@@ -246,8 +329,9 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
   image->w = width;
   image->h = height;
   image->stride = width*4;
-  image->data = calloc(1,width*height*4*sizeof(unsigned char));
-  apr_pool_cleanup_register(ctx->pool, image->data, (void*)free, apr_pool_cleanup_null) ;
+  /* the resamplers leave the pixels that fall outside of the tiles untouched */
+  image->data = mapcache_image_buffer_alloc(ctx,width*height*4,MAPCACHE_TRUE);
+  if(GC_HAS_ERROR(ctx)) return NULL;
   if(ntiles == 0) {
     return image;
   }
@@ -259,19 +343,26 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
     if(tile->y < my) my = tile->y;
     if(tile->x > Mx) Mx = tile->x;
     if(tile->y > My) My = tile->y;
+    if(!tile->nodata) ndata++;
   }
   /* create image that will contain the unscaled tiles data */
   srcimage = mapcache_image_create(ctx);
   srcimage->w = (Mx-mx+1)*tiles[0]->grid_link->grid->tile_sx;
   srcimage->h = (My-my+1)*tiles[0]->grid_link->grid->tile_sy;
   srcimage->stride = srcimage->w*4;
-  srcimage->data = calloc(1,srcimage->w*srcimage->h*4*sizeof(unsigned char));
-  apr_pool_cleanup_register(ctx->pool, srcimage->data, (void*)free, apr_pool_cleanup_null) ;
+  /*
+   * every pixel of the src image is overwritten if there is a tile with data for each
+   * cell of the mosaic, in which case the buffer does not need to be cleared
+   */
+  srcimage->data = mapcache_image_buffer_alloc(ctx,srcimage->w*srcimage->h*4,
+                   (ndata == (Mx-mx+1)*(My-my+1))?MAPCACHE_FALSE:MAPCACHE_TRUE);
+  if(GC_HAS_ERROR(ctx)) return NULL;
 
-  /* copy the tiles data into the src image */
+  /* locate the tiles data in the src image */
+  assemble_tiles = (_assemble_tile*)apr_pcalloc(ctx->pool, ndata*sizeof(_assemble_tile));
+  ndata = 0;
   for(i=0; i<ntiles; i++) {
     int ox,oy; /* the offset from the start of the src image to the start of the tile */
-    mapcache_image fakeimg;
     mapcache_tile *tile = tiles[i];
     switch(grid_link->grid->origin) {
       case MAPCACHE_GRID_ORIGIN_BOTTOM_LEFT:
@@ -305,25 +396,18 @@ mapcache_image* mapcache_tileset_assemble_map_tiles(mapcache_context *ctx, mapca
     }
     if(tile->nodata) continue;
 
-
-    fakeimg.stride = srcimage->stride;
-    fakeimg.data = &(srcimage->data[oy*srcimage->stride+ox*4]);
-    if(!tile->raw_image) {
-      mapcache_imageio_decode_to_image(ctx,tile->encoded_data,&fakeimg);
-    } else {
-      int r;
-      unsigned char *srcptr = tile->raw_image->data;
-      unsigned char *dstptr = fakeimg.data;
-      for(r=0; r<tile->raw_image->h; r++) {
-        memcpy(dstptr,srcptr,tile->raw_image->stride);
-        srcptr += tile->raw_image->stride;
-        dstptr += fakeimg.stride;
-      }
-    }
+    assemble_tiles[ndata].tile = tile;
+    assemble_tiles[ndata].region.stride = srcimage->stride;
+    assemble_tiles[ndata].region.data = &(srcimage->data[oy*srcimage->stride+ox*4]);
+    ndata++;
   }
 
   assert(toplefttile);
 
+  /* the regions of the tiles do not overlap, they can be decoded concurrently */
+  mapcache_core_run_tasks(ctx, _mapcache_tileset_assemble_tile_task, assemble_tiles, ndata);
+  if(GC_HAS_ERROR(ctx)) return NULL;
+
   /* copy/scale the srcimage onto the destination image */
   tileresolution = toplefttile->grid_link->grid->levels[toplefttile->z]->resolution;
   mapcache_grid_get_extent(ctx,toplefttile->grid_link->grid,
@@ -444,6 +528,15 @@ mapcache_metatile* mapcache_tileset_metatile_get(mapcache_context *ctx, mapcache
  *  - split the resulting image along the metabuffer / metatiles
  *  - save each tile to cache
  */
+static void _mapcache_tileset_encode_tile_task(mapcache_context *ctx, void *data, int i)
+{
+  mapcache_tile *tile = &(((mapcache_metatile*)data)->tiles[i]);
+  /* only encode to image format if tile is not blank, some caches store blank tiles differently */
+  if(!tile->encoded_data && mapcache_image_blank_color(tile->raw_image) != MAPCACHE_TRUE) {
+    tile->encoded_data = tile->tileset->format->write(ctx, tile->raw_image, tile->tileset->format);
+  }
+}
+
 void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *mt)
 {
   int i;
@@ -457,12 +550,17 @@ void mapcache_tileset_render_metatile(mapcache_context *ctx, mapcache_metatile *
   GC_CHECK_ERROR(ctx);
   mapcache_image_metatile_split(ctx, mt);
   GC_CHECK_ERROR(ctx);
+  if(mt->map.tileset->format && mt->ntiles > 1) {
+    /* encode the tiles concurrently instead of one by one in the cache's tile_set */
+    mapcache_core_run_tasks(ctx, _mapcache_tileset_encode_tile_task, mt, mt->ntiles);
+    GC_CHECK_ERROR(ctx);
+  }
   if(mt->map.tileset->cache->tile_multi_set) {
-    mt->map.tileset->cache->tile_multi_set(ctx, mt->tiles, mt->ntiles);
+    mt->map.tileset->cache->tile_multi_set(ctx, mt->map.tileset->cache, mt->tiles, mt->ntiles);
   } else {
     for(i=0; i<mt->ntiles; i++) {
       mapcache_tile *tile = &(mt->tiles[i]);
-      mt->map.tileset->cache->tile_set(ctx, tile);
+      mt->map.tileset->cache->tile_set(ctx, mt->map.tileset->cache, tile);
       GC_CHECK_ERROR(ctx);
     }
   }
@@ -495,6 +593,7 @@ mapcache_tileset* mapcache_tileset_clone(mapcache_context *ctx, mapcache_tileset
   dst->metabuffer = src->metabuffer;
   dst->expires = src->expires;
   dst->auto_expire = src->auto_expire;
+  dst->stale_while_revalidate = src->stale_while_revalidate;
   dst->metadata = src->metadata;
   dst->dimensions = src->dimensions;
   dst->format = src->format;
@@ -572,6 +671,297 @@ mapcache_feature_info* mapcache_tileset_feature_info_create(apr_pool_t *pool, ma
   return fi;
 }
 
+/*
+ * metatiles being rendered by this process. Threads waiting on the lock of a metatile
+ * that another thread of the same process is rendering pick up the encoded tiles from
+ * here once the lock is released, instead of reading them back from the cache. Waiters
+ * in other processes still go through the cache.
+ */
+typedef struct {
+  int x,y;
+  unsigned char *buf;
+  size_t size;
+} _rendezvous_tile;
+
+typedef struct {
+  char *key;
+  int refcount; /* number of threads interested in the metatile */
+  int ntiles; /* 0 until the renderer has published the tiles */
+  apr_time_t mtime;
+  _rendezvous_tile *tiles;
+} _rendezvous;
+
+static apr_hash_t *rendezvous_table = NULL;
+
+/* metatiles queued for a background refresh by this process, see stale_while_revalidate */
+static apr_hash_t *refresh_table = NULL;
+
+#ifdef APR_HAS_THREADS
+/* protects both tables */
+static apr_thread_mutex_t *tables_mutex = NULL;
+#endif
+
+static void _tables_lock()
+{
+#ifdef APR_HAS_THREADS
+  if(tables_mutex)
+    apr_thread_mutex_lock(tables_mutex);
+#endif
+}
+
+static void _tables_unlock()
+{
+#ifdef APR_HAS_THREADS
+  if(tables_mutex)
+    apr_thread_mutex_unlock(tables_mutex);
+#endif
+}
+
+static apr_status_t _tables_cleanup(void *data)
+{
+  rendezvous_table = refresh_table = NULL;
+#ifdef APR_HAS_THREADS
+  tables_mutex = NULL;
+#endif
+  return APR_SUCCESS;
+}
+
+static int _tables_init(mapcache_context *ctx)
+{
+  if(rendezvous_table)
+    return MAPCACHE_SUCCESS;
+  if(!ctx->process_pool)
+    return MAPCACHE_FAILURE;
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_lock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  /* the tables may have been created by another thread while we were waiting for the lock */
+  if(!rendezvous_table) {
+#ifdef APR_HAS_THREADS
+    apr_thread_mutex_create(&tables_mutex, APR_THREAD_MUTEX_DEFAULT, ctx->process_pool);
+#endif
+    apr_pool_cleanup_register(ctx->process_pool, NULL, _tables_cleanup, apr_pool_cleanup_null);
+    refresh_table = apr_hash_make(ctx->process_pool);
+    rendezvous_table = apr_hash_make(ctx->process_pool);
+  }
+#ifdef APR_HAS_THREADS
+  if(ctx->threadlock)
+    apr_thread_mutex_unlock((apr_thread_mutex_t*)ctx->threadlock);
+#endif
+  return MAPCACHE_SUCCESS;
+}
+
+/* register the calling thread's interest in the given metatile */
+static _rendezvous* _rendezvous_join(mapcache_context *ctx, const char *key)
+{
+  _rendezvous *rdv;
+  if(_tables_init(ctx) != MAPCACHE_SUCCESS)
+    return NULL;
+  _tables_lock();
+  rdv = apr_hash_get(rendezvous_table, key, APR_HASH_KEY_STRING);
+  if(!rdv) {
+    rdv = calloc(1, sizeof(_rendezvous));
+    if(!rdv || !(rdv->key = strdup(key))) {
+      free(rdv);
+      _tables_unlock();
+      return NULL;
+    }
+    apr_hash_set(rendezvous_table, rdv->key, APR_HASH_KEY_STRING, rdv);
+  }
+  rdv->refcount++;
+  _tables_unlock();
+  return rdv;
+}
+
+static void _rendezvous_leave(_rendezvous *rdv)
+{
+  int i;
+  if(!rdv)
+    return;
+  _tables_lock();
+  if(--rdv->refcount > 0) {
+    _tables_unlock();
+    return;
+  }
+  /* a published rendezvous has already been removed, and may have been replaced since */
+  if(apr_hash_get(rendezvous_table, rdv->key, APR_HASH_KEY_STRING) == rdv)
+    apr_hash_set(rendezvous_table, rdv->key, APR_HASH_KEY_STRING, NULL);
+  _tables_unlock();
+  for(i=0; i<rdv->ntiles; i++) {
+    free(rdv->tiles[i].buf);
+  }
+  free(rdv->tiles);
+  free(rdv->key);
+  free(rdv);
+}
+
+/*
+ * hand the encoded tiles of a freshly rendered metatile to the threads waiting for it.
+ * the rendezvous is removed from the table at the same time, so that later requests do
+ * not pick up these tiles once they may have been modified or expired in the cache
+ */
+static void _rendezvous_publish(_rendezvous *rdv, mapcache_metatile *mt)
+{
+  int i;
+  if(!rdv)
+    return;
+  _tables_lock();
+  if(apr_hash_get(rendezvous_table, rdv->key, APR_HASH_KEY_STRING) == rdv)
+    apr_hash_set(rendezvous_table, rdv->key, APR_HASH_KEY_STRING, NULL);
+  /* nobody else is waiting, don't bother copying the tiles */
+  if(rdv->refcount > 1 && !rdv->ntiles) {
+    rdv->tiles = calloc(mt->ntiles, sizeof(_rendezvous_tile));
+    if(rdv->tiles) {
+      for(i=0; i<mt->ntiles; i++) {
+        mapcache_tile *t = &mt->tiles[i];
+        rdv->tiles[i].x = t->x;
+        rdv->tiles[i].y = t->y;
+        /* tiles that weren't encoded (e.g. blank ones) are read back from the cache */
+        if(t->encoded_data && (rdv->tiles[i].buf = malloc(t->encoded_data->size))) {
+          memcpy(rdv->tiles[i].buf, t->encoded_data->buf, t->encoded_data->size);
+          rdv->tiles[i].size = t->encoded_data->size;
+        }
+      }
+      rdv->mtime = apr_time_now();
+      rdv->ntiles = mt->ntiles;
+    }
+  }
+  _tables_unlock();
+}
+
+/* returns MAPCACHE_TRUE if the tiles of the metatile have already been published */
+static int _rendezvous_published(_rendezvous *rdv)
+{
+  int published;
+  if(!rdv)
+    return MAPCACHE_FALSE;
+  _tables_lock();
+  published = rdv->ntiles ? MAPCACHE_TRUE : MAPCACHE_FALSE;
+  _tables_unlock();
+  return published;
+}
+
+static int _rendezvous_tile_get(mapcache_context *ctx, _rendezvous *rdv, mapcache_tile *tile)
+{
+  int i, ret = MAPCACHE_CACHE_MISS;
+  if(!rdv)
+    return ret;
+  _tables_lock();
+  for(i=0; i<rdv->ntiles; i++) {
+    if(rdv->tiles[i].x == tile->x && rdv->tiles[i].y == tile->y) {
+      if(rdv->tiles[i].buf) {
+        tile->encoded_data = mapcache_buffer_create(rdv->tiles[i].size, ctx->pool);
+        mapcache_buffer_append(tile->encoded_data, rdv->tiles[i].size, rdv->tiles[i].buf);
+        tile->mtime = rdv->mtime;
+        ret = MAPCACHE_SUCCESS;
+      }
+      break;
+    }
+  }
+  _tables_unlock();
+  return ret;
+}
+
+/* pick the requested tile out of the metatile this thread has just rendered */
+static int _mapcache_tileset_metatile_tile_get(mapcache_metatile *mt, mapcache_tile *tile)
+{
+  int i;
+  for(i=0; i<mt->ntiles; i++) {
+    mapcache_tile *t = &mt->tiles[i];
+    if(t->x == tile->x && t->y == tile->y) {
+      if(!t->encoded_data)
+        break;
+      tile->encoded_data = t->encoded_data;
+      tile->mtime = apr_time_now();
+      return MAPCACHE_SUCCESS;
+    }
+  }
+  return MAPCACHE_CACHE_MISS;
+}
+
+static void _refresh_done(const char *key)
+{
+  char *stored;
+  _tables_lock();
+  stored = apr_hash_get(refresh_table, key, APR_HASH_KEY_STRING);
+  if(stored) {
+    apr_hash_set(refresh_table, key, APR_HASH_KEY_STRING, NULL);
+    free(stored);
+  }
+  _tables_unlock();
+}
+
+/*
+ * re-render a stale metatile, run on the worker pool once the stale tile has been returned.
+ * the refresh is dropped if the metatile is locked, as it is then already being rendered:
+ * waiting for it would only tie up a worker
+ */
+static void _mapcache_tileset_refresh_task(mapcache_context *ctx, void *data)
+{
+  mapcache_tile *tile = (mapcache_tile*)data;
+  mapcache_metatile *mt = mapcache_tileset_metatile_get(ctx, tile);
+  char *lockname = mapcache_tileset_metatile_resource_key(ctx,mt);
+  if(mapcache_lock_resource_try(ctx, lockname) == MAPCACHE_TRUE) {
+    /* another process may have refreshed the tile while this task was queued */
+    int ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
+    if(!GC_HAS_ERROR(ctx) && (ret != MAPCACHE_SUCCESS || !tile->mtime ||
+                              tile->mtime + apr_time_from_sec(tile->tileset->auto_expire) < apr_time_now())) {
+      ctx->log(ctx, MAPCACHE_DEBUG, "refreshing stale metatile: tileset %s - tile %d %d %d",
+               tile->tileset->name,mt->x,mt->y,mt->z);
+      mapcache_tileset_render_metatile(ctx, mt);
+    }
+    mapcache_unlock_resource(ctx, lockname);
+  }
+  /* otherwise another thread or process is rendering it */
+  _refresh_done(lockname);
+}
+
+/*
+ * queue a background re-rendering of the metatile of a stale tile, unless one is
+ * already pending. returns MAPCACHE_SUCCESS if the stale tile can be returned.
+ */
+static int _mapcache_tileset_tile_refresh(mapcache_context *ctx, mapcache_tile *tile)
+{
+  mapcache_context *dctx;
+  mapcache_tile *dtile;
+  mapcache_metatile *mt;
+  char *lockname, *stored;
+
+  if(_tables_init(ctx) != MAPCACHE_SUCCESS)
+    return MAPCACHE_FAILURE;
+  mt = mapcache_tileset_metatile_get(ctx, tile);
+  lockname = mapcache_tileset_metatile_resource_key(ctx,mt);
+  _tables_lock();
+  if(apr_hash_get(refresh_table, lockname, APR_HASH_KEY_STRING)) {
+    _tables_unlock();
+    return MAPCACHE_SUCCESS;
+  }
+  if((stored = strdup(lockname)) != NULL)
+    apr_hash_set(refresh_table, stored, APR_HASH_KEY_STRING, stored);
+  _tables_unlock();
+  if(!stored)
+    return MAPCACHE_FAILURE;
+
+  dctx = mapcache_core_detached_context(ctx);
+  if(!dctx) {
+    _refresh_done(lockname);
+    return MAPCACHE_FAILURE;
+  }
+  /* the request pool will be gone by the time the task runs */
+  dtile = mapcache_tileset_tile_create(dctx->pool, tile->tileset, tile->grid_link);
+  dtile->x = tile->x;
+  dtile->y = tile->y;
+  dtile->z = tile->z;
+  if(tile->dimensions)
+    dtile->dimensions = apr_table_clone(dctx->pool, tile->dimensions);
+  if(mapcache_core_run_detached(ctx, dctx, _mapcache_tileset_refresh_task, dtile) != MAPCACHE_SUCCESS) {
+    _refresh_done(lockname);
+    return MAPCACHE_FAILURE;
+  }
+  return MAPCACHE_SUCCESS;
+}
+
 /**
  * \brief return the image data for a given tile
  * this call uses a global (interprocess+interthread) mutex if the tile was not found
@@ -588,14 +978,25 @@ mapcache_feature_info* mapcache_tileset_feature_info_create(apr_pool_t *pool, ma
  *    - aquire mutex
  *    - unlock the tiles we have rendered
  *    - release mutex
+ *  - threads of this process that waited for the rendering get the tile data directly
+ *    from the renderer, other ones read it back from the cache
+ *  - with stale_while_revalidate, a stale tile is returned as-is while its metatile is
+ *    re-rendered in the background, until it is older than the grace period
  *
  */
 void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
 {
-  int isLocked,ret;
-  mapcache_metatile *mt=NULL;
-  ret = tile->tileset->cache->tile_get(ctx, tile);
+  int ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
   GC_CHECK_ERROR(ctx);
+  mapcache_tileset_tile_get_after_lookup(ctx, tile, ret);
+}
+
+void mapcache_tileset_tile_get_after_lookup(mapcache_context *ctx, mapcache_tile *tile, int ret)
+{
+  int isLocked;
+  mapcache_metatile *mt=NULL;
+  char *lockname;
+  _rendezvous *rdv;
 
   if(ret == MAPCACHE_SUCCESS && tile->tileset->auto_expire && tile->mtime && tile->tileset->source) {
     /* the cache is in auto-expire mode, and can return the tile modification date,
@@ -604,9 +1005,15 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
     apr_time_t now = apr_time_now();
     apr_time_t stale = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
     if(stale<now) {
-      mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
-      GC_CHECK_ERROR(ctx);
-      ret = MAPCACHE_CACHE_MISS;
+      if(tile->tileset->stale_while_revalidate && !ctx->config->non_blocking &&
+          now < stale + apr_time_from_sec(tile->tileset->stale_while_revalidate) &&
+          _mapcache_tileset_tile_refresh(ctx,tile) == MAPCACHE_SUCCESS) {
+        /* return the stale tile, it will be updated in the background */
+      } else {
+        mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
+        GC_CHECK_ERROR(ctx);
+        ret = MAPCACHE_CACHE_MISS;
+      }
     }
   }
 
@@ -626,6 +1033,7 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
     /* bail out in non-blocking mode */
     if(ctx->config->non_blocking) {
       ctx->set_error(ctx,404,"tile not in cache, and configured for readonly mode");
+      ctx->_blocking = 1;
       return;
     }
 
@@ -640,24 +1048,50 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
 
     /* aquire a lock on the metatile */
     mt = mapcache_tileset_metatile_get(ctx, tile);
-    isLocked = mapcache_lock_or_wait_for_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
-
+    lockname = mapcache_tileset_metatile_resource_key(ctx,mt);
+    /* register before waiting, so the thread doing the rendering knows it must hand us the tiles */
+    rdv = _rendezvous_join(ctx, lockname);
+    isLocked = mapcache_lock_or_wait_for_resource(ctx, lockname);
+    if(GC_HAS_ERROR(ctx)) {
+      _rendezvous_leave(rdv);
+      return;
+    }
 
+    ret = MAPCACHE_CACHE_MISS;
     if(isLocked == MAPCACHE_TRUE) {
-      /* no other thread is doing the rendering, do it ourselves */
+      if(_rendezvous_published(rdv) == MAPCACHE_TRUE) {
+        /* another thread of this process rendered the metatile while we were queued for the lock */
+        mapcache_unlock_resource(ctx, lockname);
+        ret = _rendezvous_tile_get(ctx, rdv, tile);
+      } else {
+        /* no other thread is doing the rendering, do it ourselves */
 #ifdef DEBUG
-      ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
-               tile->tileset->name,tile->x, tile->y,tile->z);
+        ctx->log(ctx, MAPCACHE_DEBUG, "cache miss: tileset %s - tile %d %d %d",
+                 tile->tileset->name,tile->x, tile->y,tile->z);
 #endif
-      /* this will query the source to create the tiles, and save them to the cache */
-      mapcache_tileset_render_metatile(ctx, mt);
+        /* this will query the source to create the tiles, and save them to the cache */
+        mapcache_tileset_render_metatile(ctx, mt);
+        if(!GC_HAS_ERROR(ctx)) {
+          _rendezvous_publish(rdv, mt);
+        }
 
-      mapcache_unlock_resource(ctx, mapcache_tileset_metatile_resource_key(ctx,mt));
+        mapcache_unlock_resource(ctx, lockname);
+        if(GC_HAS_ERROR(ctx)) {
+          _rendezvous_leave(rdv);
+          return;
+        }
+        ret = _mapcache_tileset_metatile_tile_get(mt, tile);
+      }
+    } else {
+      ret = _rendezvous_tile_get(ctx, rdv, tile);
     }
+    _rendezvous_leave(rdv);
 
-    /* the previous step has successfully finished, we can now query the cache to return the tile content */
-    ret = tile->tileset->cache->tile_get(ctx, tile);
-    GC_CHECK_ERROR(ctx);
+    if(ret != MAPCACHE_SUCCESS) {
+      /* the previous step has successfully finished, we can now query the cache to return the tile content */
+      ret = tile->tileset->cache->tile_get(ctx, tile->tileset->cache, tile);
+      GC_CHECK_ERROR(ctx);
+    }
 
     if(ret != MAPCACHE_SUCCESS) {
       if(isLocked == MAPCACHE_FALSE) {
@@ -673,7 +1107,8 @@ void mapcache_tileset_tile_get(mapcache_context *ctx, mapcache_tile *tile)
   if(tile->tileset->auto_expire && tile->mtime) {
     apr_time_t now = apr_time_now();
     apr_time_t expire_time = tile->mtime + apr_time_from_sec(tile->tileset->auto_expire);
-    tile->expires = apr_time_sec(expire_time-now);
+    /* stale tiles returned while they are being refreshed must be re-requested quickly */
+    tile->expires = (expire_time > now)?apr_time_sec(expire_time-now):1;
   }
 }
 
@@ -681,7 +1116,7 @@ void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, in
 {
   int i;
   /*delete the tile itself*/
-  tile->tileset->cache->tile_delete(ctx,tile);
+  tile->tileset->cache->tile_delete(ctx, tile->tileset->cache, tile);
   GC_CHECK_ERROR(ctx);
 
   if(whole_metatile) {
@@ -690,7 +1125,7 @@ void mapcache_tileset_tile_delete(mapcache_context *ctx, mapcache_tile *tile, in
       mapcache_tile *subtile = &mt->tiles[i];
       /* skip deleting the actual tile */
       if(subtile->x == tile->x && subtile->y == tile->y) continue;
-      subtile->tileset->cache->tile_delete(ctx,subtile);
+      subtile->tileset->cache->tile_delete(ctx, subtile->tileset->cache, subtile);
       /* silently pass failure if the tile was not found */
       if(ctx->get_error(ctx) == 404) {
         ctx->clear_errors(ctx);
@@ -190,6 +190,7 @@ void _mapcache_context_clear_error_default(mapcache_context *ctx)
 {
   ctx->_errcode = 0;
   ctx->_errmsg = NULL;
+  ctx->_blocking = 0;
   if(ctx->exceptions) {
     apr_table_clear(ctx->exceptions);
   }
@@ -200,6 +201,7 @@ void mapcache_context_init(mapcache_context *ctx)
 {
   ctx->_errcode = 0;
   ctx->_errmsg = NULL;
+  ctx->_blocking = 0;
   ctx->get_error = _mapcache_context_get_error_default;
   ctx->get_error_message = _mapcache_context_get_error_msg_default;
   ctx->set_error = _mapcache_context_set_error_default;
@@ -212,6 +214,7 @@ void mapcache_context_copy(mapcache_context *src, mapcache_context *dst)
   dst->_contenttype = src->_contenttype;
   dst->_errcode = src->_errcode;
   dst->_errmsg = src->_errmsg;
+  dst->_blocking = src->_blocking;
   dst->clear_errors = src->clear_errors;
   dst->clone = src->clone;
   dst->config = src->config;
@@ -254,47 +257,250 @@ char* mapcache_util_get_tile_dimkey(mapcache_context *ctx, mapcache_tile *tile,
   return key;
 }
 
-char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *template,
-                                 char* sanitized_chars, char *sanitize_to)
+/* room reserved for a rendered number, enough for any int with a custom format */
+#define MAPCACHE_KEY_NUMBER_LEN 32
+
+static const struct {
+  const char *name;
+  mapcache_key_token_type type;
+} _key_placeholders[] = {
+  {"{tileset}", MAPCACHE_KEY_TOKEN_TILESET},
+  {"{grid}", MAPCACHE_KEY_TOKEN_GRID},
+  {"{ext}", MAPCACHE_KEY_TOKEN_EXT},
+  {"{dim}", MAPCACHE_KEY_TOKEN_DIM},
+  {"{x}", MAPCACHE_KEY_TOKEN_X},
+  {"{y}", MAPCACHE_KEY_TOKEN_Y},
+  {"{z}", MAPCACHE_KEY_TOKEN_Z},
+  {"{inv_x}", MAPCACHE_KEY_TOKEN_INV_X},
+  {"{inv_y}", MAPCACHE_KEY_TOKEN_INV_Y},
+  {"{inv_z}", MAPCACHE_KEY_TOKEN_INV_Z},
+  {"{div_x}", MAPCACHE_KEY_TOKEN_DIV_X},
+  {"{div_y}", MAPCACHE_KEY_TOKEN_DIV_Y},
+  {"{inv_div_x}", MAPCACHE_KEY_TOKEN_INV_DIV_X},
+  {"{inv_div_y}", MAPCACHE_KEY_TOKEN_INV_DIV_Y},
+  {NULL, MAPCACHE_KEY_TOKEN_LITERAL}
+};
+
+static void _key_template_add(apr_array_header_t *tokens, mapcache_key_token_type type, const char *text, apr_size_t len)
 {
-  char *path;
-  if(template) {
-    path = mapcache_util_str_replace(ctx->pool, template, "{x}",
-                                     apr_psprintf(ctx->pool, "%d", tile->x));
-    path = mapcache_util_str_replace(ctx->pool, path, "{y}",
-                                     apr_psprintf(ctx->pool, "%d", tile->y));
-    path = mapcache_util_str_replace(ctx->pool, path, "{z}",
-                                     apr_psprintf(ctx->pool, "%d", tile->z));
-    if(strstr(path,"{dim}")) {
-      path = mapcache_util_str_replace(ctx->pool, path, "{dim}", mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to));
+  mapcache_key_token *token;
+  if(type == MAPCACHE_KEY_TOKEN_LITERAL && tokens->nelts) {
+    /* merge with the previous literal */
+    token = &APR_ARRAY_IDX(tokens, tokens->nelts-1, mapcache_key_token);
+    if(token->type == MAPCACHE_KEY_TOKEN_LITERAL && token->text + token->len == text) {
+      token->len += len;
+      return;
     }
-    if(strstr(path,"{tileset}"))
-      path = mapcache_util_str_replace(ctx->pool, path, "{tileset}", tile->tileset->name);
-    if(strstr(path,"{grid}"))
-      path = mapcache_util_str_replace(ctx->pool, path, "{grid}", tile->grid_link->grid->name);
-    if(strstr(path,"{ext}"))
-      path = mapcache_util_str_replace(ctx->pool, path, "{ext}",
-                                       tile->tileset->format ? tile->tileset->format->extension : "png");
-  } else {
-    char *separator = "/";
-    /* we'll concatenate the entries ourself */
-    path = apr_pstrcat(ctx->pool,
-                       tile->tileset->name,separator,
-                       tile->grid_link->grid->name,separator,
-                       NULL);
-    if(tile->dimensions) {
-      path = apr_pstrcat(ctx->pool,path,
-                         mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to),
-                         separator,NULL);
+  }
+  token = &APR_ARRAY_PUSH(tokens, mapcache_key_token);
+  token->type = type;
+  token->text = (type == MAPCACHE_KEY_TOKEN_LITERAL)?text:NULL;
+  token->len = len;
+}
+
+mapcache_key_template* mapcache_key_template_compile(apr_pool_t *pool, const char *template)
+{
+  mapcache_key_template *tpl = apr_pcalloc(pool, sizeof(mapcache_key_template));
+  apr_array_header_t *tokens = apr_array_make(pool, 16, sizeof(mapcache_key_token));
+  const char *start = apr_pstrdup(pool, template), *ptr = start;
+  int i;
+  while(*ptr) {
+    if(*ptr == '{') {
+      for(i=0; _key_placeholders[i].name; i++) {
+        apr_size_t namelen = strlen(_key_placeholders[i].name);
+        if(!strncmp(ptr, _key_placeholders[i].name, namelen)) {
+          if(ptr > start)
+            _key_template_add(tokens, MAPCACHE_KEY_TOKEN_LITERAL, start, ptr - start);
+          _key_template_add(tokens, _key_placeholders[i].type, NULL, 0);
+          ptr += namelen;
+          start = ptr;
+          break;
+        }
+      }
+      if(_key_placeholders[i].name) continue;
+    }
+    ptr++;
+  }
+  if(ptr > start)
+    _key_template_add(tokens, MAPCACHE_KEY_TOKEN_LITERAL, start, ptr - start);
+
+  tpl->tokens = (mapcache_key_token*)tokens->elts;
+  tpl->ntokens = tokens->nelts;
+  tpl->block_x = tpl->block_y = 1;
+  for(i=0; i<tpl->ntokens; i++) {
+    switch(tpl->tokens[i].type) {
+      case MAPCACHE_KEY_TOKEN_LITERAL:
+        tpl->literal_len += tpl->tokens[i].len;
+        break;
+      case MAPCACHE_KEY_TOKEN_TILESET:
+      case MAPCACHE_KEY_TOKEN_GRID:
+      case MAPCACHE_KEY_TOKEN_EXT:
+        break;
+      case MAPCACHE_KEY_TOKEN_DIM:
+        tpl->has_dim = 1;
+        break;
+      default:
+        tpl->nnumbers++;
     }
-    path = apr_pstrcat(ctx->pool,path,
-                       apr_psprintf(ctx->pool, "%d", tile->z),separator,
-                       apr_psprintf(ctx->pool, "%d", tile->y),separator,
-                       apr_psprintf(ctx->pool, "%d", tile->x),separator,
-                       tile->tileset->format?tile->tileset->format->extension:"png",
-                       NULL);
   }
-  return path;
+  return tpl;
+}
+
+void mapcache_key_template_set_format(mapcache_key_template *tpl, mapcache_key_token_type type, const char *fmt)
+{
+  int i;
+  for(i=0; i<tpl->ntokens; i++) {
+    if(tpl->tokens[i].type == type)
+      tpl->tokens[i].text = fmt;
+  }
+}
+
+static int _key_template_number(mapcache_key_template *tpl, mapcache_key_token_type type, mapcache_tile *tile)
+{
+  switch(type) {
+    case MAPCACHE_KEY_TOKEN_X:
+      return tile->x / tpl->block_x * tpl->block_x;
+    case MAPCACHE_KEY_TOKEN_Y:
+      return tile->y / tpl->block_y * tpl->block_y;
+    case MAPCACHE_KEY_TOKEN_Z:
+      return tile->z;
+    case MAPCACHE_KEY_TOKEN_INV_X:
+      /* multiplied by block_y, as the tiff cache always did: existing trees depend on it */
+      return (tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1) / tpl->block_x * tpl->block_y;
+    case MAPCACHE_KEY_TOKEN_INV_Y:
+      return (tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1) / tpl->block_y * tpl->block_y;
+    case MAPCACHE_KEY_TOKEN_INV_Z:
+      return tile->grid_link->grid->nlevels - tile->z - 1;
+    case MAPCACHE_KEY_TOKEN_DIV_X:
+      return tile->x / tpl->block_x;
+    case MAPCACHE_KEY_TOKEN_DIV_Y:
+      return tile->y / tpl->block_y;
+    case MAPCACHE_KEY_TOKEN_INV_DIV_X:
+      return (tile->grid_link->grid->levels[tile->z]->maxx - tile->x - 1) / tpl->block_x;
+    case MAPCACHE_KEY_TOKEN_INV_DIV_Y:
+      return (tile->grid_link->grid->levels[tile->z]->maxy - tile->y - 1) / tpl->block_y;
+    default:
+      return 0;
+  }
+}
+
+/* writes the decimal representation of v to dst, returns its length */
+static apr_size_t _key_itoa(char *dst, int v)
+{
+  char tmp[16];
+  apr_size_t n = 0, len;
+  unsigned int u = (v<0)?-(unsigned int)v:(unsigned int)v;
+  do {
+    tmp[n++] = '0' + u % 10;
+    u /= 10;
+  } while(u);
+  len = n;
+  if(v<0) {
+    *dst++ = '-';
+    len++;
+  }
+  while(n) *dst++ = tmp[--n];
+  return len;
+}
+
+char* mapcache_key_template_render(mapcache_context *ctx, mapcache_key_template *tpl, mapcache_tile *tile, const char *dimkey)
+{
+  const char *ext = tile->tileset->format?tile->tileset->format->extension:"png";
+  apr_size_t len = tpl->literal_len + tpl->nnumbers * MAPCACHE_KEY_NUMBER_LEN + 1;
+  char *key, *ptr;
+  int i;
+
+  /* compute an upper bound of the key length, so it can be rendered in place */
+  for(i=0; i<tpl->ntokens; i++) {
+    switch(tpl->tokens[i].type) {
+      case MAPCACHE_KEY_TOKEN_TILESET:
+        len += strlen(tile->tileset->name);
+        break;
+      case MAPCACHE_KEY_TOKEN_GRID:
+        len += strlen(tile->grid_link->grid->name);
+        break;
+      case MAPCACHE_KEY_TOKEN_EXT:
+        len += strlen(ext);
+        break;
+      case MAPCACHE_KEY_TOKEN_DIM:
+        len += dimkey?strlen(dimkey):5;
+        break;
+      default:
+        break;
+    }
+  }
+
+  ptr = key = apr_palloc(ctx->pool, len);
+  for(i=0; i<tpl->ntokens; i++) {
+    mapcache_key_token *token = &tpl->tokens[i];
+    const char *str;
+    apr_size_t slen;
+    switch(token->type) {
+      case MAPCACHE_KEY_TOKEN_LITERAL:
+        memcpy(ptr, token->text, token->len);
+        ptr += token->len;
+        continue;
+      case MAPCACHE_KEY_TOKEN_TILESET:
+        str = tile->tileset->name;
+        break;
+      case MAPCACHE_KEY_TOKEN_GRID:
+        str = tile->grid_link->grid->name;
+        break;
+      case MAPCACHE_KEY_TOKEN_EXT:
+        str = ext;
+        break;
+      case MAPCACHE_KEY_TOKEN_DIM:
+        str = dimkey?dimkey:"{dim}";
+        break;
+      default:
+        if(token->text) {
+          ptr += apr_snprintf(ptr, MAPCACHE_KEY_NUMBER_LEN, token->text, _key_template_number(tpl, token->type, tile));
+        } else {
+          ptr += _key_itoa(ptr, _key_template_number(tpl, token->type, tile));
+        }
+        continue;
+    }
+    slen = strlen(str);
+    memcpy(ptr, str, slen);
+    ptr += slen;
+  }
+  *ptr = '\0';
+  return key;
+}
+
+/* tileset/grid/dim/z/y/x/ext and tileset/grid/z/y/x/ext, the keys used when no template is configured */
+static mapcache_key_token _default_dim_key_tokens[] = {
+  {MAPCACHE_KEY_TOKEN_TILESET,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_GRID,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_DIM,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_Z,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_Y,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_X,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_EXT,NULL,0}
+};
+static mapcache_key_token _default_key_tokens[] = {
+  {MAPCACHE_KEY_TOKEN_TILESET,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_GRID,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_Z,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_Y,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_X,NULL,0}, {MAPCACHE_KEY_TOKEN_LITERAL,"/",1},
+  {MAPCACHE_KEY_TOKEN_EXT,NULL,0}
+};
+/* tokens, ntokens, literal_len, nnumbers, has_dim, block_x, block_y */
+static mapcache_key_template _default_dim_key = {_default_dim_key_tokens, 13, 6, 3, 1, 1, 1};
+static mapcache_key_template _default_key = {_default_key_tokens, 11, 5, 3, 0, 1, 1};
+
+char* mapcache_util_get_tile_key(mapcache_context *ctx, mapcache_tile *tile, mapcache_key_template *tpl,
+                                 char* sanitized_chars, char *sanitize_to)
+{
+  char *dimkey = NULL;
+  if(!tpl) {
+    tpl = tile->dimensions?&_default_dim_key:&_default_key;
+  }
+  if(tpl->has_dim) {
+    dimkey = mapcache_util_get_tile_dimkey(ctx,tile,sanitized_chars,sanitize_to);
+  }
+  return mapcache_key_template_render(ctx, tpl, tile, dimkey);
 }
 
 
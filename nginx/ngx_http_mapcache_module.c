@@ -5,11 +5,24 @@
 #include <apr_date.h>
 #include <apr_strings.h>
 #include <apr_pools.h>
+#ifdef APR_HAS_THREADS
+#include <apr_thread_mutex.h>
+#endif
+#if (NGX_THREADS)
+#include <ngx_thread_pool.h>
+#endif
 
 
 apr_pool_t *process_pool = NULL;
+#ifdef APR_HAS_THREADS
+static apr_thread_mutex_t *thread_mutex = NULL;
+#endif
 static char *ngx_http_mapcache(ngx_conf_t *cf, ngx_command_t *cmd,
                                void *conf);
+#if (NGX_THREADS)
+static char *ngx_http_mapcache_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd,
+    void *conf);
+#endif
 
 static ngx_command_t  ngx_http_mapcache_commands[] = {
 
@@ -21,6 +34,17 @@ static ngx_command_t  ngx_http_mapcache_commands[] = {
     0,
     NULL
   },
+#if (NGX_THREADS)
+
+  {
+    ngx_string("mapcache_thread_pool"),
+    NGX_HTTP_LOC_CONF|NGX_CONF_NOARGS|NGX_CONF_TAKE1,
+    ngx_http_mapcache_thread_pool,
+    NGX_HTTP_LOC_CONF_OFFSET,
+    0,
+    NULL
+  },
+#endif
 
   ngx_null_command
 };
@@ -28,6 +52,10 @@ static ngx_command_t  ngx_http_mapcache_commands[] = {
 typedef struct {
   mapcache_context ctx;
   ngx_http_request_t *r;
+#if (NGX_THREADS)
+  ngx_thread_pool_t *thread_pool; /* renders the tiles missing from the caches, if set */
+  mapcache_cfg *blocking_config; /* the configuration without non_blocking, for the thread pool */
+#endif
 } mapcache_ngx_context;
 
 static void ngx_mapcache_context_log(mapcache_context *c, mapcache_log_level level, char *message, ...)
@@ -74,6 +102,69 @@ ngx_http_mapcache_create_conf(ngx_conf_t *cf)
 }
 
 
+/*
+ * a buffer referencing the file region the data of a response was read from, so that it is
+ * sent with sendfile instead of being copied. the file is closed with the request. returns
+ * NULL if the file cannot be opened or has been replaced since the data was read.
+ */
+static ngx_buf_t* ngx_http_mapcache_file_buf(ngx_http_request_t *r, mapcache_buffer *data)
+{
+  ngx_buf_t *b;
+  ngx_file_info_t fi;
+  ngx_pool_cleanup_t *cln;
+  ngx_pool_cleanup_file_t *clnf;
+  ngx_str_t name;
+  ngx_fd_t fd;
+
+  name.len = strlen(data->file->filename);
+  name.data = ngx_pnalloc(r->pool, name.len + 1);
+  if (name.data == NULL) {
+    return NULL;
+  }
+  ngx_cpystrn(name.data, (u_char*)data->file->filename, name.len + 1);
+
+  fd = ngx_open_file(name.data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+  if (fd == NGX_INVALID_FILE) {
+    return NULL;
+  }
+  if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+      || ngx_file_uniq(&fi) != (ngx_file_uniq_t)data->file->inode
+#if !(NGX_WIN32)
+      || fi.st_dev != (dev_t)data->file->device
+#endif
+      || ngx_file_size(&fi) < data->file->offset + (off_t)data->size) {
+    ngx_close_file(fd);
+    return NULL;
+  }
+
+  cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+  if (cln == NULL) {
+    ngx_close_file(fd);
+    return NULL;
+  }
+  cln->handler = ngx_pool_cleanup_file;
+  clnf = cln->data;
+  clnf->fd = fd;
+  clnf->name = name.data;
+  clnf->log = r->pool->log;
+
+  b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+  if (b == NULL) {
+    return NULL;
+  }
+  b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+  if (b->file == NULL) {
+    return NULL;
+  }
+  b->file->fd = fd;
+  b->file->name = name;
+  b->file->log = r->connection->log;
+  b->file_pos = data->file->offset;
+  b->file_last = data->file->offset + data->size;
+  b->in_file = 1;
+  return b;
+}
+
 static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_request_t *r,
     mapcache_http_response *response)
 {
@@ -130,19 +221,25 @@ static void ngx_http_mapcache_write_response(mapcache_context *ctx, ngx_http_req
   }
 
   if(response->data) {
-    ngx_buf_t    *b;
+    ngx_buf_t    *b = NULL;
     ngx_chain_t   out;
-    b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
-    if (b == NULL) {
-      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-                    "Failed to allocate response buffer.");
-      return;
+    if(response->data->file) {
+      b = ngx_http_mapcache_file_buf(r, response->data);
     }
+    if (b == NULL) {
+      /* the data lives in the mapcache pool, which is destroyed before it is sent */
+      b = ngx_pcalloc(r->pool, sizeof(ngx_buf_t));
+      if (b == NULL) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "Failed to allocate response buffer.");
+        return;
+      }
 
-    b->pos = ngx_pcalloc(r->pool,response->data->size);
-    memcpy(b->pos,response->data->buf,response->data->size);
-    b->last = b->pos + response->data->size;
-    b->memory = 1;
+      b->pos = ngx_pcalloc(r->pool,response->data->size);
+      memcpy(b->pos,response->data->buf,response->data->size);
+      b->last = b->pos + response->data->size;
+      b->memory = 1;
+    }
     b->last_buf = 1;
     b->flush = 1;
     out.buf = b;
@@ -173,6 +270,10 @@ static ngx_int_t ngx_mapcache_init_process(ngx_cycle_t *cycle)
   atexit(apr_terminate);
   apr_pool_initialize();
   apr_pool_create(&process_pool,NULL);
+#if (NGX_THREADS) && defined(APR_HAS_THREADS)
+  /* requests rendered on thread pools run concurrently with the event loop */
+  apr_thread_mutex_create(&thread_mutex,APR_THREAD_MUTEX_DEFAULT,process_pool);
+#endif
   return NGX_OK;
 }
 
@@ -201,6 +302,86 @@ static ngx_int_t pathinfo_index;
 static ngx_str_t  urlprefix_str = ngx_string("url_prefix");
 static ngx_int_t urlprefix_index;
 
+#if (NGX_THREADS)
+/* a request rendered on a thread pool */
+typedef struct {
+  mapcache_context *ctx;
+  char *pathinfo;
+  apr_table_t *params;
+  mapcache_http_response *response;
+} ngx_http_mapcache_job_t;
+
+/*
+ * runs in a thread of the pool: the request is dispatched again, so that it is rendered from
+ * scratch and not from the state left by the non blocking attempt
+ */
+static void ngx_http_mapcache_job_run(void *data, ngx_log_t *log)
+{
+  ngx_http_mapcache_job_t *job = data;
+  mapcache_context *ctx = job->ctx;
+  mapcache_request *request = NULL;
+
+  mapcache_service_dispatch_request(ctx,&request,job->pathinfo,job->params,ctx->config);
+  if(GC_HAS_ERROR(ctx) || !request) {
+    return;
+  }
+  if(request->type == MAPCACHE_REQUEST_GET_TILE) {
+    job->response = mapcache_core_get_tile(ctx,(mapcache_request_get_tile*)request);
+  } else if(request->type == MAPCACHE_REQUEST_GET_MAP) {
+    job->response = mapcache_core_get_map(ctx,(mapcache_request_get_map*)request);
+  } else {
+    ctx->set_error(ctx,500,"###BUG### unexpected request type on thread pool");
+  }
+}
+
+/* back on the event loop once the job has completed: send the response and finish the request */
+static void ngx_http_mapcache_job_done(ngx_event_t *ev)
+{
+  ngx_http_mapcache_job_t *job = ev->data;
+  mapcache_context *ctx = job->ctx;
+  ngx_http_request_t *r = ((mapcache_ngx_context*)ctx)->r;
+  ngx_connection_t *c = r->connection;
+  ngx_int_t ret = NGX_HTTP_OK;
+
+  if(!GC_HAS_ERROR(ctx) && job->response) {
+    ngx_http_mapcache_write_response(ctx,r,job->response);
+  }
+  if(GC_HAS_ERROR(ctx))
+    ret = ctx->_errcode?ctx->_errcode:500;
+  ctx->clear_errors(ctx);
+  apr_pool_destroy(ctx->pool);
+  ngx_http_finalize_request(r, ret);
+  ngx_http_run_posted_requests(c);
+}
+
+static ngx_int_t ngx_http_mapcache_post_job(ngx_http_request_t *r, ngx_thread_pool_t *tp,
+    mapcache_context *ctx, char *pathinfo, apr_table_t *params)
+{
+  ngx_thread_task_t *task;
+  ngx_http_mapcache_job_t *job;
+
+  task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_mapcache_job_t));
+  if (task == NULL) {
+    return NGX_ERROR;
+  }
+  job = task->ctx;
+  job->ctx = ctx;
+  job->pathinfo = pathinfo;
+  job->params = params;
+  job->response = NULL;
+  task->handler = ngx_http_mapcache_job_run;
+  task->event.data = job;
+  task->event.handler = ngx_http_mapcache_job_done;
+
+  if (ngx_thread_task_post(tp, task) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  /* the request is finalized by ngx_http_mapcache_job_done */
+  r->main->count++;
+  return NGX_OK;
+}
+#endif
+
 static ngx_int_t
 ngx_http_mapcache_handler(ngx_http_request_t *r)
 {
@@ -208,10 +389,18 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
   if (!(r->method & (NGX_HTTP_GET))) {
     return NGX_HTTP_NOT_ALLOWED;
   }
-  mapcache_ngx_context *ngctx = ngx_http_get_module_loc_conf(r, ngx_http_mapcache_module);
+  mapcache_ngx_context *conf = ngx_http_get_module_loc_conf(r, ngx_http_mapcache_module);
+  apr_pool_t *pool;
+  apr_pool_create(&pool,process_pool);
+  /* each request has its own context, as it may outlive the handler when rendered on a thread */
+  mapcache_ngx_context *ngctx = apr_pcalloc(pool, sizeof(mapcache_ngx_context));
   mapcache_context *ctx = (mapcache_context*)ngctx;
-  apr_pool_create(&(ctx->pool),process_pool);
+  mapcache_context_copy((mapcache_context*)conf,ctx);
+  ctx->pool = pool;
   ctx->process_pool = process_pool;
+#ifdef APR_HAS_THREADS
+  ctx->threadlock = thread_mutex;
+#endif
   ngctx->r = r;
   mapcache_request *request = NULL;
   mapcache_http_response *http_response;
@@ -260,6 +449,22 @@ ngx_http_mapcache_handler(ngx_http_request_t *r)
 #endif
   }
   if(GC_HAS_ERROR(ctx)) {
+#if (NGX_THREADS)
+    /*
+     * the request failed because it needed to render tiles, wait for a metatile or forward
+     * a getmap, which is not allowed in non blocking mode. run it on the thread pool, where
+     * blocking does not hold up the other requests
+     */
+    if(conf->thread_pool && ctx->_blocking &&
+        (request->type == MAPCACHE_REQUEST_GET_TILE || request->type == MAPCACHE_REQUEST_GET_MAP)) {
+      ctx->clear_errors(ctx);
+      ctx->config = conf->blocking_config;
+      if(ngx_http_mapcache_post_job(r, conf->thread_pool, ctx, pathInfo, params) == NGX_OK) {
+        return NGX_DONE;
+      }
+      ctx->set_error(ctx,500,"failed to post rendering of request to thread pool");
+    }
+#endif
     //   ngx_http_mapcache_write_response(ctx,r, mapcache_core_respond_to_error(ctx));
     goto cleanup;
   }
@@ -298,6 +503,10 @@ ngx_http_mapcache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
     ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,ctx->get_error_message(ctx));
     return NGX_CONF_ERROR;
   }
+#if (NGX_THREADS)
+  /* requests rendered on a thread pool are allowed to block */
+  ((mapcache_ngx_context*)ctx)->blocking_config = apr_pmemdup(ctx->pool, ctx->config, sizeof(mapcache_cfg));
+#endif
   ctx->config->non_blocking = 1;
 
   ngx_http_core_loc_conf_t  *clcf;
@@ -316,3 +525,22 @@ ngx_http_mapcache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 
   return NGX_CONF_OK;
 }
+
+#if (NGX_THREADS)
+static char *
+ngx_http_mapcache_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+  mapcache_ngx_context *ngctx = conf;
+  ngx_str_t *value = cf->args->elts;
+
+  if (ngctx->thread_pool) {
+    return "is duplicate";
+  }
+  /* without a name, the pool named "default" is used */
+  ngctx->thread_pool = ngx_thread_pool_add(cf, cf->args->nelts > 1 ? &value[1] : NULL);
+  if (ngctx->thread_pool == NULL) {
+    return NGX_CONF_ERROR;
+  }
+  return NGX_CONF_OK;
+}
+#endif
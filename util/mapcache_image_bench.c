@@ -0,0 +1,144 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache utility program for benchmarking pixel manipulation routines
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * times mapcache_image_merge and the resamplers for each instruction set supported
+ * by the build and the cpu. Build with "make bench" in the util directory, once
+ * with and once without pixman support to compare against pixman.
+ */
+
+#include "mapcache.h"
+#include <apr_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define BENCH_SIZE 1024
+
+mapcache_context ctx;
+
+static void bench_log(mapcache_context *c, mapcache_log_level level, char *msg, ...)
+{
+}
+
+static mapcache_image* bench_image(int opaque_rows)
+{
+  mapcache_image *img = mapcache_image_create(&ctx);
+  int i,j;
+  img->w = img->h = BENCH_SIZE;
+  img->stride = img->w * 4;
+  img->data = apr_palloc(ctx.pool, img->h * img->stride);
+  for(i=0; i<img->h; i++) {
+    unsigned char *ptr = img->data + i*img->stride;
+    for(j=0; j<img->w; j++) {
+      /* premultiplied pixels, alternating transparent, opaque and translucent runs */
+      int alpha = (i<opaque_rows)?255:((j/64)%3==0)?0:((j/64)%3==1)?255:(rand()%256);
+      ptr[3] = alpha;
+      ptr[0] = rand()%(alpha+1);
+      ptr[1] = rand()%(alpha+1);
+      ptr[2] = rand()%(alpha+1);
+      ptr += 4;
+    }
+  }
+  return img;
+}
+
+static void report(const char *name, const char *impl, apr_time_t start, int iterations)
+{
+  double ms = (double)(apr_time_now() - start) / 1000.0 / iterations;
+  printf("%-10s %-8s %8.3f ms/iteration (%.1f Mpixels/s)\n", name, impl, ms,
+         BENCH_SIZE*BENCH_SIZE / ms / 1000.0);
+}
+
+int main(int argc, const char **argv)
+{
+  mapcache_image *base, *overlay, *dst;
+  int iterations = 50, i;
+  int level, maxlevel;
+  const char *impls[] = {"scalar","sse2","avx2"};
+  apr_time_t start;
+
+  if(argc > 1) {
+    iterations = atoi(argv[1]);
+    if(iterations <= 0) {
+      printf("usage: %s [iterations]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  apr_initialize();
+  apr_pool_create(&ctx.pool,NULL);
+  mapcache_context_init(&ctx);
+  ctx.process_pool = ctx.pool;
+  ctx.log = bench_log;
+
+  srand(0);
+  base = bench_image(BENCH_SIZE);
+  overlay = bench_image(0);
+  dst = bench_image(BENCH_SIZE);
+
+  maxlevel = mapcache_image_simd_level();
+  for(level=MAPCACHE_SIMD_NONE; level<=maxlevel; level++) {
+    const char *impl = impls[level];
+#ifdef USE_PIXMAN
+    /* pixman does its own runtime dispatching */
+    impl = "pixman";
+    if(level != MAPCACHE_SIMD_NONE) break;
+#endif
+    mapcache_image_simd_limit(level);
+
+    start = apr_time_now();
+    for(i=0; i<iterations; i++) {
+      mapcache_image_merge(&ctx, base, overlay);
+    }
+    report("merge", impl, start, iterations);
+
+    start = apr_time_now();
+    for(i=0; i<iterations; i++) {
+      mapcache_image_copy_resampled_nearest(&ctx, overlay, dst, -10.5, -10.5, 1.7, 1.7);
+    }
+    report("nearest", impl, start, iterations);
+
+    start = apr_time_now();
+    for(i=0; i<iterations; i++) {
+      mapcache_image_copy_resampled_bilinear(&ctx, overlay, dst, -10.5, -10.5, 1.7, 1.7);
+    }
+    report("bilinear", impl, start, iterations);
+
+    if(GC_HAS_ERROR(&ctx)) {
+      printf("%s\n", ctx.get_error_message(&ctx));
+      return 1;
+    }
+  }
+  apr_pool_destroy(ctx.pool);
+  apr_terminate();
+  return 0;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
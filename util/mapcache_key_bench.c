@@ -0,0 +1,148 @@
+/******************************************************************************
+ * $Id$
+ *
+ * Project:  MapServer
+ * Purpose:  MapCache utility program for benchmarking tile key generation
+ * Author:   Thomas Bonfort and the MapServer team.
+ *
+ ******************************************************************************
+ * Copyright (c) 1996-2011 Regents of the University of Minnesota.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies of this Software or works derived from this Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *****************************************************************************/
+
+/*
+ * compares the number of tile keys per second produced by compiled key templates with
+ * the successive string replacements that were used before. Build with "make bench" in
+ * the util directory.
+ */
+
+#include "mapcache.h"
+#include <apr_strings.h>
+#include <apr_time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+mapcache_context ctx;
+
+static void bench_log(mapcache_context *c, mapcache_log_level level, char *msg, ...)
+{
+}
+
+/* the template substitution as it was done before templates were compiled */
+static char* legacy_tile_key(mapcache_context *ctx, mapcache_tile *tile, char *template)
+{
+  char *path;
+  path = mapcache_util_str_replace(ctx->pool, template, "{x}",
+                                   apr_psprintf(ctx->pool, "%d", tile->x));
+  path = mapcache_util_str_replace(ctx->pool, path, "{y}",
+                                   apr_psprintf(ctx->pool, "%d", tile->y));
+  path = mapcache_util_str_replace(ctx->pool, path, "{z}",
+                                   apr_psprintf(ctx->pool, "%d", tile->z));
+  if(strstr(path,"{dim}")) {
+    path = mapcache_util_str_replace(ctx->pool, path, "{dim}", mapcache_util_get_tile_dimkey(ctx,tile,NULL,NULL));
+  }
+  if(strstr(path,"{tileset}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{tileset}", tile->tileset->name);
+  if(strstr(path,"{grid}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{grid}", tile->grid_link->grid->name);
+  if(strstr(path,"{ext}"))
+    path = mapcache_util_str_replace(ctx->pool, path, "{ext}",
+                                     tile->tileset->format ? tile->tileset->format->extension : "png");
+  return path;
+}
+
+static void report(const char *name, apr_time_t start, int iterations)
+{
+  double s = (double)(apr_time_now() - start) / 1000000.0;
+  printf("%-10s %10.0f keys/s\n", name, iterations / s);
+}
+
+int main(int argc, const char **argv)
+{
+  char *template = "/data/{tileset}/{grid}/{dim}/{z}/{x}/{y}.{ext}";
+  mapcache_key_template *tpl;
+  mapcache_tileset *tileset;
+  mapcache_grid_link *grid_link;
+  mapcache_tile *tile;
+  mapcache_cfg *cfg;
+  apr_pool_t *iterpool;
+  int iterations = 1000000, i;
+  apr_time_t start;
+
+  if(argc > 1) {
+    iterations = atoi(argv[1]);
+    if(iterations <= 0) {
+      printf("usage: %s [iterations]\n", argv[0]);
+      return 1;
+    }
+  }
+
+  apr_initialize();
+  apr_pool_create(&ctx.pool,NULL);
+  mapcache_context_init(&ctx);
+  ctx.process_pool = ctx.pool;
+  ctx.log = bench_log;
+  cfg = mapcache_configuration_create(ctx.pool);
+
+  tileset = mapcache_tileset_create(&ctx);
+  tileset->name = "osm";
+  tileset->format = mapcache_configuration_get_image_format(cfg,"PNG");
+  grid_link = apr_pcalloc(ctx.pool, sizeof(mapcache_grid_link));
+  grid_link->grid = mapcache_configuration_get_grid(cfg,"GoogleMapsCompatible");
+  tile = mapcache_tileset_tile_create(ctx.pool, tileset, grid_link);
+  tile->dimensions = apr_table_make(ctx.pool,1);
+  apr_table_set(tile->dimensions,"time","2012-01-01");
+  tile->z = 17;
+  tpl = mapcache_key_template_compile(ctx.pool, template);
+
+  printf("%s => %s\n", template, mapcache_util_get_tile_key(&ctx, tile, tpl, NULL, NULL));
+  if(strcmp(legacy_tile_key(&ctx, tile, template), mapcache_util_get_tile_key(&ctx, tile, tpl, NULL, NULL))) {
+    printf("compiled template renders a different key\n");
+    return 1;
+  }
+
+  apr_pool_create(&iterpool, ctx.pool);
+  ctx.pool = iterpool;
+
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    tile->x = i & 0x1ffff;
+    tile->y = i >> 3;
+    legacy_tile_key(&ctx, tile, template);
+    if((i & 0xff) == 0) apr_pool_clear(iterpool);
+  }
+  report("replace", start, iterations);
+
+  start = apr_time_now();
+  for(i=0; i<iterations; i++) {
+    tile->x = i & 0x1ffff;
+    tile->y = i >> 3;
+    mapcache_util_get_tile_key(&ctx, tile, tpl, NULL, NULL);
+    if((i & 0xff) == 0) apr_pool_clear(iterpool);
+  }
+  report("compiled", start, iterations);
+
+  apr_terminate();
+  return 0;
+}
+
+/* vim: ts=2 sts=2 et sw=2
+*/
@@ -89,7 +89,9 @@ typedef enum {
   MAPCACHE_CMD_STOP,
   MAPCACHE_CMD_DELETE,
   MAPCACHE_CMD_SKIP,
-  MAPCACHE_CMD_TRANSFER
+  MAPCACHE_CMD_TRANSFER,
+  MAPCACHE_CMD_COMPACT,
+  MAPCACHE_CMD_GC
 } cmd;
 
 typedef enum {
@@ -198,7 +200,7 @@ static const apr_getopt_option_t seed_options[] = {
   { "extent", 'e', TRUE, "extent to seed, format: minx,miny,maxx,maxy" },
   { "nthreads", 'n', TRUE, "number of parallel threads to use (incompatible with -p/--nprocesses)" },
   { "nprocesses", 'p', TRUE, "number of parallel processes to use (incompatible with -n/--nthreads)" },
-  { "mode", 'm', TRUE, "mode: seed (default), delete or transfer" },
+  { "mode", 'm', TRUE, "mode: seed (default), delete, transfer, compact or gc" },
   { "older", 'o', TRUE, "reseed tiles older than supplied date (format: year/month/day hour:minute, eg: 2011/01/31 20:45" },
   { "dimension", 'D', TRUE, "set the value of a dimension (format DIMENSIONNAME=VALUE). Can be used multiple times for multiple dimensions" },
   { "transfer", 'x', TRUE, "tileset to transfer" },
@@ -346,12 +348,12 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
 {
   int action = MAPCACHE_CMD_SKIP;
   int intersects = -1;
-  int tile_exists = force?0:tileset->cache->tile_exists(ctx,tile);
+  int tile_exists = force?0:tileset->cache->tile_exists(ctx, tileset->cache, tile);
 
   /* if the tile exists and a time limit was specified, check the tile modification date */
   if(tile_exists) {
     if(age_limit) {
-      if(tileset->cache->tile_get(ctx,tile) == MAPCACHE_SUCCESS) {
+      if(tileset->cache->tile_get(ctx, tileset->cache, tile) == MAPCACHE_SUCCESS) {
         if(tile->mtime && tile->mtime<age_limit) {
           /* the tile modification time is older than the specified limit */
 #ifdef USE_CLIPPERS
@@ -367,7 +369,7 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
               /* if we are in mode transfer, delete it from the dst tileset */
               if (mode == MAPCACHE_CMD_TRANSFER) {
                 tile->tileset = tileset_transfer;
-                if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+                if (tileset_transfer->cache->tile_exists(ctx, tileset_transfer->cache, tile)) {
                   mapcache_tileset_tile_delete(ctx,tile,MAPCACHE_TRUE);
                 }
                 tile->tileset = tileset;
@@ -393,7 +395,7 @@ cmd examine_tile(mapcache_context *ctx, mapcache_tile *tile)
         /* the tile exists in the source tileset,
            check if the tile exists in the destination cache */
         tile->tileset = tileset_transfer;
-        if (tileset_transfer->cache->tile_exists(ctx,tile)) {
+        if (tileset_transfer->cache->tile_exists(ctx, tileset_transfer->cache, tile)) {
           action = MAPCACHE_CMD_SKIP;
         } else {
           action = MAPCACHE_CMD_TRANSFER;
@@ -638,7 +640,7 @@ void seed_worker()
         mapcache_tile *subtile = &mt->tiles[i];
         mapcache_tileset_tile_get(&seed_ctx, subtile);
         subtile->tileset = tileset_transfer;
-        tileset_transfer->cache->tile_set(&seed_ctx, subtile);
+        tileset_transfer->cache->tile_set(&seed_ctx, tileset_transfer->cache, subtile);
       }
     } else { //CMD_DELETE
       mapcache_tileset_tile_delete(&seed_ctx,tile,MAPCACHE_TRUE);
@@ -709,6 +711,90 @@ int usage(const char *progname, char *msg)
   return 1;
 }
 
+/*
+ * rewrite the bundles overlapping the seeding extent, to reclaim the space used by
+ * tiles that were replaced or deleted
+ */
+static int compact_bundles()
+{
+  mapcache_context compact_ctx = ctx;
+  mapcache_tile *tile;
+  int bundle_size = ((mapcache_cache_bundle*)tileset->cache)->bundle_size;
+  int x, y, z, ncompacted = 0;
+  apr_off_t reclaimed, reclaimedtot = 0;
+
+  apr_pool_create(&compact_ctx.pool,ctx.pool);
+  tile = mapcache_tileset_tile_create(ctx.pool, tileset, grid_link);
+  tile->dimensions = dimensions;
+  for(z=minzoom; z<=maxzoom && !sig_int_received; z++) {
+    mapcache_extent_i *limits = &grid_link->grid_limits[z];
+    for(y=limits->miny/bundle_size*bundle_size; y<limits->maxy && !sig_int_received; y+=bundle_size) {
+      for(x=limits->minx/bundle_size*bundle_size; x<limits->maxx && !sig_int_received; x+=bundle_size) {
+        apr_pool_clear(compact_ctx.pool);
+        tile->x = x;
+        tile->y = y;
+        tile->z = z;
+        if(mapcache_cache_bundle_compact(&compact_ctx, tileset->cache, tile, &reclaimed) == MAPCACHE_SUCCESS) {
+          ncompacted++;
+          reclaimedtot += reclaimed;
+          if(!quiet) {
+            printf("compacted bundle (%d,%d,%d): reclaimed %lu kB\n", x, y, z, (unsigned long)(reclaimed/1024));
+          }
+        }
+        if(compact_ctx.get_error(&compact_ctx)) {
+          printf("%s\n",compact_ctx.get_error_message(&compact_ctx));
+          apr_terminate();
+          return 1;
+        }
+      }
+    }
+  }
+  printf("compacted %d bundles, reclaimed %lu kB\n", ncompacted, (unsigned long)(reclaimedtot/1024));
+  apr_terminate();
+  return 0;
+}
+
+/*
+ * remove the deduplication objects of a disk cache that no tile links to anymore
+ */
+static int collect_objects()
+{
+  int removed;
+  apr_off_t reclaimed;
+  /*
+   * leave a margin for tiles that were being linked to their object when we started. objects
+   * that are reused have their modification time (or, when hard linked, their change time)
+   * refreshed as they are linked to.
+   */
+  apr_time_t before = apr_time_now() - apr_time_from_sec(60);
+
+  if(mapcache_cache_disk_gc(&ctx, tileset->cache, tileset, grid_link->grid, before, &removed, &reclaimed) != MAPCACHE_SUCCESS) {
+    printf("%s\n",ctx.get_error_message(&ctx));
+    apr_terminate();
+    return 1;
+  }
+  printf("removed %d unreferenced objects and stale temporary files, reclaimed %lu kB\n", removed, (unsigned long)(reclaimed/1024));
+  apr_terminate();
+  return 0;
+}
+
+/*
+ * remove the temporary files left over by crashed writers of a disk cache without dedup
+ */
+static int sweep_tmp_files()
+{
+  int removed;
+  apr_off_t reclaimed;
+  if(mapcache_cache_disk_sweep(&ctx, tileset->cache, tileset, grid_link->grid, &removed, &reclaimed) != MAPCACHE_SUCCESS) {
+    printf("%s\n",ctx.get_error_message(&ctx));
+    apr_terminate();
+    return 1;
+  }
+  printf("removed %d stale temporary files, reclaimed %lu kB\n", removed, (unsigned long)(reclaimed/1024));
+  apr_terminate();
+  return 0;
+}
+
 static int isPowerOfTwo(int x)
 {
   return (x & (x - 1)) == 0;
@@ -792,8 +878,12 @@ int main(int argc, const char **argv)
           mode = MAPCACHE_CMD_DELETE;
         } else if(!strcmp(optarg,"transfer")) {
           mode = MAPCACHE_CMD_TRANSFER;
+        } else if(!strcmp(optarg,"compact")) {
+          mode = MAPCACHE_CMD_COMPACT;
+        } else if(!strcmp(optarg,"gc")) {
+          mode = MAPCACHE_CMD_GC;
         } else if(strcmp(optarg,"seed")) {
-          return usage(argv[0],"invalid mode, expecting \"seed\", \"delete\" or \"transfer\"");
+          return usage(argv[0],"invalid mode, expecting \"seed\", \"delete\", \"transfer\", \"compact\" or \"gc\"");
         } else {
           mode = MAPCACHE_CMD_SEED;
         }
@@ -1021,7 +1111,7 @@ int main(int argc, const char **argv)
     }
 
     /* ensure our metasize is a power of 2 in drill down mode */
-    if(seed_mode == MAPCACHE_SEED_DEPTH_FIRST) {
+    if(seed_mode == MAPCACHE_SEED_DEPTH_FIRST && mode != MAPCACHE_CMD_COMPACT && mode != MAPCACHE_CMD_GC) {
       if(!isPowerOfTwo(tileset->metasize_x) || !isPowerOfTwo(tileset->metasize_y)) {
         return usage(argv[0],"metatile size is not set to a power of two, rerun with e.g -M 8,8");
       }
@@ -1105,6 +1195,23 @@ int main(int argc, const char **argv)
 
   }
 
+  if(mode == MAPCACHE_CMD_COMPACT) {
+    if(tileset->cache->type != MAPCACHE_CACHE_BUNDLE) {
+      return usage(argv[0],"compact mode is only available for tilesets stored in a bundle cache");
+    }
+    return compact_bundles();
+  }
+
+  if(mode == MAPCACHE_CMD_GC) {
+    if(tileset->cache->type != MAPCACHE_CACHE_DISK) {
+      return usage(argv[0],"gc mode is only available for tilesets stored in a disk cache");
+    }
+    if(((mapcache_cache_disk*)tileset->cache)->dedup == MAPCACHE_DISK_DEDUP_NONE) {
+      return sweep_tmp_files();
+    }
+    return collect_objects();
+  }
+
   if(nthreads == 0 && nprocesses == 0) {
     nthreads = 1;
   }
@@ -1189,6 +1296,13 @@ int main(int argc, const char **argv)
     duration = ((now_t.tv_sec-starttime.tv_sec)*1000000+(now_t.tv_usec-starttime.tv_usec))/1000000.0;
     printf("\nseeded %d metatiles at %g tiles/sec\n",seededtilestot, seededtilestot/duration);
   }
+  if(verbose) {
+    mapcache_image_buffer_stats stats;
+    mapcache_image_buffer_pool_stats(&stats);
+    printf("image buffers: %lu kB peak in use, %lu kB peak retained, %lu reused, %lu allocated\n",
+           (unsigned long)(stats.in_use_hwm/1024), (unsigned long)(stats.retained_hwm/1024),
+           stats.hits, stats.misses);
+  }
   apr_terminate();
   return 0;
 }